@@ -0,0 +1,331 @@
+/* This file implements batch mode: many products per process, driven by a
+ * manifest file.
+ *
+ * Each non-blank line of the manifest that does not start with '#' is
+ *      OUTPUT OPERATION INPUT...
+ * where OPERATION is one of
+ *      mm  A B             OUTPUT = A B
+ *      add A B             OUTPUT = A + B
+ *      sum A B C D E F     OUTPUT = (A + B + C) (D + E + F)
+ *
+ * Every distinct input file is read once, however many operations use it,
+ * and is freed after its last use.  An input naming the OUTPUT of an
+ * earlier line uses that result directly instead of reading the file.
+ * Operations are grouped into levels by these dependencies and each level
+ * runs on the OpenMP thread pool.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "utils.h"
+#include "sparsemm.h"
+
+#define MAX_INPUTS 6
+#define MAX_LINE 4096
+
+enum batch_op { OP_MM, OP_ADD, OP_SUM };
+
+struct batch_entry {
+    enum batch_op op;
+    int output;                 // index into the matrix table
+    int ninputs;
+    int inputs[MAX_INPUTS];     // indices into the matrix table
+    int level;
+    int line;
+};
+
+/* A named matrix: either a file that is read on first use, or the result
+ * of an earlier operation. */
+struct batch_matrix {
+    char *name;
+    COO mat;
+    int producer;               // entry producing this matrix, -1 if read from file
+    int uses;                   // remaining entries that read this matrix
+    int level;                  // first level at which it is needed
+};
+
+struct batch {
+    struct batch_entry *entries;
+    int nentries;
+    struct batch_matrix *matrices;
+    int nmatrices, capacity;
+    int *table;                 // open addressing hash of matrix names
+    int table_size;
+};
+
+static unsigned long hash_name(const char *s)
+{
+    // FNV-1a
+    unsigned long h = 14695981039346656037UL;
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 1099511628211UL;
+    }
+    return h;
+}
+
+/* Return the index of the named matrix, adding it if it is new. */
+static int lookup_matrix(struct batch *batch, const char *name)
+{
+    unsigned long h;
+    int slot;
+    if (2*(batch->nmatrices + 1) > batch->table_size) {
+        // Grow the hash table and rehash every name
+        int size = batch->table_size ? 2*batch->table_size : 1024;
+        free(batch->table);
+        batch->table = malloc(size*sizeof(int));
+        batch->table_size = size;
+        for (slot = 0; slot < size; slot++) {
+            batch->table[slot] = -1;
+        }
+        for (int i = 0; i < batch->nmatrices; i++) {
+            h = hash_name(batch->matrices[i].name) % size;
+            while (batch->table[h] >= 0) {
+                h = (h + 1) % size;
+            }
+            batch->table[h] = i;
+        }
+    }
+    h = hash_name(name) % batch->table_size;
+    while (batch->table[h] >= 0) {
+        if (!strcmp(batch->matrices[batch->table[h]].name, name)) {
+            return batch->table[h];
+        }
+        h = (h + 1) % batch->table_size;
+    }
+    if (batch->nmatrices == batch->capacity) {
+        batch->capacity = batch->capacity ? 2*batch->capacity : 256;
+        batch->matrices = realloc(batch->matrices, batch->capacity*sizeof(struct batch_matrix));
+    }
+    slot = batch->nmatrices++;
+    batch->matrices[slot].name = strdup(name);
+    batch->matrices[slot].mat = NULL;
+    batch->matrices[slot].producer = -1;
+    batch->matrices[slot].uses = 0;
+    batch->matrices[slot].level = -1;
+    batch->table[h] = slot;
+    return slot;
+}
+
+/* Free everything a batch holds. */
+static void free_batch(struct batch *batch)
+{
+    for (int i = 0; i < batch->nmatrices; i++) {
+        free_sparse(&batch->matrices[i].mat);
+        free(batch->matrices[i].name);
+    }
+    free(batch->matrices);
+    free(batch->entries);
+    free(batch->table);
+}
+
+/* Parse the manifest.  Returns 0 on success, or 1 with a message on
+ * stderr if it cannot be read or a line is malformed. */
+static int parse_manifest(const char *file, struct batch *batch)
+{
+    char line[MAX_LINE];
+    int lineno = 0, capacity = 0;
+    FILE *f = fopen(file, "r");
+    memset(batch, 0, sizeof(*batch));
+    if (!f) {
+        fprintf(stderr, "Unable to open manifest %s for reading.\n", file);
+        return 1;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        char *words[MAX_INPUTS + 2];
+        int nwords = 0;
+        char *tok = strtok(line, " \t\r\n");
+        struct batch_entry *e;
+        lineno++;
+        if (!tok || tok[0] == '#') {
+            continue;
+        }
+        while (tok && nwords < MAX_INPUTS + 2) {
+            words[nwords++] = tok;
+            tok = strtok(NULL, " \t\r\n");
+        }
+        if (batch->nentries == capacity) {
+            capacity = capacity ? 2*capacity : 256;
+            batch->entries = realloc(batch->entries, capacity*sizeof(struct batch_entry));
+        }
+        e = &batch->entries[batch->nentries];
+        e->line = lineno;
+        if (nwords == 4 && !strcmp(words[1], "mm")) {
+            e->op = OP_MM;
+        } else if (nwords == 4 && !strcmp(words[1], "add")) {
+            e->op = OP_ADD;
+        } else if (nwords == 8 && !strcmp(words[1], "sum") && !tok) {
+            e->op = OP_SUM;
+        } else {
+            fprintf(stderr, "%s:%d: expecting 'OUTPUT mm A B', 'OUTPUT add A B' or 'OUTPUT sum A B C D E F'\n",
+                    file, lineno);
+            fclose(f);
+            free_batch(batch);
+            return 1;
+        }
+        e->ninputs = nwords - 2;
+        e->level = 0;
+        for (int i = 0; i < e->ninputs; i++) {
+            struct batch_matrix *in;
+            e->inputs[i] = lookup_matrix(batch, words[i + 2]);
+            in = &batch->matrices[e->inputs[i]];
+            in->uses++;
+            // Inputs produced by an earlier line must wait for it
+            if (in->producer >= 0 && batch->entries[in->producer].level >= e->level) {
+                e->level = batch->entries[in->producer].level + 1;
+            }
+        }
+        for (int i = 0; i < e->ninputs; i++) {
+            struct batch_matrix *in = &batch->matrices[e->inputs[i]];
+            if (in->level < 0 || e->level < in->level) {
+                in->level = e->level;
+            }
+        }
+        e->output = lookup_matrix(batch, words[0]);
+        if (batch->matrices[e->output].producer >= 0 || batch->matrices[e->output].uses) {
+            fprintf(stderr, "%s:%d: output %s is already produced or read by an earlier line\n",
+                    file, lineno, words[0]);
+            fclose(f);
+            free_batch(batch);
+            return 1;
+        }
+        batch->matrices[e->output].producer = batch->nentries;
+        batch->nentries++;
+    }
+    fclose(f);
+    return 0;
+}
+
+/* Drop one use of a matrix, freeing it after the last one. */
+static void release_matrix(struct batch_matrix *in)
+{
+    int left;
+    #pragma omp atomic capture
+    left = --in->uses;
+    if (!left) {
+        free_sparse(&in->mat);
+    }
+}
+
+/* O = A + B, with a and b naming them in the error if the shapes differ. */
+static void add_pair(const COO A, const COO B, const char *a, const char *b, COO *O)
+{
+    CSR x, y, sum;
+    convert_sparse_to_csr(A, &x);
+    convert_sparse_to_csr(B, &y);
+    sparsemm_add_csr(x, y, a, b, &sum);
+    free_csr(&x);
+    free_csr(&y);
+    convert_csr_to_sparse(sum, O);
+    free_csr(&sum);
+}
+
+/*
+ * Run every operation in a manifest file.
+ * reader/writer select the matrix file format.
+ * If report_strategy is set, the dispatch of each product is printed on
+ * stderr, prefixed by its output name.
+ * summary, if not NULL, is filled in with what was done.
+ * Returns 0 on success, 1 if the manifest is unreadable or malformed
+ * (nothing is run then).
+ */
+int run_batch(const char *manifest,
+              void (*reader)(const char *, COO *),
+              void (*writer)(FILE *, COO),
+              int report_strategy,
+              struct batch_summary *summary)
+{
+    struct batch batch;
+    int nlevels = 0, nread = 0;
+    if (parse_manifest(manifest, &batch)) {
+        return 1;
+    }
+
+    for (int e = 0; e < batch.nentries; e++) {
+        if (batch.entries[e].level + 1 > nlevels) {
+            nlevels = batch.entries[e].level + 1;
+        }
+    }
+
+    for (int level = 0; level < nlevels; level++) {
+        // Read every file first needed at this level, once
+        #pragma omp parallel for schedule(dynamic) reduction(+:nread)
+        for (int i = 0; i < batch.nmatrices; i++) {
+            struct batch_matrix *in = &batch.matrices[i];
+            if (in->producer < 0 && in->level == level) {
+                reader(in->name, &in->mat);
+                nread++;
+            }
+        }
+
+        #pragma omp parallel for schedule(dynamic)
+        for (int e = 0; e < batch.nentries; e++) {
+            struct batch_entry *entry = &batch.entries[e];
+            struct batch_matrix *out = &batch.matrices[entry->output];
+            COO *in[MAX_INPUTS];
+            struct sparsemm_strategy strategy;
+            FILE *f;
+            if (entry->level != level) {
+                continue;
+            }
+            for (int i = 0; i < entry->ninputs; i++) {
+                in[i] = &batch.matrices[entry->inputs[i]].mat;
+            }
+            switch (entry->op) {
+            case OP_MM:
+                hybrid_sparsemm(*in[0], *in[1], &out->mat, NULL, &strategy);
+                break;
+            case OP_SUM:
+                hybrid_sparsemm_sum(*in[0], *in[1], *in[2], *in[3], *in[4], *in[5],
+                                    &out->mat, NULL, &strategy);
+                break;
+            case OP_ADD:
+                add_pair(*in[0], *in[1], batch.matrices[entry->inputs[0]].name,
+                         batch.matrices[entry->inputs[1]].name, &out->mat);
+                break;
+            }
+            if (report_strategy && entry->op != OP_ADD) {
+                #pragma omp critical(batch_report)
+                {
+                    fprintf(stderr, "%s: ", out->name);
+                    print_strategy(stderr, &strategy);
+                }
+            }
+            f = fopen(out->name, "w");
+            if (!f) {
+                fprintf(stderr, "Unable to open %s for writing output.\n", out->name);
+                exit(1);
+            }
+            writer(f, out->mat);
+            fclose(f);
+            for (int i = 0; i < entry->ninputs; i++) {
+                release_matrix(&batch.matrices[entry->inputs[i]]);
+            }
+            // Results nobody reads again are not kept around
+            if (!out->uses) {
+                free_sparse(&out->mat);
+            }
+        }
+    }
+
+    if (report_strategy) {
+        fprintf(stderr, "batch: %d operations in %d levels, %d files read for %d named matrices\n",
+                batch.nentries, nlevels, nread, batch.nmatrices);
+    }
+    if (summary) {
+        summary->operations = batch.nentries;
+        summary->levels = nlevels;
+        summary->files_read = nread;
+        summary->matrices = batch.nmatrices;
+        // Every input and intermediate should have been released after its last use
+        summary->resident = 0;
+        for (int i = 0; i < batch.nmatrices; i++) {
+            summary->resident += batch.matrices[i].mat != NULL;
+        }
+    }
+
+    free_batch(&batch);
+    return 0;
+}
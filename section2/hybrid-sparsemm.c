@@ -0,0 +1,640 @@
+/* This file implements a density-aware sparse matrix-matrix multiplication.
+ *
+ * A is split into blocks of rows.  A symbolic pass counts the exact number
+ * of nonzeros each block contributes to the product; blocks whose output
+ * is dense enough are gathered into small dense matrices (compressed to the
+ * columns that actually appear) and handed to the packed optimised_gemm
+ * from section3, the rest are computed with a row-wise (Gustavson) sparse
+ * kernel.  Both paths produce exactly the structure found by the symbolic
+ * pass, so the choice only affects speed.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "utils.h"
+#include "sparsemm.h"
+#include "gemm.h"
+#include "instrument.h"
+#include "workspace.h"
+
+// Default dispatch parameters, see sparsemm_default_options.
+// Blocks match the m_c blocking of optimised_gemm so the dense path does
+// not pay for padding, and the work ratio reflects the measured speed of
+// the dense GEMM relative to the sparse kernel (about 7x per flop with the
+// vector micro-kernels, including the gather and scatter).
+#define DEFAULT_DENSE_THRESHOLD 0.3
+#define DEFAULT_DENSE_WORK_RATIO 6.0
+#define DEFAULT_BLOCK_ROWS 512
+// Largest dense workspace (in doubles) a single block may use: 256MB
+#define MAX_DENSE_WORKSPACE (1L << 25)
+// Matrices read by hybrid_sparsemm_sum_files, each on its own thread
+#define SUM_INPUTS 6
+
+static int cmp_int(const void *a, const void *b)
+{
+    int x = *(const int *)a;
+    int y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+/* Fill in the default dispatch options.
+ * SPARSEMM_DENSE_THRESHOLD, SPARSEMM_DENSE_WORK_RATIO and
+ * SPARSEMM_BLOCK_ROWS in the environment override the built in values.
+ */
+void sparsemm_default_options(struct sparsemm_options *options)
+{
+    const char *env;
+    options->dense_threshold = DEFAULT_DENSE_THRESHOLD;
+    options->dense_work_ratio = DEFAULT_DENSE_WORK_RATIO;
+    options->block_rows = DEFAULT_BLOCK_ROWS;
+
+    if ((env = getenv("SPARSEMM_DENSE_THRESHOLD"))) {
+        options->dense_threshold = atof(env);
+    }
+    if ((env = getenv("SPARSEMM_DENSE_WORK_RATIO"))) {
+        options->dense_work_ratio = atof(env);
+    }
+    if ((env = getenv("SPARSEMM_BLOCK_ROWS")) && atoi(env) > 0) {
+        options->block_rows = atoi(env);
+    }
+}
+
+/* Compute rows [r0, r1) of C = A*B with the sparse accumulator.
+ * C->rowptr must already hold the final row starts.
+ * acc (length n) holds partial sums, marker (length n, all < r0) records
+ * which row last touched each column.
+ */
+static void sparse_block(const CSR A, const CSR B, CSR C, int r0, int r1,
+                         double *acc, int *marker)
+{
+    for(int i = r0; i < r1; i++) {
+        int pos = C->rowptr[i];
+        for(int p = A->rowptr[i]; p < A->rowptr[i + 1]; p++) {
+            double a = A->data[p];
+            int row = A->colidx[p];
+            for(int q = B->rowptr[row]; q < B->rowptr[row + 1]; q++) {
+                int j = B->colidx[q];
+                if(marker[j] != i) {
+                    // First contribution to (i, j)
+                    marker[j] = i;
+                    C->colidx[pos++] = j;
+                    acc[j] = a * B->data[q];
+                } else {
+                    acc[j] += a * B->data[q];
+                }
+            }
+        }
+        // Keep each output row sorted by column
+        qsort(&C->colidx[C->rowptr[i]], pos - C->rowptr[i], sizeof(int), cmp_int);
+        for(int p = C->rowptr[i]; p < pos; p++) {
+            C->data[p] = acc[C->colidx[p]];
+        }
+    }
+}
+
+/* Compute rows [r0, r1) of C = A*B by gathering the block into dense
+ * column major matrices and calling optimised_gemm.
+ * The inner dimension is compressed to the kc columns of A used by the
+ * block (kcols) and the output to the nc columns it produces (ncols).
+ * kmap/nmap (lengths k and n, all -1 on entry and exit) map original
+ * column indices to compressed ones, marker is as for sparse_block.
+ * a_d, b_d and c_d hold at least rows*kc, kc*nc and rows*nc doubles; they
+ * are shared by every dense block of the product and zeroed here.
+ */
+static void dense_block(const CSR A, const CSR B, CSR C, int r0, int r1,
+                        const int *kcols, int kc, const int *ncols, int nc,
+                        int *kmap, int *nmap, int *marker,
+                        double *a_d, double *b_d, double *c_d)
+{
+    int rows = r1 - r0;
+    memset(a_d, 0, (size_t)rows*kc*sizeof(double));
+    memset(b_d, 0, (size_t)kc*nc*sizeof(double));
+    memset(c_d, 0, (size_t)rows*nc*sizeof(double));
+
+    for(int t = 0; t < kc; t++) {
+        kmap[kcols[t]] = t;
+    }
+    for(int t = 0; t < nc; t++) {
+        nmap[ncols[t]] = t;
+    }
+
+    // Gather A's block (rows x kc) and the kc used rows of B (kc x nc)
+    for(int i = r0; i < r1; i++) {
+        for(int p = A->rowptr[i]; p < A->rowptr[i + 1]; p++) {
+            a_d[(size_t)kmap[A->colidx[p]]*rows + (i - r0)] = A->data[p];
+        }
+    }
+    for(int t = 0; t < kc; t++) {
+        int row = kcols[t];
+        for(int q = B->rowptr[row]; q < B->rowptr[row + 1]; q++) {
+            b_d[(size_t)nmap[B->colidx[q]]*kc + t] = B->data[q];
+        }
+    }
+
+    // optimised_gemm is reentrant, so concurrent products (batch mode)
+    // may run it at the same time; inside a parallel region it runs on
+    // the calling thread alone
+    optimised_gemm(rows, nc, kc, a_d, rows, b_d, kc, c_d, rows);
+
+    // Scatter back using the symbolic structure so that both paths agree
+    for(int i = r0; i < r1; i++) {
+        int pos = C->rowptr[i];
+        for(int p = A->rowptr[i]; p < A->rowptr[i + 1]; p++) {
+            int row = A->colidx[p];
+            for(int q = B->rowptr[row]; q < B->rowptr[row + 1]; q++) {
+                int j = B->colidx[q];
+                if(marker[j] != i) {
+                    marker[j] = i;
+                    C->colidx[pos++] = j;
+                }
+            }
+        }
+        qsort(&C->colidx[C->rowptr[i]], pos - C->rowptr[i], sizeof(int), cmp_int);
+        for(int p = C->rowptr[i]; p < pos; p++) {
+            C->data[p] = c_d[(size_t)nmap[C->colidx[p]]*rows + (i - r0)];
+        }
+    }
+
+    for(int t = 0; t < kc; t++) {
+        kmap[kcols[t]] = -1;
+    }
+    for(int t = 0; t < nc; t++) {
+        nmap[ncols[t]] = -1;
+    }
+}
+
+/* hybrid_sparsemm_csr, calling finished (if not NULL) with arg, C and the
+ * number of rows of C that are final: with 0 once the row pointers are
+ * (after the symbolic pass), then as each block of rows is, in order.
+ */
+static void multiply(const CSR A, const CSR B, CSR *C,
+                     const struct sparsemm_options *options,
+                     struct sparsemm_strategy *strategy,
+                     void (*finished)(void *, const CSR, int), void *arg)
+{
+    struct sparsemm_options defaults;
+    struct sparsemm_strategy report;
+    struct instrument_timer timer;
+    int m = A->m;
+    int k = A->n;
+    int n = B->n;
+    CSR sp;
+    // Largest gathered A, B and C blocks of any dense block
+    size_t a_size = 0, b_size = 0, c_size = 0;
+
+    *C = NULL;
+    if (k != B->m) {
+        fprintf(stderr, "Invalid matrix sizes, got %d x %d and %d x %d\n",
+                A->m, A->n, B->m, B->n);
+        exit(1);
+    }
+    if (!options) {
+        sparsemm_default_options(&defaults);
+        options = &defaults;
+    }
+    memset(&report, 0, sizeof(report));
+
+    // Non-positive block sizes fall back to the default, as from the environment
+    int block_rows = options->block_rows > 0 ? options->block_rows : DEFAULT_BLOCK_ROWS;
+    int nblocks = (m + block_rows - 1) / block_rows;
+    char *use_dense = calloc(nblocks + 1, sizeof(char));
+    // The accumulator and the maps are indexed by column all over, so they are
+    // workspace (huge pages when large); this thread touches them first
+    int *marker = workspace_alloc((n + 1)*sizeof(int));
+    int *nmap = workspace_alloc((n + 1)*sizeof(int));
+    int *kmap = workspace_alloc((k + 1)*sizeof(int));
+    int *ncols = malloc((n + 1)*sizeof(int));
+    int *kcols = malloc((k + 1)*sizeof(int));
+    double *acc = workspace_calloc((n + 1)*sizeof(double));
+    for(int j = 0; j < n; j++) {
+        marker[j] = -1;
+        nmap[j] = -1;
+    }
+    for(int j = 0; j < k; j++) {
+        kmap[j] = -1;
+    }
+
+    instrument_start(&timer, PHASE_SYMBOLIC);
+    alloc_csr(m, n, 0, &sp);
+
+    // Symbolic pass: count the nonzeros in every output row, and decide
+    // per block which kernel to use
+    for(int b = 0; b < nblocks; b++) {
+        int r0 = b*block_rows;
+        int r1 = r0 + block_rows < m ? r0 + block_rows : m;
+        int kc = 0, nc = 0;
+        long long block_nnz = 0;
+        double flops = 0;
+        for(int i = r0; i < r1; i++) {
+            int row_nnz = 0;
+            for(int p = A->rowptr[i]; p < A->rowptr[i + 1]; p++) {
+                int row = A->colidx[p];
+                if(kmap[row] < 0) {
+                    kmap[row] = kc;
+                    kcols[kc++] = row;
+                }
+                flops += 2.0*(B->rowptr[row + 1] - B->rowptr[row]);
+                for(int q = B->rowptr[row]; q < B->rowptr[row + 1]; q++) {
+                    int j = B->colidx[q];
+                    if(marker[j] != i) {
+                        marker[j] = i;
+                        row_nnz++;
+                        if(nmap[j] < 0) {
+                            nmap[j] = nc;
+                            ncols[nc++] = j;
+                        }
+                    }
+                }
+            }
+            sp->rowptr[i + 1] = row_nnz;
+            block_nnz += row_nnz;
+        }
+        for(int t = 0; t < kc; t++) {
+            kmap[kcols[t]] = -1;
+        }
+        for(int t = 0; t < nc; t++) {
+            nmap[ncols[t]] = -1;
+        }
+
+        // Density is measured against the compressed output block, and the
+        // dense GEMM must not do vastly more work than the sparse kernel
+        double dense_flops = 2.0*(r1 - r0)*(double)kc*nc;
+        double workspace = (double)(r1 - r0)*kc + (double)kc*nc + (double)(r1 - r0)*nc;
+        double density = nc ? block_nnz / ((double)(r1 - r0)*nc) : 0;
+        if(nc && density >= options->dense_threshold
+           && dense_flops <= options->dense_work_ratio*flops
+           && workspace <= MAX_DENSE_WORKSPACE) {
+            use_dense[b] = 1;
+            report.dense_blocks++;
+            report.dense_flops += dense_flops;
+            a_size = (size_t)(r1 - r0)*kc > a_size ? (size_t)(r1 - r0)*kc : a_size;
+            b_size = (size_t)kc*nc > b_size ? (size_t)kc*nc : b_size;
+            c_size = (size_t)(r1 - r0)*nc > c_size ? (size_t)(r1 - r0)*nc : c_size;
+        } else {
+            report.sparse_blocks++;
+            report.sparse_flops += flops;
+        }
+    }
+    for(int i = 0; i < m; i++) {
+        sp->rowptr[i + 1] += sp->rowptr[i];
+    }
+    sp->NZ = sp->rowptr[m];
+    free(sp->colidx);
+    free(sp->data);
+    sp->colidx = malloc((sp->NZ + 1)*sizeof(int));
+    sp->data = malloc((sp->NZ + 1)*sizeof(double));
+    instrument_alloc(sp->NZ*(sizeof(int) + sizeof(double)));
+    instrument_stop(&timer);
+    if(finished) {
+        finished(arg, sp, 0);
+    }
+
+    // Numeric pass.  The marker is reset since the symbolic pass used it.
+    // The dense blocks share one set of gather buffers (huge pages when
+    // large, see workspace.h) rather than mapping their own.
+    instrument_start(&timer, PHASE_MULTIPLY);
+    double *a_d = report.dense_blocks ? workspace_alloc(a_size*sizeof(double)) : NULL;
+    double *b_d = report.dense_blocks ? workspace_alloc(b_size*sizeof(double)) : NULL;
+    double *c_d = report.dense_blocks ? workspace_alloc(c_size*sizeof(double)) : NULL;
+    for(int j = 0; j < n; j++) {
+        marker[j] = -1;
+    }
+    for(int b = 0; b < nblocks; b++) {
+        int r0 = b*block_rows;
+        int r1 = r0 + block_rows < m ? r0 + block_rows : m;
+        if(finished && b > 0) {
+            finished(arg, sp, r0);
+        }
+        if(!use_dense[b]) {
+            sparse_block(A, B, sp, r0, r1, acc, marker);
+            continue;
+        }
+        // Recollect the compressed index sets for this block
+        int kc = 0, nc = 0;
+        for(int i = r0; i < r1; i++) {
+            for(int p = A->rowptr[i]; p < A->rowptr[i + 1]; p++) {
+                int row = A->colidx[p];
+                if(kmap[row] < 0) {
+                    kmap[row] = kc;
+                    kcols[kc++] = row;
+                }
+                for(int q = B->rowptr[row]; q < B->rowptr[row + 1]; q++) {
+                    int j = B->colidx[q];
+                    if(nmap[j] < 0) {
+                        nmap[j] = nc;
+                        ncols[nc++] = j;
+                    }
+                }
+            }
+        }
+        for(int t = 0; t < kc; t++) {
+            kmap[kcols[t]] = -1;
+        }
+        for(int t = 0; t < nc; t++) {
+            nmap[ncols[t]] = -1;
+        }
+        dense_block(A, B, sp, r0, r1, kcols, kc, ncols, nc, kmap, nmap, marker, a_d, b_d, c_d);
+    }
+    if(finished && nblocks > 0) {
+        finished(arg, sp, m);
+    }
+
+    instrument_stop(&timer);
+    instrument_count(PHASE_MULTIPLY, COUNT_FLOPS, report.sparse_flops + report.dense_flops);
+    instrument_count(PHASE_MULTIPLY, COUNT_NNZ_IN, A->NZ + B->NZ);
+    instrument_count(PHASE_MULTIPLY, COUNT_NNZ_OUT, sp->NZ);
+    // Compulsory traffic: A, B and C once each (so the bandwidth is a lower bound)
+    instrument_count(PHASE_MULTIPLY, COUNT_BYTES_READ, (A->NZ + B->NZ)*(sizeof(int) + sizeof(double))
+                     + (A->m + B->m + 2)*sizeof(int));
+    instrument_count(PHASE_MULTIPLY, COUNT_BYTES_WRITTEN, sp->NZ*(sizeof(int) + sizeof(double))
+                     + (m + 1)*sizeof(int));
+
+    report.blocks = nblocks;
+    report.nnz = sp->NZ;
+    report.density = m && n ? sp->NZ / ((double)m*n) : 0;
+    if (strategy) {
+        *strategy = report;
+    }
+
+    free(use_dense);
+    workspace_free(marker);
+    workspace_free(nmap);
+    workspace_free(kmap);
+    free(ncols);
+    free(kcols);
+    workspace_free(acc);
+    workspace_free(a_d);
+    workspace_free(b_d);
+    workspace_free(c_d);
+    *C = sp;
+}
+
+/* Computes C = A*B for CSR matrices, choosing per block of rows between
+ * the dense GEMM and the sparse kernel.
+ * C is allocated by this routine.
+ * options may be NULL to use sparsemm_default_options, strategy may be
+ * NULL if the caller does not want a report.
+ */
+void hybrid_sparsemm_csr(const CSR A, const CSR B, CSR *C,
+                         const struct sparsemm_options *options,
+                         struct sparsemm_strategy *strategy)
+{
+    multiply(A, B, C, options, strategy, NULL, NULL);
+}
+
+/* Computes C = A*B, see hybrid_sparsemm_csr.
+ * C is allocated by this routine.
+ */
+void hybrid_sparsemm(const COO A, const COO B, COO *C,
+                     const struct sparsemm_options *options,
+                     struct sparsemm_strategy *strategy)
+{
+    CSR a, b, c;
+    struct instrument_timer timer;
+    instrument_start(&timer, PHASE_CONVERT);
+    convert_sparse_to_csr(A, &a);
+    convert_sparse_to_csr(B, &b);
+    instrument_stop(&timer);
+    hybrid_sparsemm_csr(a, b, &c, options, strategy);
+    free_csr(&a);
+    free_csr(&b);
+    instrument_start(&timer, PHASE_CONVERT);
+    convert_csr_to_sparse(c, C);
+    instrument_stop(&timer);
+    free_csr(&c);
+}
+
+/* Sum three same-shaped COO matrices straight into CSR.
+ * The entries are concatenated and convert_sparse_to_csr merges the
+ * duplicate coordinates.
+ */
+static void sum_to_csr(const COO A, const COO B, const COO C, CSR *O)
+{
+    COO all;
+    alloc_sparse(A->m, A->n, A->NZ + B->NZ + C->NZ, &all);
+    memcpy(all->coords, A->coords, A->NZ*sizeof(struct coord));
+    memcpy(all->coords + A->NZ, B->coords, B->NZ*sizeof(struct coord));
+    memcpy(all->coords + A->NZ + B->NZ, C->coords, C->NZ*sizeof(struct coord));
+    memcpy(all->data, A->data, A->NZ*sizeof(double));
+    memcpy(all->data + A->NZ, B->data, B->NZ*sizeof(double));
+    memcpy(all->data + A->NZ + B->NZ, C->data, C->NZ*sizeof(double));
+    convert_sparse_to_csr(all, O);
+    free_sparse(&all);
+}
+
+/* Computes O = (A + B + C) (D + E + F), see hybrid_sparsemm_csr.
+ * O is allocated by this routine.
+ */
+void hybrid_sparsemm_sum(const COO A, const COO B, const COO C,
+                         const COO D, const COO E, const COO F,
+                         COO *O,
+                         const struct sparsemm_options *options,
+                         struct sparsemm_strategy *strategy)
+{
+    CSR left, right, out;
+    struct instrument_timer timer;
+    if (A->m != B->m || A->n != B->n || A->m != C->m || A->n != C->n) {
+        fprintf(stderr, "A (%d x %d), B (%d x %d) and C (%d x %d) are not the same shape\n",
+                A->m, A->n, B->m, B->n, C->m, C->n);
+        exit(1);
+    }
+    if (D->m != E->m || D->n != E->n || D->m != F->m || D->n != F->n) {
+        fprintf(stderr, "D (%d x %d), E (%d x %d) and F (%d x %d) are not the same shape\n",
+                D->m, D->n, E->m, E->n, F->m, F->n);
+        exit(1);
+    }
+    instrument_start(&timer, PHASE_SUM);
+    sum_to_csr(A, B, C, &left);
+    sum_to_csr(D, E, F, &right);
+    instrument_stop(&timer);
+    instrument_count(PHASE_SUM, COUNT_NNZ_IN, A->NZ + B->NZ + C->NZ + D->NZ + E->NZ + F->NZ);
+    instrument_count(PHASE_SUM, COUNT_NNZ_OUT, left->NZ + right->NZ);
+    hybrid_sparsemm_csr(left, right, &out, options, strategy);
+    free_csr(&left);
+    free_csr(&right);
+    instrument_start(&timer, PHASE_CONVERT);
+    convert_csr_to_sparse(out, O);
+    instrument_stop(&timer);
+    free_csr(&out);
+}
+
+static double wall_time(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + 1e-9*t.tv_nsec;
+}
+
+/* O = X + Y (add_csr) for two CSR matrices that must be the same shape;
+ * x and y name them in the error.  O is allocated by this routine. */
+void sparsemm_add_csr(const CSR X, const CSR Y, const char *x, const char *y, CSR *O)
+{
+    if (X->m != Y->m || X->n != Y->n) {
+        fprintf(stderr, "%s (%d x %d) and %s (%d x %d) are not the same shape\n",
+                x, X->m, X->n, y, Y->m, Y->n);
+        exit(1);
+    }
+    add_csr(X, Y, O);
+}
+
+/* The rows of the product finished so far, handed from the thread computing
+ * it to the one writing it out. */
+struct output {
+    pthread_mutex_t lock;
+    pthread_cond_t more;
+    CSR C;              // the product, once its row pointers are final
+    int rows;           // rows of C finished
+    FILE *f;
+    int binary;
+    double seconds;     // time spent writing
+};
+
+static void finished_rows(void *arg, const CSR C, int rows)
+{
+    struct output *out = arg;
+    pthread_mutex_lock(&out->lock);
+    out->C = C;
+    out->rows = rows;
+    pthread_cond_signal(&out->more);
+    pthread_mutex_unlock(&out->lock);
+}
+
+/* Write the rows of the product as they are finished (see row_writer_begin). */
+static void *write_output(void *arg)
+{
+    struct output *out = arg;
+    struct row_writer w;
+    double start;
+    int rows = 0;
+    pthread_mutex_lock(&out->lock);
+    while (!out->C) {
+        pthread_cond_wait(&out->more, &out->lock);
+    }
+    pthread_mutex_unlock(&out->lock);
+    start = wall_time();
+    row_writer_begin(&w, out->f, out->binary, out->C);
+    out->seconds += wall_time() - start;
+    while (rows < out->C->m) {
+        pthread_mutex_lock(&out->lock);
+        while (out->rows == rows) {
+            pthread_cond_wait(&out->more, &out->lock);
+        }
+        rows = out->rows;
+        pthread_mutex_unlock(&out->lock);
+        start = wall_time();
+        row_writer_rows(&w, rows);
+        out->seconds += wall_time() - start;
+    }
+    start = wall_time();
+    row_writer_end(&w);
+    out->seconds += wall_time() - start;
+    return NULL;
+}
+
+/* O = (A + B + C) (D + E + F) straight from the files names[0..5] (A to F),
+ * in the format of read_sparse, or read_sparse_binary if binary is set, and
+ * written to f in the same format.  O is allocated by this routine.
+ *
+ * Loading is pipelined: the six files are read concurrently, one thread
+ * each (they are mostly waiting on the file system), every matrix is
+ * converted to CSR as soon as it has arrived, and A + B (likewise D + E)
+ * is formed as soon as both are there and C (F) added once it is.  The
+ * additions happen in the same order as in hybrid_sparsemm_sum, so the
+ * result is the same, and each input is freed once it is added in.
+ * So is the output: the product runs on all threads while a thread of its
+ * own writes each block of rows of O as soon as it is finished (only the
+ * coordinates in the binary format, which has the values last).
+ * The wall time of loading and of the product go in the load_seconds and
+ * compute_seconds fields, the time spent writing (mostly during the
+ * product) in output_seconds, and the time from the end of the product to
+ * the end of the output in output_tail_seconds (the phases add up the time
+ * of every thread).
+ */
+void hybrid_sparsemm_sum_files(const char *const *names, int binary, FILE *f,
+                               COO *O,
+                               const struct sparsemm_options *options,
+                               struct sparsemm_strategy *strategy)
+{
+    static const char *const operand[SUM_INPUTS] = {"A", "B", "C", "D", "E", "F"};
+    void (*reader)(const char *, COO *) = binary ? &read_sparse_binary : &read_sparse;
+    struct output output = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, 0, f, binary, 0};
+    CSR in[SUM_INPUTS], partial[2], sum[2], out;
+    double start = wall_time(), loaded, computed;
+    pthread_t writer;
+
+    #pragma omp parallel num_threads(SUM_INPUTS)
+    #pragma omp single
+    {
+        for (int i = 0; i < SUM_INPUTS; i++) {
+            #pragma omp task depend(out: in[i]) firstprivate(i)
+            {
+                struct instrument_timer timer;
+                COO matrix;
+                reader(names[i], &matrix);
+                instrument_start(&timer, PHASE_SUM);
+                convert_sparse_to_csr(matrix, &in[i]);
+                instrument_stop(&timer);
+                instrument_count(PHASE_SUM, COUNT_NNZ_IN, matrix->NZ);
+                free_sparse(&matrix);
+            }
+        }
+        for (int s = 0; s < 2; s++) {
+            #pragma omp task depend(in: in[3*s], in[3*s + 1]) depend(out: partial[s]) firstprivate(s)
+            {
+                struct instrument_timer timer;
+                instrument_start(&timer, PHASE_SUM);
+                sparsemm_add_csr(in[3*s], in[3*s + 1], operand[3*s], operand[3*s + 1], &partial[s]);
+                instrument_stop(&timer);
+                free_csr(&in[3*s]);
+                free_csr(&in[3*s + 1]);
+            }
+            #pragma omp task depend(in: partial[s], in[3*s + 2]) firstprivate(s)
+            {
+                struct instrument_timer timer;
+                instrument_start(&timer, PHASE_SUM);
+                sparsemm_add_csr(partial[s], in[3*s + 2], s ? "D + E" : "A + B", operand[3*s + 2], &sum[s]);
+                instrument_stop(&timer);
+                instrument_count(PHASE_SUM, COUNT_NNZ_OUT, sum[s]->NZ);
+                free_csr(&partial[s]);
+                free_csr(&in[3*s + 2]);
+            }
+        }
+    }
+    loaded = wall_time();
+
+    // A thread outside OpenMP, so the product's parallel regions keep every thread
+    if (pthread_create(&writer, NULL, &write_output, &output)) {
+        fprintf(stderr, "Unable to start the output thread\n");
+        exit(1);
+    }
+    multiply(sum[0], sum[1], &out, options, strategy, &finished_rows, &output);
+    computed = wall_time();
+    free_csr(&sum[0]);
+    free_csr(&sum[1]);
+    struct instrument_timer timer;
+    instrument_start(&timer, PHASE_CONVERT);
+    convert_csr_to_sparse(out, O);
+    instrument_stop(&timer);
+    pthread_join(writer, NULL);
+    free_csr(&out);
+    instrument_field("load_seconds", loaded - start);
+    instrument_field("compute_seconds", computed - loaded);
+    instrument_field("output_seconds", output.seconds);
+    instrument_field("output_tail_seconds", wall_time() - computed);
+}
+
+/*
+ * Print a one line summary of the dispatch decisions.
+ */
+void print_strategy(FILE *f, const struct sparsemm_strategy *strategy)
+{
+    fprintf(f, "strategy: %d row blocks, %d dense (GEMM), %d sparse; "
+            "nnz %lld, density %.3g; flops dense %.4g sparse %.4g\n",
+            strategy->blocks, strategy->dense_blocks, strategy->sparse_blocks,
+            strategy->nnz, strategy->density,
+            strategy->dense_flops, strategy->sparse_flops);
+}
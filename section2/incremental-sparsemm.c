@@ -0,0 +1,465 @@
+/* This file keeps a sparse product C = A B up to date while A and B change
+ * a few rows or entries at a time.
+ *
+ * Row i of C depends only on row i of A and on the rows of B that row i of
+ * A has entries in.  So a change to some rows of A recomputes just those
+ * rows of C, and a change to some rows of B recomputes the rows of C whose
+ * row of A has an entry in one of those columns.  They are found through
+ * the pattern of A by column, which is kept with the product and rebuilt
+ * only after A's structure (not merely its values) has changed.
+ *
+ * Changed rows are recomputed with the row-wise (Gustavson) kernel and
+ * spliced into A, B and C.  If every changed row keeps its length (new
+ * values, or new columns for old ones) they are overwritten in place, and
+ * an update costs only its own rows.  Otherwise the rows after the first
+ * changed one are moved along in place with memmove, which is no arithmetic
+ * but is a pass over the rest of the matrix (tens of milliseconds for 20
+ * million entries, where recomputing the product takes over a second).
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+
+#include "utils.h"
+#include "sparsemm.h"
+#include "instrument.h"
+#include "workspace.h"
+
+struct sparsemm_update {
+    CSR A, B, C;
+    // Rows of A with an entry in each column (A's pattern by column), for changes to B
+    int *a_colptr, *a_rows;
+    int a_columns_stale;
+    // Sparse accumulator over the columns of C; a column belongs to the current row
+    // only if its marker holds the current stamp, so it is never cleared.  The
+    // markers also mark rows of A (there are as many as the larger of the two)
+    double *acc;
+    int *marker, markers;
+    int stamp;
+};
+
+static int cmp_int(const void *a, const void *b)
+{
+    int x = *(const int *)a;
+    int y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+/* A stamp no row has used yet, clearing the markers when they run out. */
+static int next_stamp(struct sparsemm_update *u)
+{
+    if (u->stamp == INT_MAX) {
+        for (int j = 0; j < u->markers; j++) {
+            u->marker[j] = -1;
+        }
+        u->stamp = 0;
+    }
+    return u->stamp++;
+}
+
+/* Sorted, checked copy of the row indices rows[0..count) of a matrix with m rows.
+ * Returns the copy (freed by the caller). */
+static int *sorted_rows(int count, const int *rows, int m, const char *name)
+{
+    int *sorted = malloc((count + 1)*sizeof(int));
+    memcpy(sorted, rows, count*sizeof(int));
+    qsort(sorted, count, sizeof(int), cmp_int);
+    for (int r = 0; r < count; r++) {
+        if (sorted[r] < 0 || sorted[r] >= m || (r > 0 && sorted[r] == sorted[r - 1])) {
+            fprintf(stderr, "Invalid or repeated row %d of %s (%d rows)\n", sorted[r], name, m);
+            exit(1);
+        }
+    }
+    return sorted;
+}
+
+/* Position of row in rows[0..count) (ascending), -1 if absent. */
+static int find_row(int count, const int *rows, int row)
+{
+    int lo = 0, hi = count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (rows[mid] < row) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo < count && rows[lo] == row ? lo : -1;
+}
+
+/* The entries of changes (same shape as X) as a CSR matrix with one row per
+ * rows[0..count), which must hold the row of every entry. */
+static void gather_rows(const COO changes, int count, const int *rows, const char *name, CSR *O)
+{
+    COO local;
+    alloc_sparse(count, changes->n, changes->NZ, &local);
+    for (int e = 0; e < changes->NZ; e++) {
+        int r = find_row(count, rows, changes->coords[e].i);
+        if (r < 0) {
+            fprintf(stderr, "Entry (%d, %d) of %s is not in one of the rows being replaced\n",
+                    changes->coords[e].i, changes->coords[e].j, name);
+            exit(1);
+        }
+        local->coords[e].i = r;
+        local->coords[e].j = changes->coords[e].j;
+        local->data[e] = changes->data[e];
+    }
+    convert_sparse_to_csr(local, O);
+    free_sparse(&local);
+}
+
+/* Replace rows rows[0..count) (ascending) of X with the rows of R (count rows).
+ * Returns 1 if X's structure changed, 0 if only its values did. */
+static int replace_rows(CSR X, int count, const int *rows, const CSR R)
+{
+    long long grow = 0;
+    int changed = 0;
+
+    for (int r = 0; r < count; r++) {
+        grow += (R->rowptr[r + 1] - R->rowptr[r]) - (X->rowptr[rows[r] + 1] - X->rowptr[rows[r]]);
+    }
+    if (!grow) {
+        // Lengths may still differ row by row; in place only if none does
+        for (int r = 0; r < count && !changed; r++) {
+            changed = R->rowptr[r + 1] - R->rowptr[r] != X->rowptr[rows[r] + 1] - X->rowptr[rows[r]];
+        }
+    }
+    if (!grow && !changed) {
+        for (int r = 0; r < count; r++) {
+            int length = R->rowptr[r + 1] - R->rowptr[r];
+            int *colidx = X->colidx + X->rowptr[rows[r]];
+            changed |= memcmp(colidx, R->colidx + R->rowptr[r], length*sizeof(int)) != 0;
+            memcpy(colidx, R->colidx + R->rowptr[r], length*sizeof(int));
+            memcpy(X->data + X->rowptr[rows[r]], R->data + R->rowptr[r], length*sizeof(double));
+        }
+        return changed;
+    }
+    if (X->NZ + grow > INT_MAX) {
+        fprintf(stderr, "Too many nonzeros after the update (%lld)\n", X->NZ + grow);
+        exit(1);
+    }
+
+    // Move the rows in between along in place, to where they end up with the new
+    // lengths, then drop the new rows in.  Segment r (the rows before rows[r], or
+    // the last rows for r = count) moves by shift[r]: those moving down first, front
+    // to back, then those moving up, back to front, so none is overwritten before
+    // it has moved
+    int nz = (int)(X->NZ + grow);
+    int *shift = malloc((count + 1)*sizeof(int));
+    shift[0] = 0;
+    for (int r = 0; r < count; r++) {
+        shift[r + 1] = shift[r] + (R->rowptr[r + 1] - R->rowptr[r])
+            - (X->rowptr[rows[r] + 1] - X->rowptr[rows[r]]);
+    }
+    if (grow > 0) {
+        X->colidx = realloc(X->colidx, (nz + 1)*sizeof(int));
+        X->data = realloc(X->data, (nz + 1)*sizeof(double));
+        instrument_realloc(nz*(sizeof(int) + sizeof(double)));
+    }
+    for (int pass = 0; pass < 2; pass++) {
+        for (int t = 0; t <= count; t++) {
+            int r = pass ? count - t : t;
+            int from = r > 0 ? X->rowptr[rows[r - 1] + 1] : 0;
+            int end = r < count ? X->rowptr[rows[r]] : X->NZ;
+            if ((shift[r] > 0) == pass && shift[r] && end > from) {
+                memmove(X->colidx + from + shift[r], X->colidx + from, (end - from)*sizeof(int));
+                memmove(X->data + from + shift[r], X->data + from, (end - from)*sizeof(double));
+            }
+        }
+    }
+    // The new row starts, back to front so each old one is still there when needed
+    for (int r = count; r >= 0; r--) {
+        int first = r > 0 ? rows[r - 1] + 1 : 0, last = r < count ? rows[r] : X->m;
+        for (int i = first; i < last; i++) {
+            X->rowptr[i + 1] += shift[r];
+        }
+        if (r > 0) {
+            int length = R->rowptr[r] - R->rowptr[r - 1];
+            X->rowptr[rows[r - 1] + 1] = X->rowptr[rows[r - 1]] + shift[r - 1] + length;
+        }
+    }
+    for (int r = 0; r < count; r++) {
+        int length = R->rowptr[r + 1] - R->rowptr[r];
+        memcpy(X->colidx + X->rowptr[rows[r]], R->colidx + R->rowptr[r], length*sizeof(int));
+        memcpy(X->data + X->rowptr[rows[r]], R->data + R->rowptr[r], length*sizeof(double));
+    }
+    X->NZ = nz;
+    free(shift);
+    return 1;
+}
+
+/* The rows rows[0..count) of X with the entries of C (a row each, see gather_rows)
+ * set: a CSR matrix of count rows. */
+static void merge_rows(const CSR X, int count, const int *rows, const CSR C, CSR *O)
+{
+    CSR sp;
+    int nz = 0;
+    for (int r = 0; r < count; r++) {
+        nz += X->rowptr[rows[r] + 1] - X->rowptr[rows[r]] + C->rowptr[r + 1] - C->rowptr[r];
+    }
+    alloc_csr(count, X->n, nz, &sp);
+    nz = 0;
+    for (int r = 0; r < count; r++) {
+        int p = X->rowptr[rows[r]], p_end = X->rowptr[rows[r] + 1];
+        int q = C->rowptr[r], q_end = C->rowptr[r + 1];
+        // Both rows are sorted; where both have a column the change wins
+        while (p < p_end || q < q_end) {
+            if (q == q_end || (p < p_end && X->colidx[p] < C->colidx[q])) {
+                sp->colidx[nz] = X->colidx[p];
+                sp->data[nz++] = X->data[p++];
+            } else {
+                if (p < p_end && X->colidx[p] == C->colidx[q]) {
+                    p++;
+                }
+                sp->colidx[nz] = C->colidx[q];
+                sp->data[nz++] = C->data[q++];
+            }
+        }
+        sp->rowptr[r + 1] = nz;
+    }
+    sp->NZ = nz;
+    *O = sp;
+}
+
+/* Recompute rows rows[0..count) (ascending) of C from A and B. */
+static void recompute_rows(struct sparsemm_update *u, int count, const int *rows)
+{
+    const CSR A = u->A, B = u->B;
+    struct instrument_timer timer;
+    double flops = 0;
+    CSR R;
+    int nz = 0;
+
+    instrument_start(&timer, PHASE_MULTIPLY);
+    alloc_csr(count, B->n, 0, &R);
+    // Symbolic: the length of each new row
+    for (int r = 0; r < count; r++) {
+        int i = rows[r], stamp = next_stamp(u);
+        for (int p = A->rowptr[i]; p < A->rowptr[i + 1]; p++) {
+            int row = A->colidx[p];
+            flops += 2.0*(B->rowptr[row + 1] - B->rowptr[row]);
+            for (int q = B->rowptr[row]; q < B->rowptr[row + 1]; q++) {
+                if (u->marker[B->colidx[q]] != stamp) {
+                    u->marker[B->colidx[q]] = stamp;
+                    nz++;
+                }
+            }
+        }
+        R->rowptr[r + 1] = nz;
+    }
+    free(R->colidx);
+    free(R->data);
+    R->colidx = malloc((nz + 1)*sizeof(int));
+    R->data = malloc((nz + 1)*sizeof(double));
+    R->NZ = nz;
+
+    // Numeric, as sparse_block in hybrid-sparsemm.c
+    for (int r = 0; r < count; r++) {
+        int i = rows[r], stamp = next_stamp(u), pos = R->rowptr[r];
+        for (int p = A->rowptr[i]; p < A->rowptr[i + 1]; p++) {
+            double a = A->data[p];
+            int row = A->colidx[p];
+            for (int q = B->rowptr[row]; q < B->rowptr[row + 1]; q++) {
+                int j = B->colidx[q];
+                if (u->marker[j] != stamp) {
+                    u->marker[j] = stamp;
+                    R->colidx[pos++] = j;
+                    u->acc[j] = a*B->data[q];
+                } else {
+                    u->acc[j] += a*B->data[q];
+                }
+            }
+        }
+        qsort(&R->colidx[R->rowptr[r]], pos - R->rowptr[r], sizeof(int), cmp_int);
+        for (int p = R->rowptr[r]; p < pos; p++) {
+            R->data[p] = u->acc[R->colidx[p]];
+        }
+    }
+    replace_rows(u->C, count, rows, R);
+    instrument_stop(&timer);
+    instrument_count(PHASE_MULTIPLY, COUNT_FLOPS, flops);
+    instrument_count(PHASE_MULTIPLY, COUNT_NNZ_OUT, nz);
+    free_csr(&R);
+}
+
+/* Rebuild the pattern of A by column. */
+static void index_columns(struct sparsemm_update *u)
+{
+    const CSR A = u->A;
+    int *next;
+    free(u->a_colptr);
+    free(u->a_rows);
+    u->a_colptr = calloc(A->n + 1, sizeof(int));
+    u->a_rows = malloc((A->NZ + 1)*sizeof(int));
+    for (int p = 0; p < A->NZ; p++) {
+        u->a_colptr[A->colidx[p] + 1]++;
+    }
+    for (int j = 0; j < A->n; j++) {
+        u->a_colptr[j + 1] += u->a_colptr[j];
+    }
+    next = malloc((A->n + 1)*sizeof(int));
+    memcpy(next, u->a_colptr, A->n*sizeof(int));
+    // Rows in ascending order within each column
+    for (int i = 0; i < A->m; i++) {
+        for (int p = A->rowptr[i]; p < A->rowptr[i + 1]; p++) {
+            u->a_rows[next[A->colidx[p]]++] = i;
+        }
+    }
+    free(next);
+    u->a_columns_stale = 0;
+}
+
+/* Replace rows rows[0..count) (ascending) of A (which = 0) or B (which = 1) with R,
+ * and recompute the rows of C that depend on them. */
+static void update(struct sparsemm_update *u, int which, int count, const int *rows, const CSR R)
+{
+    if (!which) {
+        u->a_columns_stale |= replace_rows(u->A, count, rows, R);
+        recompute_rows(u, count, rows);
+        return;
+    }
+
+    // Changes to B: every row of C whose row of A has an entry in a changed column
+    int affected = 0, *list, stamp;
+    replace_rows(u->B, count, rows, R);
+    if (u->a_columns_stale) {
+        index_columns(u);
+    }
+    list = malloc(((size_t)u->A->m + 1)*sizeof(int));
+    stamp = next_stamp(u);
+    for (int r = 0; r < count; r++) {
+        for (int p = u->a_colptr[rows[r]]; p < u->a_colptr[rows[r] + 1]; p++) {
+            if (u->marker[u->a_rows[p]] != stamp) {
+                u->marker[u->a_rows[p]] = stamp;
+                list[affected++] = u->a_rows[p];
+            }
+        }
+    }
+    qsort(list, affected, sizeof(int), cmp_int);
+    recompute_rows(u, affected, list);
+    free(list);
+}
+
+/* Start keeping C = A B (computed here with hybrid_sparsemm_csr, options as for it).
+ * A and B are copied. */
+struct sparsemm_update *sparsemm_update_create(const COO A, const COO B,
+                                               const struct sparsemm_options *options)
+{
+    struct sparsemm_update *u = calloc(1, sizeof(*u));
+    struct instrument_timer timer;
+    instrument_start(&timer, PHASE_CONVERT);
+    convert_sparse_to_csr(A, &u->A);
+    convert_sparse_to_csr(B, &u->B);
+    instrument_stop(&timer);
+    hybrid_sparsemm_csr(u->A, u->B, &u->C, options, NULL);
+    u->markers = u->C->n > u->A->m ? u->C->n : u->A->m;
+    u->acc = workspace_calloc((u->C->n + 1)*sizeof(double));
+    u->marker = workspace_alloc((u->markers + 1)*sizeof(int));
+    for (int j = 0; j < u->markers; j++) {
+        u->marker[j] = -1;
+    }
+    u->a_columns_stale = 1;
+    return u;
+}
+
+void sparsemm_update_destroy(struct sparsemm_update *u)
+{
+    if (!u) {
+        return;
+    }
+    free_csr(&u->A);
+    free_csr(&u->B);
+    free_csr(&u->C);
+    free(u->a_colptr);
+    free(u->a_rows);
+    workspace_free(u->acc);
+    workspace_free(u->marker);
+    free(u);
+}
+
+/* The current product (owned by u, valid until its next update). */
+CSR sparsemm_update_product(const struct sparsemm_update *u)
+{
+    return u->C;
+}
+
+/* Rows rows[0..count) of A (which = 0) or B (which = 1) become the rows of values
+ * (entries in other rows are an error), possibly changing their structure. */
+static void update_rows(struct sparsemm_update *u, int which, int count, const int *rows, const COO values)
+{
+    const CSR X = which ? u->B : u->A;
+    const char *name = which ? "B" : "A";
+    int *sorted;
+    CSR R;
+    if (values->m != X->m || values->n != X->n) {
+        fprintf(stderr, "New rows (%d x %d) do not match %s (%d x %d)\n",
+                values->m, values->n, name, X->m, X->n);
+        exit(1);
+    }
+    sorted = sorted_rows(count, rows, X->m, name);
+    gather_rows(values, count, sorted, name, &R);
+    update(u, which, count, sorted, R);
+    free_csr(&R);
+    free(sorted);
+}
+
+/* The entries of changes are set in A (which = 0) or B (which = 1), adding them to
+ * the structure if they are new; the rest of each row stays as it is. */
+static void update_entries(struct sparsemm_update *u, int which, const COO changes)
+{
+    const CSR X = which ? u->B : u->A;
+    const char *name = which ? "B" : "A";
+    int count = 0, *rows;
+    CSR C, R;
+    if (changes->m != X->m || changes->n != X->n) {
+        fprintf(stderr, "Changes (%d x %d) do not match %s (%d x %d)\n",
+                changes->m, changes->n, name, X->m, X->n);
+        exit(1);
+    }
+    rows = malloc((changes->NZ + 1)*sizeof(int));
+    for (int e = 0; e < changes->NZ; e++) {
+        if (changes->coords[e].i < 0 || changes->coords[e].i >= X->m
+            || changes->coords[e].j < 0 || changes->coords[e].j >= X->n) {
+            fprintf(stderr, "Entry (%d, %d) is outside %s (%d x %d)\n",
+                    changes->coords[e].i, changes->coords[e].j, name, X->m, X->n);
+            exit(1);
+        }
+        rows[e] = changes->coords[e].i;
+    }
+    // The distinct rows changed
+    qsort(rows, changes->NZ, sizeof(int), cmp_int);
+    for (int e = 0; e < changes->NZ; e++) {
+        if (!count || rows[e] != rows[count - 1]) {
+            rows[count++] = rows[e];
+        }
+    }
+    gather_rows(changes, count, rows, name, &C);
+    merge_rows(X, count, rows, C, &R);
+    update(u, which, count, rows, R);
+    free_csr(&C);
+    free_csr(&R);
+    free(rows);
+}
+
+void sparsemm_update_rows_a(struct sparsemm_update *u, int count, const int *rows, const COO values)
+{
+    update_rows(u, 0, count, rows, values);
+}
+
+void sparsemm_update_rows_b(struct sparsemm_update *u, int count, const int *rows, const COO values)
+{
+    update_rows(u, 1, count, rows, values);
+}
+
+void sparsemm_update_entries_a(struct sparsemm_update *u, const COO changes)
+{
+    update_entries(u, 0, changes);
+}
+
+void sparsemm_update_entries_b(struct sparsemm_update *u, const COO changes)
+{
+    update_entries(u, 1, changes);
+}
@@ -0,0 +1,519 @@
+/* This file implements server mode: a resident process that keeps named
+ * matrices in memory (already converted to CSR, the layout the kernels
+ * use) and serves requests over a Unix domain stream socket.
+ *
+ * Requests are single lines, and every reply starts with a line that is
+ * either "ERR message" or "OK ...".  Matrix names may only contain
+ * letters, digits, '_', '-' and '.'.
+ *
+ *      LOAD name path          read a matrix file into memory
+ *      MUL out a b [path]      out = a b
+ *      ADD out a b [path]      out = a + b
+ *      SUM out a b c d e f [path]
+ *                              out = (a + b + c) (d + e + f)
+ *      WRITE name path         write a resident matrix to a file
+ *      SHM name                export a matrix to POSIX shared memory
+ *      DROP name               forget a matrix (and its shared memory)
+ *      LIST                    "OK n" then one "name m n NZ" line each
+ *      STATS                   "OK n" then one latency line per request type
+ *      QUIT                    close this connection
+ *      SHUTDOWN                stop the server
+ *
+ * Results stay resident under their output name, and are also written to
+ * path if one is given.  Files use the format selected on the command line
+ * (--binary or text).  SHM replies "OK ms /object bytes"; the object holds
+ * the same layout as the binary file format (m, n, NZ, coordinates,
+ * values) and can be opened with shm_open or under /dev/shm.
+ * Apart from LIST, STATS, QUIT and SHUTDOWN, successful replies start with
+ * the request latency in milliseconds, and STATS summarises them.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "utils.h"
+#include "sparsemm.h"
+
+#define MAX_LINE 4096
+#define MAX_WORDS 10
+// Longest shared memory object name, with its '/' (NAME_MAX + 1)
+#define MAX_OBJECT 256
+
+enum command { CMD_LOAD, CMD_MUL, CMD_ADD, CMD_SUM, CMD_WRITE, CMD_SHM,
+               CMD_DROP, CMD_LIST, CMD_STATS, CMD_QUIT, CMD_SHUTDOWN,
+               NCOMMANDS };
+
+static const char *command_names[NCOMMANDS] = {
+    "LOAD", "MUL", "ADD", "SUM", "WRITE", "SHM",
+    "DROP", "LIST", "STATS", "QUIT", "SHUTDOWN"
+};
+
+struct resident {
+    char *name;
+    CSR mat;
+    char *shm;                  // shared memory object, if exported
+};
+
+struct latency {
+    long count;
+    double total, min, max;
+};
+
+struct server {
+    struct resident *matrices;
+    int nmatrices, capacity;
+    struct latency stats[NCOMMANDS];
+    int (*reader)(const char *, COO *);
+    int (*writer)(FILE *, COO);
+};
+
+static double now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + 1e-9*t.tv_nsec;
+}
+
+static int valid_name(const char *name)
+{
+    if (!*name) {
+        return 0;
+    }
+    for (; *name; name++) {
+        char c = *name;
+        if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')
+              || (c >= '0' && c <= '9') || c == '_' || c == '-' || c == '.')) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static struct resident *find_matrix(struct server *server, const char *name)
+{
+    for (int i = 0; i < server->nmatrices; i++) {
+        if (!strcmp(server->matrices[i].name, name)) {
+            return &server->matrices[i];
+        }
+    }
+    return NULL;
+}
+
+static void drop_matrix(struct server *server, struct resident *r)
+{
+    free_csr(&r->mat);
+    if (r->shm) {
+        shm_unlink(r->shm);
+        free(r->shm);
+    }
+    free(r->name);
+    *r = server->matrices[--server->nmatrices];
+}
+
+/* Store mat under name, replacing any previous matrix of that name. */
+static void store_matrix(struct server *server, const char *name, CSR mat)
+{
+    struct resident *r = find_matrix(server, name);
+    if (r) {
+        drop_matrix(server, r);
+    }
+    if (server->nmatrices == server->capacity) {
+        server->capacity = server->capacity ? 2*server->capacity : 16;
+        server->matrices = realloc(server->matrices, server->capacity*sizeof(struct resident));
+    }
+    r = &server->matrices[server->nmatrices++];
+    r->name = strdup(name);
+    r->mat = mat;
+    r->shm = NULL;
+}
+
+static void write_matrix(struct server *server, const CSR mat, const char *path,
+                         char *err, size_t errlen)
+{
+    COO coo;
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        snprintf(err, errlen, "unable to open %s for writing", path);
+        return;
+    }
+    convert_csr_to_sparse(mat, &coo);
+    // A full disk fails this request only
+    if (server->writer(f, coo) | (fclose(f) != 0)) {
+        snprintf(err, errlen, "unable to write %s", path);
+    }
+    free_sparse(&coo);
+}
+
+/* Copy a matrix into a shared memory object in the binary file layout.
+ * Returns the size in bytes, or 0 on failure. */
+static size_t export_shm(const CSR mat, const char *object)
+{
+    size_t header = 3*sizeof(int);
+    size_t coords = (size_t)mat->NZ*sizeof(struct coord);
+    size_t bytes = header + coords + (size_t)mat->NZ*sizeof(double);
+    int fd = shm_open(object, O_CREAT | O_RDWR | O_TRUNC, 0600);
+    int *ints;
+    struct coord *c;
+    if (fd < 0) {
+        return 0;
+    }
+    if (ftruncate(fd, bytes)) {
+        close(fd);
+        shm_unlink(object);
+        return 0;
+    }
+    ints = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ints == MAP_FAILED) {
+        shm_unlink(object);
+        return 0;
+    }
+    ints[0] = mat->m;
+    ints[1] = mat->n;
+    ints[2] = mat->NZ;
+    c = (struct coord *)((char *)ints + header);
+    for (int i = 0; i < mat->m; i++) {
+        for (int p = mat->rowptr[i]; p < mat->rowptr[i + 1]; p++) {
+            c[p].i = i;
+            c[p].j = mat->colidx[p];
+        }
+    }
+    memcpy((char *)ints + header + coords, mat->data, (size_t)mat->NZ*sizeof(double));
+    munmap(ints, bytes);
+    return bytes;
+}
+
+/* Fetch the named operands of a request, reporting the first missing one. */
+static int get_operands(struct server *server, char **names, int count, CSR *out,
+                        char *err, size_t errlen)
+{
+    for (int i = 0; i < count; i++) {
+        struct resident *r = find_matrix(server, names[i]);
+        if (!r) {
+            snprintf(err, errlen, "no matrix named %s", names[i]);
+            return 1;
+        }
+        out[i] = r->mat;
+    }
+    return 0;
+}
+
+static int same_shape(const CSR a, const CSR b)
+{
+    return a->m == b->m && a->n == b->n;
+}
+
+/*
+ * Execute one request, writing the reply to out.
+ * Returns the command executed, or -1 for an unrecognised request.
+ */
+static int handle_request(struct server *server, char *line, FILE *out)
+{
+    char *words[MAX_WORDS];
+    char err[MAX_LINE] = "";
+    char detail[MAX_LINE] = "";
+    int nwords = 0, cmd;
+    CSR operands[6], result = NULL;
+    struct sparsemm_strategy strategy;
+    double start = now();
+
+    for (char *tok = strtok(line, " \t\r\n"); tok && nwords < MAX_WORDS;
+         tok = strtok(NULL, " \t\r\n")) {
+        words[nwords++] = tok;
+    }
+    if (!nwords) {
+        return -1;
+    }
+    for (cmd = 0; cmd < NCOMMANDS; cmd++) {
+        if (!strcmp(words[0], command_names[cmd])) {
+            break;
+        }
+    }
+
+    switch (cmd) {
+    case CMD_LOAD: {
+        COO coo;
+        if (nwords != 3 || !valid_name(words[1])) {
+            snprintf(err, sizeof(err), "usage: LOAD name path");
+        } else if (access(words[2], R_OK)) {
+            snprintf(err, sizeof(err), "unable to open %s for reading", words[2]);
+        } else if (server->reader(words[2], &coo)) {
+            // A malformed or truncated file fails this request only
+            snprintf(err, sizeof(err), "unable to read a matrix from %s", words[2]);
+        } else {
+            convert_sparse_to_csr(coo, &result);
+            free_sparse(&coo);
+            snprintf(detail, sizeof(detail), "%d %d %d", result->m, result->n, result->NZ);
+            store_matrix(server, words[1], result);
+        }
+        break;
+    }
+    case CMD_MUL:
+    case CMD_ADD:
+    case CMD_SUM: {
+        int count = cmd == CMD_SUM ? 6 : 2;
+        if ((nwords != count + 2 && nwords != count + 3) || !valid_name(words[1])) {
+            snprintf(err, sizeof(err), "usage: %s out %s [path]", command_names[cmd],
+                     cmd == CMD_SUM ? "a b c d e f" : "a b");
+            break;
+        }
+        if (get_operands(server, &words[2], count, operands, err, sizeof(err))) {
+            break;
+        }
+        if (cmd == CMD_MUL) {
+            if (operands[0]->n != operands[1]->m) {
+                snprintf(err, sizeof(err), "invalid matrix sizes");
+                break;
+            }
+            hybrid_sparsemm_csr(operands[0], operands[1], &result, NULL, &strategy);
+        } else if (cmd == CMD_ADD) {
+            if (!same_shape(operands[0], operands[1])) {
+                snprintf(err, sizeof(err), "operands are not the same shape");
+                break;
+            }
+            add_csr(operands[0], operands[1], &result);
+        } else {
+            CSR t, left, right;
+            if (!same_shape(operands[0], operands[1]) || !same_shape(operands[0], operands[2])
+                || !same_shape(operands[3], operands[4]) || !same_shape(operands[3], operands[5])
+                || operands[0]->n != operands[3]->m) {
+                snprintf(err, sizeof(err), "invalid matrix sizes");
+                break;
+            }
+            add_csr(operands[0], operands[1], &t);
+            add_csr(t, operands[2], &left);
+            free_csr(&t);
+            add_csr(operands[3], operands[4], &t);
+            add_csr(t, operands[5], &right);
+            free_csr(&t);
+            hybrid_sparsemm_csr(left, right, &result, NULL, &strategy);
+            free_csr(&left);
+            free_csr(&right);
+        }
+        snprintf(detail, sizeof(detail), "%d %d %d", result->m, result->n, result->NZ);
+        if (cmd != CMD_ADD) {
+            snprintf(detail + strlen(detail), sizeof(detail) - strlen(detail),
+                     " dense_blocks %d sparse_blocks %d",
+                     strategy.dense_blocks, strategy.sparse_blocks);
+        }
+        if (nwords == count + 3) {
+            write_matrix(server, result, words[count + 2], err, sizeof(err));
+        }
+        // A request that fails leaves the named matrix as it was
+        if (*err) {
+            free_csr(&result);
+        } else {
+            store_matrix(server, words[1], result);
+        }
+        break;
+    }
+    case CMD_WRITE:
+        if (nwords != 3) {
+            snprintf(err, sizeof(err), "usage: WRITE name path");
+        } else if (!get_operands(server, &words[1], 1, operands, err, sizeof(err))) {
+            write_matrix(server, operands[0], words[2], err, sizeof(err));
+        }
+        break;
+    case CMD_SHM: {
+        struct resident *r;
+        char object[MAX_OBJECT];
+        size_t bytes;
+        if (nwords != 2) {
+            snprintf(err, sizeof(err), "usage: SHM name");
+            break;
+        }
+        if (get_operands(server, &words[1], 1, operands, err, sizeof(err))) {
+            break;
+        }
+        r = find_matrix(server, words[1]);
+        if (snprintf(object, sizeof(object), "/sparsemm.%d.%s", (int)getpid(), r->name)
+            >= (int)sizeof(object)) {
+            snprintf(err, sizeof(err), "name too long for a shared memory object");
+            break;
+        }
+        bytes = export_shm(r->mat, object);
+        if (!bytes) {
+            snprintf(err, sizeof(err), "unable to create shared memory object %s", object);
+            break;
+        }
+        if (!r->shm) {
+            r->shm = strdup(object);
+        }
+        snprintf(detail, sizeof(detail), "%s %zu", object, bytes);
+        break;
+    }
+    case CMD_DROP:
+        if (nwords != 2) {
+            snprintf(err, sizeof(err), "usage: DROP name");
+        } else if (!get_operands(server, &words[1], 1, operands, err, sizeof(err))) {
+            drop_matrix(server, find_matrix(server, words[1]));
+        }
+        break;
+    case CMD_LIST:
+        fprintf(out, "OK %d\n", server->nmatrices);
+        for (int i = 0; i < server->nmatrices; i++) {
+            CSR mat = server->matrices[i].mat;
+            fprintf(out, "%s %d %d %d\n", server->matrices[i].name, mat->m, mat->n, mat->NZ);
+        }
+        return cmd;
+    case CMD_STATS: {
+        int lines = 0;
+        for (int c = 0; c < NCOMMANDS; c++) {
+            lines += server->stats[c].count > 0;
+        }
+        fprintf(out, "OK %d\n", lines);
+        for (int c = 0; c < NCOMMANDS; c++) {
+            struct latency *s = &server->stats[c];
+            if (s->count) {
+                fprintf(out, "%s count %ld mean_ms %.3f min_ms %.3f max_ms %.3f\n",
+                        command_names[c], s->count, 1e3*s->total/s->count,
+                        1e3*s->min, 1e3*s->max);
+            }
+        }
+        return cmd;
+    }
+    case CMD_QUIT:
+    case CMD_SHUTDOWN:
+        fprintf(out, "OK\n");
+        return cmd;
+    default:
+        fprintf(out, "ERR unrecognised request %s\n", words[0]);
+        return -1;
+    }
+
+    if (*err) {
+        fprintf(out, "ERR %s\n", err);
+    } else {
+        double elapsed = now() - start;
+        struct latency *s = &server->stats[cmd];
+        if (!s->count || elapsed < s->min) {
+            s->min = elapsed;
+        }
+        if (elapsed > s->max) {
+            s->max = elapsed;
+        }
+        s->total += elapsed;
+        s->count++;
+        fprintf(out, "OK %.3f%s%s\n", 1e3*elapsed, *detail ? " " : "", detail);
+    }
+    return cmd;
+}
+
+/*
+ * Serve requests from one connected socket fd until the client hangs up
+ * or sends QUIT or SHUTDOWN.  Returns 1 after SHUTDOWN, 0 otherwise.
+ */
+static int serve_client(struct server *server, int fd)
+{
+    char line[MAX_LINE];
+    FILE *in = fdopen(fd, "r");
+    FILE *out = fdopen(dup(fd), "w");
+    int stop = 0;
+    while (fgets(line, sizeof(line), in)) {
+        int cmd = handle_request(server, line, out);
+        fflush(out);
+        if (cmd == CMD_QUIT) {
+            break;
+        }
+        if (cmd == CMD_SHUTDOWN) {
+            stop = 1;
+            break;
+        }
+    }
+    fclose(in);
+    fclose(out);
+    return stop;
+}
+
+static void free_server(struct server *server)
+{
+    while (server->nmatrices) {
+        drop_matrix(server, &server->matrices[0]);
+    }
+    free(server->matrices);
+}
+
+/*
+ * Serve requests on a Unix domain socket at socket_path until a SHUTDOWN
+ * request arrives.  Connections are served one at a time.
+ * reader/writer select the matrix file format; they return nonzero
+ * (rather than exiting) on a file they cannot read or write.
+ * Returns 0 on a clean shutdown.
+ */
+int run_server(const char *socket_path,
+               int (*reader)(const char *, COO *),
+               int (*writer)(FILE *, COO))
+{
+    struct server server;
+    struct sockaddr_un addr;
+    int listener, stop = 0;
+
+    memset(&server, 0, sizeof(server));
+    server.reader = reader;
+    server.writer = writer;
+
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path %s is too long.\n", socket_path);
+        return 1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+
+    listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0) {
+        perror("socket");
+        return 1;
+    }
+    unlink(socket_path);
+    if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) || listen(listener, 16)) {
+        perror(socket_path);
+        close(listener);
+        return 1;
+    }
+    // A client hanging up mid-reply must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+    fprintf(stderr, "sparsemm: serving on %s\n", socket_path);
+
+    while (!stop) {
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+        stop = serve_client(&server, fd);
+    }
+
+    close(listener);
+    unlink(socket_path);
+    free_server(&server);
+    return 0;
+}
+
+/*
+ * Serve the requests of a single client already connected on fd (e.g.
+ * one end of a socketpair), as run_server does for each connection, then
+ * forget every matrix.  Closes fd.  Returns 0.
+ */
+int serve_connection(int fd,
+                     int (*reader)(const char *, COO *),
+                     int (*writer)(FILE *, COO))
+{
+    struct server server;
+
+    memset(&server, 0, sizeof(server));
+    server.reader = reader;
+    server.writer = writer;
+    signal(SIGPIPE, SIG_IGN);
+    serve_client(&server, fd);
+    free_server(&server);
+    return 0;
+}
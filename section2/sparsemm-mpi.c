@@ -0,0 +1,732 @@
+/* This file implements a distributed-memory driver for sparsemm over MPI.
+ *
+ * Rows of A (and of the output) are split between ranks in contiguous
+ * runs of whole dispatch blocks (sparsemm_options.block_rows), and the
+ * rows of B in contiguous even runs.  Every rank reads its own slice of
+ * each input file, the entries are redistributed to the rank owning their
+ * row, and each rank then fetches just the rows of B named by the column
+ * pattern of its rows of A.  The local product uses hybrid_sparsemm_csr
+ * on exactly the row blocks the single process run would use, and every
+ * output row is accumulated in the same order, so the result is bitwise
+ * identical to ./sparsemm for any number of ranks.  Ranks write their rows
+ * of the result straight into the output file with MPI-IO.
+ */
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+#include <unistd.h>
+#include <mpi.h>
+
+#include "utils.h"
+#include "sparsemm.h"
+#include "instrument.h"
+
+// Chars in each block of a rank's text output handed to MPI-IO at once
+#define TEXT_CHUNK (1 << 20)
+
+struct triplet {
+    int i, j;
+    double v;
+};
+
+struct slice {
+    int m, n;
+    int count;
+    struct triplet *entries;
+};
+
+/* Split nitems into nparts contiguous ranges whose boundaries are
+ * multiples of align (except the last).  starts has nparts + 1 entries. */
+static void partition(int nitems, int nparts, int align, int *starts)
+{
+    int nblocks = (nitems + align - 1) / align;
+    for (int r = 0; r <= nparts; r++) {
+        long block = (long)nblocks*r / nparts;
+        starts[r] = block*align < nitems ? block*align : nitems;
+    }
+}
+
+static int owner(int item, const int *starts, int nparts)
+{
+    int lo = 0, hi = nparts - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (starts[mid] <= item) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return lo;
+}
+
+/* Read this rank's share of the entries of a binary matrix file. */
+static void read_slice_binary(const char *file, int rank, int size, struct slice *s)
+{
+    int header[3];
+    long lo, hi;
+    FILE *f = fopen(file, "r");
+    if (!f) {
+        fprintf(stderr, "Unable to open %s for reading.\n", file);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    if (fread(header, sizeof(int), 3, f) != 3) {
+        fprintf(stderr, "Did not read header from %s\n", file);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    s->m = header[0];
+    s->n = header[1];
+    if (s->m < 0 || s->n < 0 || header[2] < 0 || header[2] > (long long)s->m*s->n) {
+        fprintf(stderr, "Invalid size in %s (%d x %d, %d nonzeros)\n", file, s->m, s->n, header[2]);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    lo = (long)header[2]*rank / size;
+    hi = (long)header[2]*(rank + 1) / size;
+    s->count = hi - lo;
+    s->entries = malloc((s->count + 1)*sizeof(struct triplet));
+    struct coord *coords = malloc((s->count + 1)*sizeof(struct coord));
+    double *data = malloc((s->count + 1)*sizeof(double));
+    fseek(f, 3*sizeof(int) + lo*sizeof(struct coord), SEEK_SET);
+    if (fread(coords, sizeof(struct coord), s->count, f) != (size_t)s->count) {
+        fprintf(stderr, "Did not read nonzero locations from %s\n", file);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    fseek(f, 3*sizeof(int) + (long)header[2]*sizeof(struct coord) + lo*sizeof(double), SEEK_SET);
+    if (fread(data, sizeof(double), s->count, f) != (size_t)s->count) {
+        fprintf(stderr, "Did not read nonzero values from %s\n", file);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    for (int p = 0; p < s->count; p++) {
+        // Rows out of range would be sent to the wrong rank and index past the local CSR
+        if (coords[p].i < 0 || coords[p].j < 0 || coords[p].i >= s->m || coords[p].j >= s->n) {
+            fprintf(stderr, "Entry %ld incorrect, index (%d, %d) out of bounds for %d x %d matrix in %s\n",
+                    lo + p, coords[p].i, coords[p].j, s->m, s->n, file);
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        s->entries[p].i = coords[p].i;
+        s->entries[p].j = coords[p].j;
+        s->entries[p].v = data[p];
+    }
+    free(coords);
+    free(data);
+    fclose(f);
+}
+
+/* Read this rank's share of the entries of a text matrix file: the lines
+ * that start inside its equal share of the bytes after the header.  Every
+ * rank checks its own lines, and together the number of entries. */
+static void read_slice_text(const char *file, int rank, int size, struct slice *s)
+{
+    long body, end, lo, hi;
+    long long count, total;
+    int nz, capacity = 1024;
+    char *line = NULL;
+    size_t len = 0;
+    FILE *f = fopen(file, "r");
+    if (!f) {
+        fprintf(stderr, "Unable to open %s for reading.\n", file);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    if (fscanf(f, "%d %d %d", &s->m, &s->n, &nz) != 3 || getline(&line, &len, f) < 0) {
+        fprintf(stderr, "File format incorrect on line 1 of %s\n", file);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    if (s->m < 0 || s->n < 0 || nz < 0 || nz > (long long)s->m*s->n) {
+        fprintf(stderr, "Invalid size in %s (%d x %d, %d nonzeros)\n", file, s->m, s->n, nz);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    body = ftell(f);
+    fseek(f, 0, SEEK_END);
+    end = ftell(f);
+    lo = body + (end - body)*rank / size;
+    hi = body + (end - body)*(rank + 1) / size;
+
+    // Start at the first line beginning at or after lo
+    fseek(f, lo, SEEK_SET);
+    if (lo > body) {
+        fseek(f, lo - 1, SEEK_SET);
+        if (getline(&line, &len, f) < 0) {
+            lo = end;
+        }
+    }
+    s->count = 0;
+    s->entries = malloc(capacity*sizeof(struct triplet));
+    while (ftell(f) < hi && getline(&line, &len, f) > 0) {
+        struct triplet t;
+        if (sscanf(line, "%d %d %lg", &t.i, &t.j, &t.v) != 3) {
+            // Blank lines are allowed, as by read_sparse
+            if (strspn(line, " \t\r\n") == strlen(line)) {
+                continue;
+            }
+            fprintf(stderr, "File format incorrect in %s, expecting 'i j value', got %s", file, line);
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        if (t.i < 0 || t.j < 0 || t.i >= s->m || t.j >= s->n) {
+            fprintf(stderr, "Entry index (%d, %d) out of bounds for %d x %d matrix in %s\n",
+                    t.i, t.j, s->m, s->n, file);
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        if (s->count == capacity) {
+            capacity *= 2;
+            s->entries = realloc(s->entries, capacity*sizeof(struct triplet));
+        }
+        s->entries[s->count++] = t;
+    }
+    free(line);
+    fclose(f);
+
+    count = s->count;
+    MPI_Allreduce(&count, &total, 1, MPI_LONG_LONG, MPI_SUM, MPI_COMM_WORLD);
+    if (total != nz) {
+        if (rank == 0) {
+            fprintf(stderr, "%s has %lld entries, but its header says %d\n", file, total, nz);
+        }
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+}
+
+/* The MPI datatype of a struct triplet, so that counts and displacements
+ * are in entries rather than bytes (which overflow an int at 2GB). */
+static MPI_Datatype triplet_type(void)
+{
+    int lengths[2] = {2, 1};
+    MPI_Aint displacements[2] = {offsetof(struct triplet, i), offsetof(struct triplet, v)};
+    MPI_Datatype types[2] = {MPI_INT, MPI_DOUBLE};
+    MPI_Datatype packed, triplet;
+    MPI_Type_create_struct(2, lengths, displacements, types, &packed);
+    MPI_Type_create_resized(packed, 0, sizeof(struct triplet), &triplet);
+    MPI_Type_free(&packed);
+    MPI_Type_commit(&triplet);
+    return triplet;
+}
+
+/* Send every entry of s to the rank owning its row; entries arrive in
+ * rank order, which preserves the order they had in the file. */
+static void distribute(struct slice *s, const int *starts, int size)
+{
+    int *sendcounts = calloc(size, sizeof(int));
+    int *recvcounts = malloc(size*sizeof(int));
+    int *sdispls = malloc((size + 1)*sizeof(int));
+    int *rdispls = malloc((size + 1)*sizeof(int));
+    int *next = malloc(size*sizeof(int));
+    struct triplet *sorted = malloc((s->count + 1)*sizeof(struct triplet));
+    struct triplet *received;
+    MPI_Datatype triplet = triplet_type();
+    long long total = 0;
+
+    for (int p = 0; p < s->count; p++) {
+        sendcounts[owner(s->entries[p].i, starts, size)]++;
+    }
+    sdispls[0] = 0;
+    for (int r = 0; r < size; r++) {
+        sdispls[r + 1] = sdispls[r] + sendcounts[r];
+        next[r] = sdispls[r];
+    }
+    // Stable bucket by destination
+    for (int p = 0; p < s->count; p++) {
+        sorted[next[owner(s->entries[p].i, starts, size)]++] = s->entries[p];
+    }
+    MPI_Alltoall(sendcounts, 1, MPI_INT, recvcounts, 1, MPI_INT, MPI_COMM_WORLD);
+    for (int r = 0; r < size; r++) {
+        total += recvcounts[r];
+    }
+    // A rank's entries are counted in ints, by MPI and in the local CSR
+    if (total > INT_MAX) {
+        fprintf(stderr, "A rank owns too many entries (%lld), use more ranks\n", total);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    rdispls[0] = 0;
+    for (int r = 0; r < size; r++) {
+        rdispls[r + 1] = rdispls[r] + recvcounts[r];
+    }
+    received = malloc((total + 1)*sizeof(struct triplet));
+    MPI_Alltoallv(sorted, sendcounts, sdispls, triplet,
+                  received, recvcounts, rdispls, triplet, MPI_COMM_WORLD);
+    MPI_Type_free(&triplet);
+    free(s->entries);
+    s->entries = received;
+    s->count = total;
+    free(sorted);
+    free(sendcounts);
+    free(recvcounts);
+    free(sdispls);
+    free(rdispls);
+    free(next);
+}
+
+/* Build the local CSR from the (concatenated, in order) owned entries of
+ * one or more slices, renumbering rows from row0. */
+static void local_csr(struct slice *slices, int nslices, int row0, int nrows, CSR *out)
+{
+    int total = 0, q = 0;
+    COO coo;
+    for (int s = 0; s < nslices; s++) {
+        total += slices[s].count;
+    }
+    alloc_sparse(nrows, slices[0].n, total, &coo);
+    for (int s = 0; s < nslices; s++) {
+        for (int p = 0; p < slices[s].count; p++, q++) {
+            coo->coords[q].i = slices[s].entries[p].i - row0;
+            coo->coords[q].j = slices[s].entries[p].j;
+            coo->data[q] = slices[s].entries[p].v;
+        }
+    }
+    convert_sparse_to_csr(coo, out);
+    free_sparse(&coo);
+}
+
+/* Fetch from their owners the rows of B named by the columns of A.
+ * Bmine holds this rank's rows of B (renumbered from b_starts[rank]).
+ * The result has all k rows of B, with only the needed ones filled in. */
+static void fetch_b_rows(const CSR A, const CSR Bmine, const int *b_starts,
+                         int rank, int size, int k, CSR *out)
+{
+    char *needed = calloc(k + 1, 1);
+    int *sendcounts = calloc(size, sizeof(int));
+    int *recvcounts = malloc(size*sizeof(int));
+    int *sdispls = malloc((size + 1)*sizeof(int));
+    int *rdispls = malloc((size + 1)*sizeof(int));
+    int *requests, *wanted, *lens, *replylens;
+    int nrequests = 0, nwanted;
+    CSR B;
+
+    for (int p = 0; p < A->NZ; p++) {
+        needed[A->colidx[p]] = 1;
+    }
+    requests = malloc((k + 1)*sizeof(int));
+    for (int row = 0; row < k; row++) {
+        if (needed[row]) {
+            requests[nrequests++] = row;
+            sendcounts[owner(row, b_starts, size)]++;
+        }
+    }
+    MPI_Alltoall(sendcounts, 1, MPI_INT, recvcounts, 1, MPI_INT, MPI_COMM_WORLD);
+    sdispls[0] = rdispls[0] = 0;
+    for (int r = 0; r < size; r++) {
+        sdispls[r + 1] = sdispls[r] + sendcounts[r];
+        rdispls[r + 1] = rdispls[r] + recvcounts[r];
+    }
+    nwanted = rdispls[size];
+    wanted = malloc((nwanted + 1)*sizeof(int));
+    MPI_Alltoallv(requests, sendcounts, sdispls, MPI_INT,
+                  wanted, recvcounts, rdispls, MPI_INT, MPI_COMM_WORLD);
+
+    // Reply with the length of every requested row ...
+    lens = malloc((nwanted + 1)*sizeof(int));
+    for (int w = 0; w < nwanted; w++) {
+        int row = wanted[w] - b_starts[rank];
+        lens[w] = Bmine->rowptr[row + 1] - Bmine->rowptr[row];
+    }
+    replylens = malloc((nrequests + 1)*sizeof(int));
+    MPI_Alltoallv(lens, recvcounts, rdispls, MPI_INT,
+                  replylens, sendcounts, sdispls, MPI_INT, MPI_COMM_WORLD);
+
+    // ... then with its contents
+    int *ssize = calloc(size, sizeof(int));
+    int *rsize = calloc(size, sizeof(int));
+    int *sdisp = malloc((size + 1)*sizeof(int));
+    int *rdisp = malloc((size + 1)*sizeof(int));
+    for (int r = 0; r < size; r++) {
+        for (int w = rdispls[r]; w < rdispls[r + 1]; w++) {
+            ssize[r] += lens[w];
+        }
+        for (int w = sdispls[r]; w < sdispls[r + 1]; w++) {
+            rsize[r] += replylens[w];
+        }
+    }
+    sdisp[0] = rdisp[0] = 0;
+    for (int r = 0; r < size; r++) {
+        sdisp[r + 1] = sdisp[r] + ssize[r];
+        rdisp[r + 1] = rdisp[r] + rsize[r];
+    }
+    int *sendcols = malloc((sdisp[size] + 1)*sizeof(int));
+    double *sendvals = malloc((sdisp[size] + 1)*sizeof(double));
+    for (int w = 0, q = 0; w < nwanted; w++) {
+        int row = wanted[w] - b_starts[rank];
+        for (int p = Bmine->rowptr[row]; p < Bmine->rowptr[row + 1]; p++, q++) {
+            sendcols[q] = Bmine->colidx[p];
+            sendvals[q] = Bmine->data[p];
+        }
+    }
+    alloc_csr(k, Bmine->n, rdisp[size], &B);
+    MPI_Alltoallv(sendcols, ssize, sdisp, MPI_INT,
+                  B->colidx, rsize, rdisp, MPI_INT, MPI_COMM_WORLD);
+    MPI_Alltoallv(sendvals, ssize, sdisp, MPI_DOUBLE,
+                  B->data, rsize, rdisp, MPI_DOUBLE, MPI_COMM_WORLD);
+
+    // Requests went out in increasing row order, so replies are too
+    for (int w = 0; w < nrequests; w++) {
+        B->rowptr[requests[w] + 1] = replylens[w];
+    }
+    for (int row = 0; row < k; row++) {
+        B->rowptr[row + 1] += B->rowptr[row];
+    }
+    *out = B;
+
+    free(needed);
+    free(sendcounts);
+    free(recvcounts);
+    free(sdispls);
+    free(rdispls);
+    free(requests);
+    free(wanted);
+    free(lens);
+    free(replylens);
+    free(ssize);
+    free(rsize);
+    free(sdisp);
+    free(rdisp);
+    free(sendcols);
+    free(sendvals);
+}
+
+/* Write the rows of C owned by each rank into one file with MPI-IO, in the
+ * same format (and byte for byte the same contents) as write_sparse or
+ * write_sparse_binary. */
+static void write_distributed(const char *file, const CSR C, int row0, int m, int binary)
+{
+    MPI_File fh;
+    long long nz = C->NZ, before = 0, total = 0;
+    MPI_Exscan(&nz, &before, 1, MPI_LONG_LONG, MPI_SUM, MPI_COMM_WORLD);
+    MPI_Allreduce(&nz, &total, 1, MPI_LONG_LONG, MPI_SUM, MPI_COMM_WORLD);
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    if (rank == 0) {
+        before = 0;
+    }
+    if (total > 0x7fffffff) {
+        fprintf(stderr, "Result has too many nonzeros (%lld) for the file format\n", total);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+
+    MPI_File_delete(file, MPI_INFO_NULL);
+    if (MPI_File_open(MPI_COMM_WORLD, file, MPI_MODE_CREATE | MPI_MODE_WRONLY,
+                      MPI_INFO_NULL, &fh) != MPI_SUCCESS) {
+        fprintf(stderr, "Unable to open %s for writing output.\n", file);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    if (binary) {
+        int header[3] = {m, C->n, (int)total};
+        struct coord *coords = malloc((C->NZ + 1)*sizeof(struct coord));
+        MPI_Offset base = 3*sizeof(int);
+        MPI_Datatype coord;
+        MPI_Type_contiguous(2, MPI_INT, &coord);
+        MPI_Type_commit(&coord);
+        for (int i = 0; i < C->m; i++) {
+            for (int p = C->rowptr[i]; p < C->rowptr[i + 1]; p++) {
+                coords[p].i = i + row0;
+                coords[p].j = C->colidx[p];
+            }
+        }
+        if (rank == 0) {
+            MPI_File_write_at(fh, 0, header, 3, MPI_INT, MPI_STATUS_IGNORE);
+        }
+        MPI_File_write_at_all(fh, base + before*sizeof(struct coord), coords,
+                              C->NZ, coord, MPI_STATUS_IGNORE);
+        MPI_File_write_at_all(fh, base + total*sizeof(struct coord) + before*sizeof(double),
+                              C->data, C->NZ, MPI_DOUBLE, MPI_STATUS_IGNORE);
+        MPI_Type_free(&coord);
+        free(coords);
+    } else {
+        char header[64];
+        long long len = 0, offset = 0;
+        MPI_Datatype chunk;
+        size_t capacity = 64*(size_t)C->NZ + 1;
+        char *text = malloc(capacity);
+        int hlen = snprintf(header, sizeof(header), "%d %d %lld\n", m, C->n, total);
+        for (int i = 0; i < C->m; i++) {
+            for (int p = C->rowptr[i]; p < C->rowptr[i + 1]; p++) {
+                len += snprintf(text + len, capacity - len, "%d %d %.15g\n",
+                                i + row0, C->colidx[p], C->data[p]);
+            }
+        }
+        MPI_Exscan(&len, &offset, 1, MPI_LONG_LONG, MPI_SUM, MPI_COMM_WORLD);
+        if (rank == 0) {
+            offset = 0;
+            MPI_File_write_at(fh, 0, header, hlen, MPI_CHAR, MPI_STATUS_IGNORE);
+        }
+        // A rank's text can pass 2GB, more chars than an int counts, so it
+        // goes out as whole chunks of TEXT_CHUNK chars and then the rest
+        MPI_Type_contiguous(TEXT_CHUNK, MPI_CHAR, &chunk);
+        MPI_Type_commit(&chunk);
+        MPI_File_write_at_all(fh, hlen + offset, text, len / TEXT_CHUNK, chunk, MPI_STATUS_IGNORE);
+        MPI_File_write_at_all(fh, hlen + offset + len / TEXT_CHUNK * TEXT_CHUNK,
+                              text + len / TEXT_CHUNK * TEXT_CHUNK, len % TEXT_CHUNK,
+                              MPI_CHAR, MPI_STATUS_IGNORE);
+        MPI_Type_free(&chunk);
+        free(text);
+    }
+    MPI_File_close(&fh);
+}
+
+/*
+ * Compute O = (sum of left) (sum of right) across all ranks and write it
+ * to output.  With one file on each side this is O = A B.
+ */
+static void distributed_sparsemm(const char *output, const char **left, const char **right,
+                                 int nterms, int binary, const struct sparsemm_options *options,
+                                 struct sparsemm_strategy *strategy)
+{
+    int rank, size, m, k, n;
+    int *a_starts, *b_starts;
+    struct slice a[3], b[3];
+    CSR A, Bmine, B, C;
+    struct instrument_timer timer;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+
+    instrument_start(&timer, PHASE_READ);
+    for (int t = 0; t < nterms; t++) {
+        if (binary) {
+            read_slice_binary(left[t], rank, size, &a[t]);
+            read_slice_binary(right[t], rank, size, &b[t]);
+        } else {
+            read_slice_text(left[t], rank, size, &a[t]);
+            read_slice_text(right[t], rank, size, &b[t]);
+        }
+        if (a[t].m != a[0].m || a[t].n != a[0].n || b[t].m != b[0].m || b[t].n != b[0].n) {
+            if (rank == 0) {
+                fprintf(stderr, "Summed matrices are not the same shape\n");
+            }
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+    }
+    instrument_stop(&timer);
+    m = a[0].m;
+    k = a[0].n;
+    n = b[0].n;
+    if (k != b[0].m) {
+        if (rank == 0) {
+            fprintf(stderr, "Invalid matrix sizes, got %d x %d and %d x %d\n", m, k, b[0].m, n);
+        }
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+
+    // Rows of A in whole dispatch blocks, so each block is multiplied
+    // exactly as in the single process run
+    instrument_start(&timer, PHASE_EXCHANGE);
+    a_starts = malloc((size + 1)*sizeof(int));
+    b_starts = malloc((size + 1)*sizeof(int));
+    partition(m, size, options->block_rows, a_starts);
+    partition(k, size, 1, b_starts);
+    for (int t = 0; t < nterms; t++) {
+        distribute(&a[t], a_starts, size);
+        distribute(&b[t], b_starts, size);
+    }
+    local_csr(a, nterms, a_starts[rank], a_starts[rank + 1] - a_starts[rank], &A);
+    local_csr(b, nterms, b_starts[rank], b_starts[rank + 1] - b_starts[rank], &Bmine);
+    for (int t = 0; t < nterms; t++) {
+        free(a[t].entries);
+        free(b[t].entries);
+    }
+    fetch_b_rows(A, Bmine, b_starts, rank, size, k, &B);
+    free_csr(&Bmine);
+    instrument_stop(&timer);
+
+    hybrid_sparsemm_csr(A, B, &C, options, strategy);
+    free_csr(&A);
+    free_csr(&B);
+
+    instrument_start(&timer, PHASE_WRITE);
+    write_distributed(output, C, a_starts[rank], m, binary);
+    instrument_stop(&timer);
+    free_csr(&C);
+    free(a_starts);
+    free(b_starts);
+}
+
+static int files_identical(const char *x, const char *y)
+{
+    FILE *f = fopen(x, "r");
+    FILE *g = fopen(y, "r");
+    int same = f && g;
+    while (same) {
+        int c = fgetc(f);
+        same = c == fgetc(g);
+        if (c == EOF) {
+            break;
+        }
+    }
+    if (f) {
+        fclose(f);
+    }
+    if (g) {
+        fclose(g);
+    }
+    return same;
+}
+
+/*
+ * Check that the distributed product (and sum-product) is bitwise
+ * identical to the single process hybrid_sparsemm, in both file formats
+ * and with the dense path forced on and off.
+ */
+static int check_distributed(void)
+{
+    const char *names[8] = {"A", "B", "C", "D", "E", "F", "O", "S"};
+    const int shapes[6][2] = {{150, 90}, {150, 90}, {150, 90}, {90, 120}, {90, 120}, {90, 120}};
+    const double fracs[6] = {0.05, 0.1, 0.02, 0.3, 0.2, 0.1};
+    char files[8][64];
+    int rank, pass = 0;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+    for (int f = 0; f < 8; f++) {
+        snprintf(files[f], sizeof(files[f]), "sparsemm-mpi-check-%s.matrix", names[f]);
+    }
+    for (int binary = 0; binary < 2; binary++) {
+        void (*writer)(FILE *, COO) = binary ? &write_sparse_binary : &write_sparse;
+        COO mats[6];
+        if (rank == 0) {
+            srand48(42 + binary);
+            for (int f = 0; f < 6; f++) {
+                FILE *fp = fopen(files[f], "w");
+                random_matrix(shapes[f][0], shapes[f][1], fracs[f], &mats[f]);
+                writer(fp, mats[f]);
+                fclose(fp);
+            }
+        }
+        MPI_Barrier(MPI_COMM_WORLD);
+        for (int dense = 0; dense < 2; dense++) {
+            for (int nterms = 1; nterms <= 3; nterms += 2) {
+                struct sparsemm_options options;
+                struct sparsemm_strategy strategy;
+                const char *left[3] = {files[0], files[1], files[2]};
+                const char *right[3] = {files[3], files[4], files[5]};
+                sparsemm_default_options(&options);
+                options.block_rows = 16;
+                if (dense) {
+                    options.dense_threshold = 0;
+                    options.dense_work_ratio = 1e300;
+                }
+                if (nterms == 1) {
+                    right[0] = files[3];
+                }
+                distributed_sparsemm(files[6], left, right, nterms, binary, &options, &strategy);
+                if (rank == 0) {
+                    COO serial;
+                    FILE *fp = fopen(files[7], "w");
+                    // Read back what was written, as the driver would
+                    COO in[6];
+                    void (*reader)(const char *, COO *) = binary ? &read_sparse_binary : &read_sparse;
+                    for (int f = 0; f < 6; f++) {
+                        reader(files[f], &in[f]);
+                    }
+                    if (nterms == 1) {
+                        hybrid_sparsemm(in[0], in[3], &serial, &options, NULL);
+                    } else {
+                        hybrid_sparsemm_sum(in[0], in[1], in[2], in[3], in[4], in[5],
+                                            &serial, &options, NULL);
+                    }
+                    writer(fp, serial);
+                    fclose(fp);
+                    if (!files_identical(files[6], files[7])) {
+                        fprintf(stderr, "MPI Failed check (%s, %s, %s): result differs from a single process\n",
+                                binary ? "binary" : "text", dense ? "dense" : "default",
+                                nterms == 1 ? "mm" : "sum");
+                        pass = 1;
+                    }
+                    free_sparse(&serial);
+                    for (int f = 0; f < 6; f++) {
+                        free_sparse(&in[f]);
+                    }
+                }
+                MPI_Barrier(MPI_COMM_WORLD);
+            }
+        }
+        if (rank == 0) {
+            for (int f = 0; f < 6; f++) {
+                free_sparse(&mats[f]);
+            }
+        }
+    }
+    if (rank == 0) {
+        for (int f = 0; f < 8; f++) {
+            unlink(files[f]);
+        }
+        if (!pass) {
+            int size;
+            MPI_Comm_size(MPI_COMM_WORLD, &size);
+            fprintf(stdout, "MPI Passed check on %d ranks\n", size);
+        }
+    }
+    MPI_Bcast(&pass, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    return pass;
+}
+
+int main(int argc, char **argv)
+{
+    int rank, size, binary = 0, report_strategy = 0, status = 0;
+    const char *prog = argv[0];
+    struct sparsemm_options options;
+    struct sparsemm_strategy strategy;
+
+    MPI_Init(&argc, &argv);
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+    instrument_init("sparsemm-mpi");
+    sparsemm_default_options(&options);
+
+    while (argc > 1 && !strncmp(argv[1], "--", 2)) {
+        if (!strcmp(argv[1], "--binary")) {
+            binary = 1;
+        } else if (!strcmp(argv[1], "--strategy")) {
+            report_strategy = 1;
+        } else if (!strcmp(argv[1], "--stats")) {
+            instrument_enable("-");
+        } else if (!strncmp(argv[1], "--stats=", 8)) {
+            instrument_enable(argv[1] + 8);
+        } else {
+            if (rank == 0) {
+                fprintf(stderr, "Unrecognised flag '%s'\n", argv[1]);
+            }
+            MPI_Finalize();
+            return 1;
+        }
+        argc--;
+        argv++;
+    }
+
+    if (argc == 2 && !strcmp(argv[1], "CHECK")) {
+        status = check_distributed();
+    } else if (argc == 4 || argc == 8) {
+        const char *left[3], *right[3];
+        int nterms = argc == 4 ? 1 : 3;
+        for (int t = 0; t < nterms; t++) {
+            left[t] = argv[2 + t];
+            right[t] = argv[2 + nterms + t];
+        }
+        instrument_label("mode", nterms == 1 ? "MM" : "SUM");
+        instrument_field("ranks", size);
+        distributed_sparsemm(argv[1], left, right, nterms, binary, &options, &strategy);
+        // One rank at a time so the lines do not interleave
+        for (int r = 0; report_strategy && r < size; r++) {
+            if (r == rank) {
+                fprintf(stderr, "rank %d: ", rank);
+                print_strategy(stderr, &strategy);
+                fflush(stderr);
+            }
+            MPI_Barrier(MPI_COMM_WORLD);
+        }
+        // Only rank 0 reports; its phases are representative of the run
+        if (rank == 0) {
+            instrument_report();
+        }
+    } else {
+        if (rank == 0) {
+            fprintf(stderr, "Invalid arguments.\n");
+            fprintf(stderr, "Usage: mpirun -np N %s CHECK\n", prog);
+            fprintf(stderr, "  Check the distributed product reproduces a single process run exactly.\n");
+            fprintf(stderr, "Alternate usage: mpirun -np N %s [--binary] [--strategy] [--stats[=FILE]] O A B\n", prog);
+            fprintf(stderr, "  Computes O = A B\n");
+            fprintf(stderr, "Alternate usage: mpirun -np N %s [--binary] [--strategy] [--stats[=FILE]] O A B C D E F\n", prog);
+            fprintf(stderr, "  Computes O = (A + B + C) (D + E + F)\n");
+        }
+        status = 1;
+    }
+    MPI_Finalize();
+    return status;
+}
@@ -2,8 +2,19 @@
 #include <stdio.h>
 #include <math.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #include "utils.h"
+#include "sparsemm.h"
+#include "instrument.h"
+#include "gemm.h"
+#include "peak.h"
 
 void basic_sparsemm(const COO, const COO, COO*);
 void basic_sparsemm_sum(const COO, const COO, const COO,
@@ -104,26 +115,865 @@ static int check_sparsemm_sum()
     return pass;
 }
 
+/*
+ * Check the density-aware dispatcher against the basic implementation
+ * with every block forced dense, every block forced sparse, and the
+ * default choice.
+ */
+static int check_hybrid_sparsemm()
+{
+    COO A, B, Cbasic, Chybrid;
+    double *basic, *hybrid;
+    struct sparsemm_options options[3];
+    struct sparsemm_strategy strategy;
+    int i, j, t, m, n, k;
+    int pass = 0;
+
+    m = 150;
+    k = 80;
+    n = 70;
+    random_matrix(m, k, 0.1, &A);
+    random_matrix(k, n, 0.2, &B);
+    basic_sparsemm(A, B, &Cbasic);
+    convert_sparse_to_dense(Cbasic, &basic);
+
+    /* Small blocks so that every variant sees several of them */
+    for (t = 0; t < 3; t++) {
+        sparsemm_default_options(&options[t]);
+        options[t].block_rows = 32;
+    }
+    options[0].dense_threshold = 0;
+    options[0].dense_work_ratio = 1e300;
+    options[1].dense_threshold = 2;
+
+    for (t = 0; t < 3; t++) {
+        hybrid_sparsemm(A, B, &Chybrid, &options[t], &strategy);
+        convert_sparse_to_dense(Chybrid, &hybrid);
+        for (j = 0; j < n; j++) {
+            for (i = 0; i < m; i++) {
+                double diff = fabs(hybrid[j*m + i] - basic[j*m + i]);
+                if (diff != diff || diff > 1e-3) {
+                    fprintf(stderr, "HYBRID Failed check at entry (%d, %d), basic value %g, hybrid value %g\n", i, j, basic[j*m + i], hybrid[j*m + i]);
+                    pass = 1;
+                }
+            }
+        }
+        if ((t == 0 && strategy.sparse_blocks) || (t == 1 && strategy.dense_blocks)) {
+            fprintf(stderr, "HYBRID Failed check, forced dispatch not honoured\n");
+            pass = 1;
+        }
+        free(hybrid);
+        free_sparse(&Chybrid);
+    }
+
+    if(!pass) {
+        fprintf(stdout, "HYBRID Passed check\n");
+    }
+
+    free(basic);
+    free_sparse(&A);
+    free_sparse(&B);
+    free_sparse(&Cbasic);
+
+    return pass;
+}
+
+/*
+ * Compare the product an update state holds with the dense product of a
+ * (m x k) and b (k x n), both column major.
+ */
+static int compare_update(const struct sparsemm_update *u, const double *a, const double *b,
+                          int m, int k, int n, const char *what)
+{
+    COO C;
+    double *c;
+    int pass = 0;
+    convert_csr_to_sparse(sparsemm_update_product(u), &C);
+    convert_sparse_to_dense(C, &c);
+    for (int j = 0; j < n; j++) {
+        for (int i = 0; i < m; i++) {
+            double expect = 0;
+            for (int p = 0; p < k; p++) {
+                expect += a[p*m + i]*b[j*k + p];
+            }
+            double diff = fabs(c[j*m + i] - expect);
+            if (diff != diff || diff > 1e-3) {
+                fprintf(stderr, "INCREMENTAL Failed check after %s at entry (%d, %d), expected %g, got %g\n",
+                        what, i, j, expect, c[j*m + i]);
+                pass = 1;
+            }
+        }
+    }
+    free(c);
+    free_sparse(&C);
+    return pass;
+}
+
+/*
+ * The entries of X (m x n) in the listed rows, with those rows of the
+ * dense copy x replaced to match.
+ */
+static void pick_rows(const COO X, int count, const int *rows, double *x, COO *O)
+{
+    COO sp;
+    int nz = 0;
+    alloc_sparse(X->m, X->n, X->NZ, &sp);
+    for (int r = 0; r < count; r++) {
+        for (int j = 0; j < X->n; j++) {
+            x[j*X->m + rows[r]] = 0;
+        }
+    }
+    for (int e = 0; e < X->NZ; e++) {
+        for (int r = 0; r < count; r++) {
+            if (X->coords[e].i == rows[r]) {
+                sp->coords[nz] = X->coords[e];
+                sp->data[nz++] = X->data[e];
+                x[X->coords[e].j*X->m + rows[r]] = X->data[e];
+            }
+        }
+    }
+    sp->NZ = nz;
+    *O = sp;
+}
+
+/* count random entries of an m x n matrix, set in the dense copy x too. */
+static void pick_entries(int m, int n, int count, double *x, COO *O)
+{
+    COO sp;
+    alloc_sparse(m, n, count, &sp);
+    for (int e = 0; e < count; e++) {
+        int i = (int)(drand48()*m), j = (int)(drand48()*n);
+        // Each entry once: move along to one not yet picked
+        for (int f = 0; f < e; f++) {
+            if (sp->coords[f].i == i && sp->coords[f].j == j) {
+                j = (j + 1) % n;
+                f = -1;
+            }
+        }
+        sp->coords[e].i = i;
+        sp->coords[e].j = j;
+        sp->data[e] = e % 4 ? drand48() : 0.0;
+        x[j*m + i] = sp->data[e];
+    }
+    *O = sp;
+}
+
+/*
+ * Check incremental updates of a product against the dense product of
+ * matching dense copies: rows of A replaced (with neighbouring rows, the
+ * last row and a row cleared), entries of A set (some new, some zero),
+ * then the same for B, and finally values alone (in place).
+ */
+static int check_incremental_sparsemm()
+{
+    COO A, B, X, changes;
+    double *a, *b;
+    struct sparsemm_update *u;
+    int m = 150, k = 80, n = 70;
+    int rows_a[] = {149, 5, 0, 6}, rows_b[] = {2, 79, 1};
+    int pass = 0;
+
+    random_matrix(m, k, 0.1, &A);
+    random_matrix(k, n, 0.2, &B);
+    convert_sparse_to_dense(A, &a);
+    convert_sparse_to_dense(B, &b);
+    u = sparsemm_update_create(A, B, NULL);
+    pass |= compare_update(u, a, b, m, k, n, "create");
+
+    // Only rows 149, 5 and 0 are taken from X, so row 6, listed in rows_a
+    // with no entries, is cleared
+    random_matrix(m, k, 0.3, &X);
+    pick_rows(X, 3, rows_a, a, &changes);
+    for (int j = 0; j < k; j++) {
+        a[j*m + 6] = 0;
+    }
+    sparsemm_update_rows_a(u, 4, rows_a, changes);
+    pass |= compare_update(u, a, b, m, k, n, "replacing rows of A");
+    free_sparse(&changes);
+    free_sparse(&X);
+
+    pick_entries(m, k, 25, a, &changes);
+    sparsemm_update_entries_a(u, changes);
+    pass |= compare_update(u, a, b, m, k, n, "setting entries of A");
+    free_sparse(&changes);
+
+    random_matrix(k, n, 0.4, &X);
+    pick_rows(X, 3, rows_b, b, &changes);
+    sparsemm_update_rows_b(u, 3, rows_b, changes);
+    pass |= compare_update(u, a, b, m, k, n, "replacing rows of B");
+    free_sparse(&changes);
+    free_sparse(&X);
+
+    pick_entries(k, n, 15, b, &changes);
+    sparsemm_update_entries_b(u, changes);
+    pass |= compare_update(u, a, b, m, k, n, "setting entries of B");
+    free_sparse(&changes);
+
+    // New values for the entries A already has in a few rows
+    alloc_sparse(m, k, A->NZ, &changes);
+    changes->NZ = 0;
+    for (int j = 0; j < k; j++) {
+        for (int i = 10; i < 20; i++) {
+            if (a[j*m + i] != 0) {
+                changes->coords[changes->NZ].i = i;
+                changes->coords[changes->NZ].j = j;
+                changes->data[changes->NZ] = a[j*m + i] = drand48();
+                changes->NZ++;
+            }
+        }
+    }
+    sparsemm_update_entries_a(u, changes);
+    pass |= compare_update(u, a, b, m, k, n, "changing values of A");
+    free_sparse(&changes);
+
+    if (!pass) {
+        fprintf(stdout, "INCREMENTAL Passed check\n");
+    }
+    sparsemm_update_destroy(u);
+    free(a);
+    free(b);
+    free_sparse(&A);
+    free_sparse(&B);
+    return pass;
+}
+
+// Directory holding the files the checks write (made by main for CHECK)
+static char check_dir[] = "/tmp/sparsemm-check-XXXXXX";
+
+/* The path of a check file called name, in a static buffer of its own per slot. */
+static const char *check_path(int slot, const char *name)
+{
+    static char paths[8][64];
+    snprintf(paths[slot], sizeof(paths[slot]), "%s/%s", check_dir, name);
+    return paths[slot];
+}
+
+/* Write X (text format) to the check file called name. */
+static void write_check_matrix(const char *name, const COO X)
+{
+    FILE *f = fopen(check_path(0, name), "w");
+    if (!f) {
+        fprintf(stderr, "Unable to open %s for writing.\n", check_path(0, name));
+        exit(1);
+    }
+    write_sparse(f, X);
+    fclose(f);
+}
+
+/* Stop (quiet = 1) or resume (quiet = 0) printing on stderr, around checks
+ * of error paths that are expected to complain. */
+static void quiet_stderr(int quiet)
+{
+    static int saved = -1;
+    if (quiet) {
+        int null = open("/dev/null", O_WRONLY);
+        fflush(stderr);
+        saved = dup(2);
+        dup2(null, 2);
+        close(null);
+    } else if (saved >= 0) {
+        fflush(stderr);
+        dup2(saved, 2);
+        close(saved);
+        saved = -1;
+    }
+}
+
+/*
+ * Compare got with expect (same shape, entries within 1e-9 relative),
+ * reporting the first few differences prefixed by what.
+ */
+static int compare_sparse(const COO expect, const COO got, const char *what)
+{
+    double *e, *g;
+    int pass = 0, reported = 0;
+    if (!got || got->m != expect->m || got->n != expect->n) {
+        fprintf(stderr, "%s Failed check, expected a %d x %d result\n", what, expect->m, expect->n);
+        return 1;
+    }
+    convert_sparse_to_dense(expect, &e);
+    convert_sparse_to_dense(got, &g);
+    for (int j = 0; j < expect->n; j++) {
+        for (int i = 0; i < expect->m; i++) {
+            double x = e[(size_t)j*expect->m + i], y = g[(size_t)j*expect->m + i];
+            double diff = fabs(x - y);
+            if (diff != diff || diff > 1e-9*(1 + fabs(x))) {
+                if (reported++ < 5) {
+                    fprintf(stderr, "%s Failed check at entry (%d, %d), expected %g, got %g\n",
+                            what, i, j, x, y);
+                }
+                pass = 1;
+            }
+        }
+    }
+    free(e);
+    free(g);
+    return pass;
+}
+
+/*
+ * Check batch mode on a manifest with a chain of dependencies
+ * (P = A B, S = P + C, Q = S C) and a sum reusing the inputs, against
+ * the same operations run directly; every input should be read once and
+ * every matrix released by the end.  Then check that malformed manifests
+ * are rejected without running anything.
+ */
+static int check_batch()
+{
+    static const char *const bad[] = {
+        "P frob A B\n",                       // unknown operation
+        "P mm A\n",                           // too few inputs
+        "P sum A A A B B B B\n",              // too many inputs
+        "P mm A B\nP add C C\n",              // output produced twice
+        "P mm A B\nA add C C\n",              // output read by an earlier line
+    };
+    static const char *const outputs[] = {"P", "S", "Q", "T"};
+    COO A, B, C, expect[4], got;
+    CSR p, c, s;
+    struct batch_summary summary;
+    char manifest[4096];
+    FILE *f;
+    int pass = 0;
+
+    random_matrix(60, 40, 0.1, &A);
+    random_matrix(40, 60, 0.2, &B);
+    random_matrix(60, 60, 0.3, &C);
+    write_check_matrix("A", A);
+    write_check_matrix("B", B);
+    write_check_matrix("C", C);
+    free_sparse(&A);
+    free_sparse(&B);
+    free_sparse(&C);
+    // What batch mode reads back, rounded by the text format
+    read_sparse(check_path(0, "A"), &A);
+    read_sparse(check_path(0, "B"), &B);
+    read_sparse(check_path(0, "C"), &C);
+
+    hybrid_sparsemm(A, B, &expect[0], NULL, NULL);
+    convert_sparse_to_csr(expect[0], &p);
+    convert_sparse_to_csr(C, &c);
+    add_csr(p, c, &s);
+    convert_csr_to_sparse(s, &expect[1]);
+    hybrid_sparsemm(expect[1], C, &expect[2], NULL, NULL);
+    hybrid_sparsemm_sum(A, A, A, B, B, B, &expect[3], NULL, NULL);
+    free_csr(&p);
+    free_csr(&c);
+    free_csr(&s);
+
+    // Lines out of dependency order, with a comment and a blank line
+    snprintf(manifest, sizeof(manifest),
+             "# chained\n%s mm %s %s\n\n%s add %s %s\n%s sum %s %s %s %s %s %s\n%s mm %s %s\n",
+             check_path(0, "P"), check_path(1, "A"), check_path(2, "B"),
+             check_path(3, "S"), check_path(0, "P"), check_path(4, "C"),
+             check_path(5, "T"), check_path(1, "A"), check_path(1, "A"), check_path(1, "A"),
+             check_path(2, "B"), check_path(2, "B"), check_path(2, "B"),
+             check_path(6, "Q"), check_path(3, "S"), check_path(4, "C"));
+    f = fopen(check_path(7, "manifest"), "w");
+    fputs(manifest, f);
+    fclose(f);
+
+    if (run_batch(check_path(7, "manifest"), &read_sparse, &write_sparse, 0, &summary)) {
+        fprintf(stderr, "BATCH Failed check, manifest rejected\n");
+        pass = 1;
+    } else {
+        if (summary.operations != 4 || summary.levels != 3 || summary.files_read != 3
+            || summary.matrices != 7 || summary.resident) {
+            fprintf(stderr, "BATCH Failed check, ran %d operations in %d levels reading %d files "
+                    "for %d matrices, %d left resident (expected 4, 3, 3, 7 and 0)\n",
+                    summary.operations, summary.levels, summary.files_read,
+                    summary.matrices, summary.resident);
+            pass = 1;
+        }
+        for (int o = 0; o < 4; o++) {
+            char what[32];
+            read_sparse(check_path(0, outputs[o]), &got);
+            snprintf(what, sizeof(what), "BATCH (%s)", outputs[o]);
+            pass |= compare_sparse(expect[o], got, what);
+            free_sparse(&got);
+        }
+    }
+
+    quiet_stderr(1);
+    for (size_t t = 0; t < sizeof(bad)/sizeof(bad[0]); t++) {
+        f = fopen(check_path(7, "manifest"), "w");
+        fputs(bad[t], f);
+        fclose(f);
+        if (!run_batch(check_path(7, "manifest"), &read_sparse, &write_sparse, 0, NULL)) {
+            quiet_stderr(0);
+            fprintf(stderr, "BATCH Failed check, malformed manifest accepted: %s", bad[t]);
+            quiet_stderr(1);
+            pass = 1;
+        }
+    }
+    if (!run_batch(check_path(7, "missing"), &read_sparse, &write_sparse, 0, NULL)) {
+        quiet_stderr(0);
+        fprintf(stderr, "BATCH Failed check, missing manifest accepted\n");
+        quiet_stderr(1);
+        pass = 1;
+    }
+    quiet_stderr(0);
+
+    if (!pass) {
+        fprintf(stdout, "BATCH Passed check\n");
+    }
+    for (int o = 0; o < 4; o++) {
+        free_sparse(&expect[o]);
+        unlink(check_path(0, outputs[o]));
+    }
+    free_sparse(&A);
+    free_sparse(&B);
+    free_sparse(&C);
+    unlink(check_path(0, "A"));
+    unlink(check_path(0, "B"));
+    unlink(check_path(0, "C"));
+    unlink(check_path(0, "manifest"));
+    return pass;
+}
+
+static int files_identical(const char *x, const char *y)
+{
+    FILE *f = fopen(x, "r");
+    FILE *g = fopen(y, "r");
+    int same = f && g;
+    while (same) {
+        int c = fgetc(f);
+        same = c == fgetc(g);
+        if (c == EOF) {
+            break;
+        }
+    }
+    if (f) {
+        fclose(f);
+    }
+    if (g) {
+        fclose(g);
+    }
+    return same;
+}
+
+/*
+ * Check that the pipelined hybrid_sparsemm_sum_files gives exactly the
+ * result of hybrid_sparsemm_sum on the same inputs, and writes the same
+ * bytes, in both file formats, on one thread and on several (the dense
+ * blocks are forced on so that the GEMM's threads take part too).
+ */
+static int check_sparsemm_sum_files()
+{
+    static const char *const names[] = {"A", "B", "C", "D", "E", "F"};
+    const double fracs[6] = {0.05, 0.2, 0.0, 0.3, 0.1, 0.02};
+    const int threads[2] = {1, 3};
+    struct sparsemm_options options;
+    const char *files[6];
+    int pass = 0;
+#ifdef _OPENMP
+    int max_threads = omp_get_max_threads();
+#endif
+
+    sparsemm_default_options(&options);
+    options.block_rows = 16;
+    options.dense_threshold = 0;
+    options.dense_work_ratio = 1e300;
+    for (int binary = 0; binary < 2; binary++) {
+        void (*reader)(const char *, COO *) = binary ? &read_sparse_binary : &read_sparse;
+        void (*writer)(FILE *, COO) = binary ? &write_sparse_binary : &write_sparse;
+        COO in[6], expect;
+        FILE *f;
+        for (int i = 0; i < 6; i++) {
+            COO X;
+            random_matrix(i < 3 ? 70 : 50, i < 3 ? 50 : 60, fracs[i], &X);
+            files[i] = check_path(i, names[i]);
+            f = fopen(files[i], "w");
+            writer(f, X);
+            fclose(f);
+            free_sparse(&X);
+            reader(files[i], &in[i]);
+        }
+        hybrid_sparsemm_sum(in[0], in[1], in[2], in[3], in[4], in[5], &expect, &options, NULL);
+        f = fopen(check_path(6, "expect"), "w");
+        writer(f, expect);
+        fclose(f);
+
+        for (int t = 0; t < 2; t++) {
+            COO got;
+#ifdef _OPENMP
+            omp_set_num_threads(threads[t]);
+#endif
+            gemm_set_num_threads(threads[t]);
+            f = fopen(check_path(7, "got"), "w");
+            hybrid_sparsemm_sum_files(files, binary, f, &got, &options, NULL);
+            fclose(f);
+            int same = got->m == expect->m && got->n == expect->n && got->NZ == expect->NZ;
+            for (int p = 0; same && p < got->NZ; p++) {
+                same = got->coords[p].i == expect->coords[p].i
+                    && got->coords[p].j == expect->coords[p].j
+                    && got->data[p] == expect->data[p];
+            }
+            if (!same) {
+                fprintf(stderr, "SUM FILES Failed check (%s, %d threads), result differs from hybrid_sparsemm_sum\n",
+                        binary ? "binary" : "text", threads[t]);
+                pass = 1;
+            }
+            if (!files_identical(check_path(6, "expect"), check_path(7, "got"))) {
+                fprintf(stderr, "SUM FILES Failed check (%s, %d threads), written file differs\n",
+                        binary ? "binary" : "text", threads[t]);
+                pass = 1;
+            }
+            free_sparse(&got);
+        }
+        free_sparse(&expect);
+        for (int i = 0; i < 6; i++) {
+            free_sparse(&in[i]);
+            unlink(files[i]);
+        }
+    }
+#ifdef _OPENMP
+    omp_set_num_threads(max_threads);
+#endif
+    gemm_set_num_threads(0);
+
+    if (!pass) {
+        fprintf(stdout, "SUM FILES Passed check\n");
+    }
+    unlink(check_path(0, "expect"));
+    unlink(check_path(0, "got"));
+    return pass;
+}
+
+/*
+ * Check add_csr against the dense sum on rows that overlap fully, partly
+ * or not at all, interleave, or are empty in either operand or both.
+ */
+static int check_add_csr()
+{
+    COO A, B, expect, got;
+    CSR a, b, sum;
+    double *dense;
+    int m = 36, n = 20;
+    int pass = 0;
+
+    alloc_sparse(m, n, m*n, &A);
+    alloc_sparse(m, n, m*n, &B);
+    A->NZ = B->NZ = 0;
+    for (int i = 0; i < m; i++) {
+        for (int j = 0; j < n; j++) {
+            int in_a, in_b;
+            switch (i % 6) {
+            case 0: in_a = in_b = j % 3 == 0; break;            // the same columns
+            case 1: in_a = j % 2 == 0; in_b = 0; break;         // B's row empty
+            case 2: in_a = 0; in_b = j % 4 == 1; break;         // A's row empty
+            case 3: in_a = in_b = 0; break;                     // both empty
+            case 4: in_a = j % 2 == 0; in_b = j % 2 == 1; break; // disjoint, interleaved
+            default: in_a = j < 12; in_b = j >= 8; break;       // overlapping in part
+            }
+            if (in_a) {
+                A->coords[A->NZ].i = i;
+                A->coords[A->NZ].j = j;
+                A->data[A->NZ++] = drand48();
+            }
+            if (in_b) {
+                B->coords[B->NZ].i = i;
+                B->coords[B->NZ].j = j;
+                B->data[B->NZ++] = drand48();
+            }
+        }
+    }
+    convert_sparse_to_csr(A, &a);
+    convert_sparse_to_csr(B, &b);
+    add_csr(a, b, &sum);
+
+    // Dense A + B, back to coordinates
+    convert_sparse_to_dense(A, &dense);
+    for (int e = 0; e < B->NZ; e++) {
+        dense[B->coords[e].j*m + B->coords[e].i] += B->data[e];
+    }
+    convert_dense_to_sparse(dense, m, n, &expect);
+    free(dense);
+
+    convert_csr_to_sparse(sum, &got);
+    pass |= compare_sparse(expect, got, "ADD");
+    if (sum->NZ != expect->NZ) {
+        fprintf(stderr, "ADD Failed check, %d entries rather than %d\n", sum->NZ, expect->NZ);
+        pass = 1;
+    }
+    for (int i = 0; i < m; i++) {
+        for (int p = sum->rowptr[i] + 1; p < sum->rowptr[i + 1]; p++) {
+            if (sum->colidx[p] <= sum->colidx[p - 1]) {
+                fprintf(stderr, "ADD Failed check, row %d not sorted by column\n", i);
+                pass = 1;
+            }
+        }
+    }
+
+    if (!pass) {
+        fprintf(stdout, "ADD Passed check\n");
+    }
+    free_sparse(&A);
+    free_sparse(&B);
+    free_sparse(&expect);
+    free_sparse(&got);
+    free_csr(&a);
+    free_csr(&b);
+    free_csr(&sum);
+    return pass;
+}
+
+/* Send one request to the server and check that its reply starts with OK
+ * (ok set) or ERR; the first line of the reply is left in reply. */
+static int server_request(FILE *to, FILE *from, const char *request, int ok,
+                          char *reply, size_t len)
+{
+    fprintf(to, "%s\n", request);
+    fflush(to);
+    if (!fgets(reply, len, from)) {
+        fprintf(stderr, "SERVER Failed check, no reply to %s\n", request);
+        snprintf(reply, len, "\n");
+        return 1;
+    }
+    if (strncmp(reply, ok ? "OK" : "ERR", ok ? 2 : 3)) {
+        fprintf(stderr, "SERVER Failed check, %s replied %s", request, reply);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Drive a server over a socketpair: LOAD (including a truncated file, an
+ * out of range entry and a missing file, which must fail the request but
+ * not the server), MUL, ADD and WRITE, compared with the products computed
+ * here, failed writes (to a missing directory and to a full device) that
+ * must leave their output name as it was, DROP, LIST and SHUTDOWN.
+ *
+ * The server runs in a child process forked before anything has run an
+ * OpenMP parallel region (libgomp's thread pool does not survive a fork),
+ * so this check must come first.
+ */
+static int check_server()
+{
+    COO A, B, C, expect_p, expect_s, got;
+    CSR a, c, s;
+    char request[512], reply[512];
+    FILE *to, *from, *f;
+    int fds[2], status, pass = 0;
+    pid_t child;
+
+    random_matrix(50, 30, 0.2, &A);
+    random_matrix(30, 40, 0.2, &B);
+    random_matrix(50, 30, 0.3, &C);
+    write_check_matrix("A", A);
+    write_check_matrix("B", B);
+    write_check_matrix("C", C);
+    free_sparse(&A);
+    free_sparse(&B);
+    free_sparse(&C);
+    // Says 10 entries but has 2, and an entry outside the matrix
+    f = fopen(check_path(0, "truncated"), "w");
+    fprintf(f, "5 5 10\n0 0 1.0\n1 1 2.0\n");
+    fclose(f);
+    f = fopen(check_path(0, "outside"), "w");
+    fprintf(f, "5 5 2\n0 0 1.0\n-1 7 2.0\n");
+    fclose(f);
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds)) {
+        perror("socketpair");
+        return 1;
+    }
+    fflush(stdout);
+    fflush(stderr);
+    child = fork();
+    if (child < 0) {
+        perror("fork");
+        return 1;
+    }
+    if (!child) {
+        close(fds[0]);
+        quiet_stderr(1);
+        _exit(serve_connection(fds[1], &try_read_sparse, &try_write_sparse));
+    }
+    close(fds[1]);
+    to = fdopen(fds[0], "w");
+    from = fdopen(dup(fds[0]), "r");
+
+#define REQUEST(ok, ...)                                                    \
+    do {                                                                    \
+        snprintf(request, sizeof(request), __VA_ARGS__);                    \
+        pass |= server_request(to, from, request, ok, reply, sizeof(reply)); \
+    } while (0)
+    REQUEST(1, "LOAD A %s", check_path(0, "A"));
+    REQUEST(1, "LOAD B %s", check_path(0, "B"));
+    REQUEST(1, "LOAD C %s", check_path(0, "C"));
+    REQUEST(0, "LOAD X %s", check_path(0, "truncated"));
+    REQUEST(0, "LOAD X %s", check_path(0, "outside"));
+    REQUEST(0, "LOAD X %s", check_path(0, "missing"));
+    REQUEST(1, "MUL P A B %s", check_path(0, "P"));
+    REQUEST(1, "ADD S A C");
+    // Failed writes: S must keep the sum, and F must not appear
+    REQUEST(0, "MUL S A B %s", check_path(0, "missing/S"));
+    REQUEST(0, "MUL F A B %s", check_path(0, "missing/F"));
+    REQUEST(0, "WRITE F %s", check_path(0, "F"));
+    REQUEST(1, "WRITE S %s", check_path(0, "S"));
+    // A full device: the write itself fails, which must not stop the server
+    REQUEST(0, "WRITE S /dev/full");
+    REQUEST(0, "MUL S A B /dev/full");
+    REQUEST(1, "DROP A");
+    REQUEST(0, "DROP A");
+    REQUEST(0, "MUL P A B");
+    REQUEST(1, "LIST");
+    if (strcmp(reply, "OK 4\n")) {
+        fprintf(stderr, "SERVER Failed check, expected 4 resident matrices (B, C, P, S), LIST replied %s", reply);
+        pass = 1;
+    }
+    for (int i = 0; i < 4 && fgets(reply, sizeof(reply), from); i++) {
+        if (reply[0] == 'F' || reply[0] == 'A' || reply[0] == 'X') {
+            fprintf(stderr, "SERVER Failed check, LIST shows %s", reply);
+            pass = 1;
+        }
+    }
+    REQUEST(1, "SHUTDOWN");
+#undef REQUEST
+    fclose(to);
+    fclose(from);
+    if (waitpid(child, &status, 0) != child || !WIFEXITED(status) || WEXITSTATUS(status)) {
+        fprintf(stderr, "SERVER Failed check, the server did not exit cleanly\n");
+        pass = 1;
+    }
+
+    // The same operations on the matrices as the server read them
+    read_sparse(check_path(0, "A"), &A);
+    read_sparse(check_path(0, "B"), &B);
+    read_sparse(check_path(0, "C"), &C);
+    hybrid_sparsemm(A, B, &expect_p, NULL, NULL);
+    convert_sparse_to_csr(A, &a);
+    convert_sparse_to_csr(C, &c);
+    add_csr(a, c, &s);
+    convert_csr_to_sparse(s, &expect_s);
+    if (!try_read_sparse(check_path(0, "P"), &got)) {
+        pass |= compare_sparse(expect_p, got, "SERVER (MUL)");
+        free_sparse(&got);
+    } else {
+        pass = 1;
+    }
+    if (!try_read_sparse(check_path(0, "S"), &got)) {
+        pass |= compare_sparse(expect_s, got, "SERVER (ADD)");
+        free_sparse(&got);
+    } else {
+        pass = 1;
+    }
+
+    if (!pass) {
+        fprintf(stdout, "SERVER Passed check\n");
+    }
+    free_sparse(&A);
+    free_sparse(&B);
+    free_sparse(&C);
+    free_sparse(&expect_p);
+    free_sparse(&expect_s);
+    free_csr(&a);
+    free_csr(&c);
+    free_csr(&s);
+    const char *const files[] = {"A", "B", "C", "truncated", "outside", "P", "S"};
+    for (size_t i = 0; i < sizeof(files)/sizeof(files[0]); i++) {
+        unlink(check_path(0, files[i]));
+    }
+    return pass;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Invalid arguments.\n");
+    fprintf(stderr, "Usage: %s CHECK\n", prog);
+    fprintf(stderr, "  Check the implemented routines using randomly generated matrices.\n");
+    fprintf(stderr, "Alternate usage: %s [--binary] [--strategy] [--stats[=FILE]] [--perf[=EVENTS]] [--peak] O A B\n", prog);
+    fprintf(stderr, "  Computes O = A B\n");
+    fprintf(stderr, "  Where A and B are filenames of matrices to read.\n");
+    fprintf(stderr, "  O is the filename of the matrix to be written.\n\n");
+    fprintf(stderr, "Alternate usage: %s [--binary] [--strategy] [--stats[=FILE]] [--perf[=EVENTS]] [--peak] O A B C D E F\n", prog);
+    fprintf(stderr, "  Computes O = (A + B + C) (D + E + F)\n");
+    fprintf(stderr, "  Where A-F are the files names of matrices to read.\n");
+    fprintf(stderr, "  A-F are read concurrently, and each sum starts as soon as its operands are in.\n");
+    fprintf(stderr, "  O is the filename of the matrix to be written.\n\n");
+    fprintf(stderr, "Alternate usage: %s [--binary] [--strategy] BATCH MANIFEST\n", prog);
+    fprintf(stderr, "  Runs every operation listed in the file MANIFEST, one per line as\n");
+    fprintf(stderr, "    OUTPUT mm A B | OUTPUT add A B | OUTPUT sum A B C D E F\n");
+    fprintf(stderr, "  on OMP_NUM_THREADS threads, reading each input file only once.\n\n");
+    fprintf(stderr, "Alternate usage: %s [--binary] SERVE SOCKET\n", prog);
+    fprintf(stderr, "  Keeps matrices resident and serves LOAD/MUL/ADD/SUM/WRITE/SHM/STATS\n");
+    fprintf(stderr, "  requests on the Unix domain socket SOCKET (see server.c).\n\n");
+    fprintf(stderr, "If the --binary flag is given use binary reading and writing of matrices.\n");
+    fprintf(stderr, "If the --strategy flag is given report the dense/sparse dispatch on stderr.\n");
+    fprintf(stderr, "If the --stats flag (or MM_STATS=1|FILE) is given emit per-phase timings\n");
+    fprintf(stderr, "and counters as one JSON record, on stderr or appended to FILE.\n");
+    fprintf(stderr, "If the --perf flag (or MM_PERF=1|EVENTS) is given add hardware counters to each\n");
+    fprintf(stderr, "phase (convert includes the sorting into CSR): cycles, instructions, l1d_misses,\n");
+    fprintf(stderr, "llc_misses, dtlb_misses, fp_ops and page_faults, or the comma separated EVENTS.\n");
+    fprintf(stderr, "If the --peak flag is given report each phase's rates as percentages of the\n");
+    fprintf(stderr, "per-thread FMA and STREAM triad roofs (measured once per host, see peak.h).\n\n");
+}
+
 int main(int argc, char **argv)
 {
     COO O;
     FILE *f;
+    const char *prog = argv[0];
+    struct sparsemm_strategy strategy;
+    int report_strategy = 0;
+    int binary = 0;
 
     void (*reader)(const char *, COO *) = &read_sparse;
     void (*writer)(FILE *, COO) = &write_sparse;
-    if (!(argc == 2 || argc == 4 || argc == 8 || argc == 5 || argc == 9)) {
-        fprintf(stderr, "Invalid arguments.\n");
-        fprintf(stderr, "Usage: %s CHECK\n", argv[0]);
-        fprintf(stderr, "  Check the implemented routines using randomly generated matrices.\n");
-        fprintf(stderr, "Alternate usage: %s [--binary] O A B\n", argv[0]);
-        fprintf(stderr, "  Computes O = A B\n");
-        fprintf(stderr, "  Where A and B are filenames of matrices to read.\n");
-        fprintf(stderr, "  O is the filename of the matrix to be written.\n\n");
-        fprintf(stderr, "Alternate usage: %s [--binary] O A B C D E F\n", argv[0]);
-        fprintf(stderr, "  Computes O = (A + B + C) (D + E + F)\n");
-        fprintf(stderr, "  Where A-F are the files names of matrices to read.\n");
-        fprintf(stderr, "  O is the filename of the matrix to be written.\n\n");
-        fprintf(stderr, "If the --binary flag is given use binary reading and writing of matrices.\n\n");
+    // The server answers ERR for a file it cannot read or write rather than exiting
+    int (*try_reader)(const char *, COO *) = &try_read_sparse;
+    int (*try_writer)(FILE *, COO) = &try_write_sparse;
+
+    instrument_init("sparsemm");
+    while (argc > 1 && !strncmp(argv[1], "--", 2)) {
+        if (!strcmp(argv[1], "--binary")) {
+            binary = 1;
+            reader = &read_sparse_binary;
+            writer = &write_sparse_binary;
+            try_reader = &try_read_sparse_binary;
+            try_writer = &try_write_sparse_binary;
+        } else if (!strcmp(argv[1], "--strategy")) {
+            report_strategy = 1;
+        } else if (!strcmp(argv[1], "--stats")) {
+            instrument_enable("-");
+        } else if (!strncmp(argv[1], "--stats=", 8)) {
+            instrument_enable(argv[1] + 8);
+        } else if (!strcmp(argv[1], "--peak")) {
+            struct peak peak;
+            peak_load(&peak);
+            // Per-thread roofs, as for ./gemm (see peak.h)
+            instrument_set_peak(peak.core_gflops, peak_thread_gbs(&peak));
+            if (!instrument_enabled) {
+                instrument_enable("-");
+            }
+        } else if (!strcmp(argv[1], "--perf") || !strncmp(argv[1], "--perf=", 7)) {
+            instrument_enable_events(argv[1][6] ? argv[1] + 7 : "1");
+            if (!instrument_enabled) {
+                instrument_enable("-");
+            }
+        } else {
+            fprintf(stderr, "Unrecognised flag '%s'\n", argv[1]);
+            return 1;
+        }
+        argc--;
+        argv++;
+    }
+    if (argc == 3 && !strcmp(argv[1], "BATCH")) {
+        int status;
+        instrument_label("mode", "BATCH");
+        status = run_batch(argv[2], reader, writer, report_strategy, NULL);
+        instrument_report();
+        return status;
+    }
+    if (argc == 3 && !strcmp(argv[1], "SERVE")) {
+        int status;
+        instrument_label("mode", "SERVE");
+        status = run_server(argv[2], try_reader, try_writer);
+        instrument_report();
+        return status;
+    }
+    if (!(argc == 2 || argc == 4 || argc == 8)) {
+        usage(prog);
         return 1;
     }
 
@@ -133,54 +983,53 @@ int main(int argc, char **argv)
             fprintf(stderr, "Invalid mode, expecting CHECK, got %s\n", argv[1]);
             return 1;
         }
+        if (!mkdtemp(check_dir)) {
+            perror(check_dir);
+            return 1;
+        }
+        // Forks, so before anything uses OpenMP
+        pass |= check_server();
         pass |= check_sparsemm();
         pass |= check_sparsemm_sum();
+        pass |= check_sparsemm_sum_files();
+        pass |= check_hybrid_sparsemm();
+        pass |= check_incremental_sparsemm();
+        pass |= check_add_csr();
+        pass |= check_batch();
+        rmdir(check_dir);
         return pass;
     }
-    if (argc == 5 || argc == 9) {
-      if (strcmp(argv[1], "--binary") != 0) {
-        fprintf(stderr, "Expecting flag --binary, not '%s'\n", argv[1]);
-        return 1;
-      }
-      reader = &read_sparse_binary;
-      writer = &write_sparse_binary;
-      argc--;
-      argv++;
+    instrument_label("mode", argc == 4 ? "MM" : "SUM");
+    instrument_label("output", argv[1]);
+    f = fopen(argv[1], "w");
+    if (!f) {
+      fprintf(stderr, "Unable to open %s for writing output.\n", argv[1]);
+      exit(1);
     }
     if (argc == 4) {
         COO A, B;
         reader(argv[2], &A);
         reader(argv[3], &B);
-        optimised_sparsemm(A, B, &O);
+        hybrid_sparsemm(A, B, &O, NULL, &strategy);
 
         free_sparse(&A);
         free_sparse(&B);
+        writer(f, O);
     } else {
-        COO A, B, C, D, E, F;
-        reader(argv[2], &A);
-        reader(argv[3], &B);
-        reader(argv[4], &C);
-        reader(argv[5], &D);
-        reader(argv[6], &E);
-        reader(argv[7], &F);
-
-        optimised_sparsemm_sum(A, B, C, D, E, F, &O);
-
-        free_sparse(&A);
-        free_sparse(&B);
-        free_sparse(&C);
-        free_sparse(&D);
-        free_sparse(&E);
-        free_sparse(&F);
+        // Reads A-F concurrently, sums as they arrive and writes O
+        hybrid_sparsemm_sum_files((const char *const *)argv + 2, binary, f, &O, NULL, &strategy);
     }
-
-    f = fopen(argv[1], "w");
-    if (!f) {
-      fprintf(stderr, "Unable to open %s for writing output.\n", argv[1]);
-      exit(1);
+    if (report_strategy) {
+        print_strategy(stderr, &strategy);
     }
-    writer(f, O);
+    instrument_field("m", O->m);
+    instrument_field("n", O->n);
+    instrument_field("nnz", O->NZ);
+    instrument_field("density", strategy.density);
+    instrument_field("dense_blocks", strategy.dense_blocks);
+    instrument_field("sparse_blocks", strategy.sparse_blocks);
     free_sparse(&O);
     fclose(f);
+    instrument_report();
     return 0;
 }
@@ -0,0 +1,96 @@
+#ifndef _SPARSEMM_H
+#define _SPARSEMM_H
+
+#include <stdio.h>
+#include "utils.h"
+
+/*
+ * Tuning knobs for the dense/sparse dispatch in hybrid_sparsemm.
+ * dense_threshold - a row block whose product fills at least this
+ *                   fraction of its (compressed) output block is
+ *                   computed with the dense GEMM.
+ * dense_work_ratio - upper bound on dense flops / sparse flops for a
+ *                    block to still be sent to the dense GEMM.
+ * block_rows - number of rows of A in each dispatch block.
+ */
+struct sparsemm_options {
+    double dense_threshold;
+    double dense_work_ratio;
+    int block_rows;
+};
+
+/*
+ * Record of what hybrid_sparsemm decided, for reporting.
+ */
+struct sparsemm_strategy {
+    int blocks, dense_blocks, sparse_blocks;
+    long long nnz;
+    double density;
+    double sparse_flops, dense_flops;
+};
+
+void sparsemm_default_options(struct sparsemm_options *);
+void hybrid_sparsemm_csr(const CSR, const CSR, CSR *,
+                         const struct sparsemm_options *,
+                         struct sparsemm_strategy *);
+void hybrid_sparsemm(const COO, const COO, COO *,
+                     const struct sparsemm_options *,
+                     struct sparsemm_strategy *);
+void hybrid_sparsemm_sum(const COO, const COO, const COO,
+                         const COO, const COO, const COO,
+                         COO *,
+                         const struct sparsemm_options *,
+                         struct sparsemm_strategy *);
+void hybrid_sparsemm_sum_files(const char *const *, int, FILE *,
+                               COO *,
+                               const struct sparsemm_options *,
+                               struct sparsemm_strategy *);
+void sparsemm_add_csr(const CSR, const CSR, const char *, const char *, CSR *);
+void print_strategy(FILE *, const struct sparsemm_strategy *);
+
+/*
+ * C = A B kept up to date as a few rows or entries of A or B change (see
+ * incremental-sparsemm.c): each update recomputes only the rows of C that
+ * depend on the change, so it costs about as much as those rows of the
+ * product rather than all of it.
+ * create    copies A and B and computes C (options as for hybrid_sparsemm)
+ * rows_a/b  replace the listed rows (count of them) of A or B with the
+ *           entries of a matrix the same shape holding just those rows
+ *           (an empty row clears it)
+ * entries_a/b  set each entry listed (once) to its new value, adding it to
+ *           the structure if it is new; the rest of A or B is unchanged
+ * product   the current C, owned by the update state and valid until
+ *           its next change
+ */
+struct sparsemm_update;
+
+struct sparsemm_update *sparsemm_update_create(const COO, const COO,
+                                               const struct sparsemm_options *);
+void sparsemm_update_destroy(struct sparsemm_update *);
+void sparsemm_update_rows_a(struct sparsemm_update *, int, const int *, const COO);
+void sparsemm_update_rows_b(struct sparsemm_update *, int, const int *, const COO);
+void sparsemm_update_entries_a(struct sparsemm_update *, const COO);
+void sparsemm_update_entries_b(struct sparsemm_update *, const COO);
+CSR sparsemm_update_product(const struct sparsemm_update *);
+
+/*
+ * What run_batch did: operations run, dependency levels, input files
+ * read, distinct named matrices, and matrices still held after the last
+ * level (0 unless an input or intermediate was not released).
+ */
+struct batch_summary {
+    int operations, levels, files_read, matrices, resident;
+};
+
+int run_batch(const char *,
+              void (*)(const char *, COO *),
+              void (*)(FILE *, COO),
+              int, struct batch_summary *);
+int run_server(const char *,
+               int (*)(const char *, COO *),
+               int (*)(FILE *, COO));
+int serve_connection(int,
+                     int (*)(const char *, COO *),
+                     int (*)(FILE *, COO));
+
+#endif
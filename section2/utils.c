@@ -5,6 +5,7 @@
 #include <limits.h>
 #include <stdint.h>
 #include "utils.h"
+#include "instrument.h"
 
 
 #ifdef _MSC_VER
@@ -23,6 +24,7 @@ double drand48()
 void alloc_dense(int m, int n, double **dense)
 {
   *dense = malloc(m*n*sizeof(**dense));
+  instrument_alloc(m*n*sizeof(**dense));
 }
 
 /*
@@ -69,6 +71,7 @@ void alloc_sparse(int m, int n, int NZ, COO *sparse)
     sp->NZ = NZ;
     sp->coords = calloc(NZ, sizeof(struct coord));
     sp->data = calloc(NZ, sizeof(double));
+    instrument_alloc(NZ*(sizeof(struct coord) + sizeof(double)));
     *sparse = sp;
 }
 
@@ -82,6 +85,7 @@ void realloc_sparse(int NZ, COO *sparse)
     (*sparse)->NZ = NZ;
     (*sparse)->coords = realloc((*sparse)->coords, NZ*sizeof(struct coord));
     (*sparse)->data = realloc((*sparse)->data, NZ*sizeof(double));
+    instrument_realloc(NZ*(sizeof(struct coord) + sizeof(double)));
 }
 
 /*
@@ -162,6 +166,167 @@ void convert_dense_to_sparse(const double *dense, int m, int n,
     *sparse = sp;
 }
 
+/*
+ * Allocate a sparse matrix in compressed sparse row format.
+ * m - number of rows
+ * n - number of columns
+ * NZ - number of nonzeros
+ * sparse - newly allocated matrix.
+ */
+void alloc_csr(int m, int n, int NZ, CSR *sparse)
+{
+    CSR sp = calloc(1, sizeof(struct _p_CSR));
+    sp->m = m;
+    sp->n = n;
+    sp->NZ = NZ;
+    sp->rowptr = calloc(m + 1, sizeof(int));
+    sp->colidx = calloc(NZ, sizeof(int));
+    sp->data = calloc(NZ, sizeof(double));
+    instrument_alloc((m + 1)*sizeof(int) + NZ*(sizeof(int) + sizeof(double)));
+    *sparse = sp;
+}
+
+/*
+ * Free a CSR matrix.
+ * sparse - sparse matrix, may be NULL
+ */
+void free_csr(CSR *sparse)
+{
+    CSR sp = *sparse;
+    if (!sp) {
+        return;
+    }
+    free(sp->rowptr);
+    free(sp->colidx);
+    free(sp->data);
+    free(sp);
+    *sparse = NULL;
+}
+
+/*
+ * Convert a coordinate format matrix to CSR.
+ * Entries are bucketed by column and then, keeping that order, by row
+ * (two counting sorts), so each row comes out sorted by column in
+ * O(NZ + m + n) however long it is.  Duplicate coordinates are summed.
+ *
+ * sparse - the matrix to convert
+ * csr - output matrix (allocated by this routine)
+ */
+void convert_sparse_to_csr(const COO sparse, CSR *csr)
+{
+    int i, n, p, q;
+    int *next, *colptr, *order;
+    CSR sp;
+    alloc_csr(sparse->m, sparse->n, sparse->NZ, &sp);
+
+    /* Order the entries by column. */
+    colptr = calloc(sp->n + 1, sizeof(*colptr));
+    order = malloc((sparse->NZ + 1)*sizeof(*order));
+    for (n = 0; n < sparse->NZ; n++) {
+        colptr[sparse->coords[n].j + 1]++;
+    }
+    for (i = 0; i < sp->n; i++) {
+        colptr[i + 1] += colptr[i];
+    }
+    for (n = 0; n < sparse->NZ; n++) {
+        order[colptr[sparse->coords[n].j]++] = n;
+    }
+    free(colptr);
+
+    /* Count the entries in each row, then prefix sum into row starts, and
+     * place them in column order, which leaves every row sorted. */
+    for (n = 0; n < sparse->NZ; n++) {
+        sp->rowptr[sparse->coords[n].i + 1]++;
+    }
+    for (i = 0; i < sp->m; i++) {
+        sp->rowptr[i + 1] += sp->rowptr[i];
+    }
+    next = malloc((sp->m + 1)*sizeof(*next));
+    memcpy(next, sp->rowptr, sp->m*sizeof(*next));
+    for (q = 0; q < sparse->NZ; q++) {
+        n = order[q];
+        p = next[sparse->coords[n].i]++;
+        sp->colidx[p] = sparse->coords[n].j;
+        sp->data[p] = sparse->data[n];
+    }
+    free(next);
+    free(order);
+
+    /* Merge duplicates (now adjacent); q is the write position. */
+    q = 0;
+    for (i = 0; i < sp->m; i++) {
+        int start = sp->rowptr[i];
+        int end = sp->rowptr[i + 1];
+        sp->rowptr[i] = q;
+        for (p = start; p < end; p++) {
+            if (q > sp->rowptr[i] && sp->colidx[q - 1] == sp->colidx[p]) {
+                sp->data[q - 1] += sp->data[p];
+                continue;
+            }
+            sp->colidx[q] = sp->colidx[p];
+            sp->data[q++] = sp->data[p];
+        }
+    }
+    sp->rowptr[sp->m] = q;
+    sp->NZ = q;
+    *csr = sp;
+}
+
+/*
+ * Convert a CSR matrix to coordinate format, in row major order.
+ *
+ * csr - the matrix to convert
+ * sparse - output matrix (allocated by this routine)
+ */
+void convert_csr_to_sparse(const CSR csr, COO *sparse)
+{
+    int i, p;
+    COO sp;
+    alloc_sparse(csr->m, csr->n, csr->NZ, &sp);
+    for (i = 0; i < csr->m; i++) {
+        for (p = csr->rowptr[i]; p < csr->rowptr[i + 1]; p++) {
+            sp->coords[p].i = i;
+            sp->coords[p].j = csr->colidx[p];
+            sp->data[p] = csr->data[p];
+        }
+    }
+    *sparse = sp;
+}
+
+/*
+ * Add two CSR matrices of the same shape by merging their sorted rows.
+ *
+ * A, B - the matrices to add
+ * O - output matrix A + B (allocated by this routine)
+ */
+void add_csr(const CSR A, const CSR B, CSR *O)
+{
+    int i, p, q, r;
+    CSR sp;
+    alloc_csr(A->m, A->n, A->NZ + B->NZ, &sp);
+    r = 0;
+    for (i = 0; i < A->m; i++) {
+        p = A->rowptr[i];
+        q = B->rowptr[i];
+        while (p < A->rowptr[i + 1] || q < B->rowptr[i + 1]) {
+            if (q == B->rowptr[i + 1]
+                || (p < A->rowptr[i + 1] && A->colidx[p] < B->colidx[q])) {
+                sp->colidx[r] = A->colidx[p];
+                sp->data[r++] = A->data[p++];
+            } else if (p == A->rowptr[i + 1] || B->colidx[q] < A->colidx[p]) {
+                sp->colidx[r] = B->colidx[q];
+                sp->data[r++] = B->data[q++];
+            } else {
+                sp->colidx[r] = A->colidx[p];
+                sp->data[r++] = A->data[p++] + B->data[q++];
+            }
+        }
+        sp->rowptr[i + 1] = r;
+    }
+    sp->NZ = r;
+    *O = sp;
+}
+
 /*
  * Create a random sparse matrix
  *
@@ -190,46 +355,49 @@ void random_matrix(int m, int n, double frac, COO *sparse)
 
 /*
  * Read a sparse matrix from a file.
+ * Returns 0 on success, or 1 (with a message on stderr, and nothing left
+ * allocated) if the file cannot be opened or is malformed or truncated.
  *
  * file - The filename to read
  * sparse - The newly read sparse matrix (allocated here)
  */
-void read_sparse(const char *file, COO *sparse)
+int try_read_sparse(const char *file, COO *sparse)
 {
-    COO sp;
+    COO sp = NULL;
     int i, j, k, m, n, NZ;
     double val;
     int c;
-    FILE *f = fopen(file, "r");
+    struct instrument_timer timer;
+    FILE *f;
+    instrument_start(&timer, PHASE_READ);
+    f = fopen(file, "r");
     if (!f) {
         fprintf(stderr, "Unable to open %s for reading.\n", file);
-        exit(1);
+        goto fail;
     }
     c = fscanf(f, "%d %d %d\n", &m, &n, &NZ);
     if (c != 3) {
         fprintf(stderr, "File format incorrect on line 1, expecting 3 integers, got %d\n", c);
-        fclose(f);
-        exit(1);
+        goto fail;
+    }
+    if (m < 0 || n < 0 || NZ < 0) {
+        fprintf(stderr, "Negative size (%d x %d, %d nonzeros)\n", m, n, NZ);
+        goto fail;
     }
     if (NZ > (uint64_t)m*n) {
         fprintf(stderr, "More nonzeros (%d) than matrix entries (%d x %d)!\n", NZ, m, n);
-        fclose(f);
-        exit(1);
+        goto fail;
     }
     alloc_sparse(m, n, NZ, &sp);
     k = 0;
     while ((c = fscanf(f, "%d %d %lg\n", &i, &j, &val)) == 3) {
         if (k >= NZ) {
             fprintf(stderr, "File has nonzero lines than expected (%d)\n", NZ);
-            fclose(f);
-            free_sparse(&sp);
-            exit(1);
+            goto fail;
         }
-        if (i >= m || j >= n) {
+        if (i < 0 || j < 0 || i >= m || j >= n) {
             fprintf(stderr, "Entry on line %d incorrect, index (%d, %d) out of bounds for %d x %d matrix\n", k + 2, i, j, m, n);
-            fclose(f);
-            free_sparse(&sp);
-            exit(1);
+            goto fail;
         }
         sp->coords[k].i = i;
         sp->coords[k].j = j;
@@ -240,27 +408,76 @@ void read_sparse(const char *file, COO *sparse)
     if (k != NZ) {
         fprintf(stderr, "File has fewer lines (%d) than expected (%d)\n",
                 k, NZ);
-        fclose(f);
-        free_sparse(&sp);
-        exit(1);
+        goto fail;
     }
     *sparse = sp;
+    instrument_count(PHASE_READ, COUNT_BYTES_READ, ftell(f));
+    instrument_count(PHASE_READ, COUNT_NNZ_IN, NZ);
     fclose(f);
+    instrument_stop(&timer);
+    return 0;
+
+fail:
+    if (f) {
+        fclose(f);
+    }
+    free_sparse(&sp);
+    instrument_stop(&timer);
+    *sparse = NULL;
+    return 1;
+}
+
+/*
+ * Read a sparse matrix from a file, exiting on any error.
+ *
+ * file - The filename to read
+ * sparse - The newly read sparse matrix (allocated here)
+ */
+void read_sparse(const char *file, COO *sparse)
+{
+    if (try_read_sparse(file, sparse)) {
+        exit(1);
+    }
 }
 
 /*
  * Write a sparse matrix to a file.
  *
- * f - The file handle.
+ * f - The file handle (flushed here, so only closing it can still fail).
  * sp - The sparse matrix to write.
+ *
+ * Returns 0 on success, or 1 with a message on stderr if writing failed
+ * (a full disk, say).
  */
-void write_sparse(FILE *f, COO sp)
+int try_write_sparse(FILE *f, COO sp)
 {
-    int i;
+    int i, failed;
+    struct instrument_timer timer;
+    long start = ftell(f);
+    instrument_start(&timer, PHASE_WRITE);
     fprintf(f, "%d %d %d\n", sp->m, sp->n, sp->NZ);
-    for (i = 0; i < sp->NZ; i++) {
+    for (i = 0; i < sp->NZ && !ferror(f); i++) {
         fprintf(f, "%d %d %.15g\n", sp->coords[i].i, sp->coords[i].j, sp->data[i]);
     }
+    failed = fflush(f) || ferror(f);
+    if (failed) {
+        fprintf(stderr, "Could not write the matrix to the output file\n");
+    } else {
+        instrument_count(PHASE_WRITE, COUNT_BYTES_WRITTEN, ftell(f) - start);
+        instrument_count(PHASE_WRITE, COUNT_NNZ_OUT, sp->NZ);
+    }
+    instrument_stop(&timer);
+    return failed;
+}
+
+/*
+ * Write a sparse matrix to a file, exiting on any error.
+ */
+void write_sparse(FILE *f, COO sp)
+{
+    if (try_write_sparse(f, sp)) {
+        exit(1);
+    }
 }
 
 /*
@@ -273,74 +490,215 @@ void print_sparse(COO sp)
     write_sparse(stdout, sp);
 }
 
-void read_sparse_binary(const char *file, COO *sparse)
+/*
+ * Read a sparse matrix from a binary file (m, n, NZ, then the coordinates
+ * and the values), as try_read_sparse.
+ */
+int try_read_sparse_binary(const char *file, COO *sparse)
 {
-    COO sp;
+    COO sp = NULL;
     int m, n, NZ;
     size_t nread;
-    FILE *f = fopen(file, "r");
+    struct instrument_timer timer;
+    FILE *f;
+    instrument_start(&timer, PHASE_READ);
+    f = fopen(file, "r");
     if (!f) {
         fprintf(stderr, "Unable to open %s for reading.\n", file);
-        exit(1);
+        goto fail;
     }
     nread = fread(&m, sizeof(m), 1, f);
     if (nread != 1) {
       fprintf(stderr, "Did not read rows from file\n");
-      exit(1);
+      goto fail;
     }
     nread = fread(&n, sizeof(n), 1, f);
     if (nread != 1) {
       fprintf(stderr, "Did not read columns from file\n");
-      exit(1);
+      goto fail;
     }
     nread = fread(&NZ, sizeof(NZ), 1, f);
     if (nread != 1) {
       fprintf(stderr, "Did not read number of nonzeros from file\n");
-      exit(1);
+      goto fail;
+    }
+    if (m < 0 || n < 0 || NZ < 0 || NZ > (uint64_t)m*n) {
+      fprintf(stderr, "Invalid size in file (%d x %d, %d nonzeros)\n", m, n, NZ);
+      goto fail;
     }
     alloc_sparse(m, n, NZ, &sp);
     nread = fread(sp->coords, sizeof(*sp->coords), NZ, f);
     if (nread != NZ) {
       fprintf(stderr, "Did not read nonzero locations from file\n");
-      exit(1);
+      goto fail;
     }
     nread = fread(sp->data, sizeof(*sp->data), NZ, f);
     if (nread != NZ) {
       fprintf(stderr, "Did not read nonzero values from file\n");
-      exit(1);
+      goto fail;
+    }
+    for (int k = 0; k < NZ; k++) {
+      if (sp->coords[k].i < 0 || sp->coords[k].j < 0 || sp->coords[k].i >= m || sp->coords[k].j >= n) {
+        fprintf(stderr, "Entry %d incorrect, index (%d, %d) out of bounds for %d x %d matrix\n",
+                k, sp->coords[k].i, sp->coords[k].j, m, n);
+        goto fail;
+      }
     }
     *sparse = sp;
+    instrument_count(PHASE_READ, COUNT_BYTES_READ, 3*sizeof(int) + NZ*(sizeof(struct coord) + sizeof(double)));
+    instrument_count(PHASE_READ, COUNT_NNZ_IN, NZ);
     fclose(f);
+    instrument_stop(&timer);
+    return 0;
+
+fail:
+    if (f) {
+      fclose(f);
+    }
+    free_sparse(&sp);
+    instrument_stop(&timer);
+    *sparse = NULL;
+    return 1;
 }
 
-void write_sparse_binary(FILE *f, COO sp)
+void read_sparse_binary(const char *file, COO *sparse)
+{
+    if (try_read_sparse_binary(file, sparse)) {
+        exit(1);
+    }
+}
+
+/*
+ * Write a sparse matrix to a binary file, as try_write_sparse.
+ */
+int try_write_sparse_binary(FILE *f, COO sp)
 {
   size_t nwrite;
+  struct instrument_timer timer;
+  instrument_start(&timer, PHASE_WRITE);
   nwrite = fwrite(&(sp->m), sizeof(sp->m), 1, f);
   if (nwrite != 1) {
     fprintf(stderr, "Could not write rows to output file\n");
-    exit(1);
+    goto fail;
   }
 
   nwrite = fwrite(&(sp->n), sizeof(sp->n), 1, f);
   if (nwrite != 1) {
     fprintf(stderr, "Could not write columns to output file\n");
-    exit(1);
+    goto fail;
   }
 
   nwrite = fwrite(&(sp->NZ), sizeof(sp->NZ), 1, f);
   if (nwrite != 1) {
     fprintf(stderr, "Could not write number of nonzeros to output file\n");
-    exit(1);
+    goto fail;
   }
   nwrite = fwrite(sp->coords, sizeof(*sp->coords), sp->NZ, f);
   if (nwrite != sp->NZ) {
     fprintf(stderr, "Could not write nonzero locations to output file\n");
-    exit(1);
+    goto fail;
   }
   nwrite = fwrite(sp->data, sizeof(*sp->data), sp->NZ, f);
   if (nwrite != sp->NZ) {
     fprintf(stderr, "Could not write nonzero values to output file\n");
+    goto fail;
+  }
+  if (fflush(f) || ferror(f)) {
+    fprintf(stderr, "Could not write the matrix to the output file\n");
+    goto fail;
+  }
+  instrument_count(PHASE_WRITE, COUNT_BYTES_WRITTEN, 3*sizeof(int) + sp->NZ*(sizeof(struct coord) + sizeof(double)));
+  instrument_count(PHASE_WRITE, COUNT_NNZ_OUT, sp->NZ);
+  instrument_stop(&timer);
+  return 0;
+
+fail:
+  instrument_stop(&timer);
+  return 1;
+}
+
+void write_sparse_binary(FILE *f, COO sp)
+{
+  if (try_write_sparse_binary(f, sp)) {
     exit(1);
   }
 }
+
+static void row_writer_check(const struct row_writer *w)
+{
+    if (ferror(w->f)) {
+        fprintf(stderr, "Could not write the matrix to the output file\n");
+        exit(1);
+    }
+}
+
+/*
+ * Write a CSR matrix while it is being computed, its rows in order a block
+ * at a time, as the same bytes as write_sparse (binary 0) or
+ * write_sparse_binary (binary 1) of the matrix converted to COO.
+ * row_writer_begin writes the header, so the row pointers must be final;
+ * row_writer_rows writes the rows up to (not including) rows, which must be
+ * finished; row_writer_end writes what is left and flushes.  The binary
+ * format has all the values after all the coordinates, so only the
+ * coordinates go out with the rows and the values at the end.
+ * Exits on any error, as write_sparse.
+ */
+void row_writer_begin(struct row_writer *w, FILE *f, int binary, const CSR csr)
+{
+    struct instrument_timer timer;
+    instrument_start(&timer, PHASE_WRITE);
+    w->f = f;
+    w->binary = binary;
+    w->csr = csr;
+    w->rows = 0;
+    w->start = ftell(f);
+    if (binary) {
+        fwrite(&csr->m, sizeof(csr->m), 1, f);
+        fwrite(&csr->n, sizeof(csr->n), 1, f);
+        fwrite(&csr->NZ, sizeof(csr->NZ), 1, f);
+    } else {
+        fprintf(f, "%d %d %d\n", csr->m, csr->n, csr->NZ);
+    }
+    instrument_stop(&timer);
+    row_writer_check(w);
+}
+
+void row_writer_rows(struct row_writer *w, int rows)
+{
+    int i, p;
+    const CSR csr = w->csr;
+    struct instrument_timer timer;
+    instrument_start(&timer, PHASE_WRITE);
+    for (i = w->rows; i < rows && !ferror(w->f); i++) {
+        for (p = csr->rowptr[i]; p < csr->rowptr[i + 1]; p++) {
+            if (w->binary) {
+                struct coord c = {i, csr->colidx[p]};
+                fwrite(&c, sizeof(c), 1, w->f);
+            } else {
+                fprintf(w->f, "%d %d %.15g\n", i, csr->colidx[p], csr->data[p]);
+            }
+        }
+    }
+    w->rows = rows;
+    instrument_stop(&timer);
+    row_writer_check(w);
+}
+
+void row_writer_end(struct row_writer *w)
+{
+    const CSR csr = w->csr;
+    struct instrument_timer timer;
+    instrument_start(&timer, PHASE_WRITE);
+    if (w->binary) {
+        fwrite(csr->data, sizeof(*csr->data), csr->NZ, w->f);
+    }
+    if (fflush(w->f) || ferror(w->f)) {
+        fprintf(stderr, "Could not write the matrix to the output file\n");
+        exit(1);
+    }
+    instrument_count(PHASE_WRITE, COUNT_BYTES_WRITTEN, w->binary
+                     ? 3*sizeof(int) + csr->NZ*(sizeof(struct coord) + sizeof(double))
+                     : (double)(ftell(w->f) - w->start));
+    instrument_count(PHASE_WRITE, COUNT_NNZ_OUT, csr->NZ);
+    instrument_stop(&timer);
+}
@@ -15,6 +15,17 @@ struct _p_COO {
 
 typedef struct _p_COO *COO;
 
+/* Compressed sparse row storage: the column indices and values of row i
+ * live in colidx/data[rowptr[i] .. rowptr[i+1]), with columns sorted. */
+struct _p_CSR {
+    int m, n, NZ;
+    int *rowptr;
+    int *colidx;
+    double *data;
+};
+
+typedef struct _p_CSR *CSR;
+
 void alloc_sparse(int, int, int, COO*);
 void realloc_sparse(int, COO*);
 void free_sparse(COO*);
@@ -25,10 +36,32 @@ void zero_dense(int, int, double *);
 void convert_sparse_to_dense(const COO, double **);
 void convert_dense_to_sparse(const double *, int, int, COO *);
 
+void alloc_csr(int, int, int, CSR*);
+void free_csr(CSR*);
+void convert_sparse_to_csr(const COO, CSR *);
+void convert_csr_to_sparse(const CSR, COO *);
+void add_csr(const CSR, const CSR, CSR *);
+
 void read_sparse(const char *, COO *);
 void write_sparse(FILE *, COO);
 void read_sparse_binary(const char *, COO *);
 void write_sparse_binary(FILE *, COO);
+/* The readers and writers returning 1 on error (reported on stderr) instead of exiting. */
+int try_read_sparse(const char *, COO *);
+int try_read_sparse_binary(const char *, COO *);
+int try_write_sparse(FILE *, COO);
+int try_write_sparse_binary(FILE *, COO);
+/* Writing a CSR matrix a block of rows at a time as they are finished, see utils.c. */
+struct row_writer {
+    FILE *f;
+    int binary;
+    CSR csr;
+    int rows;       // rows written so far
+    long start;     // position of the header
+};
+void row_writer_begin(struct row_writer *, FILE *, int, const CSR);
+void row_writer_rows(struct row_writer *, int);
+void row_writer_end(struct row_writer *);
 void print_sparse(COO);
 void random_matrix(int, int, double, COO *);
 
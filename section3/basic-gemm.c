@@ -1,3 +1,5 @@
+#include <stddef.h>
+
 /* Compute C = C + A*B
  *
  * C has rank m x n (m rows, n columns)
@@ -18,7 +20,7 @@ void basic_gemm(int m, int n, int k,
     for (j = 0; j < n; j++) {
       for (p = 0; p < k; p++) {
         for (i = 0; i < m; i++) {
-                c[j*ldc + i] = c[j*ldc + i] + a[p*lda + i] * b[j*ldb + p];
+                c[(size_t)j*ldc + i] = c[(size_t)j*ldc + i] + a[(size_t)p*lda + i] * b[(size_t)j*ldb + p];
             }
         }
     }
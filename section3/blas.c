@@ -0,0 +1,142 @@
+/* This file implements the BLAS (xgemm_) and CBLAS (cblas_xgemm)
+ * interfaces, for x = s, d, c and z, on top of xgemm_ctx.
+ *
+ * Arguments are checked as the reference BLAS does; on an illegal value a
+ * message naming the offending parameter is printed and nothing is
+ * computed.  Row major CBLAS calls are computed as the column major
+ * product C^T = op(B)^T op(A)^T, which needs no copies.
+ */
+
+#include <stdio.h>
+#include <ctype.h>
+
+#include "gemm.h"
+#include "blas.h"
+
+static int max1(int x)
+{
+    return x > 1 ? x : 1;
+}
+
+static int valid_trans(char t)
+{
+    t = toupper((unsigned char)t);
+    return t == 'N' || t == 'T' || t == 'C';
+}
+
+/*
+ * Check column major dgemm arguments.
+ * Returns the (1-based, BLAS numbering) position of the first illegal
+ * argument, or 0 if they are all fine.
+ */
+static int check_arguments(char transa, char transb, int m, int n, int k,
+                           int lda, int ldb, int ldc)
+{
+    int rows_a = toupper((unsigned char)transa) == 'N' ? m : k;
+    int rows_b = toupper((unsigned char)transb) == 'N' ? k : n;
+    if (!valid_trans(transa)) {
+        return 1;
+    } else if (!valid_trans(transb)) {
+        return 2;
+    } else if (m < 0) {
+        return 3;
+    } else if (n < 0) {
+        return 4;
+    } else if (k < 0) {
+        return 5;
+    } else if (lda < max1(rows_a)) {
+        return 8;
+    } else if (ldb < max1(rows_b)) {
+        return 10;
+    } else if (ldc < max1(m)) {
+        return 13;
+    }
+    return 0;
+}
+
+/*
+ * Check the arguments of a CBLAS call and translate the transposes.
+ * Returns 0 for a column major call, 1 for a row major one (computed as the
+ * column major C^T = op(B)^T op(A)^T: the operands swap, the flags do not),
+ * and -1 (having reported it) if an argument is illegal.
+ */
+static int cblas_arguments(const char *name, enum CBLAS_ORDER order,
+                           enum CBLAS_TRANSPOSE transa, enum CBLAS_TRANSPOSE transb,
+                           int m, int n, int k, int lda, int ldb, int ldc, char *ta, char *tb)
+{
+    int info;
+    *ta = transa == CblasNoTrans ? 'N' : transa == CblasTrans ? 'T' : transa == CblasConjTrans ? 'C' : '?';
+    *tb = transb == CblasNoTrans ? 'N' : transb == CblasTrans ? 'T' : transb == CblasConjTrans ? 'C' : '?';
+    if (order == CblasColMajor) {
+        if ((info = check_arguments(*ta, *tb, m, n, k, lda, ldb, ldc))) {
+            // CBLAS numbers the arguments from the order
+            fprintf(stderr, " ** On entry to %s parameter number %d had an illegal value\n", name, info + 1);
+            return -1;
+        }
+        return 0;
+    } else if (order == CblasRowMajor) {
+        if ((info = check_arguments(*tb, *ta, n, m, k, ldb, lda, ldc))) {
+            // Map back to the row major argument positions
+            const int position[14] = {0, 3, 2, 5, 4, 6, 0, 0, 11, 0, 9, 0, 0, 14};
+            fprintf(stderr, " ** On entry to %s parameter number %d had an illegal value\n",
+                    name, position[info]);
+            return -1;
+        }
+        return 1;
+    }
+    fprintf(stderr, " ** On entry to %s parameter number 1 had an illegal value\n", name);
+    return -1;
+}
+
+/*
+ * Fortran BLAS xGEMM and CBLAS cblas_xgemm (row or column major) for one precision:
+ * C = alpha op(A) op(B) + beta C.
+ * CBLAS passes real scalars by value and complex ones by address (SCALAR reads them),
+ * and complex matrices as void pointers.
+ */
+#define GEMM_ENTRY_POINTS(x, X, T, CBLAS_SCALAR, SCALAR, CBLAS_MATRIX)                              \
+    void x##gemm_(const char *transa, const char *transb,                                          \
+                  const int *m, const int *n, const int *k,                                        \
+                  const T *alpha, const T *a, const int *lda,                                      \
+                  const T *b, const int *ldb,                                                      \
+                  const T *beta, T *c, const int *ldc)                                             \
+    {                                                                                              \
+        int info = check_arguments(*transa, *transb, *m, *n, *k, *lda, *ldb, *ldc);                \
+        if (info) {                                                                                \
+            fprintf(stderr, " ** On entry to " #X "GEMM parameter number %d had an illegal value\n", \
+                    info);                                                                         \
+            return;                                                                                \
+        }                                                                                          \
+        x##gemm_ctx(gemm_thread_context(), toupper((unsigned char)*transa),                        \
+                    toupper((unsigned char)*transb), *m, *n, *k, *alpha, a, *lda, b, *ldb,         \
+                    *beta, c, *ldc);                                                               \
+    }                                                                                              \
+                                                                                                   \
+    void cblas_##x##gemm(enum CBLAS_ORDER order,                                                   \
+                         enum CBLAS_TRANSPOSE transa, enum CBLAS_TRANSPOSE transb,                 \
+                         int m, int n, int k,                                                      \
+                         CBLAS_SCALAR alpha, const CBLAS_MATRIX *a, int lda,                       \
+                         const CBLAS_MATRIX *b, int ldb,                                           \
+                         CBLAS_SCALAR beta, CBLAS_MATRIX *c, int ldc)                              \
+    {                                                                                              \
+        char ta, tb;                                                                               \
+        switch (cblas_arguments("cblas_" #x "gemm", order, transa, transb, m, n, k,                \
+                                lda, ldb, ldc, &ta, &tb)) {                                        \
+        case 0:                                                                                    \
+            x##gemm_ctx(gemm_thread_context(), ta, tb, m, n, k, SCALAR(T, alpha),                  \
+                        (const T *)a, lda, (const T *)b, ldb, SCALAR(T, beta), (T *)c, ldc);       \
+            break;                                                                                 \
+        case 1:                                                                                    \
+            x##gemm_ctx(gemm_thread_context(), tb, ta, n, m, k, SCALAR(T, alpha),                  \
+                        (const T *)b, ldb, (const T *)a, lda, SCALAR(T, beta), (T *)c, ldc);       \
+            break;                                                                                 \
+        }                                                                                          \
+    }
+
+#define BY_VALUE(T, x) (x)
+#define BY_ADDRESS(T, x) (*(const T *)(x))
+
+GEMM_ENTRY_POINTS(d, D, double, double, BY_VALUE, double)
+GEMM_ENTRY_POINTS(s, S, float, float, BY_VALUE, float)
+GEMM_ENTRY_POINTS(c, C, float _Complex, const void *, BY_ADDRESS, void)
+GEMM_ENTRY_POINTS(z, Z, double _Complex, const void *, BY_ADDRESS, void)
@@ -0,0 +1,62 @@
+#ifndef _BLAS_H
+#define _BLAS_H
+
+/*
+ * Standard BLAS and CBLAS GEMM entry points (all four precisions), so code
+ * written against a vendor BLAS can link against this library instead.
+ * Both use the calling thread's GEMM context (see gemm.h).
+ */
+
+#ifndef CBLAS_H
+enum CBLAS_ORDER {CblasRowMajor = 101, CblasColMajor = 102};
+enum CBLAS_TRANSPOSE {CblasNoTrans = 111, CblasTrans = 112, CblasConjTrans = 113};
+#endif
+
+void dgemm_(const char *transa, const char *transb,
+            const int *m, const int *n, const int *k,
+            const double *alpha, const double *a, const int *lda,
+            const double *b, const int *ldb,
+            const double *beta, double *c, const int *ldc);
+void sgemm_(const char *transa, const char *transb,
+            const int *m, const int *n, const int *k,
+            const float *alpha, const float *a, const int *lda,
+            const float *b, const int *ldb,
+            const float *beta, float *c, const int *ldc);
+void cgemm_(const char *transa, const char *transb,
+            const int *m, const int *n, const int *k,
+            const float _Complex *alpha, const float _Complex *a, const int *lda,
+            const float _Complex *b, const int *ldb,
+            const float _Complex *beta, float _Complex *c, const int *ldc);
+void zgemm_(const char *transa, const char *transb,
+            const int *m, const int *n, const int *k,
+            const double _Complex *alpha, const double _Complex *a, const int *lda,
+            const double _Complex *b, const int *ldb,
+            const double _Complex *beta, double _Complex *c, const int *ldc);
+
+void cblas_dgemm(enum CBLAS_ORDER order,
+                 enum CBLAS_TRANSPOSE transa, enum CBLAS_TRANSPOSE transb,
+                 int m, int n, int k,
+                 double alpha, const double *a, int lda,
+                 const double *b, int ldb,
+                 double beta, double *c, int ldc);
+void cblas_sgemm(enum CBLAS_ORDER order,
+                 enum CBLAS_TRANSPOSE transa, enum CBLAS_TRANSPOSE transb,
+                 int m, int n, int k,
+                 float alpha, const float *a, int lda,
+                 const float *b, int ldb,
+                 float beta, float *c, int ldc);
+/* The complex scalars are passed by address, as in the CBLAS standard. */
+void cblas_cgemm(enum CBLAS_ORDER order,
+                 enum CBLAS_TRANSPOSE transa, enum CBLAS_TRANSPOSE transb,
+                 int m, int n, int k,
+                 const void *alpha, const void *a, int lda,
+                 const void *b, int ldb,
+                 const void *beta, void *c, int ldc);
+void cblas_zgemm(enum CBLAS_ORDER order,
+                 enum CBLAS_TRANSPOSE transa, enum CBLAS_TRANSPOSE transb,
+                 int m, int n, int k,
+                 const void *alpha, const void *a, int lda,
+                 const void *b, int ldb,
+                 const void *beta, void *c, int ldc);
+
+#endif
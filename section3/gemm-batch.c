@@ -0,0 +1,355 @@
+/* This file implements batched GEMM: C_i = C_i + A_i*B_i for many independent
+ * problems of the same (small) shape, e.g. element-local operators.
+ *
+ * Each problem is far too small for the packing in optimised-gemm.c to pay off, so
+ * common shapes get their own kernel, generated below with every dimension a
+ * compile-time constant: the compiler then fully unrolls the row loop into vector
+ * registers and keeps a whole column of C in them while it runs over k.  Other
+ * shapes up to SMALL_MAX use the same loop nest with run-time bounds, and anything
+ * larger goes through dgemm_ctx one problem at a time.  The batch itself is split
+ * across threads, one problem per iteration.  The run-time shape kernel is also
+ * the base case of recursive_gemm (gemm-recursive.c) and the thin path
+ * (gemm-skinny.c), as gemm_small, with kernels of their own for common row counts.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "gemm.h"
+#include "instrument.h"
+
+// Largest m handled by the small kernels (a column of C must fit in registers)
+#define SMALL_MAX 64
+
+// Shapes (m, n, k) with a specialised kernel: nodes per element of the common
+// hex (2^3, 3^3, 4^3) and tet (4, 10, 20, 35, 56) elements, and powers of two
+#define SPECIALISED_SHAPES(X) \
+    X(4, 4, 4)                \
+    X(8, 8, 8)                \
+    X(10, 10, 10)             \
+    X(16, 16, 16)             \
+    X(20, 20, 20)             \
+    X(27, 27, 27)             \
+    X(32, 32, 32)             \
+    X(35, 35, 35)             \
+    X(56, 56, 56)             \
+    X(64, 64, 64)
+
+// Row counts with a kernel of their own for gemm_small (n and k at run time): the
+// thin products of gemm-skinny.c and whole panels of rows
+#define FIXED_ROWS(X) \
+    X(1) X(2) X(3) X(4) X(5) X(6) X(7) X(8) \
+    X(12) X(16) X(24) X(32) X(48) X(64)
+
+// Vector length (doubles) and number of vector registers of the target
+#if defined(__AVX512F__)
+#define VLEN 8
+#define VREGS 32
+#elif defined(__AVX__)
+#define VLEN 4
+#define VREGS 16
+#else
+#define VLEN 2
+#define VREGS 16
+#endif
+
+// Most columns of C held in registers at once
+#define BLOCK_MAX 8
+
+typedef double vec_t __attribute__((vector_size(VLEN*sizeof(double))));
+
+typedef void (*small_kernel_t)(int, int, int,
+                               const double *restrict, int,
+                               const double *restrict, int,
+                               double *restrict, int);
+
+// Unaligned vector load/store
+static inline vec_t load(const double *p)
+{
+    vec_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline void store(double *p, vec_t v)
+{
+    memcpy(p, &v, sizeof(v));
+}
+
+/* C = C + A*B for one block of columns of C, held in registers throughout:
+ * each column is vectors full vectors of rows and tail single rows.
+ * With constant arguments every loop but the one over k unrolls completely. */
+static inline __attribute__((always_inline))
+void small_block(int vectors, int tail, int columns, int k,
+                 const double *restrict a, int lda,
+                 const double *restrict b, int ldb,
+                 double *restrict c, int ldc)
+{
+    vec_t acc[BLOCK_MAX][SMALL_MAX / VLEN];
+    double acc_tail[BLOCK_MAX][VLEN];
+
+    #pragma GCC unroll 8
+    for (int j = 0; j < columns; j++) {
+        #pragma GCC unroll 16
+        for (int v = 0; v < vectors; v++) {
+            acc[j][v] = load(c + j*ldc + v*VLEN);
+        }
+        #pragma GCC unroll 8
+        for (int r = 0; r < tail; r++) {
+            acc_tail[j][r] = c[j*ldc + vectors*VLEN + r];
+        }
+    }
+    for (int p = 0; p < k; p++) {
+        #pragma GCC unroll 16
+        for (int v = 0; v < vectors; v++) {
+            const vec_t a_v = load(a + p*lda + v*VLEN);
+            #pragma GCC unroll 8
+            for (int j = 0; j < columns; j++) {
+                acc[j][v] += a_v*b[j*ldb + p];
+            }
+        }
+        #pragma GCC unroll 8
+        for (int r = 0; r < tail; r++) {
+            const double a_r = a[p*lda + vectors*VLEN + r];
+            #pragma GCC unroll 8
+            for (int j = 0; j < columns; j++) {
+                acc_tail[j][r] += a_r*b[j*ldb + p];
+            }
+        }
+    }
+    #pragma GCC unroll 8
+    for (int j = 0; j < columns; j++) {
+        #pragma GCC unroll 16
+        for (int v = 0; v < vectors; v++) {
+            store(c + j*ldc + v*VLEN, acc[j][v]);
+        }
+        #pragma GCC unroll 8
+        for (int r = 0; r < tail; r++) {
+            c[j*ldc + vectors*VLEN + r] = acc_tail[j][r];
+        }
+    }
+}
+
+/* Columns of C in each block for rows of the given number of full vectors: each
+ * column's accumulators plus one broadcast of B must fit in the registers. */
+static inline int block_width(int vectors)
+{
+    const int fit = (VREGS - 1) / (vectors + 1);
+    return fit < 1 ? 1 : fit > BLOCK_MAX ? BLOCK_MAX : fit;
+}
+
+/* C = C + A*B for m <= SMALL_MAX, a block of columns at a time, the block as wide
+ * as the registers allow (each column's accumulators plus one broadcast of B).
+ * Inlined into each specialised kernel with constant m, n and k. */
+static inline __attribute__((always_inline))
+void small_gemm(int m, int n, int k,
+                const double *restrict a, int lda,
+                const double *restrict b, int ldb,
+                double *restrict c, int ldc)
+{
+    const int vectors = m / VLEN;
+    const int tail = m % VLEN;
+    const int block = block_width(vectors);
+    int j;
+
+    for (j = 0; j + block <= n; j += block) {
+        small_block(vectors, tail, block, k, a, lda, b + j*ldb, ldb, c + j*ldc, ldc);
+    }
+    if (j < n) {
+        small_block(vectors, tail, n - j, k, a, lda, b + j*ldb, ldb, c + j*ldc, ldc);
+    }
+}
+
+// Generic small kernel (run-time shape)
+static void small_any(int m, int n, int k,
+                      const double *restrict a, int lda,
+                      const double *restrict b, int ldb,
+                      double *restrict c, int ldc)
+{
+    small_gemm(m, n, k, a, lda, b, ldb, c, ldc);
+}
+
+// One kernel per specialised shape, the arguments m, n and k being ignored
+#define DEFINE_SMALL(M, N, K)                                              \
+    static void small_##M##x##N##x##K(int m, int n, int k,                 \
+                                      const double *restrict a, int lda,   \
+                                      const double *restrict b, int ldb,   \
+                                      double *restrict c, int ldc)         \
+    {                                                                      \
+        (void)m; (void)n; (void)k;                                         \
+        small_gemm(M, N, K, a, lda, b, ldb, c, ldc);                       \
+    }
+SPECIALISED_SHAPES(DEFINE_SMALL)
+
+static const struct {
+    int m, n, k;
+    small_kernel_t kernel;
+} specialised[] = {
+#define SMALL_ENTRY(M, N, K) {M, N, K, &small_##M##x##N##x##K},
+    SPECIALISED_SHAPES(SMALL_ENTRY)
+};
+
+/* small_gemm for a constant m and run-time n: the last, narrower block of columns
+ * has a constant width too, so that its accumulators also stay in registers. */
+static inline __attribute__((always_inline))
+void small_rows(int m, int n, int k,
+                const double *restrict a, int lda,
+                const double *restrict b, int ldb,
+                double *restrict c, int ldc)
+{
+    const int vectors = m / VLEN;
+    const int tail = m % VLEN;
+    const int block = block_width(vectors);
+    int j;
+
+    for (j = 0; j + block <= n; j += block) {
+        small_block(vectors, tail, block, k, a, lda, b + j*ldb, ldb, c + j*ldc, ldc);
+    }
+    switch (n - j) {
+#define LAST_BLOCK(COLUMNS)                                                           \
+    case COLUMNS:                                                                     \
+        small_block(vectors, tail, COLUMNS, k, a, lda, b + j*ldb, ldb, c + j*ldc, ldc); \
+        break;
+    LAST_BLOCK(7) LAST_BLOCK(6) LAST_BLOCK(5) LAST_BLOCK(4)
+    LAST_BLOCK(3) LAST_BLOCK(2) LAST_BLOCK(1)
+#undef LAST_BLOCK
+    }
+}
+
+// One kernel per fixed row count, the argument m being ignored
+#define DEFINE_ROWS(M)                                                     \
+    static void small_rows_##M(int m, int n, int k,                        \
+                               const double *restrict a, int lda,          \
+                               const double *restrict b, int ldb,          \
+                               double *restrict c, int ldc)                \
+    {                                                                      \
+        (void)m;                                                           \
+        small_rows(M, n, k, a, lda, b, ldb, c, ldc);                       \
+    }
+FIXED_ROWS(DEFINE_ROWS)
+
+// Kernel for each m up to SMALL_MAX (index m), the fixed one if there is one
+static const small_kernel_t rows_kernel[SMALL_MAX + 1] = {
+#define ROWS_ENTRY(M) [M] = &small_rows_##M,
+    FIXED_ROWS(ROWS_ENTRY)
+};
+
+/* The specialised kernel for shape (m, n, k), or NULL if there is none. */
+static small_kernel_t find_specialised(int m, int n, int k)
+{
+    for (size_t i = 0; i < sizeof(specialised)/sizeof(specialised[0]); i++) {
+        if (specialised[i].m == m && specialised[i].n == n && specialised[i].k == k) {
+            return specialised[i].kernel;
+        }
+    }
+    return NULL;
+}
+
+int gemm_batch_specialised(int m, int n, int k)
+{
+    return find_specialised(m, n, k) != NULL;
+}
+
+/* The kernel used for every problem in a batch of shape (m, n, k), or NULL to use dgemm_ctx. */
+static small_kernel_t batch_kernel(int m, int n, int k)
+{
+    small_kernel_t kernel = find_specialised(m, n, k);
+    if (kernel) {
+        return kernel;
+    }
+    return m <= SMALL_MAX && n <= SMALL_MAX && k <= SMALL_MAX ? &small_any : NULL;
+}
+
+/*
+ * Run a batch of count problems, in parallel; a, b and c are expressions in i
+ * selecting the matrices of problem i.  Shared by the strided and pointer-array forms.
+ */
+#define RUN_BATCH(m, n, k, count, a, lda, b, ldb, c, ldc)                       \
+    do {                                                                        \
+        small_kernel_t kernel = batch_kernel(m, n, k);                          \
+        int threads = gemm_get_num_threads();                                   \
+        struct instrument_timer timer;                                          \
+        if (kernel) {                                                           \
+            instrument_start(&timer, PHASE_KERNEL);                             \
+        }                                                                       \
+        threads = threads < count ? threads : count;                            \
+        _Pragma("omp parallel for schedule(static) num_threads(threads) if(threads > 1)") \
+        for (int i = 0; i < count; i++) {                                       \
+            if (kernel) {                                                       \
+                kernel(m, n, k, a, lda, b, ldb, c, ldc);                        \
+            } else {                                                            \
+                dgemm_ctx(gemm_thread_context(), 'N', 'N', m, n, k,             \
+                          1.0, a, lda, b, ldb, 1.0, c, ldc);                    \
+            }                                                                   \
+        }                                                                       \
+        if (kernel) {                                                           \
+            instrument_stop(&timer);                                            \
+            instrument_count(PHASE_KERNEL, COUNT_FLOPS, 2.0*m*n*k*count);       \
+        }                                                                       \
+    } while (0)
+
+/* Compute C_i = C_i + A_i*B_i for i = 0 ... count-1
+ *
+ * C_i has rank m x n (m rows, n columns) and starts at c + i*stride_c
+ * A_i has rank m x k and starts at a + i*stride_a
+ * B_i has rank k x n and starts at b + i*stride_b
+ * ldX is the leading dimension of the respective matrices.
+ *
+ * All matrices are stored in column major format, and no two C_i may overlap.
+ * A stride of 0 shares one matrix between all problems (e.g. one operator A applied
+ * to every element's B_i).
+ */
+void gemm_batch_strided(int m, int n, int k,
+                        const double *a, int lda, long stride_a,
+                        const double *b, int ldb, long stride_b,
+                        double *c, int ldc, long stride_c, int count)
+{
+    if (m <= 0 || n <= 0 || k <= 0 || count <= 0) {
+        return;
+    }
+    RUN_BATCH(m, n, k, count,
+              a + i*stride_a, lda,
+              b + i*stride_b, ldb,
+              c + i*stride_c, ldc);
+}
+
+/* Compute C_i = C_i + A_i*B_i for i = 0 ... count-1, with the matrices given by
+ * the arrays a, b and c (A_i is a[i] etc.); otherwise as gemm_batch_strided. */
+void gemm_batch(int m, int n, int k,
+                const double *const *a, int lda,
+                const double *const *b, int ldb,
+                double *const *c, int ldc, int count)
+{
+    if (m <= 0 || n <= 0 || k <= 0 || count <= 0) {
+        return;
+    }
+    RUN_BATCH(m, n, k, count,
+              a[i], lda,
+              b[i], ldb,
+              c[i], ldc);
+}
+
+/* Compute C = C + A*B straight from A and B (no packing) for m <= gemm_small_max()
+ * rows and any n and k: the base case of recursive_gemm and skinny_gemm. */
+void gemm_small(int m, int n, int k,
+                const double *a, int lda,
+                const double *b, int ldb,
+                double *c, int ldc)
+{
+    small_kernel_t kernel = rows_kernel[m];
+
+    (kernel ? kernel : &small_any)(m, n, k, a, lda, b, ldb, c, ldc);
+}
+
+int gemm_small_max(void)
+{
+    return SMALL_MAX;
+}
+
+int gemm_small_lanes(void)
+{
+    return VLEN;
+}
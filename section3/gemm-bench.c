@@ -0,0 +1,567 @@
+/* This file implements the SUITE mode of the gemm driver: a benchmark
+ * for regression gating, comparing implementations side by side over
+ * sweeps of shapes and leading dimensions.
+ *
+ * Every measurement is wall clock (CLOCK_MONOTONIC), after warmup calls,
+ * over a number of samples, and reports the min, median, mean and
+ * standard deviation of the time per call.  Problems too quick to time
+ * on their own run several times per sample (so each sample takes at
+ * least --sample seconds).  With --cold every sample is one call with
+ * A, B and C flushed from the caches first.
+ *
+ * Output is CSV (one header line) or JSON (one object per line), with
+ * GFLOP/s from the best and median times and, given --peak, the best as
+ * a percentage of that peak.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_CLFLUSH 1
+#endif
+
+#include "gemm.h"
+#include "gemm-bench.h"
+#include "instrument.h"
+#include "workspace.h"
+#include "peak.h"
+
+#define MAX_VARIANTS 16
+#define MAX_SHAPES 256
+#define MAX_PADS 8
+#define MAX_SAMPLES 1000
+
+// Leading dimension padding meaning "round up to a multiple of 4KB", the worst case for cache set aliasing
+#define PAD_PAGE -1
+
+struct shape {
+    int m, n, k;
+};
+
+struct variant {
+    char name[64];
+    char transa, transb;            // For the dgemm variants, 'N' otherwise
+    enum { BASIC, OPTIMISED, DGEMM, STRASSEN, EPILOGUE, SEPARATE_EPILOGUE } kind;
+    struct gemm_context *ctx;       // For all but basic
+    double tolerance;               // For strassen
+};
+
+struct suite {
+    struct variant variants[MAX_VARIANTS];
+    int nvariants;
+    struct shape shapes[MAX_SHAPES];
+    int nshapes;
+    int pads[MAX_PADS];
+    int npads;
+    int warmup, samples;
+    double sample_time;             // Shortest sample, in seconds
+    int cold;
+    double peak;                    // GFLOP/s, 0 if not given
+    double tolerance;               // For the strassen variant
+    int json;
+    FILE *out;
+};
+
+static double now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + 1e-9*t.tv_nsec;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* Evict count doubles at x from every cache level. */
+static void flush(const double *x, size_t count)
+{
+#ifdef HAVE_CLFLUSH
+    for (size_t i = 0; i < count; i += 8) {
+        _mm_clflush(x + i);
+    }
+    if (count) {
+        _mm_clflush(x + count - 1);
+    }
+    _mm_mfence();
+#else
+    // Without a flush instruction, stream through more than the last level cache
+    static double *sweep = NULL;
+    static size_t size = 0;
+    volatile double sink = 0;
+    (void)x;
+    (void)count;
+    if (!sweep) {
+        struct gemm_caches caches;
+        gemm_cache_sizes(&caches);
+        size = 2*(caches.l3 > 0 ? caches.l3 : 64L << 20) / sizeof(double);
+        sweep = workspace_calloc(size*sizeof(double));
+    }
+    for (size_t i = 0; i < size; i += 8) {
+        sweep[i] += 1;
+        sink += sweep[i];
+    }
+    (void)sink;
+#endif
+}
+
+static void random_fill(double *x, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        x[i] = drand48();
+    }
+}
+
+/* Leading dimension for rows rows with padding pad. */
+static int leading_dimension(int rows, int pad)
+{
+    if (pad == PAD_PAGE) {
+        return 512*(1 + (rows - 1) / 512);
+    }
+    return rows + pad;
+}
+
+static void run(const struct variant *v, const struct shape *s,
+                const double *a, int lda, const double *b, int ldb, double *c, int ldc,
+                const struct gemm_epilogue *epilogue)
+{
+    switch (v->kind) {
+    case BASIC:
+        basic_gemm(s->m, s->n, s->k, a, lda, b, ldb, c, ldc);
+        break;
+    case OPTIMISED:
+        optimised_gemm_ctx(v->ctx, s->m, s->n, s->k, a, lda, b, ldb, c, ldc);
+        break;
+    case DGEMM:
+        dgemm_ctx(v->ctx, v->transa, v->transb, s->m, s->n, s->k, 1.0, a, lda, b, ldb, 1.0, c, ldc);
+        break;
+    case STRASSEN:
+        strassen_gemm_ctx(v->ctx, v->tolerance, s->m, s->n, s->k, a, lda, b, ldb, c, ldc);
+        break;
+    case EPILOGUE:
+        dgemm_epilogue_ctx(v->ctx, 'N', 'N', s->m, s->n, s->k, 1.0, a, lda, b, ldb, 0.0, c, ldc, epilogue);
+        break;
+    case SEPARATE_EPILOGUE:
+        dgemm_ctx(v->ctx, 'N', 'N', s->m, s->n, s->k, 1.0, a, lda, b, ldb, 0.0, c, ldc);
+        gemm_epilogue_apply(epilogue, s->m, s->n, c, ldc);
+        break;
+    }
+}
+
+/*
+ * Time call(arg) the way every suite measurement is made: warmup calls,
+ * the last of which sizes the samples so that each takes at least
+ * sample_time seconds (pass 0, or no warmup, for one call per sample), then
+ * samples samples, each after prepare(arg) if prepare is not NULL.
+ * times gets the time per call of each sample.  Returns the number of
+ * calls per sample.
+ */
+int gemm_bench_time(void (*call)(void *), void (*prepare)(void *), void *arg,
+                    int warmup, int samples, double sample_time, double *times)
+{
+    int inner = 1;
+    double start, last = 0;
+
+    // Warm up (first touch, thread start up, workspace), and size the samples from the last call
+    for (int i = 0; i < warmup; i++) {
+        start = now();
+        call(arg);
+        last = now() - start;
+    }
+    if (last > 0 && last < sample_time) {
+        inner = (int)ceil(sample_time / last);
+    }
+    inner = inner < 1000000 ? inner : 1000000;
+
+    for (int sample = 0; sample < samples; sample++) {
+        if (prepare) {
+            prepare(arg);
+        }
+        start = now();
+        for (int i = 0; i < inner; i++) {
+            call(arg);
+        }
+        times[sample] = (now() - start) / inner;
+    }
+    return inner;
+}
+
+/* One call of a variant, with its operands, for gemm_bench_time. */
+struct call {
+    const struct variant *v;
+    const struct shape *s;
+    double *a, *b, *c;
+    int lda, ldb, ldc;
+    size_t size_a, size_b, size_c;
+    const struct gemm_epilogue *epilogue;
+};
+
+static void run_call(void *arg)
+{
+    const struct call *call = arg;
+    run(call->v, call->s, call->a, call->lda, call->b, call->ldb, call->c, call->ldc, call->epilogue);
+}
+
+static void flush_call(void *arg)
+{
+    const struct call *call = arg;
+    flush(call->a, call->size_a);
+    flush(call->b, call->size_b);
+    flush(call->c, call->size_c);
+}
+
+/* Time variant v on shape s with padding pad, and print one record. */
+static void measure(const struct suite *suite, const struct variant *v, const struct shape *s, int pad)
+{
+    // op(A) is m x k, so A is stored k x m if transposed (and likewise B)
+    int a_rows = v->transa == 'N' ? s->m : s->k, a_columns = v->transa == 'N' ? s->k : s->m;
+    int b_rows = v->transb == 'N' ? s->k : s->n, b_columns = v->transb == 'N' ? s->n : s->k;
+    int lda = leading_dimension(a_rows, pad);
+    int ldb = leading_dimension(b_rows, pad);
+    int ldc = leading_dimension(s->m, pad);
+    size_t size_a = (size_t)lda*a_columns, size_b = (size_t)ldb*b_columns, size_c = (size_t)ldc*s->n;
+    double *a = workspace_alloc(size_a*sizeof(double));
+    double *b = workspace_alloc(size_b*sizeof(double));
+    double *c = workspace_alloc(size_c*sizeof(double));
+    // Row and column biases and a ReLU, for the epilogue variants
+    double *bias = workspace_alloc(((size_t)s->m + s->n)*sizeof(double));
+    struct gemm_epilogue epilogue = {bias, bias + s->m, 1, 0.0, HUGE_VAL, NULL, NULL};
+    double flop = 2.0*s->m*s->n*s->k;
+    struct call call = {v, s, a, b, c, lda, ldb, ldc, size_a, size_b, size_c, &epilogue};
+    double times[MAX_SAMPLES];
+    double min, median, mean = 0, deviation = 0;
+    int inner;
+
+    random_fill(a, size_a);
+    random_fill(b, size_b);
+    random_fill(c, size_c);
+    random_fill(bias, (size_t)s->m + s->n);
+
+    // Cold samples are one call each, after flushing the operands
+    inner = gemm_bench_time(&run_call, suite->cold ? &flush_call : NULL, &call, suite->warmup,
+                            suite->samples, suite->cold ? 0 : suite->sample_time, times);
+    for (int sample = 0; sample < suite->samples; sample++) {
+        mean += times[sample];
+    }
+    mean /= suite->samples;
+    for (int sample = 0; sample < suite->samples; sample++) {
+        deviation += (times[sample] - mean)*(times[sample] - mean);
+    }
+    deviation = suite->samples > 1 ? sqrt(deviation / (suite->samples - 1)) : 0;
+    qsort(times, suite->samples, sizeof(double), compare_double);
+    min = times[0];
+    median = suite->samples % 2 ? times[suite->samples / 2]
+        : 0.5*(times[suite->samples / 2 - 1] + times[suite->samples / 2]);
+
+    if (suite->json) {
+        fprintf(suite->out, "{\"variant\": \"%s\", \"m\": %d, \"n\": %d, \"k\": %d, "
+                "\"lda\": %d, \"ldb\": %d, \"ldc\": %d, \"cache\": \"%s\", \"threads\": %d, "
+                "\"samples\": %d, \"calls_per_sample\": %d, \"min_seconds\": %.9g, "
+                "\"median_seconds\": %.9g, \"mean_seconds\": %.9g, \"stddev_seconds\": %.9g, "
+                "\"gflops_best\": %.6g, \"gflops_median\": %.6g",
+                v->name, s->m, s->n, s->k, lda, ldb, ldc, suite->cold ? "cold" : "warm",
+                gemm_get_num_threads(), suite->samples, inner, min, median, mean, deviation,
+                1e-9*flop/min, 1e-9*flop/median);
+        if (suite->peak > 0) {
+            fprintf(suite->out, ", \"percent_of_peak\": %.4g", 100*1e-9*flop/min/suite->peak);
+        }
+        fprintf(suite->out, "}\n");
+    } else {
+        fprintf(suite->out, "%s,%d,%d,%d,%d,%d,%d,%s,%d,%d,%d,%.9g,%.9g,%.9g,%.9g,%.6g,%.6g,",
+                v->name, s->m, s->n, s->k, lda, ldb, ldc, suite->cold ? "cold" : "warm",
+                gemm_get_num_threads(), suite->samples, inner, min, median, mean, deviation,
+                1e-9*flop/min, 1e-9*flop/median);
+        if (suite->peak > 0) {
+            fprintf(suite->out, "%.4g", 100*1e-9*flop/min/suite->peak);
+        }
+        fprintf(suite->out, "\n");
+    }
+    fflush(suite->out);
+
+    workspace_free(a);
+    workspace_free(b);
+    workspace_free(c);
+    workspace_free(bias);
+}
+
+static int add_shape(struct suite *suite, int m, int n, int k)
+{
+    if (m < 1 || n < 1 || k < 1) {
+        return 0;
+    }
+    if (suite->nshapes == MAX_SHAPES) {
+        fprintf(stderr, "At most %d shapes\n", MAX_SHAPES);
+        return 1;
+    }
+    suite->shapes[suite->nshapes++] = (struct shape){m, n, k};
+    return 0;
+}
+
+/*
+ * Add the shapes of one --shapes item:
+ *   MxNxK          one shape
+ *   square:A-B[:S] squares from A to B in steps of S (doubling if S is omitted)
+ *   family:S       the shape families at size S: square, tall and skinny, short and wide,
+ *                  rank-S/16 update, panel times square, and small output with deep k
+ */
+static int parse_shapes(struct suite *suite, const char *item)
+{
+    int m, n, k, low, high, step = 0, size;
+    if (sscanf(item, "square:%d-%d:%d", &low, &high, &step) >= 2) {
+        if (low < 1 || high < low || step < 0) {
+            fprintf(stderr, "Invalid square sweep '%s'\n", item);
+            return 1;
+        }
+        for (int s = low; s <= high; s = step > 0 ? s + step : 2*s) {
+            if (add_shape(suite, s, s, s)) {
+                return 1;
+            }
+        }
+        return 0;
+    }
+    if (sscanf(item, "family:%d", &size) == 1 && size >= 16) {
+        return add_shape(suite, size, size, size)
+            || add_shape(suite, 4*size, size / 4, size)
+            || add_shape(suite, size / 4, 4*size, size)
+            || add_shape(suite, size, size, size / 16)
+            || add_shape(suite, size, size / 16, size)
+            || add_shape(suite, size / 4, size / 4, 16*size);
+    }
+    if (sscanf(item, "%dx%dx%d", &m, &n, &k) == 3 && m > 0 && n > 0 && k > 0) {
+        return add_shape(suite, m, n, k);
+    }
+    fprintf(stderr, "Invalid shape '%s', expected MxNxK, square:A-B[:S] or family:S\n", item);
+    return 1;
+}
+
+/*
+ * Add one --variants item:
+ *   basic          basic_gemm
+ *   optimised      optimised_gemm with the default settings
+ *   kernel:NAME    optimised_gemm with micro-kernel NAME
+ *   prefetch       optimised_gemm with pipelined packing (see gemm_context_set_prefetch)
+ *   dgemm:XY       dgemm with op(A) = X and op(B) = Y, each N or T
+ *   strassen       strassen_gemm with the --strassen tolerance (default 1e-8)
+ *   epilogue       dgemm (beta 0) with row and column biases and a ReLU fused in
+ *   epilogue:separate  the same, the epilogue as a second pass over C
+ */
+static int parse_variant(struct suite *suite, const char *item)
+{
+    struct variant *v;
+    char x, y;
+    if (suite->nvariants == MAX_VARIANTS) {
+        fprintf(stderr, "At most %d variants\n", MAX_VARIANTS);
+        return 1;
+    }
+    v = &suite->variants[suite->nvariants];
+    memset(v, 0, sizeof(*v));
+    snprintf(v->name, sizeof(v->name), "%s", item);
+    v->transa = v->transb = 'N';
+    v->kind = OPTIMISED;
+    if (!strcmp(item, "basic")) {
+        v->kind = BASIC;
+    } else if (!strcmp(item, "optimised")) {
+        v->ctx = gemm_context_create();
+    } else if (!strncmp(item, "kernel:", 7)) {
+        int count;
+        const struct gemm_kernel *kernels = gemm_kernels(&count);
+        v->ctx = gemm_context_create();
+        for (int i = 0; i < count; i++) {
+            if (!strcmp(kernels[i].name, item + 7)) {
+                if (!kernels[i].supported()) {
+                    fprintf(stderr, "Kernel %s is not supported on this CPU\n", item + 7);
+                    return 1;
+                }
+                gemm_context_set_kernel(v->ctx, &kernels[i]);
+                break;
+            }
+            if (i == count - 1) {
+                fprintf(stderr, "Unknown kernel '%s'\n", item + 7);
+                return 1;
+            }
+        }
+    } else if (!strcmp(item, "prefetch")) {
+        v->ctx = gemm_context_create();
+        gemm_context_set_prefetch(v->ctx, 1);
+    } else if (sscanf(item, "dgemm:%c%c", &x, &y) == 2 && strchr("NT", x) && strchr("NT", y)) {
+        v->kind = DGEMM;
+        v->transa = x;
+        v->transb = y;
+        v->ctx = gemm_context_create();
+    } else if (!strcmp(item, "strassen")) {
+        v->kind = STRASSEN;
+        v->tolerance = suite->tolerance;
+        v->ctx = gemm_context_create();
+    } else if (!strcmp(item, "epilogue") || !strcmp(item, "epilogue:separate")) {
+        v->kind = item[8] ? SEPARATE_EPILOGUE : EPILOGUE;
+        v->ctx = gemm_context_create();
+    } else {
+        fprintf(stderr, "Unknown variant '%s', expected basic, optimised, kernel:NAME, prefetch,"
+                " dgemm:XY, strassen or epilogue[:separate]\n", item);
+        return 1;
+    }
+    suite->nvariants++;
+    return 0;
+}
+
+/* Call parse on every comma separated item of list. */
+static int parse_list(struct suite *suite, const char *list, int (*parse)(struct suite *, const char *))
+{
+    char item[64];
+    while (*list) {
+        size_t length = strcspn(list, ",");
+        if (length >= sizeof(item)) {
+            fprintf(stderr, "Item too long in '%s'\n", list);
+            return 1;
+        }
+        memcpy(item, list, length);
+        item[length] = '\0';
+        if (length && parse(suite, item)) {
+            return 1;
+        }
+        list += length + (list[length] == ',');
+    }
+    return 0;
+}
+
+static int parse_pad(struct suite *suite, const char *item)
+{
+    if (suite->npads == MAX_PADS) {
+        fprintf(stderr, "At most %d paddings\n", MAX_PADS);
+        return 1;
+    }
+    if (!strcmp(item, "page")) {
+        suite->pads[suite->npads++] = PAD_PAGE;
+    } else if (atoi(item) >= 0) {
+        suite->pads[suite->npads++] = atoi(item);
+    } else {
+        fprintf(stderr, "Invalid padding '%s'\n", item);
+        return 1;
+    }
+    return 0;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: gemm [flags] SUITE [options]\n");
+    fprintf(stderr, "  --shapes=LIST     MxNxK, square:A-B[:S] (doubling without S) or family:S (square,\n");
+    fprintf(stderr, "                    tall, wide, low rank, panel and deep-k shapes around S); default 1000x1000x1000\n");
+    fprintf(stderr, "  --variants=LIST   basic, optimised, kernel:NAME, prefetch, dgemm:XY (X, Y in N, T) or\n");
+    fprintf(stderr, "                    strassen, epilogue (bias and ReLU fused) or epilogue:separate (as a\n");
+    fprintf(stderr, "                    second pass); default basic,optimised\n");
+    fprintf(stderr, "  --pad=LIST        leading dimension padding (ld = rows + P), or page for a multiple of 4KB;\n");
+    fprintf(stderr, "                    default 0\n");
+    fprintf(stderr, "  --warmup=N        untimed calls first (default 2)\n");
+    fprintf(stderr, "  --samples=N       timed samples (default 10, at most %d)\n", MAX_SAMPLES);
+    fprintf(stderr, "  --sample=SECONDS  shortest sample, calls are repeated within one to reach it (default 0.001)\n");
+    fprintf(stderr, "  --cold            flush A, B and C from the caches before every (single call) sample\n");
+    fprintf(stderr, "  --peak=GFLOPS     report the best rate as a percentage of this peak, or of the measured\n");
+    fprintf(stderr, "                    FMA peak for the number of threads with --peak=auto (see peak.h)\n");
+    fprintf(stderr, "  --strassen=TOL    error tolerance of the strassen variant (default 1e-8)\n");
+    fprintf(stderr, "  --format=csv|json CSV with a header line (default), or one JSON object per line\n");
+    fprintf(stderr, "  --output=FILE     write there instead of stdout\n");
+}
+
+/*
+ * Run the benchmark suite: argv holds the options after SUITE.
+ * Returns the process exit status.
+ */
+int gemm_bench_suite(int argc, char **argv)
+{
+    static struct suite suite;
+    const char *variants = "basic,optimised";
+    int status = 0;
+
+    suite.warmup = 2;
+    suite.samples = 10;
+    suite.sample_time = 1e-3;
+    suite.tolerance = 1e-8;
+    suite.out = stdout;
+    for (int i = 0; i < argc; i++) {
+        const char *arg = argv[i];
+        if (!strcmp(arg, "--help")) {
+            usage();
+            return 0;
+        } else if (!strncmp(arg, "--shapes=", 9)) {
+            status = parse_list(&suite, arg + 9, &parse_shapes);
+        } else if (!strncmp(arg, "--variants=", 11)) {
+            variants = arg + 11;
+        } else if (!strncmp(arg, "--pad=", 6)) {
+            status = parse_list(&suite, arg + 6, &parse_pad);
+        } else if (!strncmp(arg, "--warmup=", 9)) {
+            suite.warmup = atoi(arg + 9);
+            status = suite.warmup < 0;
+        } else if (!strncmp(arg, "--samples=", 10)) {
+            suite.samples = atoi(arg + 10);
+            status = suite.samples < 1 || suite.samples > MAX_SAMPLES;
+        } else if (!strncmp(arg, "--sample=", 9)) {
+            suite.sample_time = atof(arg + 9);
+        } else if (!strcmp(arg, "--cold")) {
+            suite.cold = 1;
+        } else if (!strcmp(arg, "--peak=auto")) {
+            struct peak peak;
+            peak_load(&peak);
+            suite.peak = peak_gflops(&peak, gemm_get_num_threads());
+        } else if (!strncmp(arg, "--peak=", 7)) {
+            suite.peak = atof(arg + 7);
+        } else if (!strncmp(arg, "--strassen=", 11)) {
+            suite.tolerance = atof(arg + 11);
+        } else if (!strcmp(arg, "--format=csv") || !strcmp(arg, "--format=json")) {
+            suite.json = !strcmp(arg, "--format=json");
+        } else if (!strncmp(arg, "--output=", 9)) {
+            if (!(suite.out = fopen(arg + 9, "w"))) {
+                fprintf(stderr, "Unable to open %s for writing\n", arg + 9);
+                return 1;
+            }
+        } else {
+            fprintf(stderr, "Unrecognised option '%s'\n", arg);
+            status = 1;
+        }
+        if (status) {
+            usage();
+            return 1;
+        }
+    }
+    if (!suite.nshapes) {
+        add_shape(&suite, 1000, 1000, 1000);
+    }
+    // After the options, so that --strassen applies wherever it comes
+    if (parse_list(&suite, variants, &parse_variant)) {
+        usage();
+        return 1;
+    }
+    if (!suite.npads) {
+        suite.pads[suite.npads++] = 0;
+    }
+    instrument_field("samples", suite.samples);
+    instrument_field("warmup", suite.warmup);
+    instrument_label("cache", suite.cold ? "cold" : "warm");
+
+    if (!suite.json) {
+        fprintf(suite.out, "variant,m,n,k,lda,ldb,ldc,cache,threads,samples,calls_per_sample,"
+                "min_seconds,median_seconds,mean_seconds,stddev_seconds,gflops_best,gflops_median,"
+                "percent_of_peak\n");
+    }
+    // Variants innermost, so the ones compared run back to back under the same conditions
+    for (int s = 0; s < suite.nshapes; s++) {
+        for (int p = 0; p < suite.npads; p++) {
+            for (int v = 0; v < suite.nvariants; v++) {
+                measure(&suite, &suite.variants[v], &suite.shapes[s], suite.pads[p]);
+            }
+        }
+    }
+
+    for (int v = 0; v < suite.nvariants; v++) {
+        gemm_context_destroy(suite.variants[v].ctx);
+    }
+    if (suite.out != stdout) {
+        fclose(suite.out);
+    }
+    return 0;
+}
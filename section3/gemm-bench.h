@@ -0,0 +1,14 @@
+#ifndef _GEMM_BENCH_H
+#define _GEMM_BENCH_H
+
+/*
+ * The benchmark suite behind "gemm SUITE [options]": warmed up, repeated
+ * timings of several gemm variants over sweeps of shapes and leading
+ * dimensions, as CSV or JSON.  See gemm-bench.c for the options.
+ */
+
+int gemm_bench_suite(int argc, char **argv);
+/* The suite's timing loop on its own (also used by the tuner, see gemm-tune.c). */
+int gemm_bench_time(void (*)(void *), void (*)(void *), void *, int, int, double, double *);
+
+#endif
@@ -0,0 +1,159 @@
+/* Type-generic micro-kernel, included (without include guard) once per element type by
+ * optimised-gemm.c, with these defined:
+ *   T           the element type (float, double, float _Complex or double _Complex)
+ *   R           its real type
+ *   IS_COMPLEX  1 for the complex types, 0 otherwise
+ *   NAME(x)     x with the type's BLAS prefix (s, d, c or z)
+ *
+ * The kernel works on the reals of the packed panels, in vectors of the build target's width
+ * (GCC vector extensions, so ARCH decides the instruction set; the double kernels in
+ * gemm-kernels.c are the ones chosen at run time from CPUID).  The tile is two vectors of
+ * reals tall and as wide as the registers allow, with every accumulator a named register.
+ * A complex tile (interleaved real and imaginary parts) keeps two accumulators per vector:
+ * the products with the real and with the imaginary part of B, combined into complex
+ * products only when C is updated, so the loop over k is all plain multiply-adds.
+ * A struct gemm_update is applied entry by entry as the tile is stored (real types only:
+ * its fields are real, and the engine applies complex beta to C before the product).
+ */
+
+// Vector width (bytes) and number of vector registers of the build target
+#ifndef GEMM_VECTOR_BYTES
+#if defined(__AVX512F__)
+#define GEMM_VECTOR_BYTES 64
+#define GEMM_VECTOR_REGISTERS 32
+#elif defined(__AVX__)
+#define GEMM_VECTOR_BYTES 32
+#define GEMM_VECTOR_REGISTERS 16
+#else
+#define GEMM_VECTOR_BYTES 16
+#define GEMM_VECTOR_REGISTERS 16
+#endif
+#endif
+
+typedef R NAME(vector) __attribute__((vector_size(GEMM_VECTOR_BYTES)));
+
+enum {
+    // Reals in a vector
+    NAME(lanes) = GEMM_VECTOR_BYTES / sizeof(R),
+    // Tile: two vectors of reals by (on 32 registers) 12 real or 6 complex columns, 24 accumulators
+    NAME(vector_m_r) = 2*NAME(lanes) / (1 + IS_COMPLEX),
+    NAME(vector_n_r) = (GEMM_VECTOR_REGISTERS == 32 ? 12 : 6) / (1 + IS_COMPLEX),
+};
+
+static inline NAME(vector) NAME(load)(const R *p)
+{
+    NAME(vector) v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline void NAME(store)(R *p, NAME(vector) v)
+{
+    memcpy(p, &v, sizeof(v));
+}
+
+#if !IS_COMPLEX
+/* Entry (i, j) of a tile with accumulator acc, updated as struct gemm_update says
+ * (c is not read if beta is zero). */
+static inline R NAME(update_entry)(const R *c, R acc, int i, int j, const struct gemm_update *update)
+{
+    R x = (update->beta == 0.0 ? acc : (update->beta == 1.0 ? *c : (R)update->beta * *c) + acc);
+    const R bias = update->column_bias ? update->column_bias[j] : 0.0;
+    if (update->row_bias) {
+        x += (R)update->row_bias[i] + bias;
+    } else if (update->column_bias) {
+        x += bias;
+    }
+    if (update->clamp) {
+        // NaN stays NaN (neither comparison holds)
+        x = x < update->lower ? (R)update->lower : x > update->upper ? (R)update->upper : x;
+    }
+    return x;
+}
+#endif
+
+/* C += A B for one vector_m_r x vector_n_r tile (updated with update if not NULL); a and b are
+ * packed as by pack_a and pack_b. */
+static void NAME(vector_kernel)(int k, const T *a, const T *b, T *c, int ldc, const struct gemm_update *update)
+{
+    enum { M_R = NAME(vector_m_r), N_R = NAME(vector_n_r) };
+    const R *a_r = (const R *)a;
+    const R *b_r = (const R *)b;
+    // acc[j][v]: vector v of column j (times the real part of B for complex types)
+    NAME(vector) acc[N_R][2] = {{{0}}};
+#if IS_COMPLEX
+    // Vector v of column j times the imaginary part of B
+    NAME(vector) acc_i[N_R][2] = {{{0}}};
+#endif
+
+    for (int p = 0; p < k; p++) {
+        const NAME(vector) a_0 = NAME(load)(a_r + (1 + IS_COMPLEX)*M_R*p);
+        const NAME(vector) a_1 = NAME(load)(a_r + (1 + IS_COMPLEX)*M_R*p + NAME(lanes));
+        #pragma GCC unroll 12
+        for (int j = 0; j < N_R; j++) {
+#if IS_COMPLEX
+            const R b_re = b_r[2*(N_R*p + j)], b_im = b_r[2*(N_R*p + j) + 1];
+            acc[j][0] += a_0*b_re;
+            acc[j][1] += a_1*b_re;
+            acc_i[j][0] += a_0*b_im;
+            acc_i[j][1] += a_1*b_im;
+#else
+            const R b_pj = b_r[N_R*p + j];
+            acc[j][0] += a_0*b_pj;
+            acc[j][1] += a_1*b_pj;
+#endif
+        }
+    }
+
+    #pragma GCC unroll 12
+    for (int j = 0; j < N_R; j++) {
+        R *c_r = (R *)(c + (size_t)j*ldc);
+#if IS_COMPLEX
+        // (a_re + i a_im)(b_re + i b_im): the lanes hold a_re b_re, a_im b_re (acc) and a_re b_im, a_im b_im (acc_i)
+        R re[2*NAME(lanes)], im[2*NAME(lanes)];
+        NAME(store)(re, acc[j][0]);
+        NAME(store)(re + NAME(lanes), acc[j][1]);
+        NAME(store)(im, acc_i[j][0]);
+        NAME(store)(im + NAME(lanes), acc_i[j][1]);
+        (void)update;
+        for (int i = 0; i < M_R; i++) {
+            c_r[2*i] += re[2*i] - im[2*i + 1];
+            c_r[2*i + 1] += re[2*i + 1] + im[2*i];
+        }
+#else
+        if (update) {
+            R x[2*NAME(lanes)];
+            NAME(store)(x, acc[j][0]);
+            NAME(store)(x + NAME(lanes), acc[j][1]);
+            for (int i = 0; i < M_R; i++) {
+                c_r[i] = NAME(update_entry)(c_r + i, x[i], i, j, update);
+            }
+            continue;
+        }
+        NAME(store)(c_r, NAME(load)(c_r) + acc[j][0]);
+        NAME(store)(c_r + NAME(lanes), NAME(load)(c_r + NAME(lanes)) + acc[j][1]);
+#endif
+    }
+}
+
+/* The same for the top left rows x columns of a tile: the whole tile is computed into a
+ * local one and only its part inside C added, so C is never touched outside it. */
+static void NAME(vector_edge)(int k, int rows, int columns, const T *a, const T *b, T *c, int ldc,
+                              const struct gemm_update *update)
+{
+    enum { M_R = NAME(vector_m_r), N_R = NAME(vector_n_r) };
+    T tile[M_R*N_R];
+    memset(tile, 0, sizeof(tile));
+    NAME(vector_kernel)(k, a, b, tile, M_R, NULL);
+    for (int j = 0; j < columns; j++) {
+        for (int i = 0; i < rows; i++) {
+#if IS_COMPLEX
+            (void)update;
+            c[(size_t)j*ldc + i] += tile[j*M_R + i];
+#else
+            T *cij = c + (size_t)j*ldc + i;
+            *cij = update ? NAME(update_entry)(cij, tile[j*M_R + i], i, j, update) : *cij + tile[j*M_R + i];
+#endif
+        }
+    }
+}
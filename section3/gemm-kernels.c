@@ -0,0 +1,542 @@
+/* This file implements the micro-kernels used by optimised_gemm, and the
+ * run time selection between them.
+ *
+ * Each kernel keeps its whole m_r x n_r tile of C in registers for the
+ * full depth of the packed panels and only reads and writes C once at the
+ * end.  The vector kernels are compiled with target attributes, so they
+ * are all present whatever -march the library is built with; the best
+ * one the running CPU supports (according to CPUID) is chosen on first
+ * use, unless the tuning profile (see gemm-tune.c) names another one.
+ * GEMM_KERNEL=name in the environment overrides either choice.
+ *
+ * Every kernel has an edge variant for the partial tiles at the bottom
+ * and right of C.  It only computes the columns that exist and only the
+ * vectors that hold rows that exist, and writes the last vector with a
+ * masked (or partial) store, so C is never touched outside the tile.
+ * Rows of the packed A beyond the edge are zero (see pack_a); columns of
+ * the packed B beyond the edge are never read.
+ *
+ * Given a struct gemm_update, the kernels apply beta, the biases and the
+ * clamp to the accumulators as they store them (in vectors for AVX2 and
+ * AVX-512, entry by entry otherwise), so the tile is still stored once.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define GEMM_X86 1
+#include <immintrin.h>
+#endif
+
+#include "gemm.h"
+
+/* Entry (i, j) of a tile with accumulator acc, updated as struct gemm_update says
+ * (c is not read if beta is zero). */
+static inline double update_entry(const double *c, double acc, int i, int j,
+                                  const struct gemm_update *update)
+{
+    double x = (update->beta == 0.0 ? acc : (update->beta == 1.0 ? *c : update->beta * *c) + acc);
+    const double bias = update->column_bias ? update->column_bias[j] : 0.0;
+    if (update->row_bias) {
+        x += update->row_bias[i] + bias;
+    } else if (update->column_bias) {
+        x += bias;
+    }
+    if (update->clamp) {
+        // NaN stays NaN (neither comparison holds)
+        x = x < update->lower ? update->lower : x > update->upper ? update->upper : x;
+    }
+    return x;
+}
+
+/* Portable kernel: 4 x 8 tile, scalar code the compiler may vectorise
+ * for the baseline instruction set. */
+static void kernel_generic(int k, const double *a, const double *b, double *c, int ldc,
+                           const struct gemm_update *update)
+{
+    double acc[8][4] = {{0}};
+    for (int p = 0; p < k; p++) {
+        for (int j = 0; j < 8; j++) {
+            for (int i = 0; i < 4; i++) {
+                acc[j][i] += a[i]*b[j];
+            }
+        }
+        a += 4;
+        b += 8;
+    }
+    for (int j = 0; j < 8; j++) {
+        for (int i = 0; i < 4; i++) {
+            double *cij = c + i + j*ldc;
+            *cij = update ? update_entry(cij, acc[j][i], i, j, update) : *cij + acc[j][i];
+        }
+    }
+}
+
+static void edge_generic(int k, int rows, int columns, const double *a, const double *b,
+                         double *c, int ldc, const struct gemm_update *update)
+{
+    double acc[8][4] = {{0}};
+    for (int p = 0; p < k; p++) {
+        for (int j = 0; j < columns; j++) {
+            for (int i = 0; i < rows; i++) {
+                acc[j][i] += a[i]*b[j];
+            }
+        }
+        a += 4;
+        b += 8;
+    }
+    for (int j = 0; j < columns; j++) {
+        for (int i = 0; i < rows; i++) {
+            double *cij = c + i + j*ldc;
+            *cij = update ? update_entry(cij, acc[j][i], i, j, update) : *cij + acc[j][i];
+        }
+    }
+}
+
+static int supported_generic(void)
+{
+    return 1;
+}
+
+#ifdef GEMM_X86
+
+/* SSE2: 4 x 4 tile in 8 xmm accumulators, no FMA.  The accumulators are
+ * named variables rather than an array, which GCC would spill to the stack
+ * on every iteration (likewise in the kernels below). */
+#define SSE2_COLUMN(j)                                           \
+    bj = _mm_set1_pd(b[j]);                                      \
+    c##j##0 = _mm_add_pd(c##j##0, _mm_mul_pd(a0, bj));           \
+    c##j##1 = _mm_add_pd(c##j##1, _mm_mul_pd(a1, bj))
+#define SSE2_STORE(j)                                                         \
+    _mm_storeu_pd(c + j*ldc, _mm_add_pd(_mm_loadu_pd(c + j*ldc), c##j##0));   \
+    _mm_storeu_pd(c + j*ldc + 2, _mm_add_pd(_mm_loadu_pd(c + j*ldc + 2), c##j##1))
+#define SSE2_UPDATE(j)                                                        \
+    update_sse2(c + j*ldc, c##j##0, 2, 0, j, update);                         \
+    update_sse2(c + j*ldc + 2, c##j##1, 2, 2, j, update)
+
+/* Store the first lanes lanes of acc, rows i on of column j of a tile, updated
+ * (SSE2 has no blend, so entry by entry). */
+__attribute__((target("sse2")))
+static inline void update_sse2(double *c, __m128d acc, int lanes, int i, int j,
+                               const struct gemm_update *update)
+{
+    double x[2];
+    _mm_storeu_pd(x, acc);
+    for (int l = 0; l < lanes; l++) {
+        c[l] = update_entry(c + l, x[l], i + l, j, update);
+    }
+}
+
+__attribute__((target("sse2")))
+static void kernel_sse2(int k, const double *a, const double *b, double *c, int ldc,
+                        const struct gemm_update *update)
+{
+    __m128d c00, c01, c10, c11, c20, c21, c30, c31;
+    __m128d a0, a1, bj;
+    c00 = c01 = c10 = c11 = c20 = c21 = c30 = c31 = _mm_setzero_pd();
+    for (int p = 0; p < k; p++) {
+        a0 = _mm_loadu_pd(a);
+        a1 = _mm_loadu_pd(a + 2);
+        SSE2_COLUMN(0);
+        SSE2_COLUMN(1);
+        SSE2_COLUMN(2);
+        SSE2_COLUMN(3);
+        a += 4;
+        b += 4;
+    }
+    if (update) {
+        SSE2_UPDATE(0);
+        SSE2_UPDATE(1);
+        SSE2_UPDATE(2);
+        SSE2_UPDATE(3);
+        return;
+    }
+    SSE2_STORE(0);
+    SSE2_STORE(1);
+    SSE2_STORE(2);
+    SSE2_STORE(3);
+}
+
+__attribute__((target("sse2")))
+static void edge_sse2(int k, int rows, int columns, const double *a, const double *b,
+                      double *c, int ldc, const struct gemm_update *update)
+{
+    __m128d acc[4][2];
+    const int vectors = (rows + 1) / 2;
+    for (int j = 0; j < columns; j++) {
+        acc[j][0] = acc[j][1] = _mm_setzero_pd();
+    }
+    for (int p = 0; p < k; p++) {
+        __m128d av[2] = {_mm_loadu_pd(a), _mm_loadu_pd(a + 2)};
+        for (int j = 0; j < columns; j++) {
+            __m128d bj = _mm_set1_pd(b[j]);
+            for (int v = 0; v < vectors; v++) {
+                acc[j][v] = _mm_add_pd(acc[j][v], _mm_mul_pd(av[v], bj));
+            }
+        }
+        a += 4;
+        b += 4;
+    }
+    for (int j = 0; j < columns; j++) {
+        double *cj = c + j*ldc;
+        if (update) {
+            for (int v = 0; v < vectors; v++) {
+                update_sse2(cj + 2*v, acc[j][v], rows - 2*v < 2 ? rows - 2*v : 2, 2*v, j, update);
+            }
+            continue;
+        }
+        for (int v = 0; v < rows / 2; v++) {
+            _mm_storeu_pd(cj + 2*v, _mm_add_pd(_mm_loadu_pd(cj + 2*v), acc[j][v]));
+        }
+        if (rows % 2) {
+            // Odd row out: low half only
+            _mm_store_sd(cj + rows - 1, _mm_add_sd(_mm_load_sd(cj + rows - 1), acc[j][rows / 2]));
+        }
+    }
+}
+
+static int supported_sse2(void)
+{
+    return __builtin_cpu_supports("sse2");
+}
+
+/* AVX2 + FMA: 8 x 6 tile in 12 ymm accumulators, leaving 4 registers for
+ * the two columns of A and the broadcast of B. */
+#define AVX2_COLUMN(j)                                   \
+    bj = _mm256_broadcast_sd(b + j);                     \
+    c##j##0 = _mm256_fmadd_pd(a0, bj, c##j##0);          \
+    c##j##1 = _mm256_fmadd_pd(a1, bj, c##j##1)
+#define AVX2_STORE(j)                                                         \
+    _mm256_storeu_pd(c + j*ldc, _mm256_add_pd(_mm256_loadu_pd(c + j*ldc), c##j##0)); \
+    _mm256_storeu_pd(c + j*ldc + 4, _mm256_add_pd(_mm256_loadu_pd(c + j*ldc + 4), c##j##1))
+#define AVX2_UPDATE(j)                                                        \
+    update_avx2(c + j*ldc, c##j##0, all, 0, j, update);                       \
+    update_avx2(c + j*ldc + 4, c##j##1, all, 4, j, update)
+
+/* Store the lanes of acc in mask, rows i on of column j of a tile, updated. */
+__attribute__((target("avx2,fma")))
+static inline void update_avx2(double *c, __m256d acc, __m256i mask, int i, int j,
+                               const struct gemm_update *update)
+{
+    __m256d x = acc;
+    if (update->beta != 0.0) {
+        const __m256d old = _mm256_maskload_pd(c, mask);
+        x = _mm256_add_pd(update->beta == 1.0 ? old : _mm256_mul_pd(_mm256_set1_pd(update->beta), old), x);
+    }
+    if (update->row_bias || update->column_bias) {
+        __m256d bias = _mm256_set1_pd(update->column_bias ? update->column_bias[j] : 0.0);
+        if (update->row_bias) {
+            bias = _mm256_add_pd(_mm256_maskload_pd(update->row_bias + i, mask), bias);
+        }
+        x = _mm256_add_pd(x, bias);
+    }
+    if (update->clamp) {
+        // As x < lower ? lower : x > upper ? upper : x, so NaN stays NaN
+        const __m256d lower = _mm256_set1_pd(update->lower), upper = _mm256_set1_pd(update->upper);
+        const __m256d below = _mm256_cmp_pd(x, lower, _CMP_LT_OQ), above = _mm256_cmp_pd(x, upper, _CMP_GT_OQ);
+        x = _mm256_blendv_pd(_mm256_blendv_pd(x, upper, above), lower, below);
+    }
+    _mm256_maskstore_pd(c, mask, x);
+}
+
+__attribute__((target("avx2,fma")))
+static void kernel_avx2(int k, const double *a, const double *b, double *c, int ldc,
+                        const struct gemm_update *update)
+{
+    __m256d c00, c01, c10, c11, c20, c21, c30, c31, c40, c41, c50, c51;
+    __m256d a0, a1, bj;
+    c00 = c01 = c10 = c11 = c20 = c21 = _mm256_setzero_pd();
+    c30 = c31 = c40 = c41 = c50 = c51 = _mm256_setzero_pd();
+    for (int p = 0; p < k; p++) {
+        a0 = _mm256_loadu_pd(a);
+        a1 = _mm256_loadu_pd(a + 4);
+        AVX2_COLUMN(0);
+        AVX2_COLUMN(1);
+        AVX2_COLUMN(2);
+        AVX2_COLUMN(3);
+        AVX2_COLUMN(4);
+        AVX2_COLUMN(5);
+        a += 8;
+        b += 6;
+    }
+    if (update) {
+        const __m256i all = _mm256_set1_epi64x(-1);
+        AVX2_UPDATE(0);
+        AVX2_UPDATE(1);
+        AVX2_UPDATE(2);
+        AVX2_UPDATE(3);
+        AVX2_UPDATE(4);
+        AVX2_UPDATE(5);
+        return;
+    }
+    AVX2_STORE(0);
+    AVX2_STORE(1);
+    AVX2_STORE(2);
+    AVX2_STORE(3);
+    AVX2_STORE(4);
+    AVX2_STORE(5);
+}
+
+__attribute__((target("avx2,fma")))
+static void edge_avx2(int k, int rows, int columns, const double *a, const double *b,
+                      double *c, int ldc, const struct gemm_update *update)
+{
+    __m256d acc[6][2];
+    const int vectors = (rows + 3) / 4;
+    // Lanes of the last vector that are inside C
+    const int tail = rows - 4*(vectors - 1);
+    const __m256i mask = _mm256_set_epi64x(tail > 3 ? -1 : 0, tail > 2 ? -1 : 0, tail > 1 ? -1 : 0, -1);
+    for (int j = 0; j < columns; j++) {
+        acc[j][0] = acc[j][1] = _mm256_setzero_pd();
+    }
+    for (int p = 0; p < k; p++) {
+        __m256d av[2] = {_mm256_loadu_pd(a), _mm256_loadu_pd(a + 4)};
+        for (int j = 0; j < columns; j++) {
+            __m256d bj = _mm256_broadcast_sd(b + j);
+            for (int v = 0; v < vectors; v++) {
+                acc[j][v] = _mm256_fmadd_pd(av[v], bj, acc[j][v]);
+            }
+        }
+        a += 8;
+        b += 6;
+    }
+    for (int j = 0; j < columns; j++) {
+        double *cj = c + j*ldc;
+        if (update) {
+            for (int v = 0; v < vectors; v++) {
+                update_avx2(cj + 4*v, acc[j][v], v < vectors - 1 ? _mm256_set1_epi64x(-1) : mask, 4*v, j, update);
+            }
+            continue;
+        }
+        for (int v = 0; v < vectors - 1; v++) {
+            _mm256_storeu_pd(cj + 4*v, _mm256_add_pd(_mm256_loadu_pd(cj + 4*v), acc[j][v]));
+        }
+        cj += 4*(vectors - 1);
+        _mm256_maskstore_pd(cj, mask, _mm256_add_pd(_mm256_maskload_pd(cj, mask), acc[j][vectors - 1]));
+    }
+}
+
+static int supported_avx2(void)
+{
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+}
+
+/* AVX-512: 24 x 8 tile in 24 zmm accumulators, out of 32. */
+#define AVX512_COLUMN(j)                                 \
+    bj = _mm512_set1_pd(b[j]);                           \
+    c##j##0 = _mm512_fmadd_pd(a0, bj, c##j##0);          \
+    c##j##1 = _mm512_fmadd_pd(a1, bj, c##j##1);          \
+    c##j##2 = _mm512_fmadd_pd(a2, bj, c##j##2)
+#define AVX512_STORE(j)                                                       \
+    _mm512_storeu_pd(c + j*ldc, _mm512_add_pd(_mm512_loadu_pd(c + j*ldc), c##j##0)); \
+    _mm512_storeu_pd(c + j*ldc + 8, _mm512_add_pd(_mm512_loadu_pd(c + j*ldc + 8), c##j##1)); \
+    _mm512_storeu_pd(c + j*ldc + 16, _mm512_add_pd(_mm512_loadu_pd(c + j*ldc + 16), c##j##2))
+#define AVX512_UPDATE(j)                                                      \
+    update_avx512(c + j*ldc, c##j##0, 0xff, 0, j, update);                    \
+    update_avx512(c + j*ldc + 8, c##j##1, 0xff, 8, j, update);                \
+    update_avx512(c + j*ldc + 16, c##j##2, 0xff, 16, j, update)
+
+/* Store the lanes of acc in mask, rows i on of column j of a tile, updated. */
+__attribute__((target("avx512f")))
+static inline void update_avx512(double *c, __m512d acc, __mmask8 mask, int i, int j,
+                                 const struct gemm_update *update)
+{
+    __m512d x = acc;
+    if (update->beta != 0.0) {
+        const __m512d old = _mm512_maskz_loadu_pd(mask, c);
+        x = _mm512_add_pd(update->beta == 1.0 ? old : _mm512_mul_pd(_mm512_set1_pd(update->beta), old), x);
+    }
+    if (update->row_bias || update->column_bias) {
+        __m512d bias = _mm512_set1_pd(update->column_bias ? update->column_bias[j] : 0.0);
+        if (update->row_bias) {
+            bias = _mm512_add_pd(_mm512_maskz_loadu_pd(mask, update->row_bias + i), bias);
+        }
+        x = _mm512_add_pd(x, bias);
+    }
+    if (update->clamp) {
+        // As x < lower ? lower : x > upper ? upper : x, so NaN stays NaN
+        const __m512d lower = _mm512_set1_pd(update->lower), upper = _mm512_set1_pd(update->upper);
+        const __mmask8 below = _mm512_cmp_pd_mask(x, lower, _CMP_LT_OQ);
+        const __mmask8 above = _mm512_cmp_pd_mask(x, upper, _CMP_GT_OQ);
+        x = _mm512_mask_blend_pd(below, _mm512_mask_blend_pd(above, x, upper), lower);
+    }
+    _mm512_mask_storeu_pd(c, mask, x);
+}
+
+__attribute__((target("avx512f")))
+static void kernel_avx512(int k, const double *a, const double *b, double *c, int ldc,
+                          const struct gemm_update *update)
+{
+    __m512d c00, c01, c02, c10, c11, c12, c20, c21, c22, c30, c31, c32;
+    __m512d c40, c41, c42, c50, c51, c52, c60, c61, c62, c70, c71, c72;
+    __m512d a0, a1, a2, bj;
+    c00 = c01 = c02 = c10 = c11 = c12 = c20 = c21 = c22 = c30 = c31 = c32 = _mm512_setzero_pd();
+    c40 = c41 = c42 = c50 = c51 = c52 = c60 = c61 = c62 = c70 = c71 = c72 = _mm512_setzero_pd();
+    for (int p = 0; p < k; p++) {
+        a0 = _mm512_loadu_pd(a);
+        a1 = _mm512_loadu_pd(a + 8);
+        a2 = _mm512_loadu_pd(a + 16);
+        AVX512_COLUMN(0);
+        AVX512_COLUMN(1);
+        AVX512_COLUMN(2);
+        AVX512_COLUMN(3);
+        AVX512_COLUMN(4);
+        AVX512_COLUMN(5);
+        AVX512_COLUMN(6);
+        AVX512_COLUMN(7);
+        a += 24;
+        b += 8;
+    }
+    if (update) {
+        AVX512_UPDATE(0);
+        AVX512_UPDATE(1);
+        AVX512_UPDATE(2);
+        AVX512_UPDATE(3);
+        AVX512_UPDATE(4);
+        AVX512_UPDATE(5);
+        AVX512_UPDATE(6);
+        AVX512_UPDATE(7);
+        return;
+    }
+    AVX512_STORE(0);
+    AVX512_STORE(1);
+    AVX512_STORE(2);
+    AVX512_STORE(3);
+    AVX512_STORE(4);
+    AVX512_STORE(5);
+    AVX512_STORE(6);
+    AVX512_STORE(7);
+}
+
+__attribute__((target("avx512f")))
+static void edge_avx512(int k, int rows, int columns, const double *a, const double *b,
+                        double *c, int ldc, const struct gemm_update *update)
+{
+    __m512d acc[8][3];
+    const int vectors = (rows + 7) / 8;
+    // Lanes of the last vector that are inside C
+    const __mmask8 mask = (__mmask8)((1u << (rows - 8*(vectors - 1))) - 1);
+    for (int j = 0; j < columns; j++) {
+        acc[j][0] = acc[j][1] = acc[j][2] = _mm512_setzero_pd();
+    }
+    for (int p = 0; p < k; p++) {
+        __m512d av[3] = {_mm512_loadu_pd(a), _mm512_loadu_pd(a + 8), _mm512_loadu_pd(a + 16)};
+        for (int j = 0; j < columns; j++) {
+            __m512d bj = _mm512_set1_pd(b[j]);
+            for (int v = 0; v < vectors; v++) {
+                acc[j][v] = _mm512_fmadd_pd(av[v], bj, acc[j][v]);
+            }
+        }
+        a += 24;
+        b += 8;
+    }
+    for (int j = 0; j < columns; j++) {
+        double *cj = c + j*ldc;
+        if (update) {
+            for (int v = 0; v < vectors; v++) {
+                update_avx512(cj + 8*v, acc[j][v], v < vectors - 1 ? 0xff : mask, 8*v, j, update);
+            }
+            continue;
+        }
+        for (int v = 0; v < vectors - 1; v++) {
+            _mm512_storeu_pd(cj + 8*v, _mm512_add_pd(_mm512_loadu_pd(cj + 8*v), acc[j][v]));
+        }
+        cj += 8*(vectors - 1);
+        _mm512_mask_storeu_pd(cj, mask, _mm512_add_pd(_mm512_maskz_loadu_pd(mask, cj), acc[j][vectors - 1]));
+    }
+}
+
+static int supported_avx512(void)
+{
+    return __builtin_cpu_supports("avx512f");
+}
+
+#endif  /* GEMM_X86 */
+
+// In order of preference, best last
+static const struct gemm_kernel kernels[] = {
+    {"generic", 4, 8, &kernel_generic, &edge_generic, &supported_generic},
+#ifdef GEMM_X86
+    {"sse2", 4, 4, &kernel_sse2, &edge_sse2, &supported_sse2},
+    {"avx2", 8, 6, &kernel_avx2, &edge_avx2, &supported_avx2},
+    {"avx512", 24, 8, &kernel_avx512, &edge_avx512, &supported_avx512},
+#endif
+};
+
+#define NKERNELS ((int)(sizeof(kernels)/sizeof(kernels[0])))
+
+static const struct gemm_kernel *active;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+static const struct gemm_kernel *find_kernel(const char *name)
+{
+    for (int i = 0; i < NKERNELS; i++) {
+        if (!strcmp(kernels[i].name, name) && kernels[i].supported()) {
+            return &kernels[i];
+        }
+    }
+    return NULL;
+}
+
+static void init_kernel(void)
+{
+    const char *env = getenv("GEMM_KERNEL");
+    const struct gemm_profile *profile = gemm_loaded_profile();
+    active = gemm_best_kernel();
+    if (!(env && *env) && profile->kernel[0] && find_kernel(profile->kernel)) {
+        active = find_kernel(profile->kernel);
+    } else if (env && *env && find_kernel(env)) {
+        active = find_kernel(env);
+    } else if (env && *env) {
+        fprintf(stderr, "GEMM_KERNEL=%s is not a kernel this CPU supports, using %s\n",
+                env, active->name);
+    }
+}
+
+/* All compiled in kernels (including ones the CPU may not support). */
+const struct gemm_kernel *gemm_kernels(int *count)
+{
+    *count = NKERNELS;
+    return kernels;
+}
+
+/* The best kernel the running CPU supports. */
+const struct gemm_kernel *gemm_best_kernel(void)
+{
+    #ifdef GEMM_X86
+    __builtin_cpu_init();
+    #endif
+    for (int i = NKERNELS - 1; i > 0; i--) {
+        if (kernels[i].supported()) {
+            return &kernels[i];
+        }
+    }
+    return &kernels[0];
+}
+
+/* The kernel optimised_gemm currently uses. */
+const struct gemm_kernel *gemm_active_kernel(void)
+{
+    pthread_once(&once, &init_kernel);
+    return active;
+}
+
+/*
+ * Make optimised_gemm use the named kernel (NULL for the best one).
+ * Returns 1 if there is no such kernel or the CPU cannot run it, 0 on
+ * success.  Not safe to call while another thread is inside
+ * optimised_gemm.
+ */
+int gemm_select_kernel(const char *name)
+{
+    const struct gemm_kernel *kernel = name ? find_kernel(name) : gemm_best_kernel();
+    pthread_once(&once, &init_kernel);
+    if (!kernel) {
+        return 1;
+    }
+    active = kernel;
+    return 0;
+}
@@ -0,0 +1,63 @@
+/* This file implements a cache-oblivious recursive GEMM for the products that are
+ * too small for the packing in optimised-gemm.c to pay off.
+ *
+ * C = C + A*B is halved along whichever dimension is furthest beyond its leaf size
+ * until it fits a leaf, so at every level of the memory hierarchy some level of the
+ * recursion has a working set that fits, without knowing the cache sizes.  The leaves
+ * go to the batched gemm's small kernel (gemm_small, see gemm-batch.c), which holds
+ * a block of columns of C in vector registers while it runs over k.  A, B and C are
+ * read in place, so there is no packing and no workspace, and views cost nothing.
+ *
+ * dgemm_ctx sends plain products (no transposes, alpha 1) here while m n k is at
+ * most the cube of the recursive cutoff, which the tuner measures (see gemm-tune.c).
+ */
+
+#include "gemm.h"
+
+// Leaf shape: m is the small kernel's register limit (gemm_small_max); k is deep
+// enough that loading and storing the leaf of C is a small part of its work
+#define LEAF_N 64
+#define LEAF_K 128
+// Row splits keep whole vectors in the upper half
+#define ROW_ALIGN 8
+
+/* Compute C = C + A*B
+ *
+ * C has rank m x n (m rows, n columns)
+ * A has rank m x k
+ * B has rank k x n
+ * ldX is the leading dimension of the respective matrix.
+ *
+ * All matrices are stored in column major format.
+ */
+void recursive_gemm(int m, int n, int k,
+                    const double *a, int lda,
+                    const double *b, int ldb,
+                    double *c, int ldc)
+{
+    const int leaf_m = gemm_small_max();
+    const double over_m = (double)m / leaf_m, over_n = (double)n / LEAF_N, over_k = (double)k / LEAF_K;
+
+    if (m <= 0 || n <= 0 || k <= 0) {
+        return;
+    }
+    if (m <= leaf_m && n <= LEAF_N && k <= LEAF_K) {
+        gemm_small(m, n, k, a, lda, b, ldb, c, ldc);
+    } else if (over_m >= over_n && over_m >= over_k) {
+        // Split the rows: [C1; C2] += [A1; A2] B
+        int half = (m / 2 + ROW_ALIGN - 1) / ROW_ALIGN * ROW_ALIGN;
+        half = half < m ? half : m / 2;
+        recursive_gemm(half, n, k, a, lda, b, ldb, c, ldc);
+        recursive_gemm(m - half, n, k, a + half, lda, b, ldb, c + half, ldc);
+    } else if (over_n >= over_k) {
+        // Split the columns: [C1 C2] += A [B1 B2]
+        const int half = n / 2;
+        recursive_gemm(m, half, k, a, lda, b, ldb, c, ldc);
+        recursive_gemm(m, n - half, k, a, lda, b + (size_t)half*ldb, ldb, c + (size_t)half*ldc, ldc);
+    } else {
+        // Split the inner dimension: C += A1 B1, then C += A2 B2
+        const int half = k / 2;
+        recursive_gemm(m, n, half, a, lda, b, ldb, c, ldc);
+        recursive_gemm(m, n, k - half, a + (size_t)half*lda, lda, b + half, ldb, c, ldc);
+    }
+}
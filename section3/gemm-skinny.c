@@ -0,0 +1,106 @@
+/* This file implements GEMM for thin shapes that packing serves badly: tall and skinny
+ * (a few columns) and short and wide (a few rows), as block Krylov methods and
+ * QR updates produce.
+ *
+ * For these one operand is large and each of its elements is used only a few times
+ * (n or m times), so they are bound by the bandwidth of streaming it, and packing it
+ * first (reading it once and writing a copy that the kernels read again) costs about
+ * as much as the product itself.  Here the large operand is read in place, once, by
+ * the batched gemm's small kernel (gemm_small, see gemm-batch.c), which holds a block
+ * of columns of C in vector registers while it runs over k:
+ *   short, wide  the columns of B and C are shared out in chunks of WIDE_N, each
+ *                streaming its columns of B against all of A (small, and in cache)
+ *   tall, skinny the rows of A and C are shared out in chunks of TALL_ROWS, each
+ *                streaming its rows of A in blocks of TALL_K columns, a panel of
+ *                gemm_small_max() rows at a time, against the matching rows of B
+ *                (small, and in cache); a block is a page or so of each column of A,
+ *                so the hardware prefetcher sees long runs rather than one short run
+ *                per column of a panel, and its chunk of C stays in L2 between blocks
+ *
+ * Shallow products (small k, m and n large) stay with packing: C is then the large
+ * operand, which the packed path also reads and writes only once per panel of k, but
+ * with the faster kernels (gemm_small was about half as fast for k = 8 or 16).
+ */
+
+#include "gemm.h"
+
+// Columns of B and C in each chunk of a short, wide product
+#define WIDE_N 64
+// Depth of the blocks of a short, wide product (a block of A is at most 64 x 256, in L2)
+#define WIDE_K 256
+// Rows of A and C in each chunk of a tall, skinny product
+#define TALL_ROWS 512
+// Depth of the blocks of a tall, skinny product (a block of A is 128KB, in L2)
+#define TALL_K 32
+// Most rows of a short, wide product and columns of a tall, skinny one sent here, per
+// lane of the small kernel's vectors: with AVX-512 (8 lanes) the thin path was faster
+// up to 32 rows and 12 columns (1.2-2.5x), above them packing.  The packed kernels
+// gain with the vector width as the small kernel does, so the limits scale with it
+#define WIDE_MAX_PER_LANE 4
+#define TALL_MAX_PER_2_LANES 3
+// Fewest rows for which a product narrower than a vector goes to packing
+#define PARTIAL_MIN 4
+
+/* Whether dgemm_ctx should multiply an m x k by k x n plain product with skinny_gemm.
+ * Rows from PARTIAL_MIN up to a vector are left out: the small kernel handles rows
+ * short of a whole vector one at a time, and packing was faster for them (4 to 7
+ * rows with AVX-512; none are left out with AVX2 or SSE2).  Fewer rows are so few
+ * that packing does not pay either way. */
+int gemm_skinny_shape(int m, int n, int k)
+{
+    const int lanes = gemm_small_lanes();
+    (void)k;
+    return (m <= WIDE_MAX_PER_LANE*lanes && (m < PARTIAL_MIN || m >= lanes))
+        || n <= TALL_MAX_PER_2_LANES*lanes/2;
+}
+
+/* Compute C = C + A*B on up to threads threads
+ *
+ * C has rank m x n (m rows, n columns)
+ * A has rank m x k
+ * B has rank k x n
+ * ldX is the leading dimension of the respective matrix.
+ *
+ * All matrices are stored in column major format.
+ */
+void skinny_gemm(int threads, int m, int n, int k,
+                 const double *a, int lda,
+                 const double *b, int ldb,
+                 double *c, int ldc)
+{
+    const int panel = gemm_small_max();
+
+    if (m <= 0 || n <= 0 || k <= 0) {
+        return;
+    }
+    if (m <= panel) {
+        // Short and wide: chunks of columns, each through all of k
+        const int chunks = 1 + (n - 1) / WIDE_N;
+        #pragma omp parallel for schedule(static) num_threads(threads) if(threads > 1 && chunks > 1)
+        for (int chunk = 0; chunk < chunks; chunk++) {
+            const int j = chunk*WIDE_N;
+            const int columns = n - j < WIDE_N ? n - j : WIDE_N;
+            for (int p = 0; p < k; p += WIDE_K) {
+                gemm_small(m, columns, k - p < WIDE_K ? k - p : WIDE_K, a + (size_t)p*lda, lda,
+                           b + p + (size_t)j*ldb, ldb, c + (size_t)j*ldc, ldc);
+            }
+        }
+        return;
+    }
+
+    // Tall and skinny: chunks of rows, each through all of k a block at a time, and
+    // each block a panel at a time
+    const int chunks = 1 + (m - 1) / TALL_ROWS;
+    #pragma omp parallel for schedule(static) num_threads(threads) if(threads > 1 && chunks > 1)
+    for (int chunk = 0; chunk < chunks; chunk++) {
+        const int first = chunk*TALL_ROWS;
+        const int last = m - first < TALL_ROWS ? m : first + TALL_ROWS;
+        for (int p = 0; p < k; p += TALL_K) {
+            const int depth = k - p < TALL_K ? k - p : TALL_K;
+            for (int i = first; i < last; i += panel) {
+                gemm_small(last - i < panel ? last - i : panel, n, depth, a + i + (size_t)p*lda, lda,
+                           b + p, ldb, c + i, ldc);
+            }
+        }
+    }
+}
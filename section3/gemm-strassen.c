@@ -0,0 +1,242 @@
+/* This file implements a Strassen-Winograd layer above optimised_gemm for very large
+ * multiplications, trading some accuracy for fewer flops: each level of recursion
+ * replaces 8 half-size products by 7 and 18 half-size additions, saving 12.5% of the
+ * flops per level (23% with two levels, 33% with three).
+ *
+ * The number of levels is the smaller of what the cutoff allows (a product is only
+ * split while every dimension is at least the cutoff, below which the blocked
+ * kernel is faster) and what the caller's error tolerance allows.  The normwise
+ * error bound of the Winograd variant (Higham, "Accuracy and Stability of Numerical
+ * Algorithms", 2nd ed., Theorem 23.3) for L levels and inner dimension k = 2^L k_0,
+ *
+ *   max|C - C_computed| <= ((k_0^2 + 6 k_0) 18^L - 6 k) u max|A| max|B|,
+ *
+ * grows by roughly a factor of 18/4 per level, against k^2 u for the usual algorithm
+ * (L = 0).
+ *
+ * Odd dimensions are peeled: the even leading part goes through the recursion and
+ * the last row, column and (rank one) inner slice are added by optimised_gemm.
+ * Temporaries come from one scratch buffer owned by the context, sized for the whole
+ * recursion before it starts.
+ */
+
+#include <float.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "gemm.h"
+#include "instrument.h"
+
+// Internal to optimised-gemm.c
+int gemm_context_strassen_cutoff(const struct gemm_context *ctx);
+double *gemm_context_scratch(struct gemm_context *ctx, size_t count);
+
+// Unit roundoff
+#define UNIT_ROUNDOFF (DBL_EPSILON / 2)
+
+/* Normwise error bound factor (relative to u max|A| max|B|, times u) of levels
+ * levels of Strassen-Winograd with inner dimension k. */
+static double error_bound(int levels, int k)
+{
+    double k_0 = (double)k / (1 << levels);
+    double growth = 1;
+    for (int l = 0; l < levels; l++) {
+        growth *= 18;
+    }
+    return ((k_0*k_0 + 6*k_0)*growth - 6.0*k)*UNIT_ROUNDOFF;
+}
+
+/* Doubles of scratch space used by levels levels of recursion on an m x n x k product. */
+static size_t scratch_size(int levels, int m, int n, int k)
+{
+    size_t size = 0;
+    for (int l = 0; l < levels; l++) {
+        m /= 2;
+        n /= 2;
+        k /= 2;
+        // S (m x k), T (k x n), X and Y (m x n)
+        size += (size_t)m*k + (size_t)k*n + 2*(size_t)m*n;
+    }
+    return size;
+}
+
+/* Z = X + beta_y*Y, all m x n; Z may be X or Y. */
+static void add(int m, int n, const double *x, int ldx, double beta_y, const double *y, int ldy,
+                double *z, int ldz)
+{
+    int threads = gemm_get_num_threads();
+    #pragma omp parallel for schedule(static) num_threads(threads) if(threads > 1)
+    for (int j = 0; j < n; j++) {
+        const double *x_j = x + (size_t)j*ldx;
+        const double *y_j = y + (size_t)j*ldy;
+        double *z_j = z + (size_t)j*ldz;
+        if (beta_y == 0.0) {
+            for (int i = 0; i < m; i++) {
+                z_j[i] = x_j[i];
+            }
+        } else {
+            for (int i = 0; i < m; i++) {
+                z_j[i] = x_j[i] + beta_y*y_j[i];
+            }
+        }
+    }
+}
+
+/* Z = X - Y, all m x n; Z may be X or Y. */
+static void subtract(int m, int n, const double *x, int ldx, const double *y, int ldy,
+                     double *z, int ldz)
+{
+    int threads = gemm_get_num_threads();
+    #pragma omp parallel for schedule(static) num_threads(threads) if(threads > 1)
+    for (int j = 0; j < n; j++) {
+        const double *x_j = x + (size_t)j*ldx;
+        const double *y_j = y + (size_t)j*ldy;
+        double *z_j = z + (size_t)j*ldz;
+        for (int i = 0; i < m; i++) {
+            z_j[i] = x_j[i] - y_j[i];
+        }
+    }
+}
+
+/*
+ * C = A*B + beta*C (beta 0 or 1) with levels levels of Strassen-Winograd;
+ * m, n and k are even whenever levels > 0.  work holds scratch_size(levels, m, n, k)
+ * doubles.
+ */
+static void strassen(struct gemm_context *ctx, int levels, int m, int n, int k,
+                     const double *a, int lda, const double *b, int ldb,
+                     double beta, double *c, int ldc, double *work);
+
+/* C = A*B + beta*C for any m, n, k: peel the odd row, column and inner index. */
+static void peeled(struct gemm_context *ctx, int levels, int m, int n, int k,
+                   const double *a, int lda, const double *b, int ldb,
+                   double beta, double *c, int ldc, double *work)
+{
+    int m_e = m & ~1, n_e = n & ~1, k_e = k & ~1;
+    if (levels == 0) {
+        dgemm_ctx(ctx, 'N', 'N', m, n, k, 1.0, a, lda, b, ldb, beta, c, ldc);
+        return;
+    }
+    strassen(ctx, levels, m_e, n_e, k_e, a, lda, b, ldb, beta, c, ldc, work);
+    if (k_e < k) {
+        // Rank one update with the last column of A and last row of B
+        dgemm_ctx(ctx, 'N', 'N', m_e, n_e, 1, 1.0, a + (size_t)k_e*lda, lda, b + k_e, ldb,
+                  1.0, c, ldc);
+    }
+    if (m_e < m) {
+        dgemm_ctx(ctx, 'N', 'N', 1, n_e, k, 1.0, a + m_e, lda, b, ldb, beta, c + m_e, ldc);
+    }
+    if (n_e < n) {
+        dgemm_ctx(ctx, 'N', 'N', m, 1, k, 1.0, a, lda, b + (size_t)n_e*ldb, ldb,
+                  beta, c + (size_t)n_e*ldc, ldc);
+    }
+}
+
+static void strassen(struct gemm_context *ctx, int levels, int m, int n, int k,
+                     const double *a, int lda, const double *b, int ldb,
+                     double beta, double *c, int ldc, double *work)
+{
+    const int h_m = m / 2, h_n = n / 2, h_k = k / 2;
+    const double *a11 = a, *a21 = a + h_m, *a12 = a + (size_t)h_k*lda, *a22 = a12 + h_m;
+    const double *b11 = b, *b21 = b + h_k, *b12 = b + (size_t)h_n*ldb, *b22 = b12 + h_k;
+    double *c11 = c, *c21 = c + h_m, *c12 = c + (size_t)h_n*ldc, *c22 = c12 + h_m;
+    // Temporaries: S (h_m x h_k), T (h_k x h_n), X and Y (h_m x h_n), then the next level's
+    double *s = work;
+    double *t = s + (size_t)h_m*h_k;
+    double *x = t + (size_t)h_k*h_n;
+    double *y = x + (size_t)h_m*h_n;
+    double *next = y + (size_t)h_m*h_n;
+
+    levels--;
+    // X = M1 = A11 B11; C11 = M1 + M2 (+ C11)
+    peeled(ctx, levels, h_m, h_n, h_k, a11, lda, b11, ldb, 0.0, x, h_m, next);
+    add(h_m, h_n, x, h_m, beta, c11, ldc, c11, ldc);
+    peeled(ctx, levels, h_m, h_n, h_k, a12, lda, b21, ldb, 1.0, c11, ldc, next);
+    // S = S2 = A21 + A22 - A11, T = T2 = B22 - (B12 - B11); X = M1 + M6
+    add(h_m, h_k, a21, lda, 1.0, a22, lda, s, h_m);
+    subtract(h_m, h_k, s, h_m, a11, lda, s, h_m);
+    subtract(h_k, h_n, b12, ldb, b11, ldb, t, h_k);
+    subtract(h_k, h_n, b22, ldb, t, h_k, t, h_k);
+    peeled(ctx, levels, h_m, h_n, h_k, s, h_m, t, h_k, 1.0, x, h_m, next);
+    // S = S4 = A12 - S2; C12 = M3 (+ C12)
+    subtract(h_m, h_k, a12, lda, s, h_m, s, h_m);
+    peeled(ctx, levels, h_m, h_n, h_k, s, h_m, b22, ldb, beta, c12, ldc, next);
+    // T = -T4 = B21 - T2; C21 = -M4 (+ C21)
+    subtract(h_k, h_n, b21, ldb, t, h_k, t, h_k);
+    peeled(ctx, levels, h_m, h_n, h_k, a22, lda, t, h_k, beta, c21, ldc, next);
+    // Every block but C11 needs M1 + M6
+    add(h_m, h_n, c12, ldc, 1.0, x, h_m, c12, ldc);
+    add(h_m, h_n, c21, ldc, 1.0, x, h_m, c21, ldc);
+    add(h_m, h_n, x, h_m, beta, c22, ldc, c22, ldc);
+    // Y = M7 = S3 T3 = (A11 - A21)(B22 - B12), into C21 and C22
+    subtract(h_m, h_k, a11, lda, a21, lda, s, h_m);
+    subtract(h_k, h_n, b22, ldb, b12, ldb, t, h_k);
+    peeled(ctx, levels, h_m, h_n, h_k, s, h_m, t, h_k, 0.0, y, h_m, next);
+    add(h_m, h_n, c21, ldc, 1.0, y, h_m, c21, ldc);
+    add(h_m, h_n, c22, ldc, 1.0, y, h_m, c22, ldc);
+    // Y = M5 = S1 T1 = (A21 + A22)(B12 - B11), into C12 and C22
+    add(h_m, h_k, a21, lda, 1.0, a22, lda, s, h_m);
+    subtract(h_k, h_n, b12, ldb, b11, ldb, t, h_k);
+    peeled(ctx, levels, h_m, h_n, h_k, s, h_m, t, h_k, 0.0, y, h_m, next);
+    add(h_m, h_n, c12, ldc, 1.0, y, h_m, c12, ldc);
+    add(h_m, h_n, c22, ldc, 1.0, y, h_m, c22, ldc);
+}
+
+/* Compute C = C + A*B, using Strassen-Winograd where it is faster and its error
+ * bound is within tolerance
+ *
+ * C has rank m x n (m rows, n columns)
+ * A has rank m x k
+ * B has rank k x n
+ * ldX is the leading dimension of the respective matrix.
+ * tolerance: largest acceptable bound on max|C - C_exact| / (max|A| max|B|); a
+ * tolerance of 0 (or below the bound of one level) gives plain optimised_gemm_ctx.
+ *
+ * All matrices are stored in column major format.
+ * Returns the error bound of the levels used, in the same units as tolerance.
+ */
+double strassen_gemm_ctx(struct gemm_context *ctx, double tolerance,
+                         int m, int n, int k,
+                         const double *a, int lda,
+                         const double *b, int ldb,
+                         double *c, int ldc)
+{
+    const int cutoff = gemm_context_strassen_cutoff(ctx);
+    int levels = 0;
+    double *work = NULL;
+
+    if (m <= 0 || n <= 0 || k <= 0) {
+        return 0.0;
+    }
+    // Split while every dimension (after peeling) is at least the cutoff and the bound allows
+    for (int dm = m, dn = n, dk = k; ; levels++) {
+        dm &= ~1;
+        dn &= ~1;
+        dk &= ~1;
+        if (dm < cutoff || dn < cutoff || dk < cutoff || dm < 2 || dn < 2 || dk < 2
+            || error_bound(levels + 1, k) > tolerance) {
+            break;
+        }
+        dm /= 2;
+        dn /= 2;
+        dk /= 2;
+    }
+    if (levels > 0) {
+        work = gemm_context_scratch(ctx, scratch_size(levels, m, n, k));
+    }
+    peeled(ctx, levels, m, n, k, a, lda, b, ldb, 1.0, c, ldc, work);
+    return error_bound(levels, k);
+}
+
+/* Compute C = C + A*B with the calling thread's own context.
+ *
+ * See strassen_gemm_ctx.
+ */
+double strassen_gemm(double tolerance, int m, int n, int k,
+                     const double *a, int lda,
+                     const double *b, int ldb,
+                     double *c, int ldc)
+{
+    return strassen_gemm_ctx(gemm_thread_context(), tolerance, m, n, k, a, lda, b, ldb, c, ldc);
+}
@@ -0,0 +1,657 @@
+/* The BLIS-style engine behind dgemm_ctx and the other precisions, included (without
+ * include guard) once per element type by optimised-gemm.c, with these defined:
+ *   T              the element type
+ *   IS_COMPLEX     1 for the complex types, 0 otherwise
+ *   NAME(x)        x with the type's BLAS prefix (s, d, c or z)
+ *   CONJ(x)        the complex conjugate of x (complex types only)
+ *   KERNEL_OF(ctx, micro)  fill in micro (a struct NAME(micro)) with the kernel ctx uses
+ *   BASIC_GEMM     (optional) basic_gemm for the type, for small plain products
+ *   RECURSIVE_GEMM, RECURSIVE_CUTOFF(ctx)  (optional) recursive_gemm for the type, and the size below
+ *                  which plain products use it rather than packing
+ *   SKINNY_GEMM, SKINNY_SHAPE(m, n, k)  (optional) skinny_gemm for the type (taking the thread count
+ *                  first), and whether a plain product of that shape goes to it rather than packing
+ *   EPILOGUE       (optional) apply struct gemm_epilogue to the tiles of C (double only, as its
+ *                  bias and bounds are double); without it the engine ignores any epilogue
+ *
+ * Packing, blocking, threading and the edge handling are the same for every type; only the
+ * micro-kernels (gemm-kernels.c for double, gemm-kernel-template.h otherwise) differ.
+ */
+
+// A micro-kernel of this type (as struct gemm_kernel)
+struct NAME(micro) {
+    int m_r, n_r;
+    void (*kernel)(int k, const T *a, const T *b, T *c, int ldc, const struct gemm_update *update);
+    void (*edge)(int k, int rows, int columns, const T *a, const T *b, T *c, int ldc,
+                 const struct gemm_update *update);
+};
+
+#if IS_COMPLEX
+#define CONJ_IF(x, flag) ((flag) ? CONJ(x) : (x))
+// The kernels' struct gemm_update is real, so complex beta is applied to C before the product
+#define KERNEL_BETA(beta) 1.0
+#else
+#define CONJ_IF(x, flag) ((void)(flag), (x))
+#define KERNEL_BETA(beta) (beta)
+#endif
+// Workspace is counted in doubles
+#define IN_DOUBLES(count) (((count)*sizeof(T) + sizeof(double) - 1) / sizeof(double))
+// Real flops in each c += a*b
+#define FLOPS_PER_UPDATE (IS_COMPLEX ? 8.0 : 2.0)
+// Fewest multiply-adds for the recursive path: below it the vector kernels' loop overhead dominates
+#define RECURSIVE_MIN 256
+// Start of part part of parts of count things shared out in ranges
+#define SHARE(count, part, parts) ((int)((long)(count)*(part) / (parts)))
+
+static void NAME(pack_a)(const T *a, int rs, int cs, int conjugate, T alpha, int rows, int depth, int m_r, T *A_packed);
+static void NAME(pack_b)(const T *b, int rs, int cs, int conjugate, int depth, int n, int n_r, T *B_packed);
+static void NAME(micro_kernel)(const struct NAME(micro) *kernel, int depth, const T *A_splice, const T *B_splice,
+                               int rows, int columns, T *c, int ldc, const struct gemm_update *update,
+                               int row, int column);
+
+/* Software prefetch of a block of op(X) ahead of packing it, spread over a number of calls to prefetch_step.
+ * The block is fetched a few lines at a time (columns if op(X) is X, rows otherwise), each contiguous in memory. */
+struct NAME(prefetcher) {
+    const char *x;
+    size_t length, stride;  // Bytes in each line, and from one line to the next
+    int lines, next, step;  // Lines in all, the next to fetch, and how many each step fetches
+};
+
+static void NAME(prefetch_start)(struct NAME(prefetcher) *fetch, const T *x, int rs, int cs, int rows, int columns,
+                                 int steps);
+static inline void NAME(prefetch_step)(struct NAME(prefetcher) *fetch, int locality);
+
+/* Blocking for this type: k_c scaled so a panel of k_c elements takes as many bytes as for
+ * double (m_c and n_c then keep the blocks of A and B the same size in bytes too). */
+static const struct gemm_blocking *NAME(blocking)(const struct gemm_context *ctx, struct gemm_blocking *scaled)
+{
+    const struct gemm_blocking *blocking = ctx->blocking.k_c > 0 ? &ctx->blocking : gemm_default_blocking();
+    if(sizeof(T) == sizeof(double)) {
+        return blocking;
+    }
+    *scaled = *blocking;
+    scaled->k_c = (int)(blocking->k_c*sizeof(double)/sizeof(T));
+    return scaled;
+}
+
+/* Scale columns [first, last) of C by beta, without reading C if beta is zero. */
+static void NAME(scale_c)(int m, int first, int last, T beta, T *c, int ldc)
+{
+    if(beta == 1.0) {
+        return;
+    }
+    for(int column = first; column < last; column++) {
+        T *c_column = c + (size_t)column*ldc;
+        if(beta == 0.0) {
+            for(int row = 0; row < m; row++) {
+                c_column[row] = 0.0;
+            }
+        } else {
+            for(int row = 0; row < m; row++) {
+                c_column[row] *= beta;
+            }
+        }
+    }
+}
+
+#ifdef EPILOGUE
+/* Apply epilogue to the rows x columns tile of C at (row, column), starting at c. */
+static void NAME(epilogue_tile)(const struct gemm_epilogue *epilogue, int row, int column, int rows, int columns,
+                                T *c, int ldc)
+{
+    const T lower = epilogue->lower, upper = epilogue->upper;
+
+    for(int j = 0; j < columns; j++) {
+        T *c_column = c + (size_t)j*ldc;
+        // Both biases in one sweep, the column's added to each of the row's
+        const T bias = epilogue->column_bias ? epilogue->column_bias[column + j] : 0.0;
+        if(epilogue->row_bias) {
+            const double *row_bias = epilogue->row_bias + row;
+            for(int i = 0; i < rows; i++) {
+                c_column[i] += row_bias[i] + bias;
+            }
+        } else if(epilogue->column_bias) {
+            for(int i = 0; i < rows; i++) {
+                c_column[i] += bias;
+            }
+        }
+        if(epilogue->clamp) {
+            // NaN stays NaN (neither comparison holds)
+            for(int i = 0; i < rows; i++) {
+                c_column[i] = c_column[i] < lower ? lower : c_column[i] > upper ? upper : c_column[i];
+            }
+        }
+    }
+    if(epilogue->tile) {
+        epilogue->tile(c, ldc, rows, columns, row, column, epilogue->data);
+    }
+}
+#define FINISH(row, column, rows, columns, c)                                                       \
+    do {                                                                                            \
+        if(epilogue) {                                                                              \
+            NAME(epilogue_tile)(epilogue, row, column, rows, columns, c, ldc);                      \
+        }                                                                                           \
+    } while(0)
+// The rest of it for a tile the kernel has just stored with the biases and clamp applied
+#define FINISH_TILE(row, column, rows, columns, c)                                                  \
+    do {                                                                                            \
+        if(epilogue && epilogue->tile) {                                                            \
+            epilogue->tile(c, ldc, rows, columns, row, column, epilogue->data);                     \
+        }                                                                                           \
+    } while(0)
+#else
+#define FINISH(row, column, rows, columns, c) ((void)epilogue)
+#define FINISH_TILE(row, column, rows, columns, c) ((void)epilogue)
+#endif
+
+/* Compute C = alpha*op(A)*op(B) + beta*C, where op(X) is X, its transpose or its conjugate transpose
+ *
+ * transa, transb: 'N' for op(X) = X, 'T' for op(X) = X^T, 'C' for op(X) = X^H (X^T for the real types)
+ * C has rank m x n
+ * op(A) has rank m x k
+ * op(B) has rank k x n
+ * ldX is the leading dimension of the respective matrix (as stored, i.e. before op).
+ * ctx provides the packing workspace (and settings); only one call at a time may use it.
+ * If beta is zero C is not read, so it may hold anything (even NaN) on entry.
+ * 
+ * epilogue (NULL for none, see struct gemm_epilogue) is then applied to every tile of C, which keeps the
+ * product on the packed path.
+ *
+ * for m, n, k all <= 32, basic dense multiplication is performed as this is faster
+ * 
+ * All matrices are stored in column major format.
+ */
+static void NAME(gemm_engine)(struct gemm_context *ctx, char transa, char transb,
+                              int m, int n, int k,
+                              T alpha, const T *a, int lda,
+                              const T *b, int ldb,
+                              T beta, T *c, int ldc,
+                              const struct gemm_epilogue *epilogue)
+{
+    /* Approach to dense matrix-matrix multiplication
+     *
+     * Plain products (no transposes, alpha 1, no epilogue) of at most RECURSIVE_CUTOFF^3 multiply-adds go to the recursive
+     * path (double only, see gemm-recursive.c), which needs no packing; the cutoff is where packing starts to
+     * pay, measured by the tuner (about 40 with AVX-512, below which the recursion is 1.5-2.5x faster).
+     * Otherwise if m <= 32 and n <= 32 and k <= 32 (and no epilogue), use a plain triple loop (basic_gemm for
+     * double) instead as it is faster (with the packing workspace reused between calls the packed path wins from
+     * about 40 up)
+     * Plain products that are tall and skinny (n <= 12) or short and wide (m <= 32) go to the thin path (double
+     * only, see gemm-skinny.c; those limits are for AVX-512 and scale with the vector width), which streams the
+     * large operand once, in place, instead of packing it.
+     *
+     * For any 'uneven' values, i.e.:
+     *  k % k_c != 0
+     *  m % m_c != 0
+     *  n % n_c != 0
+     *  n % n_r != 0
+     *  m_c % m_r != 0
+     * 
+     * The last panel of k is simply shallower (the kernels take the depth as an argument).
+     * Partial m_r x n_r tiles of C go to the kernel's edge variant, which only computes (and stores)
+     * the part of the tile inside C, so padding costs neither flops nor branches in the kernels.
+     *
+     * Transposes, conjugation and alpha are applied while packing (op(A) and op(B) are read through row and column
+     * strides, and alpha multiplies A as it is packed), so they cost nothing in the kernels. The kernels scale C by
+     * beta as they add the first panel of k to it (see struct gemm_update; complex types scale it before the product).
+     *
+     * Threads (BLIS style):
+     * Each panel of B is packed cooperatively (every thread packs some of its n_r slivers) into one shared B_packed.
+     * The blocks of A (loop_2) are shared out between the threads, each packing its blocks into its own A_packed.
+     * Blocks are made smaller than m_c if that is needed to give every thread one, and if m is still too small
+     * for that, the columns of each block (loop_3) are shared out as well.
+     *
+     * Pipelining (if turned on with gemm_context_set_prefetch or GEMM_PREFETCH=1):
+     * Packing reads A and B from memory once and then waits on it, which for thin shapes (small m, n or k, where
+     * each packed element is used only a few times) is a large part of the run time. So while the kernels run on
+     * one block, each thread prefetches the part of A it packs next and its share of the next panel of B, a slice
+     * before each micro-tile, and the packing that follows reads them from cache. The threads' shares of the
+     * packing are fixed ranges (rather than OpenMP work sharing) so each knows in advance what it packs next.
+     *
+     * Epilogue:
+     * The kernels add into C once per panel of k, so each tile of C is only final after the last panel. With that
+     * panel the kernel also adds the biases and clamps, to the accumulators, before it stores the tile (see struct
+     * gemm_update), and the tile function is called on the micro-tile just stored, while it is in L1. So C is not
+     * read and written again afterwards. The unpacked paths (recursive, small and thin) do not work in tiles of
+     * C, so products with an epilogue do not take them.
+     */
+
+    struct instrument_timer timer;
+    struct NAME(micro) micro;
+    const struct NAME(micro) *kernel = (KERNEL_OF(ctx, micro), &micro);
+    struct gemm_blocking scaled;
+    const struct gemm_blocking *blocking = NAME(blocking)(ctx, &scaled);
+    const int m_r = kernel->m_r;
+    const int n_r = kernel->n_r;
+    const int k_c = blocking->k_c;
+    const int m_c = blocking->m_c;
+    const int n_c = blocking->n_c;
+    // Whole number of n_r columns in each panel of B
+    const int n_b = n_c < n_r ? n_r : (n_c / n_r)*n_r;
+    int threads = ctx->threads > 0 ? ctx->threads : gemm_get_num_threads();
+    const int prefetch = ctx->prefetch >= 0 ? ctx->prefetch : gemm_default_prefetch();
+#ifdef _OPENMP
+    // Called from inside a parallel region (e.g. one item of a batch), run on the calling thread only
+    threads = omp_in_parallel() ? 1 : threads;
+#endif
+    // Whole number of m_r rows in each block of A, at most m_c and at most an even share of m
+    int m_b = m_c < m_r ? m_r : (m_c / m_r)*m_r;
+    int share = (1 + (((1 + (m - 1) / threads) - 1) / m_r))*m_r;
+    int m_blocks, n_slivers, n_split;
+    T *B_packed;
+    // Strides of op(A) and op(B): element (i, j) of op(X) is x[i*rs_x + j*cs_x]
+    const int a_trans = transa != 'N' && transa != 'n';
+    const int b_trans = transb != 'N' && transb != 'n';
+    const int a_conj = IS_COMPLEX && (transa == 'C' || transa == 'c');
+    const int b_conj = IS_COMPLEX && (transb == 'C' || transb == 'c');
+    const int rs_a = a_trans ? lda : 1, cs_a = a_trans ? 1 : lda;
+    const int rs_b = b_trans ? ldb : 1, cs_b = b_trans ? 1 : ldb;
+
+    if(m <= 0 || n <= 0) {
+        return;
+    }
+    if(k <= 0 || alpha == 0.0) {
+        // Column by column, so the epilogue finds each in cache
+        for(int column = 0; column < n; column++) {
+            NAME(scale_c)(m, column, column + 1, beta, c, ldc);
+            FINISH(0, column, m, 1, c + (size_t)column*ldc);
+        }
+        return;
+    }
+#ifdef RECURSIVE_GEMM
+    if(!a_trans && !b_trans && alpha == 1.0 && !epilogue && (double)m*n*k >= RECURSIVE_MIN
+       && (double)m*n*k <= (double)RECURSIVE_CUTOFF(ctx)*RECURSIVE_CUTOFF(ctx)*RECURSIVE_CUTOFF(ctx)) {
+        instrument_start(&timer, PHASE_KERNEL);
+        NAME(scale_c)(m, 0, n, beta, c, ldc);
+        RECURSIVE_GEMM(m, n, k, a, lda, b, ldb, c, ldc);
+        instrument_stop(&timer);
+        instrument_count(PHASE_KERNEL, COUNT_FLOPS, FLOPS_PER_UPDATE*m*n*k);
+        return;
+    }
+#endif
+    if(m <= 32 && n <= 32 && k <= 32 && !epilogue) {
+        instrument_start(&timer, PHASE_KERNEL);
+        NAME(scale_c)(m, 0, n, beta, c, ldc);
+#ifdef BASIC_GEMM
+        if(!a_trans && !b_trans && alpha == 1.0) {
+            BASIC_GEMM(m, n, k, a, lda, b, ldb, c, ldc);
+        } else
+#endif
+        {
+            for(int j = 0; j < n; j++) {
+                for(int p = 0; p < k; p++) {
+                    T b_pj = alpha*CONJ_IF(b[(size_t)p*rs_b + (size_t)j*cs_b], b_conj);
+                    for(int i = 0; i < m; i++) {
+                        c[i + (size_t)j*ldc] += CONJ_IF(a[(size_t)i*rs_a + (size_t)p*cs_a], a_conj)*b_pj;
+                    }
+                }
+            }
+        }
+        instrument_stop(&timer);
+        instrument_count(PHASE_KERNEL, COUNT_FLOPS, FLOPS_PER_UPDATE*m*n*k);
+        return;
+    }
+#ifdef SKINNY_GEMM
+    if(!a_trans && !b_trans && alpha == 1.0 && !epilogue && SKINNY_SHAPE(m, n, k)) {
+        instrument_start(&timer, PHASE_KERNEL);
+        NAME(scale_c)(m, 0, n, beta, c, ldc);
+        SKINNY_GEMM(threads, m, n, k, a, lda, b, ldb, c, ldc);
+        instrument_stop(&timer);
+        instrument_count(PHASE_KERNEL, COUNT_FLOPS, FLOPS_PER_UPDATE*m*n*k);
+        return;
+    }
+#endif
+
+    m_b = share < m_b ? share : m_b;
+    m_blocks = 1 + (m - 1) / m_b;
+    // Slivers in the widest panel of B
+    n_slivers = 1 + ((n < n_b ? n : n_b) - 1) / n_r;
+    // Split the columns too if there are fewer blocks of A than threads
+    n_split = m_blocks >= threads ? 1 : 1 + (threads - 1) / m_blocks;
+    n_split = n_split < n_slivers ? n_split : n_slivers;
+    threads = threads < m_blocks*n_split ? threads : m_blocks*n_split;
+
+    // B_packed (k_c*n_b) is shared and each thread has its own A_packed (m_b*k_c)
+    reserve_workspace(ctx, threads, IN_DOUBLES((size_t)m_b*k_c), IN_DOUBLES((size_t)k_c*n_slivers*n_r));
+    B_packed = (T *)ctx->B_packed;
+
+    #pragma omp parallel num_threads(threads) if(threads > 1)
+    {
+        struct instrument_timer thread_timer;
+#ifdef _OPENMP
+        const int thread = omp_get_thread_num(), team = omp_get_num_threads();
+#else
+        const int thread = 0, team = 1;
+#endif
+        T *A_packed = (T *)ctx->A_packed[thread];
+
+        // Fault a new A_packed in from this thread, placing it on this thread's NUMA node
+        if(ctx->A_fresh[thread]) {
+            workspace_touch(A_packed, ctx->A_size[thread]*sizeof(double));
+            ctx->A_fresh[thread] = 0;
+        }
+
+#if IS_COMPLEX
+        // Apply beta before any products are added to C (the kernels do it for the real types)
+        #pragma omp for schedule(static)
+        for(int column = 0; column < n; column++) {
+            NAME(scale_c)(m, column, column + 1, beta, c, ldc);
+        }
+#endif
+
+        // Split B into panels n_b wide (and C likewise)
+        for(int loop_0 = 0; loop_0 < n; loop_0 += n_b) {
+            // The last panel may be narrower than n_b
+            int width = n - loop_0 < n_b ? n - loop_0 : n_b;
+            int slivers = 1 + (width - 1) / n_r;
+            int split = n_split < slivers ? n_split : slivers;
+            int items = m_blocks*split;
+            // This thread's share of the items
+            const int first_item = SHARE(items, thread, team), last_item = SHARE(items, thread + 1, team);
+
+            // Split A into columns k_c wide and B into rows k_c tall. Access these simultaneously as the i'th index of column/row
+            for(int loop_1 = 0; loop_1 < k; loop_1 += k_c) {
+                // The last panel may be shallower than k_c
+                int depth = k - loop_1 < k_c ? k - loop_1 : k_c;
+                // The block of A currently in A_packed
+                int packed = -1;
+                // The panel after this one (in the next panel of B if this is the last of k), and what of it to prefetch
+                const int next_1 = loop_1 + k_c < k ? loop_1 + k_c : 0;
+                const int next_0 = loop_1 + k_c < k ? loop_0 : loop_0 + n_b;
+                const int next_depth = k - next_1 < k_c ? k - next_1 : k_c;
+                // The tiles of C are final after this panel
+                const int last_panel = loop_1 + depth == k;
+                // What the kernels do besides adding this panel: scale C by beta with the first, and add the
+                // epilogue's biases and clamp with the last
+                struct gemm_update update = {loop_1 == 0 ? KERNEL_BETA(beta) : 1.0, NULL, NULL, 0, 0.0, 0.0};
+                struct NAME(prefetcher) next_b = {0};
+
+#ifdef EPILOGUE
+                if(last_panel && epilogue) {
+                    update.row_bias = epilogue->row_bias;
+                    update.column_bias = epilogue->column_bias;
+                    update.clamp = epilogue->clamp;
+                    update.lower = epilogue->lower;
+                    update.upper = epilogue->upper;
+                }
+#endif
+                if(prefetch && next_0 < n) {
+                    // This thread's slivers of the next panel of B, over all of its tiles of C
+                    int next_width = n - next_0 < n_b ? n - next_0 : n_b;
+                    int next_slivers = 1 + (next_width - 1) / n_r;
+                    int first_column = SHARE(next_slivers, thread, team)*n_r;
+                    int last_column = SHARE(next_slivers, thread + 1, team)*n_r;
+                    int tiles = 0;
+                    for(int item = first_item; item < last_item; item++) {
+                        int rows = m - (item / split)*m_b < m_b ? m - (item / split)*m_b : m_b;
+                        tiles += (SHARE(slivers, item % split + 1, split) - SHARE(slivers, item % split, split))
+                            *(1 + (rows - 1) / m_r);
+                    }
+                    NAME(prefetch_start)(&next_b, b + (size_t)next_1*rs_b + (size_t)(next_0 + first_column)*cs_b,
+                                         rs_b, cs_b, next_depth,
+                                         (last_column < next_width ? last_column : next_width) - first_column, tiles);
+                }
+
+                // Pack the row from B, one sliver n_r wide at a time, each thread its share (the barrier waits for all of it)
+                instrument_start(&thread_timer, PHASE_PACK_B);
+                for(int sliver = SHARE(slivers, thread, team); sliver < SHARE(slivers, thread + 1, team); sliver++) {
+                    int column = sliver*n_r;
+                    NAME(pack_b)(b + (size_t)loop_1*rs_b + (size_t)(loop_0 + column)*cs_b, rs_b, cs_b, b_conj, depth,
+                           width - column < n_r ? width - column : n_r, n_r,
+                           B_packed + column*depth); // Handle possible uneven n inside pack_b
+                }
+                instrument_stop(&thread_timer);
+                #pragma omp barrier
+
+                // Split the column from A into blocks m_b tall (and possibly the row from B into split parts)
+                // Consecutive items share a block of A, so giving each thread a range of them packs each block as few times as possible
+                for(int item = first_item; item < last_item; item++) {
+                    int loop_2 = (item / split)*m_b;
+                    // The last block may be shorter than m_b
+                    int rows = m - loop_2 < m_b ? m - loop_2 : m_b;
+                    // This item's slivers of B
+                    int first = SHARE(slivers, item % split, split);
+                    int last = SHARE(slivers, item % split + 1, split);
+                    // The block of A this thread packs next (if not the one it has now), over this item's tiles of C
+                    struct NAME(prefetcher) next_a = {0};
+
+                    if(prefetch) {
+                        int next_2 = item + 1 < last_item ? ((item + 1) / split)*m_b : (first_item / split)*m_b;
+                        if(item + 1 < last_item ? next_2 != loop_2 : next_0 < n) {
+                            NAME(prefetch_start)(&next_a, a + (size_t)next_2*rs_a
+                                                 + (size_t)(item + 1 < last_item ? loop_1 : next_1)*cs_a, rs_a, cs_a,
+                                                 m - next_2 < m_b ? m - next_2 : m_b,
+                                                 item + 1 < last_item ? depth : next_depth,
+                                                 (last - first)*(1 + (rows - 1) / m_r));
+                        }
+                    }
+
+                    if(packed != loop_2) {
+                        // Pack the block from A, which starts loop_2 values down in the loop_1'th column of A
+                        instrument_start(&thread_timer, PHASE_PACK_A);
+                        NAME(pack_a)(a + (size_t)loop_2*rs_a + (size_t)loop_1*cs_a, rs_a, cs_a, a_conj, alpha,
+                                     rows, depth, m_r, A_packed); // Handle possible uneven rows inside pack_a
+                        instrument_stop(&thread_timer);
+                        packed = loop_2;
+                    }
+                    instrument_start(&thread_timer, PHASE_KERNEL);
+                    // Split the row from B into columns n_r wide
+                    for(int loop_3 = first*n_r; loop_3 < last*n_r; loop_3 += n_r) {
+                        // The start of the current column
+                        const T *B_splice = (B_packed + loop_3*depth);
+
+                        // Split the block from the column from A into rows m_r tall, stopping at the end of the block
+                        for(int loop_4 = 0; loop_4 < rows; loop_4 += m_r) {
+                            // The start of the current row
+                            const T *A_splice = (A_packed + loop_4*depth);
+
+                            // A slice of what gets packed next, into L2 (A, packed soon) or L3 (B, packed after all of A)
+                            NAME(prefetch_step)(&next_a, 2);
+                            NAME(prefetch_step)(&next_b, 1);
+
+                            // Multiply the row from A with the column from B, adding into C at (loop_2 + loop_4, loop_0 + loop_3)
+                            NAME(micro_kernel)(kernel, depth, A_splice, B_splice, rows - loop_4, width - loop_3,
+                                               c + loop_2 + loop_4 + (size_t)(loop_0 + loop_3)*ldc, ldc, &update,
+                                               loop_2 + loop_4, loop_0 + loop_3);
+                            // The tile is final
+                            if(last_panel) {
+                                FINISH_TILE(loop_2 + loop_4, loop_0 + loop_3, rows - loop_4 < m_r ? rows - loop_4 : m_r,
+                                            width - loop_3 < n_r ? width - loop_3 : n_r,
+                                            c + loop_2 + loop_4 + (size_t)(loop_0 + loop_3)*ldc);
+                            }
+                        }
+                    }
+                    instrument_stop(&thread_timer);
+                }
+                // Keep B_packed until every thread is done with it
+                #pragma omp barrier
+            }
+        }
+    }
+    if(instrument_enabled) {
+        // Packed traffic: every panel of B once, every block of A once per panel of B
+        instrument_count(PHASE_PACK_B, COUNT_BYTES_READ, sizeof(T)*(double)k*n);
+        instrument_count(PHASE_PACK_A, COUNT_BYTES_READ, sizeof(T)*(double)m*k*(1 + (n - 1) / n_b));
+        instrument_count(PHASE_PACK_B, COUNT_BYTES_WRITTEN,
+                         sizeof(T)*(double)k*(1 + ((n - 1) / n_r))*n_r);
+        instrument_count(PHASE_PACK_A, COUNT_BYTES_WRITTEN,
+                         sizeof(T)*(double)k*(1 + (m - 1) / m_r)*m_r*(1 + (n - 1) / n_b));
+        instrument_count(PHASE_KERNEL, COUNT_FLOPS, FLOPS_PER_UPDATE*m*n*k);
+        // C is read and written once per panel of k
+        instrument_count(PHASE_KERNEL, COUNT_BYTES_READ, sizeof(T)*(double)(1 + (k - 1) / k_c)*m*n);
+        instrument_count(PHASE_KERNEL, COUNT_BYTES_WRITTEN, sizeof(T)*(double)(1 + (k - 1) / k_c)*m*n);
+    }
+}
+#undef FINISH
+#undef FINISH_TILE
+
+void NAME(gemm_ctx)(struct gemm_context *ctx, char transa, char transb,
+                    int m, int n, int k,
+                    T alpha, const T *a, int lda,
+                    const T *b, int ldb,
+                    T beta, T *c, int ldc)
+{
+    NAME(gemm_engine)(ctx, transa, transb, m, n, k, alpha, a, lda, b, ldb, beta, c, ldc, NULL);
+}
+
+/* Pack alpha times a rows x depth block of op(A) (starting at a) as needed for BLIS.
+ *
+ * Element (i, j) of the block is a[i*rs + j*cs] (conjugated if conjugate): rs = 1, cs = lda for A itself and
+ * rs = lda, cs = 1 for its transpose.
+ * Output is stored in A_packed: slivers of m_r rows, each stored column by column
+ * (m_r values per column). If rows is not a multiple of m_r, the rows of the last sliver past
+ * the end of the block are set to zero, so the edge kernels can load whole vectors of it.
+ * Whole slivers are copied without any bounds checks.
+ */
+static void NAME(pack_a)(const T *a, int rs, int cs, int conjugate, T alpha, int rows, int depth, int m_r, T *A_packed) {
+    // Number of rows in whole slivers, and in the partial sliver (if any)
+    const int whole = (rows / m_r)*m_r;
+    const int left = rows - whole;
+
+    // Loop over each whole row in the output
+    for(int row = 0; row < whole; row += m_r) {
+        // Loop over each column in this row
+        for(int column = 0; column < depth; column++) {
+            // Select the appropriate values from A
+            // These can be found at value*rs + column*cs + row*rs
+            // value shifts downwards in each column, so we add value*rs
+            // column shifts rightwards within each row, so we add column*cs
+            // row shifts downwards, as each row is of height m_r, hence row*rs is added
+            const T *from = a + (size_t)column*cs + (size_t)row*rs;
+            // Loop over each value in this column (unit stride, the common case, kept separate so it vectorises)
+            if(rs == 1) {
+                for(int value = 0; value < m_r; value++) {
+                    A_packed[value] = alpha*CONJ_IF(from[value], conjugate);
+                }
+            } else {
+                for(int value = 0; value < m_r; value++) {
+                    A_packed[value] = alpha*CONJ_IF(from[(size_t)value*rs], conjugate);
+                }
+            }
+            A_packed += m_r;
+        }
+    }
+    if(left) {
+        // The partial row: copy what there is and pad with zeros
+        for(int column = 0; column < depth; column++) {
+            const T *from = a + (size_t)column*cs + (size_t)whole*rs;
+            for(int value = 0; value < left; value++) {
+                A_packed[value] = alpha*CONJ_IF(from[(size_t)value*rs], conjugate);
+            }
+            for(int value = left; value < m_r; value++) {
+                A_packed[value] = 0;
+            }
+            A_packed += m_r;
+        }
+    }
+}
+
+/* Pack a depth x n panel of op(B) (starting at b) as needed for BLIS.
+ *
+ * Element (i, j) of the panel is b[i*rs + j*cs] (conjugated if conjugate): rs = 1, cs = ldb for B itself and
+ * rs = ldb, cs = 1 for its transpose.
+ * Output is stored in B_packed: slivers of n_r columns, each stored row by row
+ * (n_r values per row). If n is not a multiple of n_r, the columns of the last sliver past the
+ * end of B are left unset; the edge kernels never read them.
+ * Whole slivers are copied without any bounds checks.
+ */
+static void NAME(pack_b)(const T *b, int rs, int cs, int conjugate, int depth, int n, int n_r, T *B_packed) {
+    // Number of columns in whole slivers, and in the partial sliver (if any)
+    const int whole = (n / n_r)*n_r;
+    const int left = n - whole;
+
+    // Loop over each whole column in the output
+    for(int column = 0; column < whole; column += n_r) {
+        // Loop over each line in this column
+        for(int line = 0; line < depth; line++) {
+            // Select the appropriate values from B
+            // These can be found at value*cs + line*rs + column*cs
+            // value shifts rightwards on each row, so we add value*cs
+            // line shifts downwards, so we add line*rs
+            // column shifts n_r steps rightwards, as each column is of width n_r, hence column*cs is added
+            const T *from = b + (size_t)line*rs + (size_t)column*cs;
+            // Loop over each value in this line (unit stride, i.e. B transposed, kept separate so it vectorises)
+            if(cs == 1) {
+                for(int value = 0; value < n_r; value++) {
+                    B_packed[value] = CONJ_IF(from[value], conjugate);
+                }
+            } else {
+                for(int value = 0; value < n_r; value++) {
+                    B_packed[value] = CONJ_IF(from[(size_t)value*cs], conjugate);
+                }
+            }
+            B_packed += n_r;
+        }
+    }
+    if(left) {
+        // The partial column: only what there is
+        for(int line = 0; line < depth; line++) {
+            const T *from = b + (size_t)line*rs + (size_t)whole*cs;
+            for(int value = 0; value < left; value++) {
+                B_packed[value] = CONJ_IF(from[(size_t)value*cs], conjugate);
+            }
+            B_packed += n_r;
+        }
+    }
+}
+
+/* Apply the micro kernel, i.e. matrix multiplication of A_splice * B_splice, adding into c
+ * 
+ * A_splice and B_splice hold depth columns/rows of the packed panels.
+ * rows and columns are how much of C is left below and to the right of c:
+ * if that is a whole m_r x n_r tile the kernel works on C directly, otherwise the edge kernel
+ * for the rows x columns that are left does (without computing or storing the padding).
+ * update is passed on for the tile at (row, column) of C (its biases are for all of C), or
+ * NULL if it leaves the tile as a plain addition.
+ */
+static void NAME(micro_kernel)(const struct NAME(micro) *kernel, int depth, const T *A_splice, const T *B_splice,
+                               int rows, int columns, T *c, int ldc, const struct gemm_update *update,
+                               int row, int column) {
+    const int m_r = kernel->m_r;
+    const int n_r = kernel->n_r;
+    struct gemm_update tile = *update;
+
+    tile.row_bias = update->row_bias ? update->row_bias + row : NULL;
+    tile.column_bias = update->column_bias ? update->column_bias + column : NULL;
+    update = tile.beta != 1.0 || tile.row_bias || tile.column_bias || tile.clamp ? &tile : NULL;
+    if(rows >= m_r && columns >= n_r) {
+        kernel->kernel(depth, A_splice, B_splice, c, ldc, update);
+    } else {
+        kernel->edge(depth, rows < m_r ? rows : m_r, columns < n_r ? columns : n_r, A_splice, B_splice, c, ldc,
+                     update);
+    }
+}
+
+/* Set fetch up to prefetch the rows x columns block of op(X) (element (i, j) at x[i*rs + j*cs]) over steps steps. */
+static void NAME(prefetch_start)(struct NAME(prefetcher) *fetch, const T *x, int rs, int cs, int rows, int columns,
+                                 int steps) {
+    fetch->x = (const char *)x;
+    fetch->lines = rs == 1 ? columns : rows;
+    fetch->length = (size_t)(rs == 1 ? rows : columns)*sizeof(T);
+    fetch->stride = (size_t)(rs == 1 ? cs : rs)*sizeof(T);
+    fetch->next = 0;
+    fetch->step = steps > 0 ? 1 + (fetch->lines - 1) / steps : fetch->lines;
+}
+
+/* Prefetch the next step of lines of fetch's block, if any are left, into L2 (locality 2) or L3 (locality 1). */
+static inline void NAME(prefetch_step)(struct NAME(prefetcher) *fetch, int locality) {
+    const int end = fetch->next + fetch->step < fetch->lines ? fetch->next + fetch->step : fetch->lines;
+
+    for(; fetch->next < end; fetch->next++) {
+        const char *start = fetch->x + fetch->next*fetch->stride;
+        // Every cache line the line touches, from the one holding its first byte
+        for(uintptr_t address = (uintptr_t)start & ~(uintptr_t)(CACHE_LINE - 1);
+            address < (uintptr_t)start + fetch->length; address += CACHE_LINE) {
+            if(locality == 2) {
+                __builtin_prefetch((const void *)address, 0, 2);
+            } else {
+                __builtin_prefetch((const void *)address, 0, 1);
+            }
+        }
+    }
+}
+
+#undef CONJ_IF
+#undef KERNEL_BETA
+#undef IN_DOUBLES
+#undef FLOPS_PER_UPDATE
+#undef SHARE
@@ -0,0 +1,500 @@
+/* This file implements the cache blocking parameters of optimised_gemm:
+ * defaults derived from the cache hierarchy (read from sysfs), tuning
+ * profiles that override them, and the autotuner that writes profiles.
+ *
+ * A profile is a text file of "key value" lines ('#' starts a comment):
+ *   kernel avx512
+ *   k_c 384
+ *   m_c 480
+ *   n_c 4096
+ *   strassen_cutoff 2048
+ *   recursive_cutoff 40
+ * Any key may be left out.  It is read from GEMM_PROFILE if that is set,
+ * otherwise from ~/.gemm-profile, the first time optimised_gemm runs.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "gemm.h"
+#include "gemm-bench.h"
+
+// Used when the cache sizes cannot be read: the values tuned by hand for Hamilton
+#define FALLBACK_K_C 256
+#define FALLBACK_M_C 512
+#define FALLBACK_N_C 4096
+// The largest n_c derived from L3, which is usually shared between many cores
+#define MAX_N_C 8192
+// Smallest dimension strassen_gemm splits when there is no tuned cutoff
+#define FALLBACK_STRASSEN_CUTOFF 4096
+// Size up to which plain products skip packing when there is no tuned cutoff (measured with AVX-512)
+#define FALLBACK_RECURSIVE_CUTOFF 40
+
+static struct gemm_blocking defaults;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static struct gemm_profile loaded;
+static pthread_once_t loaded_once = PTHREAD_ONCE_INIT;
+
+static long read_cache_size(const char *dir)
+{
+    char path[256], text[64], unit = 'B';
+    long size;
+    FILE *f;
+    snprintf(path, sizeof(path), "%s/size", dir);
+    if (!(f = fopen(path, "r"))) {
+        return 0;
+    }
+    if (!fgets(text, sizeof(text), f) || sscanf(text, "%ld%c", &size, &unit) < 1) {
+        size = 0;
+    }
+    fclose(f);
+    if (unit == 'K') {
+        size <<= 10;
+    } else if (unit == 'M') {
+        size <<= 20;
+    }
+    return size;
+}
+
+/* Read the data cache sizes of cpu0 from sysfs (0 for any not found). */
+void gemm_cache_sizes(struct gemm_caches *caches)
+{
+    memset(caches, 0, sizeof(*caches));
+    for (int index = 0; index < 16; index++) {
+        char dir[128], path[160], type[32] = "";
+        int level = 0;
+        FILE *f;
+        snprintf(dir, sizeof(dir), "/sys/devices/system/cpu/cpu0/cache/index%d", index);
+        snprintf(path, sizeof(path), "%s/level", dir);
+        if (!(f = fopen(path, "r"))) {
+            break;
+        }
+        if (fscanf(f, "%d", &level) != 1) {
+            level = 0;
+        }
+        fclose(f);
+        snprintf(path, sizeof(path), "%s/type", dir);
+        if ((f = fopen(path, "r"))) {
+            if (fscanf(f, "%31s", type) != 1) {
+                type[0] = '\0';
+            }
+            fclose(f);
+        }
+        if (!strcmp(type, "Instruction")) {
+            continue;
+        }
+        if (level == 1) {
+            caches->l1d = read_cache_size(dir);
+        } else if (level == 2) {
+            caches->l2 = read_cache_size(dir);
+        } else if (level == 3) {
+            caches->l3 = read_cache_size(dir);
+        }
+    }
+}
+
+/*
+ * Derive blocking for a kernel from the cache sizes, BLIS style:
+ * a k_c x n_r sliver of B takes half of L1, an m_c x k_c block of A half
+ * of L2 and a k_c x n_c panel of B half of L3.
+ */
+void gemm_derive_blocking(const struct gemm_caches *caches, const struct gemm_kernel *kernel,
+                          struct gemm_blocking *blocking)
+{
+    blocking->k_c = FALLBACK_K_C;
+    blocking->m_c = FALLBACK_M_C;
+    blocking->n_c = FALLBACK_N_C;
+    if (caches->l1d > 0) {
+        blocking->k_c = (int)(caches->l1d / 2 / (kernel->n_r*sizeof(double)));
+        // Multiple of 8 in [64, 1024]
+        blocking->k_c = blocking->k_c < 64 ? 64 : blocking->k_c > 1024 ? 1024 : blocking->k_c & ~7;
+    }
+    if (caches->l2 > 0) {
+        blocking->m_c = (int)(caches->l2 / 2 / (blocking->k_c*sizeof(double)));
+    }
+    if (caches->l3 > 0) {
+        blocking->n_c = (int)(caches->l3 / 2 / (blocking->k_c*sizeof(double)));
+        blocking->n_c = blocking->n_c > MAX_N_C ? MAX_N_C : blocking->n_c;
+    }
+    blocking->m_c = blocking->m_c < kernel->m_r ? kernel->m_r : (blocking->m_c / kernel->m_r)*kernel->m_r;
+    blocking->n_c = blocking->n_c < kernel->n_r ? kernel->n_r : (blocking->n_c / kernel->n_r)*kernel->n_r;
+}
+
+/* Where the tuning profile is read from and (by default) written to. */
+const char *gemm_profile_path(void)
+{
+    static char path[4096];
+    const char *env = getenv("GEMM_PROFILE");
+    const char *home = getenv("HOME");
+    if (env && *env) {
+        return env;
+    }
+    snprintf(path, sizeof(path), "%s/.gemm-profile", home ? home : ".");
+    return path;
+}
+
+/*
+ * Read a tuning profile.  Entries missing from the file are left as they
+ * were in *profile.  Returns 1 if the file cannot be read, 0 otherwise.
+ */
+int gemm_read_profile(const char *file, struct gemm_profile *profile)
+{
+    char line[256], key[64], value[64];
+    FILE *f = fopen(file, "r");
+    if (!f) {
+        return 1;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        char *comment = strchr(line, '#');
+        if (comment) {
+            *comment = '\0';
+        }
+        if (sscanf(line, "%63s %63s", key, value) != 2) {
+            continue;
+        }
+        if (!strcmp(key, "kernel")) {
+            snprintf(profile->kernel, sizeof(profile->kernel), "%.31s", value);
+        } else if (!strcmp(key, "k_c") && atoi(value) > 0) {
+            profile->blocking.k_c = atoi(value);
+        } else if (!strcmp(key, "m_c") && atoi(value) > 0) {
+            profile->blocking.m_c = atoi(value);
+        } else if (!strcmp(key, "n_c") && atoi(value) > 0) {
+            profile->blocking.n_c = atoi(value);
+        } else if (!strcmp(key, "strassen_cutoff") && atoi(value) > 0) {
+            profile->strassen_cutoff = atoi(value);
+        } else if (!strcmp(key, "recursive_cutoff") && atoi(value) > 0) {
+            profile->recursive_cutoff = atoi(value);
+        } else {
+            fprintf(stderr, "Ignoring unknown entry '%s' in GEMM profile %s\n", key, file);
+        }
+    }
+    fclose(f);
+    return 0;
+}
+
+/* Write a tuning profile. Returns 1 on failure, 0 on success. */
+int gemm_write_profile(const char *file, const struct gemm_profile *profile)
+{
+    char host[256] = "unknown";
+    time_t now = time(NULL);
+    FILE *f = fopen(file, "w");
+    if (!f) {
+        fprintf(stderr, "Unable to open %s for writing the GEMM profile.\n", file);
+        return 1;
+    }
+    gethostname(host, sizeof(host) - 1);
+    fprintf(f, "# GEMM tuning profile for %s, written by gemm TUNE on %s", host, ctime(&now));
+    fprintf(f, "kernel %s\n", profile->kernel);
+    fprintf(f, "k_c %d\n", profile->blocking.k_c);
+    fprintf(f, "m_c %d\n", profile->blocking.m_c);
+    fprintf(f, "n_c %d\n", profile->blocking.n_c);
+    if (profile->strassen_cutoff > 0) {
+        fprintf(f, "strassen_cutoff %d\n", profile->strassen_cutoff);
+    }
+    if (profile->recursive_cutoff > 0) {
+        fprintf(f, "recursive_cutoff %d\n", profile->recursive_cutoff);
+    }
+    fclose(f);
+    return 0;
+}
+
+static void load_profile(void)
+{
+    gemm_read_profile(gemm_profile_path(), &loaded);
+}
+
+/* The profile read at startup; absent entries are empty or 0. */
+const struct gemm_profile *gemm_loaded_profile(void)
+{
+    pthread_once(&loaded_once, &load_profile);
+    return &loaded;
+}
+
+static void init_defaults(void)
+{
+    struct gemm_caches caches;
+    const struct gemm_profile *profile = gemm_loaded_profile();
+    gemm_cache_sizes(&caches);
+    // The active kernel already reflects the profile's choice (see gemm-kernels.c)
+    gemm_derive_blocking(&caches, gemm_active_kernel(), &defaults);
+    if (profile->blocking.k_c > 0) {
+        defaults.k_c = profile->blocking.k_c;
+    }
+    if (profile->blocking.m_c > 0) {
+        defaults.m_c = profile->blocking.m_c;
+    }
+    if (profile->blocking.n_c > 0) {
+        defaults.n_c = profile->blocking.n_c;
+    }
+}
+
+/* The blocking optimised_gemm uses unless a context sets its own. */
+const struct gemm_blocking *gemm_default_blocking(void)
+{
+    pthread_once(&once, &init_defaults);
+    return &defaults;
+}
+
+/* The Strassen cutoff strassen_gemm uses unless a context sets its own:
+ * GEMM_STRASSEN_CUTOFF if set, otherwise the profile's, otherwise a fallback. */
+int gemm_default_strassen_cutoff(void)
+{
+    const char *env = getenv("GEMM_STRASSEN_CUTOFF");
+    if (env && atoi(env) > 0) {
+        return atoi(env);
+    }
+    if (gemm_loaded_profile()->strassen_cutoff > 0) {
+        return gemm_loaded_profile()->strassen_cutoff;
+    }
+    return FALLBACK_STRASSEN_CUTOFF;
+}
+
+/* The recursive cutoff dgemm_ctx uses unless a context sets its own:
+ * GEMM_RECURSIVE_CUTOFF if set, otherwise the profile's, otherwise a fallback. */
+int gemm_default_recursive_cutoff(void)
+{
+    static int cutoff = 0;
+    if (cutoff == 0) {
+        const char *env = getenv("GEMM_RECURSIVE_CUTOFF");
+        if (env && atoi(env) > 0) {
+            cutoff = atoi(env);
+        } else if (gemm_loaded_profile()->recursive_cutoff > 0) {
+            cutoff = gemm_loaded_profile()->recursive_cutoff;
+        } else {
+            cutoff = FALLBACK_RECURSIVE_CUTOFF;
+        }
+    }
+    return cutoff;
+}
+
+/* A product the tuner times, through the bench harness (gemm_bench_time). */
+struct tune_call {
+    struct gemm_context *ctx;
+    int strassen;               // strassen_gemm_ctx rather than optimised_gemm_ctx
+    int m, n, k;
+    const double *a, *b;
+    double *c;
+};
+
+static void run_tune_call(void *arg)
+{
+    const struct tune_call *call = arg;
+    if (call->strassen) {
+        strassen_gemm_ctx(call->ctx, 1.0, call->m, call->n, call->k, call->a, call->m,
+                          call->b, call->k, call->c, call->m);
+    } else {
+        optimised_gemm_ctx(call->ctx, call->m, call->n, call->k, call->a, call->m,
+                           call->b, call->k, call->c, call->m);
+    }
+}
+
+/* The best of samples (at most 5) timed samples of call, after a warm up call, each
+ * sample at least sample_time seconds long; returns the time per call. */
+static double best_time(struct tune_call *call, int samples, double sample_time)
+{
+    double times[5], best = 1e300;
+    gemm_bench_time(&run_tune_call, NULL, call, 1, samples, sample_time, times);
+    for (int i = 0; i < samples; i++) {
+        best = times[i] < best ? times[i] : best;
+    }
+    return best;
+}
+
+/* Best of three timed runs (after a warm up run) with the given settings. */
+static double time_gemm(struct gemm_context *ctx, const struct gemm_blocking *blocking,
+                        int m, int n, int k, const double *a, const double *b, double *c)
+{
+    struct tune_call call = {ctx, 0, m, n, k, a, b, c};
+    gemm_context_set_blocking(ctx, blocking);
+    return best_time(&call, 3, 0);
+}
+
+/* Try the candidates for one of the parameters, keeping the fastest. */
+static void search(struct gemm_context *ctx, struct gemm_blocking *blocking, int *parameter,
+                   const int *candidates, int ncandidates, int multiple, double *best,
+                   int m, int n, int k, const double *a, const double *b, double *c)
+{
+    int chosen = *parameter;
+    for (int i = 0; i < ncandidates; i++) {
+        double t;
+        *parameter = (candidates[i] / multiple)*multiple;
+        if (*parameter < multiple || *parameter == chosen) {
+            continue;
+        }
+        if ((t = time_gemm(ctx, blocking, m, n, k, a, b, c)) < *best) {
+            *best = t;
+            chosen = *parameter;
+        }
+    }
+    *parameter = chosen;
+}
+
+/*
+ * Find the smallest size (of those tried) at which one level of Strassen-Winograd
+ * beats the blocked kernel with the settings of ctx, timing square products.
+ * Returns twice the largest size tried if it never does.
+ */
+static int tune_strassen_cutoff(struct gemm_context *ctx, FILE *log)
+{
+    const int sizes[] = {1024, 2048, 4096};
+    const int nsizes = sizeof(sizes)/sizeof(sizes[0]);
+    for (int i = 0; i < nsizes; i++) {
+        const int s = sizes[i];
+        double *a = malloc((size_t)s*s*sizeof(double));
+        double *b = malloc((size_t)s*s*sizeof(double));
+        double *c = calloc((size_t)s*s, sizeof(double));
+        struct tune_call call = {ctx, 0, s, s, s, a, b, c};
+        double plain, strassen;
+        for (size_t j = 0; j < (size_t)s*s; j++) {
+            a[j] = drand48();
+            b[j] = drand48();
+        }
+        gemm_context_set_strassen_cutoff(ctx, s);
+        // Each warmed up, then best of two
+        plain = best_time(&call, 2, 0);
+        call.strassen = 1;
+        strassen = best_time(&call, 2, 0);
+        free(a);
+        free(b);
+        free(c);
+        fprintf(log, "strassen %d: %.3gs, blocked %.3gs\n", s, strassen, plain);
+        if (strassen < plain) {
+            return s;
+        }
+    }
+    return 2*sizes[nsizes - 1];
+}
+
+/*
+ * Find the largest size (of those tried) at which the recursive path still beats the
+ * packed path with the settings of ctx, timing square products: the size from which
+ * packing pays for itself.  Both sides are timed through dgemm_ctx, with the cutoff
+ * that sends the product down each path, so they include the same dispatch.
+ * Square products of up to SMALL_SQUARE never reach the packed path (dgemm_ctx sends
+ * them to the small and thin paths), so the sizes tried start above it, and
+ * SMALL_SQUARE is returned if packing wins from the first one: the recursive path
+ * then still takes the products that would not be packed anyway.
+ */
+#define SMALL_SQUARE 32
+static int tune_recursive_cutoff(struct gemm_context *ctx, FILE *log)
+{
+    const int sizes[] = {40, 48, 56, 64, 80, 96, 128, 160, 192, 256};
+    const int nsizes = sizeof(sizes)/sizeof(sizes[0]);
+    int cutoff = SMALL_SQUARE;
+    for (int i = 0; i < nsizes; i++) {
+        const int s = sizes[i];
+        double *a = malloc((size_t)s*s*sizeof(double));
+        double *b = malloc((size_t)s*s*sizeof(double));
+        double *c = calloc((size_t)s*s, sizeof(double));
+        struct tune_call call = {ctx, 0, s, s, s, a, b, c};
+        double packed, recursive;
+        for (size_t j = 0; j < (size_t)s*s; j++) {
+            a[j] = drand48();
+            b[j] = drand48();
+        }
+        // Best of five samples of about a millisecond each; with a cutoff of 1 plain
+        // products are packed, with a cutoff of s this one takes the recursive path
+        gemm_context_set_recursive_cutoff(ctx, 1);
+        packed = best_time(&call, 5, 1e-3);
+        gemm_context_set_recursive_cutoff(ctx, s);
+        recursive = best_time(&call, 5, 1e-3);
+        free(a);
+        free(b);
+        free(c);
+        fprintf(log, "recursive %d: %.3g GFLOP/s, packed %.3g GFLOP/s\n", s,
+                2.0*s*s*s / recursive * 1e-9, 2.0*s*s*s / packed * 1e-9);
+        if (packed < recursive) {
+            break;
+        }
+        cutoff = s;
+    }
+    gemm_context_set_recursive_cutoff(ctx, 0);
+    return cutoff;
+}
+
+/*
+ * Search the blocking space for every kernel the CPU supports, timing an
+ * m x n x k multiplication, and write the fastest settings to file.
+ * Each kernel starts from the blocking derived from the caches, and k_c,
+ * m_c and n_c are tuned in turn; then the Strassen and recursive cutoffs are
+ * found for the fastest kernel and blocking.  Progress is reported on log.
+ * Returns 1 if the profile could not be written, 0 otherwise.
+ */
+int gemm_tune(int m, int n, int k, const char *file, FILE *log)
+{
+    const int k_cs[] = {64, 96, 128, 192, 256, 320, 384, 448, 512, 768};
+    const int n_cs[] = {512, 1024, 2048, 3072, 4096, 6144, 8192};
+    const double flop = 2.0*m*n*k;
+    struct gemm_caches caches;
+    struct gemm_profile best = {"", {0, 0, 0}, 0, 0};
+    double best_time = 1e300;
+    int nkernels;
+    const struct gemm_kernel *kernels = gemm_kernels(&nkernels);
+    struct gemm_context *ctx = gemm_context_create();
+    double *a = malloc((size_t)m*k*sizeof(double));
+    double *b = malloc((size_t)k*n*sizeof(double));
+    double *c = calloc((size_t)m*n, sizeof(double));
+
+    for (size_t i = 0; i < (size_t)m*k; i++) {
+        a[i] = drand48();
+    }
+    for (size_t i = 0; i < (size_t)k*n; i++) {
+        b[i] = drand48();
+    }
+    gemm_cache_sizes(&caches);
+    fprintf(log, "caches: L1d %ld, L2 %ld, L3 %ld bytes; tuning %d x %d x %d on %d threads\n",
+            caches.l1d, caches.l2, caches.l3, m, n, k, gemm_get_num_threads());
+
+    for (int i = 0; i < nkernels; i++) {
+        const struct gemm_kernel *kernel = &kernels[i];
+        struct gemm_blocking blocking;
+        double t;
+        int m_cs[6];
+        if (!kernel->supported()) {
+            continue;
+        }
+        gemm_context_set_kernel(ctx, kernel);
+        gemm_derive_blocking(&caches, kernel, &blocking);
+        t = time_gemm(ctx, &blocking, m, n, k, a, b, c);
+        fprintf(log, "%-8s derived  k_c %4d m_c %4d n_c %5d: %.3g GFLOP/s\n",
+                kernel->name, blocking.k_c, blocking.m_c, blocking.n_c, flop / t * 1e-9);
+
+        search(ctx, &blocking, &blocking.k_c, k_cs, sizeof(k_cs)/sizeof(k_cs[0]), 8, &t, m, n, k, a, b, c);
+        // m_c around what fits in L2 for the chosen k_c
+        for (int j = 0; j < 6; j++) {
+            const double scale[6] = {0.25, 0.5, 0.75, 1, 1.5, 2};
+            m_cs[j] = (int)(scale[j]*(caches.l2 > 0 ? caches.l2 / 2 / (blocking.k_c*sizeof(double))
+                                                    : FALLBACK_M_C));
+        }
+        search(ctx, &blocking, &blocking.m_c, m_cs, 6, kernel->m_r, &t, m, n, k, a, b, c);
+        search(ctx, &blocking, &blocking.n_c, n_cs, sizeof(n_cs)/sizeof(n_cs[0]), kernel->n_r, &t, m, n, k, a, b, c);
+        fprintf(log, "%-8s tuned    k_c %4d m_c %4d n_c %5d: %.3g GFLOP/s\n",
+                kernel->name, blocking.k_c, blocking.m_c, blocking.n_c, flop / t * 1e-9);
+        if (t < best_time) {
+            best_time = t;
+            snprintf(best.kernel, sizeof(best.kernel), "%s", kernel->name);
+            best.blocking = blocking;
+        }
+    }
+    for (int i = 0; i < nkernels; i++) {
+        if (!strcmp(kernels[i].name, best.kernel)) {
+            gemm_context_set_kernel(ctx, &kernels[i]);
+        }
+    }
+    gemm_context_set_blocking(ctx, &best.blocking);
+    best.strassen_cutoff = tune_strassen_cutoff(ctx, log);
+    best.recursive_cutoff = tune_recursive_cutoff(ctx, log);
+    fprintf(log, "best: %s k_c %d m_c %d n_c %d, %.3g GFLOP/s, strassen_cutoff %d, recursive_cutoff %d;"
+            " writing %s\n", best.kernel, best.blocking.k_c, best.blocking.m_c, best.blocking.n_c,
+            flop / best_time * 1e-9, best.strassen_cutoff, best.recursive_cutoff, file);
+
+    gemm_context_destroy(ctx);
+    free(a);
+    free(b);
+    free(c);
+    return gemm_write_profile(file, &best);
+}
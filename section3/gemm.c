@@ -3,28 +3,27 @@
 #include <string.h>
 #include <math.h>
 #include <float.h>
+#include <complex.h>
 #include <time.h>
 
+#include "gemm.h"
+#include "blas.h"
+#include "instrument.h"
+#include "workspace.h"
+#include "gemm-bench.h"
+#include "peak.h"
+
 typedef void (*gemm_fn_t)(int, int, int,
                           const double *, int,
                           const double *, int,
                           double *, int);
 
-void optimised_gemm(int, int, int,
-                    const double *, int,
-                    const double *, int,
-                    double *, int);
-
-void basic_gemm(int, int, int,
-                const double *, int,
-                const double *, int,
-                double *, int);
-
 #ifdef _MSC_VER
 #include <malloc.h>
 void alloc_matrix(int m, int n, double **a)
 {
   *a = _aligned_malloc(m*n*sizeof(**a), 64);
+  instrument_alloc(m*n*sizeof(**a));
 }
 
 /* Provide stub for drand48 for checking */
@@ -33,18 +32,26 @@ static double drand48()
   return (double)rand()/(RAND_MAX + 1);
 }
 
+void free_matrix(double **a)
+{
+    _aligned_free(*a);
+    *a = NULL;
+}
+
 #else   /* !_MSC_VER */
+/* Matrices are workspace: page aligned, and on huge pages when large (see workspace.h). */
 void alloc_matrix(int m, int n, double **a)
 {
-    posix_memalign((void **)a, 64, m*n*sizeof(**a));
+    *a = workspace_alloc((size_t)m*n*sizeof(**a));
+    instrument_alloc((size_t)m*n*sizeof(**a));
 }
-#endif  /* _MSC_VER */
 
 void free_matrix(double **a)
 {
-    free(*a);
+    workspace_free(*a);
     *a = NULL;
 }
+#endif  /* _MSC_VER */
 
 /*
  * Print entries of a matrix.
@@ -95,6 +102,16 @@ static double diff_time(struct timespec end, struct timespec start)
     return secs + 1e-9*nsecs;
 }
 
+/*
+ * Where the view of a matrix starts in its parent for leading dimension
+ * padding pad: pad / 2 rows down and (if padded) one column across, so
+ * views are neither aligned nor at the start of their storage.
+ */
+static int view_offset(int pad, int ld)
+{
+    return pad / 2 + (pad > 0 ? ld : 0);
+}
+
 /*
  * Check that a matrix matches the result of multiplication with
  * "basic" implementation.
@@ -102,10 +119,13 @@ static double diff_time(struct timespec end, struct timespec start)
  * C has rank m x n (m rows, n columns)
  * A has rank m x k
  * B has rank k x n
+ * pad: the matrices are views into larger ones, with leading dimensions
+ *      pad more than their rows (see view_offset); 0 for plain matrices.
+ *      C starts random, and entries outside its view must stay as they are.
  * gemm: function pointer to gemm implementation.
  * Returns 1 if the check failed, 0 if it passed.
  */
-static int check(int m, int n, int k, gemm_fn_t gemm, double *maxdiff)
+static int check(int m, int n, int k, int pad, gemm_fn_t gemm, double *maxdiff)
 {
     double *a = NULL;
     double *b = NULL;
@@ -113,28 +133,44 @@ static int check(int m, int n, int k, gemm_fn_t gemm, double *maxdiff)
     double *cbasic = NULL;
     *maxdiff = -1;
     int i, j;
-    int lda, ldb, ldc;
+    int lda, ldb, ldc, columns;
+    size_t offset_a, offset_b, offset_c;
+    struct instrument_timer timer;
 
-    alloc_matrix(m, k, &a);
-    alloc_matrix(k, n, &b);
-    alloc_matrix(m, n, &copt);
-    alloc_matrix(m, n, &cbasic);
+    lda = m + pad;
+    ldb = k + pad;
+    ldc = m + pad;
+    offset_a = view_offset(pad, lda);
+    offset_b = view_offset(pad, ldb);
+    offset_c = view_offset(pad, ldc);
+    // Columns of C's parent, which are all compared
+    columns = n + (pad > 0);
 
-    lda = m;
-    ldb = k;
-    ldc = m;
+    instrument_start(&timer, PHASE_SETUP);
+    alloc_matrix(lda, k + (pad > 0), &a);
+    alloc_matrix(ldb, n + (pad > 0), &b);
+    alloc_matrix(ldc, columns, &copt);
+    alloc_matrix(ldc, columns, &cbasic);
 
-    random_matrix(m, k, a, lda);
-    random_matrix(k, n, b, ldb);
-    zero_matrix(m, n, copt, ldc);
-    zero_matrix(m, n, cbasic, ldc);
+    random_matrix(lda, k + (pad > 0), a, lda);
+    random_matrix(ldb, n + (pad > 0), b, ldb);
+    if (pad > 0) {
+        random_matrix(ldc, columns, cbasic, ldc);
+    } else {
+        zero_matrix(ldc, columns, cbasic, ldc);
+    }
+    memcpy(copt, cbasic, (size_t)ldc*columns*sizeof(*copt));
+    instrument_stop(&timer);
 
-    basic_gemm(m, n, k, a, lda, b, ldb, cbasic, ldc);
-    gemm(m, n, k, a, lda, b, ldb, copt, ldc);
+    instrument_start(&timer, PHASE_REFERENCE);
+    basic_gemm(m, n, k, a + offset_a, lda, b + offset_b, ldb, cbasic + offset_c, ldc);
+    instrument_stop(&timer);
+    instrument_count(PHASE_REFERENCE, COUNT_FLOPS, 2.0*m*n*k);
+    gemm(m, n, k, a + offset_a, lda, b + offset_b, ldb, copt + offset_c, ldc);
 
-    for (j = 0; j < n; j++) {
-        for (i = 0; i < m; i++) {
-            double diff = fabs(copt[j*ldc + i] - cbasic[j*ldc + i]);
+    for (j = 0; j < columns; j++) {
+        for (i = 0; i < ldc; i++) {
+            double diff = fabs(copt[(size_t)j*ldc + i] - cbasic[(size_t)j*ldc + i]);
             if (diff != diff) {
                 *maxdiff = diff;
                 goto done;
@@ -151,14 +187,346 @@ done:
     return (*maxdiff > 1e-3) || (*maxdiff != *maxdiff);
 }
 
+/* Copy op(X) (rows x columns, with X column major) into a plain column major matrix. */
+static void op_copy(char trans, int rows, int columns, const double *x, int ldx, double *y)
+{
+    for (int j = 0; j < columns; j++) {
+        for (int i = 0; i < rows; i++) {
+            y[(size_t)j*rows + i] = trans == 'N' ? x[(size_t)j*ldx + i] : x[(size_t)i*ldx + j];
+        }
+    }
+}
+
+/*
+ * Check the BLAS interface: every transpose combination with several
+ * alpha, beta pairs against the "basic" product of explicitly transposed
+ * copies.  Leading dimensions are padded, C starts as NaN whenever beta
+ * is zero (it must not be read), and the row major CBLAS path is checked
+ * as the transposed column major product.
+ * Returns 1 if the check failed, 0 if it passed.
+ */
+static int check_blas(int m, int n, int k, double *maxdiff)
+{
+    const char trans[2] = {'N', 'T'};
+    const double scalars[][2] = {{1, 1}, {-0.5, 0}, {2, 0.5}, {0, 2}};
+    const int pad = 3;
+    int lda = (m > k ? m : k) + pad;
+    int ldb = (k > n ? k : n) + pad;
+    int ldc = (m > n ? m : n) + pad;
+    int size = lda > ldb ? lda : ldb;
+    double *a, *b, *c, *c0, *opa, *opb, *product;
+    int failed = 0;
+
+    size = size > ldc ? size : ldc;
+    alloc_matrix(size, size, &a);
+    alloc_matrix(size, size, &b);
+    alloc_matrix(size, size, &c);
+    alloc_matrix(size, size, &c0);
+    alloc_matrix(size, size, &opa);
+    alloc_matrix(size, size, &opb);
+    alloc_matrix(size, size, &product);
+    random_matrix(size, size, a, size);
+    random_matrix(size, size, b, size);
+    random_matrix(size, size, c0, size);
+    *maxdiff = 0;
+
+    for (int row_major = 0; row_major < 2; row_major++) {
+        /* Row major m x n C is column major n x m C^T = op(B)^T op(A)^T,
+         * and a row major matrix is its column major transpose. */
+        int rows = row_major ? n : m, columns = row_major ? m : n;
+        for (int ta = 0; ta < 2; ta++) {
+            for (int tb = 0; tb < 2; tb++) {
+                if (row_major) {
+                    op_copy(trans[tb], n, k, b, ldb, opa);
+                    op_copy(trans[ta], k, m, a, lda, opb);
+                } else {
+                    op_copy(trans[ta], m, k, a, lda, opa);
+                    op_copy(trans[tb], k, n, b, ldb, opb);
+                }
+                zero_matrix(rows, columns, product, rows);
+                basic_gemm(rows, columns, k, opa, rows, opb, k, product, rows);
+
+                for (size_t s = 0; s < sizeof(scalars)/sizeof(scalars[0]); s++) {
+                    double alpha = scalars[s][0], beta = scalars[s][1];
+                    for (int j = 0; j < columns; j++) {
+                        for (int i = 0; i < rows; i++) {
+                            c[(size_t)j*ldc + i] = beta != 0 ? c0[(size_t)j*ldc + i] : NAN;
+                        }
+                    }
+                    if (row_major) {
+                        cblas_dgemm(CblasRowMajor, ta ? CblasTrans : CblasNoTrans,
+                                    tb ? CblasTrans : CblasNoTrans, m, n, k,
+                                    alpha, a, lda, b, ldb, beta, c, ldc);
+                    } else {
+                        dgemm_(&trans[ta], &trans[tb], &m, &n, &k,
+                               &alpha, a, &lda, b, &ldb, &beta, c, &ldc);
+                    }
+                    for (int j = 0; j < columns; j++) {
+                        for (int i = 0; i < rows; i++) {
+                            size_t ij = (size_t)j*ldc + i;
+                            double expect = alpha*product[(size_t)j*rows + i]
+                                + (beta != 0 ? beta*c0[ij] : 0);
+                            double diff = fabs(c[ij] - expect);
+                            if (diff != diff || diff > 1e-3) {
+                                if (!failed) {
+                                    fprintf(stderr, "BLAS check failed: %s trans%c%c alpha=%g beta=%g\n",
+                                            row_major ? "cblas row major" : "dgemm_",
+                                            trans[ta], trans[tb], alpha, beta);
+                                }
+                                failed = 1;
+                            }
+                            *maxdiff = diff != diff || diff > *maxdiff ? diff : *maxdiff;
+                        }
+                    }
+                }
+            }
+        }
+    }
+    free_matrix(&a);
+    free_matrix(&b);
+    free_matrix(&c);
+    free_matrix(&c0);
+    free_matrix(&opa);
+    free_matrix(&opb);
+    free_matrix(&product);
+    return failed;
+}
+
+/*
+ * Check both forms of the batched gemm on one shape against "basic"
+ * multiplication of each problem.  The strided form runs with padded
+ * leading dimensions and a shared A (stride 0), the pointer-array form
+ * with the problems in reverse order.
+ * Returns 1 if the check failed, 0 if it passed.
+ */
+static int check_batch_shape(int m, int n, int k, int count, double *maxdiff)
+{
+    const int pad = 1;
+    int lda = m + pad, ldb = k + pad, ldc = m + pad;
+    long stride_b = (long)ldb*n, stride_c = (long)ldc*n;
+    double *a, *b, *c, *ref;
+    const double **pa = malloc(count*sizeof(*pa));
+    const double **pb = malloc(count*sizeof(*pb));
+    double **pc = malloc(count*sizeof(*pc));
+    int failed = 0;
+
+    alloc_matrix(lda, k, &a);
+    alloc_matrix(stride_b, count, &b);
+    alloc_matrix(stride_c, count, &c);
+    alloc_matrix(stride_c, count, &ref);
+    random_matrix(lda, k, a, lda);
+    random_matrix(stride_b, count, b, stride_b);
+    for (int form = 0; form < 2; form++) {
+        random_matrix(stride_c, count, c, stride_c);
+        memcpy(ref, c, stride_c*count*sizeof(*c));
+        for (int i = 0; i < count; i++) {
+            basic_gemm(m, n, k, a, lda, b + i*stride_b, ldb, ref + i*stride_c, ldc);
+        }
+        if (form == 0) {
+            gemm_batch_strided(m, n, k, a, lda, 0, b, ldb, stride_b, c, ldc, stride_c, count);
+        } else {
+            for (int i = 0; i < count; i++) {
+                pa[i] = a;
+                pb[i] = b + (count - 1 - i)*stride_b;
+                pc[i] = c + (count - 1 - i)*stride_c;
+            }
+            gemm_batch(m, n, k, pa, lda, pb, ldb, pc, ldc, count);
+        }
+        for (long i = 0; i < stride_c*count; i++) {
+            double diff = fabs(c[i] - ref[i]);
+            if (diff != diff || diff > 1e-3) {
+                if (!failed) {
+                    fprintf(stderr, "Batch check failed: %s form, %d x %d x %d\n",
+                            form ? "pointer-array" : "strided", m, n, k);
+                }
+                failed = 1;
+            }
+            *maxdiff = diff != diff || diff > *maxdiff ? diff : *maxdiff;
+        }
+    }
+    free_matrix(&a);
+    free_matrix(&b);
+    free_matrix(&c);
+    free_matrix(&ref);
+    free(pa);
+    free(pb);
+    free(pc);
+    return failed;
+}
+
+/*
+ * Check the batched gemm on the requested shape and on every square
+ * shape up to 64 (which covers each specialised kernel).
+ * Returns 1 if the check failed, 0 if it passed.
+ */
+static int check_batch(int m, int n, int k, double *maxdiff)
+{
+    int failed = 0;
+    *maxdiff = 0;
+    failed |= check_batch_shape(m, n, k, 3, maxdiff);
+    for (int size = 1; size <= 64; size++) {
+        failed |= check_batch_shape(size, size, size, 5, maxdiff);
+    }
+    return failed;
+}
+
+/*
+ * Check Strassen-Winograd against "basic" multiplication, with a small
+ * cutoff so that the recursion (and the peeling of odd dimensions) runs
+ * several levels deep even on small problems.  The error, relative to
+ * max|A| max|B|, must be within the bound strassen_gemm_ctx reports
+ * plus the basic product's own (k^2 u, doubled for the initial C).
+ * Returns 1 if the check failed, 0 if it passed.
+ */
+static int check_strassen(int m, int n, int k, int pad, double *error, double *bound)
+{
+    double *a, *b, *c, *ref;
+    double max_a = 0, max_b = 0;
+    struct gemm_context *ctx = gemm_context_create();
+    const int lda = m + pad, ldb = k + pad, ldc = m + pad, columns = n + (pad > 0);
+    const size_t offset_c = view_offset(pad, ldc);
+
+    alloc_matrix(lda, k + (pad > 0), &a);
+    alloc_matrix(ldb, columns, &b);
+    alloc_matrix(ldc, columns, &c);
+    alloc_matrix(ldc, columns, &ref);
+    random_matrix(lda, k + (pad > 0), a, lda);
+    random_matrix(ldb, columns, b, ldb);
+    random_matrix(ldc, columns, c, ldc);
+    memcpy(ref, c, (size_t)ldc*columns*sizeof(*c));
+    for (size_t i = 0; i < (size_t)lda*(k + (pad > 0)); i++) {
+        max_a = fmax(max_a, fabs(a[i]));
+    }
+    for (size_t i = 0; i < (size_t)ldb*columns; i++) {
+        max_b = fmax(max_b, fabs(b[i]));
+    }
+
+    basic_gemm(m, n, k, a + view_offset(pad, lda), lda, b + view_offset(pad, ldb), ldb, ref + offset_c, ldc);
+    gemm_context_set_strassen_cutoff(ctx, 16);
+    *bound = strassen_gemm_ctx(ctx, 1.0, m, n, k, a + view_offset(pad, lda), lda,
+                               b + view_offset(pad, ldb), ldb, c + offset_c, ldc);
+    *error = 0;
+    // All of C's parent, so anything written outside the view counts too
+    for (size_t i = 0; i < (size_t)ldc*columns; i++) {
+        double diff = fabs(c[i] - ref[i]);
+        *error = diff != diff || diff > *error ? diff : *error;
+    }
+    *error /= max_a*max_b > 0 ? max_a*max_b : 1;
+
+    gemm_context_destroy(ctx);
+    free_matrix(&a);
+    free_matrix(&b);
+    free_matrix(&c);
+    free_matrix(&ref);
+    return !(*error <= *bound + (double)k*k*DBL_EPSILON);
+}
+
+/* An epilogue tile function that depends on where the tile is in C. */
+static void epilogue_position(double *c, int ldc, int rows, int columns, int row, int column, void *data)
+{
+    const double *weight = data;
+    for (int j = 0; j < columns; j++) {
+        for (int i = 0; i < rows; i++) {
+            c[(size_t)j*ldc + i] = *weight*c[(size_t)j*ldc + i] + (row + i) - 0.5*(column + j);
+        }
+    }
+}
+
+/*
+ * Check dgemm_epilogue_ctx (both biases, a clamp that cuts off some of C
+ * at either end, and a tile function) against dgemm_ctx followed by the
+ * epilogue as a separate pass: once as a plain product (which dgemm_ctx
+ * may not pack), once with alpha, beta and panels of k shallow enough
+ * that every tile of C is added to several times before the kernels
+ * apply the epilogue, and once with beta zero and C all NaN (which the
+ * kernels must not read).  C is a view (see view_offset).
+ * Returns 1 if the check failed, 0 if it passed.
+ */
+static int check_epilogue(int m, int n, int k, int pad, double *maxdiff)
+{
+    double *a, *b, *c, *ref, *row_bias, *column_bias;
+    double weight = 0.75;
+    struct gemm_context *ctx = gemm_context_create();
+    struct gemm_blocking shallow = *gemm_default_blocking();
+    struct gemm_epilogue epilogue = {0};
+    const int lda = m + pad, ldb = k + pad, ldc = m + pad, columns = n + (pad > 0);
+    const size_t offset_c = view_offset(pad, ldc);
+    int failed = 0;
+
+    alloc_matrix(lda, k + (pad > 0), &a);
+    alloc_matrix(ldb, columns, &b);
+    alloc_matrix(ldc, columns, &c);
+    alloc_matrix(ldc, columns, &ref);
+    alloc_matrix(m, 1, &row_bias);
+    alloc_matrix(n, 1, &column_bias);
+    random_matrix(lda, k + (pad > 0), a, lda);
+    random_matrix(ldb, columns, b, ldb);
+    random_matrix(m, 1, row_bias, m);
+    random_matrix(n, 1, column_bias, n);
+    epilogue.row_bias = row_bias;
+    epilogue.column_bias = column_bias;
+    // Entries of A B average k / 4
+    epilogue.clamp = 1;
+    epilogue.lower = 0.25*k;
+    epilogue.upper = 0.25*k + 1.5;
+    epilogue.tile = &epilogue_position;
+    epilogue.data = &weight;
+    shallow.k_c = 16;
+    *maxdiff = 0;
+
+    for (int run = 0; run < 3; run++) {
+        double alpha = run == 1 ? -1.5 : 1.0, beta = run == 1 ? 0.5 : run == 2 ? 0.0 : 1.0;
+        if (run == 1) {
+            gemm_context_set_blocking(ctx, &shallow);
+            gemm_context_set_num_threads(ctx, 2);
+            epilogue.lower = -0.375*k - 1;
+            epilogue.upper = -0.375*k + 1;
+        }
+        random_matrix(ldc, columns, c, ldc);
+        if (run == 2) {
+            for (int j = 0; j < n; j++) {
+                for (int i = 0; i < m; i++) {
+                    c[offset_c + (size_t)j*ldc + i] = NAN;
+                }
+            }
+        }
+        memcpy(ref, c, (size_t)ldc*columns*sizeof(*c));
+        dgemm_ctx(ctx, 'N', 'N', m, n, k, alpha, a + view_offset(pad, lda), lda,
+                  b + view_offset(pad, ldb), ldb, beta, ref + offset_c, ldc);
+        gemm_epilogue_apply(&epilogue, m, n, ref + offset_c, ldc);
+        dgemm_epilogue_ctx(ctx, 'N', 'N', m, n, k, alpha, a + view_offset(pad, lda), lda,
+                           b + view_offset(pad, ldb), ldb, beta, c + offset_c, ldc, &epilogue);
+        // All of C's parent, so anything written outside the view counts too
+        for (size_t i = 0; i < (size_t)ldc*columns; i++) {
+            double diff = fabs(c[i] - ref[i]);
+            *maxdiff = diff != diff || diff > *maxdiff ? diff : *maxdiff;
+        }
+        failed |= !(*maxdiff <= 1e-3);
+    }
+
+    gemm_context_destroy(ctx);
+    free_matrix(&a);
+    free_matrix(&b);
+    free_matrix(&c);
+    free_matrix(&ref);
+    free_matrix(&row_bias);
+    free_matrix(&column_bias);
+    return failed;
+}
+
+// The machine's roofs (--peak), if loaded
+static struct peak peak;
+static int have_peak = 0;
+
 /*
  * Benchmark the provided gemm implementation.
  * m, n, k: matrix sizes C[m, n] = C[m, n] + A[m, k]*B[k, n]
+ * pad: leading dimension padding of views into larger matrices, as in check
  * gemm: Function pointer to gemm implementation
  * prints:
  *  m n k TIME FLOP FLOP/s
  */
-static void bench(int m, int n, int k, gemm_fn_t gemm)
+static void bench(int m, int n, int k, int pad, gemm_fn_t gemm)
 {
     double *a = NULL;
     double *b = NULL;
@@ -167,18 +535,21 @@ static void bench(int m, int n, int k, gemm_fn_t gemm)
     double time, flop;
     int repeats, i;
     int lda, ldb, ldc;
+    struct instrument_timer timer;
 
-    alloc_matrix(m, k, &a);
-    alloc_matrix(k, n, &b);
-    alloc_matrix(m, n, &c);
+    lda = m + pad;
+    ldb = k + pad;
+    ldc = m + pad;
 
-    lda = m;
-    ldb = k;
-    ldc = m;
+    instrument_start(&timer, PHASE_SETUP);
+    alloc_matrix(lda, k + (pad > 0), &a);
+    alloc_matrix(ldb, n + (pad > 0), &b);
+    alloc_matrix(ldc, n + (pad > 0), &c);
 
-    random_matrix(m, k, a, lda);
-    random_matrix(k, n, b, ldb);
-    zero_matrix(m, n, c, ldc);
+    random_matrix(lda, k + (pad > 0), a, lda);
+    random_matrix(ldb, n + (pad > 0), b, ldb);
+    zero_matrix(ldc, n + (pad > 0), c, ldc);
+    instrument_stop(&timer);
 
     flop = 2.0*(double)m*(double)n*(double)k;
     time = DBL_MAX;
@@ -190,29 +561,289 @@ static void bench(int m, int n, int k, gemm_fn_t gemm)
         repeats = 5;
     }
 
-    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &start);
+    clock_gettime(CLOCK_MONOTONIC, &start);
     for (i = 0; i < repeats; i++) {
         gemm(m, n, k,
-             (const double *)a, lda,
-             (const double *)b, ldb,
-             c, ldc);
+             (const double *)a + view_offset(pad, lda), lda,
+             (const double *)b + view_offset(pad, ldb), ldb,
+             c + view_offset(pad, ldc), ldc);
     }
-    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &end);
+    clock_gettime(CLOCK_MONOTONIC, &end);
     time = diff_time(end, start) / repeats;
     printf("%d %d %d %g %g\n", m, n, k, time, flop);
+    instrument_field("gflops", 1e-9*flop / time);
+    if (have_peak) {
+        instrument_field("percent_peak", 100*1e-9*flop / time / peak_gflops(&peak, gemm_get_num_threads()));
+    }
+    free_matrix(&a);
+    free_matrix(&b);
+    free_matrix(&c);
+}
+
+/*
+ * Benchmark the strided batched gemm on count problems, with count chosen
+ * so the batch (about 64MB) does not fit in cache.
+ * prints:
+ *  m n k count TIME FLOP
+ */
+static void bench_batch(int m, int n, int k)
+{
+    long size_a = (long)m*k, size_b = (long)k*n, size_c = (long)m*n;
+    long count = (64L << 20) / (8*(size_a + size_b + size_c));
+    double *a, *b, *c;
+    struct timespec start, end;
+    double time, flop;
+    int repeats = 5;
+
+    count = count > 0 ? count : 1;
+    alloc_matrix(size_a, count, &a);
+    alloc_matrix(size_b, count, &b);
+    alloc_matrix(size_c, count, &c);
+    random_matrix(size_a, count, a, size_a);
+    random_matrix(size_b, count, b, size_b);
+    zero_matrix(size_c, count, c, size_c);
+    flop = 2.0*(double)m*(double)n*(double)k*count;
+
+    // Warm up (first touch, thread start up)
+    gemm_batch_strided(m, n, k, a, m, size_a, b, k, size_b, c, m, size_c, count);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < repeats; i++) {
+        gemm_batch_strided(m, n, k, a, m, size_a, b, k, size_b, c, m, size_c, count);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    time = diff_time(end, start) / repeats;
+    printf("%d %d %d %ld %g %g\n", m, n, k, count, time, flop);
     free_matrix(&a);
     free_matrix(&b);
     free_matrix(&c);
 }
 
+/*
+ * CHECK and BENCH for one precision other than the default double:
+ * x is the BLAS prefix, T the element type and EPSILON its machine epsilon.
+ *
+ * The check runs xgemm_ over every transpose combination (N, T and C) with
+ * several alpha, beta pairs and padded leading dimensions, against a naive
+ * product of op(A) and op(B) accumulated in double complex; C is NaN whenever
+ * beta is zero.  The error allowed, relative to the size of the terms, grows
+ * with k as for any summation.  Returns 1 if the check failed, 0 if it passed.
+ *
+ * The benchmark prints m n k TIME FLOP as bench does, counting a complex
+ * multiply-add as 8 flops.
+ */
+#define PRECISION_TESTS(x, T, EPSILON, IS_COMPLEX)                                                 \
+    static void x##random_matrix(size_t count, T *a)                                               \
+    {                                                                                              \
+        for (size_t i = 0; i < count; i++) {                                                       \
+            a[i] = IS_COMPLEX ? (T)(drand48() + I*drand48()) : (T)drand48();                       \
+        }                                                                                          \
+    }                                                                                              \
+                                                                                                   \
+    static double complex x##op_entry(char trans, const T *a, int lda, int i, int j)               \
+    {                                                                                              \
+        double complex entry = trans == 'N' ? a[(size_t)j*lda + i] : a[(size_t)i*lda + j];         \
+        return trans == 'C' ? conj(entry) : entry;                                                 \
+    }                                                                                              \
+                                                                                                   \
+    static int x##check_precision(int m, int n, int k, double *maxdiff)                            \
+    {                                                                                              \
+        const char trans[3] = {'N', 'T', 'C'};                                                     \
+        const double complex scalars[][2] = {{1, 1}, {-0.5, 0}, {2 - I, 0.5 + 0.25*I}, {0, 2}};    \
+        const int pad = 3;                                                                         \
+        int lda = (m > k ? m : k) + pad;                                                           \
+        int ldb = (k > n ? k : n) + pad;                                                           \
+        int ldc = m + pad;                                                                         \
+        T *a = malloc((size_t)lda*lda*sizeof(T));                                                  \
+        T *b = malloc((size_t)ldb*ldb*sizeof(T));                                                  \
+        T *c = malloc((size_t)ldc*n*sizeof(T));                                                    \
+        T *c0 = malloc((size_t)ldc*n*sizeof(T));                                                   \
+        double complex *product = malloc((size_t)m*n*sizeof(*product));                            \
+        int failed = 0;                                                                            \
+                                                                                                   \
+        x##random_matrix((size_t)lda*lda, a);                                                      \
+        x##random_matrix((size_t)ldb*ldb, b);                                                      \
+        x##random_matrix((size_t)ldc*n, c0);                                                       \
+        *maxdiff = 0;                                                                              \
+        for (int ta = 0; ta < 3; ta++) {                                                           \
+            for (int tb = 0; tb < 3; tb++) {                                                       \
+                for (int j = 0; j < n; j++) {                                                      \
+                    for (int i = 0; i < m; i++) {                                                  \
+                        double complex sum = 0;                                                    \
+                        for (int p = 0; p < k; p++) {                                              \
+                            sum += x##op_entry(trans[ta], a, lda, i, p)                            \
+                                * x##op_entry(trans[tb], b, ldb, p, j);                            \
+                        }                                                                          \
+                        product[(size_t)j*m + i] = sum;                                            \
+                    }                                                                              \
+                }                                                                                  \
+                for (size_t s = 0; s < sizeof(scalars)/sizeof(scalars[0]); s++) {                  \
+                    /* Real precisions take the real part of the scalars */                        \
+                    T alpha = IS_COMPLEX ? (T)scalars[s][0] : (T)creal(scalars[s][0]);             \
+                    T beta = IS_COMPLEX ? (T)scalars[s][1] : (T)creal(scalars[s][1]);              \
+                    double scale = 2*k*(cabs((double complex)alpha)                                \
+                                        + cabs((double complex)beta) + 1);                         \
+                    for (int j = 0; j < n; j++) {                                                  \
+                        for (int i = 0; i < m; i++) {                                              \
+                            c[(size_t)j*ldc + i] = beta != 0 ? c0[(size_t)j*ldc + i] : (T)NAN;     \
+                        }                                                                          \
+                    }                                                                              \
+                    x##gemm_(&trans[ta], &trans[tb], &m, &n, &k,                                   \
+                             &alpha, a, &lda, b, &ldb, &beta, c, &ldc);                            \
+                    for (int j = 0; j < n; j++) {                                                  \
+                        for (int i = 0; i < m; i++) {                                              \
+                            size_t ij = (size_t)j*ldc + i;                                         \
+                            double complex expect = alpha*product[(size_t)j*m + i]                 \
+                                + (beta != 0 ? beta*(double complex)c0[ij] : 0);                   \
+                            double diff = cabs(c[ij] - expect) / scale;                            \
+                            if (diff != diff || diff > 8*EPSILON) {                                \
+                                if (!failed) {                                                     \
+                                    fprintf(stderr, #x "gemm_ check failed: trans%c%c"             \
+                                            " alpha=%g%+gi beta=%g%+gi\n", trans[ta], trans[tb],   \
+                                            creal(alpha), cimag(alpha), creal(beta), cimag(beta)); \
+                                }                                                                  \
+                                failed = 1;                                                        \
+                            }                                                                      \
+                            *maxdiff = diff != diff || diff > *maxdiff ? diff : *maxdiff;          \
+                        }                                                                          \
+                    }                                                                              \
+                }                                                                                  \
+            }                                                                                      \
+        }                                                                                          \
+        free(a);                                                                                   \
+        free(b);                                                                                   \
+        free(c);                                                                                   \
+        free(c0);                                                                                  \
+        free(product);                                                                             \
+        return failed;                                                                             \
+    }                                                                                              \
+                                                                                                   \
+    static void x##bench_precision(int m, int n, int k)                                            \
+    {                                                                                              \
+        T *a = malloc((size_t)m*k*sizeof(T));                                                      \
+        T *b = malloc((size_t)k*n*sizeof(T));                                                      \
+        T *c = calloc((size_t)m*n, sizeof(T));                                                     \
+        struct timespec start, end;                                                                \
+        double flop = (IS_COMPLEX ? 8.0 : 2.0)*(double)m*(double)n*(double)k;                      \
+        int repeats = (long)m*n < 10000 ? 100 : 5;                                                 \
+                                                                                                   \
+        x##random_matrix((size_t)m*k, a);                                                          \
+        x##random_matrix((size_t)k*n, b);                                                          \
+        clock_gettime(CLOCK_MONOTONIC, &start);                                                    \
+        for (int i = 0; i < repeats; i++) {                                                        \
+            x##gemm_ctx(gemm_thread_context(), 'N', 'N', m, n, k, 1, a, m, b, k, 1, c, m);         \
+        }                                                                                          \
+        clock_gettime(CLOCK_MONOTONIC, &end);                                                      \
+        printf("%d %d %d %g %g\n", m, n, k, diff_time(end, start) / repeats, flop);                \
+        free(a);                                                                                   \
+        free(b);                                                                                   \
+        free(c);                                                                                   \
+    }
+
+PRECISION_TESTS(s, float, FLT_EPSILON, 0)
+PRECISION_TESTS(c, float complex, FLT_EPSILON, 1)
+PRECISION_TESTS(z, double complex, DBL_EPSILON, 1)
+
+// Precision CHECK and BENCH run (--precision): 'd' for the default double tests
+static char precision = 'd';
+
+// Leading dimension padding of the views BENCH and CHECK multiply (--pad); CHECK always tries CHECK_PAD too
+static int view_pad = 0;
+#define CHECK_PAD 7
+
+// Error tolerance for strassen_gemm in BENCH (--strassen), 0 for optimised_gemm
+static double strassen_tolerance = 0;
+
+static void tolerant_gemm(int m, int n, int k,
+                          const double *a, int lda,
+                          const double *b, int ldb,
+                          double *c, int ldc)
+{
+    strassen_gemm(strassen_tolerance, m, n, k, a, lda, b, ldb, c, ldc);
+}
+
 int main(int argc, char **argv)
 {
     int m, n, k;
+    const char *prog = argv[0];
+
+    instrument_init("gemm");
+    while (argc > 1 && !strncmp(argv[1], "--", 2)) {
+        if (!strcmp(argv[1], "--stats")) {
+            instrument_enable("-");
+        } else if (!strncmp(argv[1], "--stats=", 8)) {
+            instrument_enable(argv[1] + 8);
+        } else if (!strcmp(argv[1], "--perf") || !strncmp(argv[1], "--perf=", 7)) {
+            instrument_enable_events(argv[1][6] ? argv[1] + 7 : "1");
+            if (!instrument_enabled) {
+                instrument_enable("-");
+            }
+        } else if (!strcmp(argv[1], "--peak")) {
+            if (peak_load(&peak)) {
+                fprintf(stderr, "Peaks not cached; measured for this run only\n");
+            }
+            have_peak = 1;
+            if (!instrument_enabled) {
+                instrument_enable("-");
+            }
+        } else if (!strncmp(argv[1], "--threads=", 10)) {
+            gemm_set_num_threads(atoi(argv[1] + 10));
+        } else if (!strncmp(argv[1], "--pad=", 6) && atoi(argv[1] + 6) >= 0) {
+            view_pad = atoi(argv[1] + 6);
+        } else if (!strncmp(argv[1], "--strassen=", 11)) {
+            strassen_tolerance = atof(argv[1] + 11);
+        } else if (!strncmp(argv[1], "--precision=", 12) && strlen(argv[1]) == 13
+                   && strchr("sdcz", argv[1][12])) {
+            precision = argv[1][12];
+        } else {
+            fprintf(stderr, "Unrecognised flag '%s'\n", argv[1]);
+            return 1;
+        }
+        argc--;
+        argv++;
+    }
+    if (have_peak) {
+        // The phases of optimised_gemm are timed in every thread, so their rates are per
+        // thread, as are the roofs (see peak.h)
+        instrument_set_peak(peak.core_gflops, peak_thread_gbs(&peak));
+    }
+    if (argc == 2 && !strcmp(argv[1], "PEAK")) {
+        // Measure afresh (say after a hardware change) and replace the cached peaks
+        peak_measure(&peak, stdout);
+        return peak_write(peak_path(), &peak);
+    }
+    if (argc > 1 && !strcmp(argv[1], "SUITE")) {
+        int status;
+        instrument_label("mode", "SUITE");
+        instrument_field("threads", gemm_get_num_threads());
+        status = gemm_bench_suite(argc - 2, argv + 2);
+        instrument_report();
+        return status;
+    }
     if (argc != 5) {
         fprintf(stderr, "Invalid arguments.\n");
-        fprintf(stderr, "Usage: %s M N K mode\n", argv[0]);
+        fprintf(stderr, "Usage: %s [--stats[=FILE]] [--perf[=EVENTS]] [--peak] [--threads=N] [--pad=P] [--strassen=TOL] [--precision=s|d|c|z] M N K mode\n", prog);
+        fprintf(stderr, "   or: %s [--stats[=FILE]] [--threads=N] SUITE [options] (see SUITE --help)\n", prog);
+        fprintf(stderr, "   or: %s [--threads=N] PEAK\n", prog);
         fprintf(stderr, "Where M, N, and K are the dimensions of the problem.\n");
-        fprintf(stderr, "'mode' is one of BENCH or CHECK\n");
+        fprintf(stderr, "'mode' is one of BENCH, BATCH, CHECK or TUNE\n");
+        fprintf(stderr, "BATCH benchmarks the batched gemm on many M x N x K problems.\n");
+        fprintf(stderr, "TUNE searches the blocking parameters on this problem and writes GEMM_PROFILE\n");
+        fprintf(stderr, "(default ~/.gemm-profile), which later runs read.\n");
+        fprintf(stderr, "--stats (or MM_STATS=1|FILE) emits per-phase timings and counters as JSON.\n");
+        fprintf(stderr, "--perf (or MM_PERF=1|EVENTS) adds hardware counters (cycles, instructions, l1d_misses,\n");
+        fprintf(stderr, "llc_misses, dtlb_misses, fp_ops, page_faults) to each phase of --stats, default all.\n");
+        fprintf(stderr, "--peak adds the achieved rates as percentages of the machine's FMA and STREAM triad\n");
+        fprintf(stderr, "roofs to --stats, measured once per host and thread count and cached (see peak.h);\n");
+        fprintf(stderr, "PEAK measures them again.\n");
+        fprintf(stderr, "--threads (or GEMM_NUM_THREADS) sets the number of threads, default OMP_NUM_THREADS.\n");
+        fprintf(stderr, "--pad makes BENCH and CHECK multiply views into larger matrices: leading dimensions\n");
+        fprintf(stderr, "P more than the rows, starting P/2 rows down and a column across (CHECK always\n");
+        fprintf(stderr, "tries padding %d as well).\n", CHECK_PAD);
+        fprintf(stderr, "--strassen lets BENCH use Strassen-Winograd (above GEMM_STRASSEN_CUTOFF) while its\n");
+        fprintf(stderr, "error bound, relative to max|A| max|B|, stays within TOL (e.g. 1e-8).\n");
+        fprintf(stderr, "--precision makes BENCH and CHECK run sgemm, dgemm (default), cgemm or zgemm.\n");
+        fprintf(stderr, "GEMM_PREFETCH=1 prefetches what is packed next while the kernels run.\n");
+        fprintf(stderr, "GEMM_KERNEL=generic|sse2|avx2|avx512 overrides the micro-kernel chosen from CPUID.\n");
         return 1;
     }
 
@@ -220,20 +851,111 @@ int main(int argc, char **argv)
     m = atoi(argv[1]);
     n = atoi(argv[2]);
     k = atoi(argv[3]);
+    instrument_label("mode", argv[4]);
+    instrument_field("m", m);
+    instrument_field("n", n);
+    instrument_field("k", k);
+    instrument_label("kernel", gemm_active_kernel()->name);
+    instrument_field("threads", gemm_get_num_threads());
+    instrument_label("precision", (char[]){precision, '\0'});
+    instrument_field("pad", view_pad);
 
-    if (!strcmp(argv[4], "BENCH")) {
-        bench(m, n, k, &optimised_gemm);
-    } else if (!strcmp(argv[4], "CHECK")) {
-        double maxdiff;
-        int val = check(m, n, k, &optimised_gemm, &maxdiff);
-        if (val) {
-            fprintf(stderr, "CHECK FAILED, maximum entry difference %g\n", maxdiff);
+    instrument_field("k_c", gemm_default_blocking()->k_c);
+    instrument_field("m_c", gemm_default_blocking()->m_c);
+    instrument_field("n_c", gemm_default_blocking()->n_c);
+
+    if (!strcmp(argv[4], "TUNE")) {
+        if (gemm_tune(m, n, k, gemm_profile_path(), stdout)) {
+            return 1;
+        }
+    } else if (!strcmp(argv[4], "BENCH") && precision != 'd') {
+        switch (precision) {
+        case 's': sbench_precision(m, n, k); break;
+        case 'c': cbench_precision(m, n, k); break;
+        case 'z': zbench_precision(m, n, k); break;
+        }
+    } else if (!strcmp(argv[4], "CHECK") && precision != 'd') {
+        double maxdiff = 0;
+        int failed = 0;
+        switch (precision) {
+        case 's': failed = scheck_precision(m, n, k, &maxdiff); break;
+        case 'c': failed = ccheck_precision(m, n, k, &maxdiff); break;
+        case 'z': failed = zcheck_precision(m, n, k, &maxdiff); break;
+        }
+        if (failed) {
+            fprintf(stderr, "CHECK FAILED (%cgemm), maximum relative difference %g\n",
+                    precision, maxdiff);
+        } else {
+            printf("CHECK SUCCEEDED\n");
+        }
+    } else if (!strcmp(argv[4], "BENCH")) {
+        if (strassen_tolerance > 0) {
+            instrument_field("strassen_tolerance", strassen_tolerance);
+            bench(m, n, k, view_pad, &tolerant_gemm);
         } else {
+            bench(m, n, k, view_pad, &optimised_gemm);
+        }
+    } else if (!strcmp(argv[4], "BATCH")) {
+        instrument_field("specialised", gemm_batch_specialised(m, n, k));
+        bench_batch(m, n, k);
+    } else if (!strcmp(argv[4], "CHECK")) {
+        /* Check every micro-kernel this CPU can run, then restore the
+         * default choice. */
+        int nkernels, val = 0;
+        const struct gemm_kernel *kernels = gemm_kernels(&nkernels);
+        const struct gemm_kernel *active = gemm_active_kernel();
+        for (int i = 0; i < nkernels; i++) {
+            double maxdiff;
+            if (gemm_select_kernel(kernels[i].name)) {
+                continue;
+            }
+            if (check(m, n, k, view_pad, &optimised_gemm, &maxdiff)) {
+                fprintf(stderr, "CHECK FAILED (%s kernel), maximum entry difference %g\n",
+                        kernels[i].name, maxdiff);
+                val = 1;
+            }
+            if (view_pad != CHECK_PAD && check(m, n, k, CHECK_PAD, &optimised_gemm, &maxdiff)) {
+                fprintf(stderr, "CHECK FAILED (%s kernel, view with padding %d), maximum entry difference %g\n",
+                        kernels[i].name, CHECK_PAD, maxdiff);
+                val = 1;
+            }
+        }
+        gemm_select_kernel(active->name);
+        {
+            double maxdiff;
+            if (check_blas(m, n, k, &maxdiff)) {
+                fprintf(stderr, "CHECK FAILED (BLAS interface), maximum entry difference %g\n",
+                        maxdiff);
+                val = 1;
+            }
+            if (check_batch(m, n, k, &maxdiff)) {
+                fprintf(stderr, "CHECK FAILED (batched gemm), maximum entry difference %g\n",
+                        maxdiff);
+                val = 1;
+            }
+            if (check_epilogue(m, n, k, view_pad > 0 ? view_pad : CHECK_PAD, &maxdiff)) {
+                fprintf(stderr, "CHECK FAILED (fused epilogue), maximum entry difference %g\n",
+                        maxdiff);
+                val = 1;
+            }
+        }
+        {
+            double error, bound;
+            if (check_strassen(m, n, k, view_pad > 0 ? view_pad : CHECK_PAD, &error, &bound)) {
+                fprintf(stderr, "CHECK FAILED (Strassen), relative error %g above its bound %g\n",
+                        error, bound);
+                val = 1;
+            }
+            instrument_field("strassen_error", error);
+            instrument_field("strassen_bound", bound);
+        }
+        if (!val) {
             printf("CHECK SUCCEEDED\n");
         }
     } else {
-        fprintf(stderr, "Unrecognised mode %s, should be BENCH or CHECK\n", argv[4]);
+        fprintf(stderr, "Unrecognised mode %s, should be BENCH, BATCH, CHECK or TUNE\n", argv[4]);
         return 1;
     }
+    instrument_report();
     return 0;
 }
@@ -0,0 +1,250 @@
+#ifndef _GEMM_H
+#define _GEMM_H
+
+#include <stdio.h>
+
+/*
+ * Dense matrix-matrix multiplication routines (column major).
+ */
+
+void optimised_gemm(int, int, int,
+                    const double *, int,
+                    const double *, int,
+                    double *, int);
+
+void basic_gemm(int, int, int,
+                const double *, int,
+                const double *, int,
+                double *, int);
+
+/* C = C + A B by cache-oblivious recursion, without packing, for the products
+ * below the recursive cutoff (see gemm-recursive.c). */
+void recursive_gemm(int, int, int,
+                    const double *, int,
+                    const double *, int,
+                    double *, int);
+
+/* C = C + A B on up to the given number of threads, for the tall and skinny or
+ * short and wide products that gemm_skinny_shape picks (m, n, k), without
+ * packing (see gemm-skinny.c). */
+void skinny_gemm(int, int, int, int,
+                 const double *, int,
+                 const double *, int,
+                 double *, int);
+int gemm_skinny_shape(int, int, int);
+
+void gemm_set_num_threads(int);
+int gemm_get_num_threads(void);
+
+/*
+ * Reusable state for optimised_gemm_ctx: page aligned packing workspace
+ * that is allocated on first use, only grown when a call needs more, and
+ * kept between calls.  A context must not be used by two calls at once;
+ * separate contexts can be used concurrently.  optimised_gemm uses a
+ * context private to the calling thread.
+ */
+struct gemm_context;
+
+struct gemm_context *gemm_context_create(void);
+void gemm_context_destroy(struct gemm_context *);
+struct gemm_context *gemm_thread_context(void);
+void gemm_context_set_num_threads(struct gemm_context *, int);
+/* Pipelining of packing with the kernels through software prefetch:
+ * 1 on, 0 off, < 0 the default (off unless GEMM_PREFETCH=1). */
+void gemm_context_set_prefetch(struct gemm_context *, int);
+int gemm_default_prefetch(void);
+void optimised_gemm_ctx(struct gemm_context *,
+                        int, int, int,
+                        const double *, int,
+                        const double *, int,
+                        double *, int);
+
+/*
+ * C = alpha op(A) op(B) + beta C, with op(X) = X ('N'), X^T ('T') or
+ * X^H ('C', the same as 'T' for the real types).  Column major, BLAS
+ * argument order; see blas.h for the standard BLAS and CBLAS entry
+ * points.  All four precisions come from one engine (gemm-template.h).
+ */
+void dgemm_ctx(struct gemm_context *, char, char,
+               int, int, int,
+               double, const double *, int,
+               const double *, int,
+               double, double *, int);
+void sgemm_ctx(struct gemm_context *, char, char,
+               int, int, int,
+               float, const float *, int,
+               const float *, int,
+               float, float *, int);
+void cgemm_ctx(struct gemm_context *, char, char,
+               int, int, int,
+               float _Complex, const float _Complex *, int,
+               const float _Complex *, int,
+               float _Complex, float _Complex *, int);
+void zgemm_ctx(struct gemm_context *, char, char,
+               int, int, int,
+               double _Complex, const double _Complex *, int,
+               const double _Complex *, int,
+               double _Complex, double _Complex *, int);
+
+/*
+ * dgemm_ctx followed by an elementwise epilogue, fused into the product:
+ * the micro-kernels add the biases and clamp each m_r x n_r tile of C in
+ * registers as they add its last panel of k (see struct gemm_update), so
+ * C is stored once with the epilogue applied rather than read and written
+ * again.  Products with an epilogue always take the packed path, as the
+ * unpacked ones (plain products up to the recursive cutoff, those of at
+ * most 32 in every dimension, and thin ones, see gemm-skinny.c) do not
+ * work in tiles.
+ * With C = alpha op(A) op(B) + beta C, entry (i, j) becomes
+ *   clamp(C_ij + row_bias[i] + column_bias[j])
+ * (each part only if given), then tile is called on every finished tile
+ * with its position in C, for anything else (activations and the like),
+ * right after the kernel has stored it.
+ * Tiles are finished by several threads at once, in no particular order.
+ */
+struct gemm_epilogue {
+    const double *row_bias;         // m values, or NULL
+    const double *column_bias;      // n values, or NULL
+    int clamp;                      // Clamp to [lower, upper] if set
+    double lower, upper;
+    void (*tile)(double *c, int ldc, int rows, int columns, int row, int column, void *data);
+    void *data;                     // Passed to tile
+};
+
+void dgemm_epilogue_ctx(struct gemm_context *, char, char,
+                        int, int, int,
+                        double, const double *, int,
+                        const double *, int,
+                        double, double *, int,
+                        const struct gemm_epilogue *);
+/* The epilogue on its own, as a separate pass over an m x n C. */
+void gemm_epilogue_apply(const struct gemm_epilogue *, int, int, double *, int);
+
+/*
+ * C = C + A B using Strassen-Winograd above a size cutoff, for as many
+ * levels as keep the normwise error bound (relative to max|A| max|B|)
+ * within tolerance; returns the bound of the levels used.  Temporaries
+ * live in the context.  See gemm-strassen.c.
+ */
+double strassen_gemm(double, int, int, int,
+                     const double *, int,
+                     const double *, int,
+                     double *, int);
+double strassen_gemm_ctx(struct gemm_context *, double,
+                         int, int, int,
+                         const double *, int,
+                         const double *, int,
+                         double *, int);
+void gemm_context_set_strassen_cutoff(struct gemm_context *, int);
+
+/*
+ * Batched C_i = C_i + A_i B_i for count independent problems of one shape,
+ * run in parallel across the batch, with kernels specialised at compile
+ * time for common small shapes (gemm_batch_specialised tells which).
+ * Strided form: A_i = a + i*stride_a, and so on; pointer-array form:
+ * A_i = a[i], and so on.
+ */
+void gemm_batch_strided(int, int, int,
+                        const double *, int, long,
+                        const double *, int, long,
+                        double *, int, long, int);
+void gemm_batch(int, int, int,
+                const double *const *, int,
+                const double *const *, int,
+                double *const *, int, int);
+int gemm_batch_specialised(int, int, int);
+/* The batch's small kernel on its own: C = C + A B for at most
+ * gemm_small_max() rows (any n and k), straight from A and B, in vectors
+ * of gemm_small_lanes() doubles (the width it was compiled for). */
+void gemm_small(int, int, int,
+                const double *, int,
+                const double *, int,
+                double *, int);
+int gemm_small_max(void);
+int gemm_small_lanes(void);
+
+/*
+ * What a micro-kernel does to its tile of C besides adding the product,
+ * all to the accumulators before its one store: entry (i, j) of the tile
+ * becomes
+ *   clamp((beta C_ij + AB_ij) + (row_bias[i] + column_bias[j]))
+ * where C is not read if beta is zero, and each bias and the clamp only
+ * apply if given (the biases point at the tile's own rows and columns).
+ * dgemm_ctx passes beta on the first panel of k and the epilogue's biases
+ * and clamp on the last (see struct gemm_epilogue).
+ */
+struct gemm_update {
+    double beta;
+    const double *row_bias;
+    const double *column_bias;
+    int clamp;
+    double lower, upper;
+};
+
+/*
+ * A register-blocked micro-kernel computing C += A B for one m_r x n_r
+ * tile of C over k steps, with A and B packed as by optimised_gemm:
+ * a holds k columns of m_r values, b holds k rows of n_r values.
+ * c is column major with leading dimension ldc.  With update (NULL for
+ * none) the tile is updated as struct gemm_update says instead.
+ * edge - the same for a partial tile of rows x columns (at most m_r x n_r),
+ *        touching nothing in C outside it.
+ * supported - returns nonzero if the running CPU can execute the kernel.
+ */
+struct gemm_kernel {
+    const char *name;
+    int m_r, n_r;
+    void (*kernel)(int k, const double *a, const double *b, double *c, int ldc,
+                   const struct gemm_update *update);
+    void (*edge)(int k, int rows, int columns, const double *a, const double *b,
+                 double *c, int ldc, const struct gemm_update *update);
+    int (*supported)(void);
+};
+
+const struct gemm_kernel *gemm_kernels(int *count);
+const struct gemm_kernel *gemm_best_kernel(void);
+const struct gemm_kernel *gemm_active_kernel(void);
+int gemm_select_kernel(const char *name);
+void gemm_context_set_kernel(struct gemm_context *, const struct gemm_kernel *);
+
+/*
+ * Cache blocking of optimised_gemm: depth of the packed panels (k_c),
+ * rows in each packed block of A (m_c) and columns in each packed panel
+ * of B (n_c).  m_c and n_c are rounded down to multiples of the kernel's
+ * m_r and n_r.
+ */
+struct gemm_blocking {
+    int k_c, m_c, n_c;
+};
+
+/* Data cache sizes in bytes, 0 if unknown. */
+struct gemm_caches {
+    long l1d, l2, l3;
+};
+
+/* A tuning profile: kernel name ("" for the default), blocking, the
+ * Strassen cutoff and the recursive cutoff (0 for the defaults). */
+struct gemm_profile {
+    char kernel[32];
+    struct gemm_blocking blocking;
+    int strassen_cutoff;
+    int recursive_cutoff;
+};
+
+void gemm_cache_sizes(struct gemm_caches *);
+void gemm_derive_blocking(const struct gemm_caches *, const struct gemm_kernel *,
+                          struct gemm_blocking *);
+const struct gemm_blocking *gemm_default_blocking(void);
+int gemm_default_strassen_cutoff(void);
+/* dgemm_ctx multiplies plain products of at most cutoff^3 multiply-adds
+ * with recursive_gemm instead of packing them. */
+int gemm_default_recursive_cutoff(void);
+void gemm_context_set_recursive_cutoff(struct gemm_context *, int);
+void gemm_context_set_blocking(struct gemm_context *, const struct gemm_blocking *);
+const char *gemm_profile_path(void);
+const struct gemm_profile *gemm_loaded_profile(void);
+int gemm_read_profile(const char *, struct gemm_profile *);
+int gemm_write_profile(const char *, const struct gemm_profile *);
+int gemm_tune(int, int, int, const char *, FILE *);
+
+#endif
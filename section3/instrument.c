@@ -0,0 +1,532 @@
+/* This file implements the run time instrumentation declared in
+ * instrument.h.
+ *
+ * MM_STATS selects where the JSON record goes: unset, empty or "0" leaves
+ * instrumentation off, "1" or "-" writes it to stderr, anything else is a
+ * file name the record is appended to (one JSON object per line).
+ *
+ * Counters are shared between threads and protected by a mutex; when
+ * instrumentation is off every entry point returns after a single test.
+ *
+ * Hardware events are counted per thread: each thread opens its own
+ * perf_event_open descriptors (counting only itself, in user space) the
+ * first time it starts a phase, and keeps them for the run.  A phase adds
+ * the difference between the readings at its start and stop.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <errno.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#include "instrument.h"
+
+#define MAX_FIELDS 32
+#define MAX_HOOKS 4
+
+int instrument_enabled = 0;
+
+static const char *phase_names[NPHASES] = {
+    "setup", "read", "convert", "sum", "symbolic", "multiply", "write",
+    "pack_a", "pack_b", "kernel", "reference", "exchange", "other"
+};
+
+static const char *counter_names[NCOUNTERS] = {
+    "flops", "bytes_read", "bytes_written", "nnz_in", "nnz_out",
+    "alloc_bytes", "reallocs"
+};
+
+static const char *event_names[NEVENTS] = {
+    "cycles", "instructions", "l1d_misses", "llc_misses", "dtlb_misses",
+    "fp_ops", "fp_ops", "fp_ops", "fp_ops", "page_faults"
+};
+
+// Bytes per last level cache miss, for the traffic per flop
+#define CACHE_LINE 64
+
+struct phase_record {
+    long calls;
+    double seconds;
+    double counters[NCOUNTERS];
+    double events[NEVENTS];
+};
+
+struct field {
+    char key[32];
+    char text[256];
+    double value;
+    int is_text;
+};
+
+static struct {
+    const char *program;
+    char destination[4096];
+    double start;
+    struct phase_record phases[NPHASES];
+    struct field fields[MAX_FIELDS];
+    int nfields;
+    void (*hooks[MAX_HOOKS])(void);
+    int nhooks;
+    int events_wanted[NEVENTS];
+    int events_enabled;             // Any event wanted
+    int events_failed[NEVENTS];     // Wanted but could not be opened (by some thread)
+    char events_error[128];         // Why the first one failed
+    double peak_gflops, peak_gbs;   // Roofs for the percentages, 0 if not set
+} state;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+// The innermost running phase of each thread, for attributing allocations
+static _Thread_local int current_phase = -1;
+// This thread's event descriptors (-1 if not counted), once events_opened
+static _Thread_local int event_fds[NEVENTS];
+static _Thread_local int events_opened = 0;
+
+static double now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + 1e-9*t.tv_nsec;
+}
+
+/*
+ * Start the run clock and read MM_STATS.
+ * program - name recorded in the JSON record.
+ */
+void instrument_init(const char *program)
+{
+    const char *env = getenv("MM_STATS");
+    state.program = program;
+    state.start = now();
+    if (env && *env && strcmp(env, "0")) {
+        instrument_enable(env);
+    }
+    env = getenv("MM_PERF");
+    if (env && *env && strcmp(env, "0")) {
+        instrument_enable_events(env);
+    }
+}
+
+/*
+ * Switch instrumentation on.
+ * destination - "1" or "-" for stderr, otherwise a file to append to.
+ */
+void instrument_enable(const char *destination)
+{
+    snprintf(state.destination, sizeof(state.destination), "%s", destination);
+    instrument_enabled = 1;
+}
+
+/*
+ * Count hardware events around every phase (reported only if instrumentation
+ * is enabled too).
+ * events - "1" for all of them, otherwise a comma separated list of names
+ *          (cycles, instructions, l1d_misses, llc_misses, dtlb_misses,
+ *          fp_ops, page_faults).
+ */
+void instrument_enable_events(const char *events)
+{
+    int all = !strcmp(events, "1");
+    for (int e = 0; e < NEVENTS; e++) {
+        const char *name = event_names[e];
+        const size_t length = strlen(name);
+        const char *found = events;
+        state.events_wanted[e] = all;
+        // Look for name as a whole item of the list
+        while (!all && (found = strstr(found, name))) {
+            if ((found == events || found[-1] == ',') && (found[length] == ',' || !found[length])) {
+                state.events_wanted[e] = 1;
+                break;
+            }
+            found += length;
+        }
+        state.events_enabled |= state.events_wanted[e];
+    }
+    if (!state.events_enabled) {
+        fprintf(stderr, "No known events in '%s' (MM_PERF)\n", events);
+    }
+}
+
+#ifdef __linux__
+/* Open this thread's counter for event e, or return -1 (errno set). */
+static int open_event(int e)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    switch (e) {
+    case EVENT_CYCLES:
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_CPU_CYCLES;
+        break;
+    case EVENT_INSTRUCTIONS:
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+        break;
+    case EVENT_L1D_MISSES:
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = PERF_COUNT_HW_CACHE_L1D | PERF_COUNT_HW_CACHE_OP_READ << 8
+            | PERF_COUNT_HW_CACHE_RESULT_MISS << 16;
+        break;
+    case EVENT_LLC_MISSES:
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_CACHE_MISSES;
+        break;
+    case EVENT_DTLB_MISSES:
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = PERF_COUNT_HW_CACHE_DTLB | PERF_COUNT_HW_CACHE_OP_READ << 8
+            | PERF_COUNT_HW_CACHE_RESULT_MISS << 16;
+        break;
+    case EVENT_FP_SCALAR:
+    case EVENT_FP_128:
+    case EVENT_FP_256:
+    case EVENT_FP_512:
+#if defined(__x86_64__) || defined(__i386__)
+        // FP_ARITH_INST_RETIRED (event 0xc7), umasks 0x01, 0x04, 0x10 and 0x40 for double precision
+        if (!__builtin_cpu_is("intel")) {
+            errno = ENOENT;
+            return -1;
+        }
+        attr.type = PERF_TYPE_RAW;
+        attr.config = 0xc7 | (0x01 << 2*(e - EVENT_FP_SCALAR)) << 8;
+        break;
+#else
+        errno = ENOENT;
+        return -1;
+#endif
+    case EVENT_PAGE_FAULTS:
+        attr.type = PERF_TYPE_SOFTWARE;
+        attr.config = PERF_COUNT_SW_PAGE_FAULTS;
+        break;
+    }
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#endif
+
+/* Open the calling thread's counters, on its first phase. */
+static void open_events(void)
+{
+    events_opened = 1;
+    for (int e = 0; e < NEVENTS; e++) {
+        event_fds[e] = -1;
+#ifdef __linux__
+        if (state.events_wanted[e] && (event_fds[e] = open_event(e)) < 0) {
+            const int error = errno;
+            pthread_mutex_lock(&lock);
+            if (!state.events_error[0]) {
+                snprintf(state.events_error, sizeof(state.events_error), "perf_event_open: %s", strerror(error));
+            }
+            state.events_failed[e] = 1;
+            pthread_mutex_unlock(&lock);
+        }
+#else
+        if (state.events_wanted[e]) {
+            snprintf(state.events_error, sizeof(state.events_error), "needs Linux perf_event_open");
+            state.events_failed[e] = 1;
+        }
+#endif
+    }
+}
+
+/* Read this thread's counters: value, time enabled and time running (zeros if not counted). */
+static void read_events(unsigned long long events[NEVENTS][3])
+{
+    for (int e = 0; e < NEVENTS; e++) {
+        events[e][0] = events[e][1] = events[e][2] = 0;
+        if (event_fds[e] >= 0 && read(event_fds[e], events[e], sizeof(events[e])) != sizeof(events[e])) {
+            events[e][0] = events[e][1] = events[e][2] = 0;
+        }
+    }
+}
+
+/* Report each phase's flop rate and bandwidth against these roofs (<= 0 to leave one out). */
+void instrument_set_peak(double gflops, double gbs)
+{
+    state.peak_gflops = gflops;
+    state.peak_gbs = gbs;
+}
+
+static struct field *new_field(const char *key)
+{
+    struct field *f;
+    for (int i = 0; i < state.nfields; i++) {
+        if (!strcmp(state.fields[i].key, key)) {
+            return &state.fields[i];
+        }
+    }
+    if (state.nfields == MAX_FIELDS) {
+        return NULL;
+    }
+    f = &state.fields[state.nfields++];
+    snprintf(f->key, sizeof(f->key), "%s", key);
+    return f;
+}
+
+/* Record a string valued property of the run (e.g. the mode). */
+void instrument_label(const char *key, const char *value)
+{
+    struct field *f;
+    if (!instrument_enabled) {
+        return;
+    }
+    pthread_mutex_lock(&lock);
+    if ((f = new_field(key))) {
+        snprintf(f->text, sizeof(f->text), "%s", value);
+        f->is_text = 1;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+/* Record a numeric property of the run (e.g. a matrix size). */
+void instrument_field(const char *key, double value)
+{
+    struct field *f;
+    if (!instrument_enabled) {
+        return;
+    }
+    pthread_mutex_lock(&lock);
+    if ((f = new_field(key))) {
+        f->value = value;
+        f->is_text = 0;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+/* Start timing a phase on this thread. Phases may nest. */
+void instrument_start(struct instrument_timer *t, int phase)
+{
+    if (!instrument_enabled) {
+        return;
+    }
+    t->phase = phase;
+    t->previous = current_phase;
+    current_phase = phase;
+    if (state.events_enabled) {
+        if (!events_opened) {
+            open_events();
+        }
+        read_events(t->events);
+    }
+    t->start = now();
+}
+
+/* Stop timing the phase started with t. */
+void instrument_stop(struct instrument_timer *t)
+{
+    double elapsed, events[NEVENTS] = {0};
+    if (!instrument_enabled) {
+        return;
+    }
+    elapsed = now() - t->start;
+    if (state.events_enabled) {
+        unsigned long long stop[NEVENTS][3];
+        read_events(stop);
+        for (int e = 0; e < NEVENTS; e++) {
+            // Scale up for the time the event was multiplexed out
+            const double running = stop[e][2] - t->events[e][2];
+            const double enabled = stop[e][1] - t->events[e][1];
+            if (running > 0) {
+                events[e] = (stop[e][0] - t->events[e][0])*(enabled / running);
+            }
+        }
+    }
+    current_phase = t->previous;
+    pthread_mutex_lock(&lock);
+    state.phases[t->phase].calls++;
+    state.phases[t->phase].seconds += elapsed;
+    for (int e = 0; e < NEVENTS; e++) {
+        state.phases[t->phase].events[e] += events[e];
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+/* Add amount to one of the counters of a phase. */
+void instrument_count(int phase, int counter, double amount)
+{
+    if (!instrument_enabled) {
+        return;
+    }
+    pthread_mutex_lock(&lock);
+    state.phases[phase].counters[counter] += amount;
+    pthread_mutex_unlock(&lock);
+}
+
+/* Attribute an allocation to the phase running on this thread. */
+void instrument_alloc(double bytes)
+{
+    if (!instrument_enabled) {
+        return;
+    }
+    instrument_count(current_phase < 0 ? PHASE_OTHER : current_phase,
+                     COUNT_ALLOC_BYTES, bytes);
+}
+
+/* Attribute a reallocation (to bytes) to the phase running on this thread. */
+void instrument_realloc(double bytes)
+{
+    int phase = current_phase < 0 ? PHASE_OTHER : current_phase;
+    if (!instrument_enabled) {
+        return;
+    }
+    instrument_count(phase, COUNT_ALLOC_BYTES, bytes);
+    instrument_count(phase, COUNT_REALLOCS, 1);
+}
+
+/* Register hook to run (outside the lock) before each record is written. */
+void instrument_on_report(void (*hook)(void))
+{
+    pthread_mutex_lock(&lock);
+    if (state.nhooks < MAX_HOOKS) {
+        state.hooks[state.nhooks++] = hook;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+/* Write the characters of s as the inside of a JSON string: quotes,
+ * backslashes and control characters escaped (text fields hold paths). */
+static void write_escaped(FILE *f, const char *s)
+{
+    for (; *s; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') {
+            fprintf(f, "\\%c", c);
+        } else if (c == '\n') {
+            fprintf(f, "\\n");
+        } else if (c == '\t') {
+            fprintf(f, "\\t");
+        } else if (c < 0x20) {
+            fprintf(f, "\\u%04x", c);
+        } else {
+            fputc(c, f);
+        }
+    }
+}
+
+/* Write the hardware event counts of phase r, and the figures derived from them. */
+static void report_events(FILE *f, const struct phase_record *r)
+{
+    const double flops = r->counters[COUNT_FLOPS];
+    // Each width of FP_ARITH_INST_RETIRED counts once per instruction (twice for FMA)
+    const double fp_ops = r->events[EVENT_FP_SCALAR] + 2*r->events[EVENT_FP_128]
+        + 4*r->events[EVENT_FP_256] + 8*r->events[EVENT_FP_512];
+    for (int e = 0; e < NEVENTS; e++) {
+        if (e >= EVENT_FP_SCALAR && e <= EVENT_FP_512) {
+            if (e == EVENT_FP_SCALAR && fp_ops != 0) {
+                fprintf(f, ", \"fp_ops\": %.17g", fp_ops);
+            }
+        } else if (r->events[e] != 0) {
+            fprintf(f, ", \"%s\": %.17g", event_names[e], r->events[e]);
+        }
+    }
+    if (r->events[EVENT_CYCLES] > 0 && r->events[EVENT_INSTRUCTIONS] > 0) {
+        fprintf(f, ", \"ipc\": %.4g", r->events[EVENT_INSTRUCTIONS] / r->events[EVENT_CYCLES]);
+    }
+    if (r->events[EVENT_LLC_MISSES] > 0 && (flops > 0 || fp_ops > 0)) {
+        fprintf(f, ", \"llc_bytes_per_flop\": %.4g",
+                CACHE_LINE*r->events[EVENT_LLC_MISSES] / (flops > 0 ? flops : fp_ops));
+    }
+}
+
+/*
+ * Emit the JSON record for the run, if instrumentation is enabled.
+ * Only phases that ran, and counters that are nonzero, are included.
+ */
+void instrument_report(void)
+{
+    FILE *f;
+    int first = 1;
+    if (!instrument_enabled) {
+        return;
+    }
+    for (int i = 0; i < state.nhooks; i++) {
+        state.hooks[i]();
+    }
+    if (!strcmp(state.destination, "1") || !strcmp(state.destination, "-")) {
+        f = stderr;
+    } else if (!(f = fopen(state.destination, "a"))) {
+        fprintf(stderr, "Unable to open %s for instrumentation output.\n", state.destination);
+        return;
+    }
+
+    pthread_mutex_lock(&lock);
+    fprintf(f, "{\"program\": \"");
+    write_escaped(f, state.program ? state.program : "");
+    fprintf(f, "\", \"wall_seconds\": %.9g", now() - state.start);
+    for (int i = 0; i < state.nfields; i++) {
+        if (state.fields[i].is_text) {
+            fprintf(f, ", \"%s\": \"", state.fields[i].key);
+            write_escaped(f, state.fields[i].text);
+            fprintf(f, "\"");
+        } else {
+            fprintf(f, ", \"%s\": %.17g", state.fields[i].key, state.fields[i].value);
+        }
+    }
+    if (state.peak_gflops > 0) {
+        fprintf(f, ", \"peak_gflops\": %.6g", state.peak_gflops);
+    }
+    if (state.peak_gbs > 0) {
+        fprintf(f, ", \"peak_gbs\": %.6g", state.peak_gbs);
+    }
+    if (state.events_enabled) {
+        int first_failed = 1;
+        for (int e = 0; e < NEVENTS; e++) {
+            // Name each missing event once (fp_ops covers four)
+            if (state.events_failed[e] && (e <= EVENT_FP_SCALAR || e > EVENT_FP_512
+                                           || !state.events_failed[EVENT_FP_SCALAR])) {
+                fprintf(f, "%s%s", first_failed ? ", \"perf_unavailable\": \"" : ",", event_names[e]);
+                first_failed = 0;
+            }
+        }
+        if (!first_failed) {
+            fprintf(f, " (");
+            write_escaped(f, state.events_error);
+            fprintf(f, ")\"");
+        }
+    }
+    fprintf(f, ", \"phases\": {");
+    for (int p = 0; p < NPHASES; p++) {
+        struct phase_record *r = &state.phases[p];
+        int used = r->calls > 0;
+        for (int c = 0; c < NCOUNTERS; c++) {
+            used |= r->counters[c] != 0;
+        }
+        if (!used) {
+            continue;
+        }
+        fprintf(f, "%s\"%s\": {\"calls\": %ld, \"seconds\": %.9g",
+                first ? "" : ", ", phase_names[p], r->calls, r->seconds);
+        for (int c = 0; c < NCOUNTERS; c++) {
+            if (r->counters[c] != 0) {
+                fprintf(f, ", \"%s\": %.17g", counter_names[c], r->counters[c]);
+            }
+        }
+        report_events(f, r);
+        if (r->seconds > 0 && state.peak_gflops > 0 && r->counters[COUNT_FLOPS] > 0) {
+            fprintf(f, ", \"percent_peak_flops\": %.4g",
+                    100*1e-9*r->counters[COUNT_FLOPS] / r->seconds / state.peak_gflops);
+        }
+        if (r->seconds > 0 && state.peak_gbs > 0
+            && r->counters[COUNT_BYTES_READ] + r->counters[COUNT_BYTES_WRITTEN] > 0) {
+            fprintf(f, ", \"percent_peak_bandwidth\": %.4g", 100*1e-9*(r->counters[COUNT_BYTES_READ]
+                    + r->counters[COUNT_BYTES_WRITTEN]) / r->seconds / state.peak_gbs);
+        }
+        fprintf(f, "}");
+        first = 0;
+    }
+    fprintf(f, "}}\n");
+    pthread_mutex_unlock(&lock);
+
+    if (f != stderr) {
+        fclose(f);
+    }
+}
@@ -0,0 +1,92 @@
+#ifndef _INSTRUMENT_H
+#define _INSTRUMENT_H
+
+#include <stdio.h>
+
+/*
+ * Lightweight run time instrumentation shared by gemm and sparsemm.
+ *
+ * Always compiled in; does nothing unless enabled with MM_STATS in the
+ * environment (or instrument_enable), in which case per-phase wall time
+ * and counters are accumulated and instrument_report emits one JSON
+ * record for the whole run.
+ *
+ * Hardware counters (Linux perf_event_open) are read around every phase
+ * as well when MM_PERF is set (or instrument_enable_events is called):
+ * "1" for all of the events below, or a comma separated list of their
+ * names.  Each phase then reports the counts, the instructions per cycle
+ * and the last level cache miss traffic per flop.  Events the kernel will
+ * not give us (no PMU in a VM, perf_event_paranoid, another OS) are left
+ * out and named in the record's perf_unavailable field.  More events than
+ * the PMU has counters are multiplexed, and the counts scaled up.
+ */
+
+enum instrument_phase {
+    PHASE_SETUP,
+    PHASE_READ,
+    PHASE_CONVERT,
+    PHASE_SUM,
+    PHASE_SYMBOLIC,
+    PHASE_MULTIPLY,
+    PHASE_WRITE,
+    PHASE_PACK_A,
+    PHASE_PACK_B,
+    PHASE_KERNEL,
+    PHASE_REFERENCE,
+    PHASE_EXCHANGE,
+    PHASE_OTHER,
+    NPHASES
+};
+
+enum instrument_counter {
+    COUNT_FLOPS,
+    COUNT_BYTES_READ,
+    COUNT_BYTES_WRITTEN,
+    COUNT_NNZ_IN,
+    COUNT_NNZ_OUT,
+    COUNT_ALLOC_BYTES,
+    COUNT_REALLOCS,
+    NCOUNTERS
+};
+
+enum instrument_event {
+    EVENT_CYCLES,
+    EVENT_INSTRUCTIONS,
+    EVENT_L1D_MISSES,
+    EVENT_LLC_MISSES,
+    EVENT_DTLB_MISSES,
+    EVENT_FP_SCALAR,        // Double precision FP_ARITH_INST_RETIRED (Intel only) by width,
+    EVENT_FP_128,           // reported together as fp_ops
+    EVENT_FP_256,
+    EVENT_FP_512,
+    EVENT_PAGE_FAULTS,
+    NEVENTS
+};
+
+struct instrument_timer {
+    int phase, previous;
+    double start;
+    unsigned long long events[NEVENTS][3];  // Value, time enabled and time running at the start
+};
+
+extern int instrument_enabled;
+
+void instrument_init(const char *program);
+void instrument_enable(const char *destination);
+void instrument_enable_events(const char *events);
+/* Report each phase's flop rate and bandwidth as percentages of these roofs (see peak.h),
+ * which should match how the phases are timed: a phase timed in every thread adds up
+ * the threads' seconds, so its rates are per thread. */
+void instrument_set_peak(double gflops, double gbs);
+void instrument_label(const char *key, const char *value);
+void instrument_field(const char *key, double value);
+void instrument_start(struct instrument_timer *, int phase);
+void instrument_stop(struct instrument_timer *);
+void instrument_count(int phase, int counter, double amount);
+void instrument_alloc(double bytes);
+void instrument_realloc(double bytes);
+void instrument_report(void);
+/* Call hook (e.g. to add fields) whenever a record is about to be written. */
+void instrument_on_report(void (*hook)(void));
+
+#endif
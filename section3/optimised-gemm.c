@@ -6,14 +6,19 @@
  */
 
 #include<stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <complex.h>
+#include <unistd.h>
+#include <pthread.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
-void basic_gemm(int, int, int,
-                const double *, int,
-                const double *, int,
-                double *, int);
-void pack_a(int start, int loop_2, const int m, const int k, const double *a, const int lda);
-void pack_b(int start, const int n, const int k, const double *b, const int ldb);
-void micro_kernel(int loop_2, int loop_3, int loop_4, int ldc, double *c);
+#include "gemm.h"
+#include "instrument.h"
+#include "workspace.h"
 
 // Original values - from Dr. Mitchell
 // const int m_r = 4;
@@ -22,207 +27,354 @@ void micro_kernel(int loop_2, int loop_3, int loop_4, int ldc, double *c);
 // const int m_c = 512;
 
 // Best values - from experimentation
-const int m_r = 4;
-const int n_r = 8;
-const int k_c = 256;
-const int m_c = 512;
-
-// Global variable to store the packed subarray of A
-double *A_packed;
-// Global variable to store the spliced subarray of A_packed
-double *A_splice;
-// Global variable to store the packed subarray of B
-double *B_packed;
-// Global variable to store the spliced subarray of B_packed
-double *B_splice;
+// const int k_c = 256;
+// const int m_c = 512;
+// const int n_c = 4096;
+// m_r and n_r are now set by the micro-kernel in use (see gemm-kernels.c), and k_c, m_c and n_c
+// are derived from the cache sizes or read from a tuning profile (see gemm-tune.c);
+// m_c (n_c) is rounded down to a multiple of m_r (n_r)
 
-/* Compute C = C + A*B
- *
- * C has rank m x n
- * A has rank m x k
- * B has rank k x n
- * ldX is the leading dimension of the respective matrix.
- * 
- * for m, n, k all <= 512, basic dense multiplication is performed as this is faster
- * 
- * All matrices are stored in column major format.
+/* Packing workspace owned by a gemm_context.
+ * Every buffer comes from workspace_alloc (huge pages for the larger ones), is allocated on first use, and is
+ * only replaced when a call needs a larger one. Packing writes every entry a kernel reads (padding included),
+ * so none of it is ever zero-filled. A new A_packed is first touched by the thread that packs into it, so it
+ * is local to that thread's NUMA node; B_packed is shared, and its pages go to whichever thread packs there.
  */
-void optimised_gemm(int m, int n, int k,
-                    const double *a, int lda,
-                    const double *b, int ldb,
-                    double *c, int ldc)
+struct gemm_context {
+    int threads;                        // 0 to follow gemm_get_num_threads
+    const struct gemm_kernel *kernel;   // NULL to follow gemm_active_kernel
+    struct gemm_blocking blocking;      // k_c == 0 to follow gemm_default_blocking
+    double *B_packed;                   // k_c x n_c, shared by the threads
+    size_t B_size;
+    double **A_packed;                  // m_c x k_c for each thread
+    size_t *A_size;
+    char *A_fresh;                      // 1 for each A_packed not yet touched by its thread
+    int A_count;
+    int strassen_cutoff;                // 0 to follow gemm_default_strassen_cutoff
+    double *scratch;                    // Strassen temporaries (see gemm-strassen.c)
+    size_t scratch_size;
+    int prefetch;                       // -1 to follow gemm_default_prefetch
+    int recursive_cutoff;               // 0 to follow gemm_default_recursive_cutoff
+};
+
+// Bytes in a cache line, the unit of software prefetch
+#define CACHE_LINE 64
+
+// Each thread's context for optimised_gemm, freed when the thread exits
+static pthread_key_t default_key;
+static pthread_once_t default_once = PTHREAD_ONCE_INIT;
+
+// Number of threads optimised_gemm uses, 0 until first use / gemm_set_num_threads
+static int num_threads = 0;
+
+/* Set the number of threads optimised_gemm uses.
+ * threads <= 0 restores the default: GEMM_NUM_THREADS from the environment if set,
+ * otherwise the OpenMP default (OMP_NUM_THREADS or the number of cores).
+ */
+void gemm_set_num_threads(int threads)
+{
+    const char *env = getenv("GEMM_NUM_THREADS");
+    if(threads <= 0 && env) {
+        threads = atoi(env);
+    }
+#ifdef _OPENMP
+    if(threads <= 0) {
+        threads = omp_get_max_threads();
+    }
+#endif
+    num_threads = threads > 0 ? threads : 1;
+}
+
+/* The number of threads optimised_gemm uses. */
+int gemm_get_num_threads(void)
+{
+    if(num_threads == 0) {
+        gemm_set_num_threads(0);
+    }
+    return num_threads;
+}
+
+/* Create a context with no workspace yet, using the default kernel and number of threads. */
+struct gemm_context *gemm_context_create(void)
 {
-    /* Approach to dense matrix-matrix multiplication
-     *
-     * If m <= 700 and n <= 700 and k <= 700, use basic_gemm instead as it is faster
-     *
-     * For any 'uneven' values, i.e.:
-     *  k % k_c != 0
-     *  m % m_c != 0
-     *  n % n_r != 0
-     *  m_c % m_r != 0
-     * 
-     * Handle the 'leftover' by padding the affected dimension of that stage of processing with zeros.
-     * E.g.: m_c = 5, m_r = 2
-     * in the third block of each column of A, a row of zeros will be added below it to make it 2 (=m_r) tall
-     */
-
-    if(m <= 700 && n <= 700 && k <= 700) {
-        basic_gemm(m, n, k, a, lda, b, ldb, c, ldc);
+    struct gemm_context *ctx = calloc(1, sizeof(struct gemm_context));
+    if(ctx) {
+        ctx->prefetch = -1;
+    }
+    return ctx;
+}
+
+/* Free a context and all of its workspace. */
+void gemm_context_destroy(struct gemm_context *ctx)
+{
+    if(!ctx) {
         return;
     }
+    workspace_free(ctx->B_packed);
+    for(int i = 0; i < ctx->A_count; i++) {
+        workspace_free(ctx->A_packed[i]);
+    }
+    free(ctx->A_packed);
+    free(ctx->A_size);
+    free(ctx->A_fresh);
+    workspace_free(ctx->scratch);
+    free(ctx);
+}
 
-    // Allocate memory to A_packed and B_packed
-    // A_packed will be k_c*m_c, B_packed will be k_c*ceil(n/n_r)*n_r
-    // 1 + ((x - 1) / y) gives ceil(x/y), from https://stackoverflow.com/questions/2745074/fast-ceiling-of-an-integer-division-in-c-c
-    A_packed = calloc(m_c*k_c, sizeof(double));
-    B_packed = calloc(k_c*(1 + ((n - 1) / n_r))*n_r, sizeof(double));
-    // Allocate memory to A_splice and B_splice
-    // A_splice will be m_r*k_c doubles, B_splice will be k_c*n_r doubles
-    A_splice = calloc(m_r*k_c, sizeof(double));
-    B_splice = calloc(k_c*n_r, sizeof(double));
-
-    // Split A into columns k_c wide and B into rows k_c tall. Access these simultaneously as the i'th index of column/row
-    for(int loop_1 = 0; loop_1 < k; loop_1 += k_c) {
-        // Pack the row from B
-        int b_start = loop_1; // The start is loop_1 values down in the left-most column of B
-        pack_b(b_start, n, k, b, ldb); // Handle possible uneven constants inside pack_b
-        // Split the column from A into blocks m_c tall
-        for(int loop_2 = 0; loop_2 < m; loop_2 += m_c) {
-            // Pack the block from A
-            int a_start = loop_2 + loop_1*lda; // The start is loop_2 value down in the loop_1'th column of A
-            pack_a(a_start, loop_2, m, k, a, lda); // Handle possible uneven constants inside pack_a
-            // Split the row from B into columns n_r wide
-            for(int loop_3 = 0; loop_3 < n; loop_3 += n_r) {
-                // Set a pointer to the start of the current column
-                B_splice = (B_packed + loop_3*k_c);
-
-                // Split the block from the column from A into rows m_r tall
-                for(int loop_4 = 0; loop_4 < m_c; loop_4 += m_r) {
-                    // Set a pointer to the start of the current row
-                    A_splice = (A_packed + loop_4*k_c);
-
-                    // Multiply the row from A with the column from B store it in temp_output
-                    micro_kernel(loop_2, loop_3, loop_4, ldc, c);
-                }
-            }
-        }
+/* Number of threads calls with ctx use (<= 0 for gemm_get_num_threads). */
+void gemm_context_set_num_threads(struct gemm_context *ctx, int threads)
+{
+    ctx->threads = threads > 0 ? threads : 0;
+}
+
+/* Micro-kernel calls with ctx use (NULL for gemm_active_kernel). */
+void gemm_context_set_kernel(struct gemm_context *ctx, const struct gemm_kernel *kernel)
+{
+    ctx->kernel = kernel;
+}
+
+/* Cache blocking calls with ctx use (NULL for gemm_default_blocking). */
+void gemm_context_set_blocking(struct gemm_context *ctx, const struct gemm_blocking *blocking)
+{
+    if(blocking) {
+        ctx->blocking = *blocking;
+    } else {
+        ctx->blocking.k_c = 0;
     }
-    // Free the allocated memory
-    free(A_packed);
-    free(B_packed);
-    // free(A_splice);
-    // free(B_splice);
 }
 
-/* Pack A from the given start index as needed for BLIS.
- * 
- * Output is returned using the global A_packed variable
- */
-void pack_a(int start, int loop_2, const int m, const int k, const double *a, const int lda) {
-    // Output is stored in A_packed
-
-    // store which index you're inserting into
-    int output_index = 0;
-
-    // Loop over each row in the output
-    for(int row = 0; row < m_c; row += m_r) {
-        // Loop over each column in this row
-        for(int column = 0; column < k_c; column++) {
-            // Loop over each value in this column
-            for(int value = 0; value < m_r; value++) {
-                // Select the appropriate value from A
-                // This can be found at start + value + column*lda + row
-                // start shifts everything down the A matrix, hence just added
-                // value shifts downwards in each column, hence just added
-                // column shifts rightwards within each row, so we add column*lda
-                // row shifts downwards, as each row is of height m_r, hence row*m_r is added
-                int a_index = start + value + column*lda + row;
-
-                // Check if this index is outside of the block of A_i, the column of A_p, or the matrix of A
-                // That is, downward shift (loop_2 + value + row) must be < m and value + row must be < m_c
-                // And x position (i.e. which column value is in) must be within A, i.e.
-                // floor(start/m) + column must be < k
-                // Since start/m gets the # of column that start is in, and column shifts 1 column right each
-                if(loop_2 + value + row >= m || value + row >= m_c || start/m + column >= k) {
-                    A_packed[output_index] = 0.0;
-                } else {
-                    A_packed[output_index] = a[a_index];
-                }
-                // increment the index
-                output_index++;
-            }
-        }
+/* Smallest dimension strassen_gemm_ctx splits with ctx (<= 0 for gemm_default_strassen_cutoff). */
+void gemm_context_set_strassen_cutoff(struct gemm_context *ctx, int cutoff)
+{
+    ctx->strassen_cutoff = cutoff > 0 ? cutoff : 0;
+}
+
+/* Size below which dgemm_ctx with ctx multiplies without packing (<= 0 for gemm_default_recursive_cutoff). */
+void gemm_context_set_recursive_cutoff(struct gemm_context *ctx, int cutoff)
+{
+    ctx->recursive_cutoff = cutoff > 0 ? cutoff : 0;
+}
+
+/* Whether packing is pipelined with the kernels by prefetching what is packed next:
+ * GEMM_PREFETCH from the environment if set (1 turns it on), otherwise off.
+ * It pays where packing waits on memory the hardware prefetchers do not cover
+ * (a small last level cache, many threads sharing one memory bus); on a node
+ * with a large L3 it measured within noise, so it is not the default. */
+int gemm_default_prefetch(void)
+{
+    static int prefetch = -1;
+    if(prefetch < 0) {
+        const char *env = getenv("GEMM_PREFETCH");
+        prefetch = env && *env ? atoi(env) != 0 : 0;
     }
+    return prefetch;
 }
 
-/* Pack B from the given start index as needed for BLIS.
- * 
- * Output is returned using the global B_packed variable
- */
-void pack_b(int start, const int n, const int k, const double *b, const int ldb) {
-    // Output is stored in B_packed
-
-    // store which index you're inserting into
-    int output_index = 0;
-
-    // Loop over each column in the output
-    for(int column = 0; column < n; column += n_r) {
-        // Loop over each line in this column
-        for(int line = 0; line < k_c; line++) {
-            // Loop over each value in this line
-            for(int value = 0; value < n_r; value++) {
-                // Select the appropriate value from B
-                // This can be found at start + value*ldb + line + column*ldb
-                // start shifts everything down the B matrix, hence just added
-                // value shifts rightwards on each row, so we add value*ldb
-                // line shifts downwards, hence just added
-                // column shifts n_r steps rightwards, as each column is of width n_r, hence column*ldb*n_r is added
-                int b_index = start + value*ldb + line + column*ldb;
-
-                // Check if this index value is outside of the matrix B (i.e. start + line >= k, or value + column >= n)
-                // If it is, set the value of B_packed to zero
-                if(start + line >= k || value + column >= n) {
-                    // First check: bottom of the matrix
-                    // Second check: right side of the matrix
-                    B_packed[output_index] = 0.0;
-                } else {
-                    B_packed[output_index] = b[b_index];
-                }
-                // increment the index
-                output_index++;
-            }
+/* Whether calls with ctx prefetch what they pack next (1), do not (0) or follow gemm_default_prefetch (< 0). */
+void gemm_context_set_prefetch(struct gemm_context *ctx, int prefetch)
+{
+    ctx->prefetch = prefetch < 0 ? -1 : prefetch != 0;
+}
+
+int gemm_context_strassen_cutoff(const struct gemm_context *ctx)
+{
+    return ctx->strassen_cutoff > 0 ? ctx->strassen_cutoff : gemm_default_strassen_cutoff();
+}
+
+static int context_recursive_cutoff(const struct gemm_context *ctx)
+{
+    return ctx->recursive_cutoff > 0 ? ctx->recursive_cutoff : gemm_default_recursive_cutoff();
+}
+
+/* Make *buffer hold at least count doubles, keeping it if it already does.
+ * Returns 1 if it was replaced. */
+static int reserve(double **buffer, size_t *size, size_t count)
+{
+    static size_t page = 0;
+    if(count <= *size) {
+        return 0;
+    }
+    if(!page) {
+        page = sysconf(_SC_PAGESIZE);
+    }
+    workspace_free(*buffer);
+    // Round up to whole pages
+    count = (1 + (count*sizeof(double) - 1) / page)*page / sizeof(double);
+    *buffer = workspace_alloc(count*sizeof(double));
+    *size = count;
+    instrument_alloc(count*sizeof(double));
+    return 1;
+}
+
+/* Make the workspace of ctx big enough for threads threads */
+static void reserve_workspace(struct gemm_context *ctx, int threads, size_t a_count, size_t b_count)
+{
+    if(threads > ctx->A_count) {
+        ctx->A_packed = realloc(ctx->A_packed, threads*sizeof(double *));
+        ctx->A_size = realloc(ctx->A_size, threads*sizeof(size_t));
+        ctx->A_fresh = realloc(ctx->A_fresh, threads);
+        for(int i = ctx->A_count; i < threads; i++) {
+            ctx->A_packed[i] = NULL;
+            ctx->A_size[i] = 0;
         }
+        ctx->A_count = threads;
     }
+    for(int i = 0; i < threads; i++) {
+        ctx->A_fresh[i] = reserve(&ctx->A_packed[i], &ctx->A_size[i], a_count);
+    }
+    reserve(&ctx->B_packed, &ctx->B_size, b_count);
+}
+
+/* Scratch space of at least count doubles owned by ctx, kept between calls. */
+double *gemm_context_scratch(struct gemm_context *ctx, size_t count)
+{
+    reserve(&ctx->scratch, &ctx->scratch_size, count);
+    return ctx->scratch;
+}
+
+static void destroy_default(void *ctx)
+{
+    gemm_context_destroy(ctx);
+}
+
+static void create_default_key(void)
+{
+    pthread_key_create(&default_key, &destroy_default);
+}
+
+/* The calling thread's own context, created on first use and freed when the thread exits. */
+struct gemm_context *gemm_thread_context(void)
+{
+    struct gemm_context *ctx;
+    pthread_once(&default_once, &create_default_key);
+    if(!(ctx = pthread_getspecific(default_key))) {
+        ctx = gemm_context_create();
+        pthread_setspecific(default_key, ctx);
+    }
+    return ctx;
+}
+
+/* Compute C = C + A*B using the calling thread's own (reused) context.
+ *
+ * See optimised_gemm_ctx.
+ */
+void optimised_gemm(int m, int n, int k,
+                    const double *a, int lda,
+                    const double *b, int ldb,
+                    double *c, int ldc)
+{
+    optimised_gemm_ctx(gemm_thread_context(), m, n, k, a, lda, b, ldb, c, ldc);
 }
 
-/* Apply the micro kernel, i.e. matrix multiplication of A_splice * B_splice
+/* Compute C = C + A*B
+ *
+ * C has rank m x n
+ * A has rank m x k
+ * B has rank k x n
+ * ldX is the leading dimension of the respective matrix.
+ * ctx provides the packing workspace (and settings); only one call at a time may use it.
  * 
- * All required variables for multiplication are globally defined.
- * The input variables define where in C the output should be stored:
- *      loop_2 + loop_4 tells us how far down the column we are
- *      loop_3 tells us how many columns right we are, i.e. loop_3*ldc steps in the 1D matrix
- * If called out of order may result in segmentation fault (if A_splice or B_splice are not correctly allocated memory/initialized)
+ * All matrices are stored in column major format.
  */
-void micro_kernel(int loop_2, int loop_3, int loop_4, int ldc, double *c) {
-    // Compute the start index
-    int start = loop_2 + loop_4 + ldc*loop_3;
-    // Loop over each column in A_splice and row in B_splice as pairs (i.e. column 0 row 0, column 1 row 1, etc.)
-    for(int index = 0; index < k_c; index++) {
-        // Loop over each value in the row of B_splice
-        for(int B_val = 0; B_val < n_r; B_val++) {
-            // Loop over each value in the column of A_splice
-            for(int A_val = 0; A_val < m_r; A_val++) {
-                // Multiply the values together, and store the result in kernel_output
-                // As we loop over the row first and the column second, the output will automatically be in column-major format
-                // The correct value of A_splice is found at [A_val + index*m_r], as index tracks which column we're in, and each column is m_r long. The value in B_splice is similarly found at [B_val + index*n_r], as each row is n_r long.
-                c[start + A_val + B_val*ldc] += A_splice[A_val + index*m_r] * B_splice[B_val + index*n_r];
-                // Start = loop_2 + loop_4 + loop_3 * ldc
-                // Adjustment = A_val + B_val*ldc
-            }
-        }
+void optimised_gemm_ctx(struct gemm_context *ctx,
+                        int m, int n, int k,
+                        const double *a, int lda,
+                        const double *b, int ldb,
+                        double *c, int ldc)
+{
+    dgemm_ctx(ctx, 'N', 'N', m, n, k, 1.0, a, lda, b, ldb, 1.0, c, ldc);
+}
+
+/* The double kernel calls with ctx use */
+static const struct gemm_kernel *context_kernel(const struct gemm_context *ctx)
+{
+    return ctx->kernel ? ctx->kernel : gemm_active_kernel();
+}
+
+/* Every precision is generated from gemm-template.h; double uses the micro-kernels of
+ * gemm-kernels.c and the others the type-generic vector kernel of gemm-kernel-template.h. */
+#define T double
+#define IS_COMPLEX 0
+#define NAME(x) d##x
+#define BASIC_GEMM basic_gemm
+#define RECURSIVE_GEMM recursive_gemm
+#define RECURSIVE_CUTOFF(ctx) context_recursive_cutoff(ctx)
+#define SKINNY_GEMM skinny_gemm
+#define SKINNY_SHAPE(m, n, k) gemm_skinny_shape(m, n, k)
+#define KERNEL_OF(ctx, micro)                                                                       \
+    ((micro).m_r = context_kernel(ctx)->m_r, (micro).n_r = context_kernel(ctx)->n_r,               \
+     (micro).kernel = context_kernel(ctx)->kernel, (micro).edge = context_kernel(ctx)->edge)
+#define EPILOGUE
+#include "gemm-template.h"
+#undef T
+#undef IS_COMPLEX
+#undef NAME
+#undef BASIC_GEMM
+#undef RECURSIVE_GEMM
+#undef RECURSIVE_CUTOFF
+#undef SKINNY_GEMM
+#undef SKINNY_SHAPE
+#undef KERNEL_OF
+
+void dgemm_epilogue_ctx(struct gemm_context *ctx, char transa, char transb,
+                        int m, int n, int k,
+                        double alpha, const double *a, int lda,
+                        const double *b, int ldb,
+                        double beta, double *c, int ldc,
+                        const struct gemm_epilogue *epilogue)
+{
+    dgemm_engine(ctx, transa, transb, m, n, k, alpha, a, lda, b, ldb, beta, c, ldc, epilogue);
+}
+
+void gemm_epilogue_apply(const struct gemm_epilogue *epilogue, int m, int n, double *c, int ldc)
+{
+    if(m > 0 && n > 0) {
+        depilogue_tile(epilogue, 0, 0, m, n, c, ldc);
     }
 }
+#undef EPILOGUE
+
+#define KERNEL_OF(ctx, micro)                                                                       \
+    ((void)(ctx), (micro).m_r = NAME(vector_m_r), (micro).n_r = NAME(vector_n_r),                  \
+     (micro).kernel = &NAME(vector_kernel), (micro).edge = &NAME(vector_edge))
+
+#define T float
+#define R float
+#define IS_COMPLEX 0
+#define NAME(x) s##x
+#include "gemm-kernel-template.h"
+#include "gemm-template.h"
+#undef T
+#undef R
+#undef IS_COMPLEX
+#undef NAME
+
+#define T float _Complex
+#define R float
+#define IS_COMPLEX 1
+#define NAME(x) c##x
+#define CONJ(x) conjf(x)
+#include "gemm-kernel-template.h"
+#include "gemm-template.h"
+#undef T
+#undef R
+#undef IS_COMPLEX
+#undef NAME
+#undef CONJ
+
+#define T double _Complex
+#define R double
+#define IS_COMPLEX 1
+#define NAME(x) z##x
+#define CONJ(x) conj(x)
+#include "gemm-kernel-template.h"
+#include "gemm-template.h"
+#undef T
+#undef R
+#undef IS_COMPLEX
+#undef NAME
+#undef CONJ
+#undef KERNEL_OF
 
 /* Main function used for testing as required.
  *
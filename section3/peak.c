@@ -0,0 +1,358 @@
+/* This file implements the peak probe declared in peak.h.
+ *
+ * The FMA rate comes from independent chains of fused multiply-adds, more of
+ * them than the FMA units' latency times their number, so the units never
+ * wait; like the gemm micro-kernels, the loops are compiled for each instruction
+ * set with target attributes and the widest the CPU supports is used.  Each
+ * measurement is calibrated to run for at least RUN_SECONDS and is the best of
+ * REPEATS.
+ *
+ * The triad is a[i] = b[i] + s c[i] over arrays much larger than the last
+ * level cache (up to a limit), counted as STREAM does: 24 bytes per element,
+ * without the write-allocate traffic.  Each thread first touches the part of
+ * the arrays it then works on.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#define PEAK_X86 1
+#include <immintrin.h>
+#endif
+
+#include "peak.h"
+#include "gemm.h"
+#include "workspace.h"
+
+// Shortest timed run, and the number of timed runs
+#define RUN_SECONDS 0.1
+#define REPEATS 3
+// Bounds on the size of each triad array, in doubles (32MB and 256MB)
+#define TRIAD_MIN ((size_t)4 << 20)
+#define TRIAD_MAX ((size_t)32 << 20)
+
+static double now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + 1e-9*t.tv_nsec;
+}
+
+/* An FMA loop: runs iterations steps, returns a value depending on all the work
+ * (so none of it is optimised away), and sets *flops to the flops per step. */
+typedef double (*fma_loop_t)(long iterations, int *flops);
+
+// Portable loop: scalar chains the compiler may vectorise for the baseline
+static double fma_generic(long iterations, int *flops)
+{
+    double acc[16];
+    const double x = 0.999999, y = 1e-6;
+    double sum = 0;
+    for (int j = 0; j < 16; j++) {
+        acc[j] = j;
+    }
+    for (long i = 0; i < iterations; i++) {
+        for (int j = 0; j < 16; j++) {
+            acc[j] = acc[j]*x + y;
+        }
+    }
+    for (int j = 0; j < 16; j++) {
+        sum += acc[j];
+    }
+    *flops = 2*16;
+    return sum;
+}
+
+#ifdef PEAK_X86
+// Twelve chains of each: more than the two FMA units times a four cycle latency
+
+#define CHAINS(X) X(0) X(1) X(2) X(3) X(4) X(5) X(6) X(7) X(8) X(9) X(10) X(11)
+
+__attribute__((target("sse2")))
+static double fma_sse2(long iterations, int *flops)
+{
+    const __m128d x = _mm_set1_pd(0.999999), y = _mm_set1_pd(1e-6);
+#define DECLARE(j) __m128d acc##j = _mm_set1_pd(j);
+#define STEP(j) acc##j = _mm_add_pd(_mm_mul_pd(acc##j, x), y);
+#define SUM(j) sum = _mm_add_pd(sum, acc##j);
+    CHAINS(DECLARE)
+    __m128d sum = _mm_setzero_pd();
+    for (long i = 0; i < iterations; i++) {
+        CHAINS(STEP)
+    }
+    CHAINS(SUM)
+#undef DECLARE
+#undef STEP
+#undef SUM
+    *flops = 12*2*2;
+    return _mm_cvtsd_f64(sum);
+}
+
+__attribute__((target("avx2,fma")))
+static double fma_avx2(long iterations, int *flops)
+{
+    const __m256d x = _mm256_set1_pd(0.999999), y = _mm256_set1_pd(1e-6);
+#define DECLARE(j) __m256d acc##j = _mm256_set1_pd(j);
+#define STEP(j) acc##j = _mm256_fmadd_pd(acc##j, x, y);
+#define SUM(j) sum = _mm256_add_pd(sum, acc##j);
+    CHAINS(DECLARE)
+    __m256d sum = _mm256_setzero_pd();
+    for (long i = 0; i < iterations; i++) {
+        CHAINS(STEP)
+    }
+    CHAINS(SUM)
+#undef DECLARE
+#undef STEP
+#undef SUM
+    *flops = 12*4*2;
+    return _mm256_cvtsd_f64(sum);
+}
+
+__attribute__((target("avx512f")))
+static double fma_avx512(long iterations, int *flops)
+{
+    const __m512d x = _mm512_set1_pd(0.999999), y = _mm512_set1_pd(1e-6);
+#define DECLARE(j) __m512d acc##j = _mm512_set1_pd(j);
+#define STEP(j) acc##j = _mm512_fmadd_pd(acc##j, x, y);
+#define SUM(j) sum = _mm512_add_pd(sum, acc##j);
+    CHAINS(DECLARE)
+    __m512d sum = _mm512_setzero_pd();
+    for (long i = 0; i < iterations; i++) {
+        CHAINS(STEP)
+    }
+    CHAINS(SUM)
+#undef DECLARE
+#undef STEP
+#undef SUM
+    *flops = 12*8*2;
+    return _mm512_reduce_add_pd(sum);
+}
+#endif
+
+/* The widest FMA loop the running CPU supports, and its name. */
+static fma_loop_t best_loop(const char **isa)
+{
+#ifdef PEAK_X86
+    if (__builtin_cpu_supports("avx512f")) {
+        *isa = "avx512";
+        return &fma_avx512;
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        *isa = "avx2";
+        return &fma_avx2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        *isa = "sse2";
+        return &fma_sse2;
+    }
+#endif
+    *isa = "generic";
+    return &fma_generic;
+}
+
+/* GFLOP/s of loop on threads threads at once (each running the same number of steps). */
+static double fma_rate(fma_loop_t loop, int threads)
+{
+    long iterations = 1 << 16;
+    double best = 0;
+    volatile double sink = 0;
+    int flops = 0;
+
+    // Calibrate on one thread
+    for (;;) {
+        double start = now();
+        sink += loop(iterations, &flops);
+        if (now() - start >= RUN_SECONDS / 4) {
+            iterations *= 4;
+            break;
+        }
+        iterations *= 2;
+    }
+    for (int r = 0; r < REPEATS; r++) {
+        double start = 0, end = 0;
+        #pragma omp parallel num_threads(threads) if(threads > 1)
+        {
+            double value;
+            #pragma omp barrier
+            #pragma omp master
+            start = now();
+            value = loop(iterations, &flops);
+            #pragma omp barrier
+            #pragma omp master
+            end = now();
+            #pragma omp atomic
+            sink += value;
+        }
+        best = (double)flops*iterations*threads / (end - start) > best
+            ? (double)flops*iterations*threads / (end - start) : best;
+    }
+    (void)sink;
+    return 1e-9*best;
+}
+
+/* STREAM triad bandwidth in GB/s on threads threads. */
+static double triad_rate(int threads)
+{
+    struct gemm_caches caches;
+    size_t n;
+    double *a, *b, *c, best = 0;
+    const double scalar = 3.0;
+
+    gemm_cache_sizes(&caches);
+    // Four times the last level cache over the three arrays, within bounds
+    n = caches.l3 > 0 ? 4*(size_t)caches.l3 / 3 / sizeof(double) : TRIAD_MAX;
+    n = n < TRIAD_MIN ? TRIAD_MIN : n > TRIAD_MAX ? TRIAD_MAX : n;
+    a = workspace_alloc(n*sizeof(double));
+    b = workspace_alloc(n*sizeof(double));
+    c = workspace_alloc(n*sizeof(double));
+    #pragma omp parallel for schedule(static) num_threads(threads) if(threads > 1)
+    for (size_t i = 0; i < n; i++) {
+        a[i] = 0;
+        b[i] = 1;
+        c[i] = 2;
+    }
+    // One untimed pass, then the best of the rest
+    for (int r = 0; r <= REPEATS + 2; r++) {
+        double start = now(), seconds;
+        #pragma omp parallel for schedule(static) num_threads(threads) if(threads > 1)
+        for (size_t i = 0; i < n; i++) {
+            a[i] = b[i] + scalar*c[i];
+        }
+        seconds = now() - start;
+        if (r > 0 && 3*sizeof(double)*n / seconds > best) {
+            best = 3*sizeof(double)*n / seconds;
+        }
+    }
+    workspace_free(a);
+    workspace_free(b);
+    workspace_free(c);
+    return 1e-9*best;
+}
+
+/* Where the probe results are cached. */
+const char *peak_path(void)
+{
+    static char path[4096];
+    char host[64] = "unknown";
+    const char *env = getenv("MM_PEAK_FILE");
+    const char *home = getenv("HOME");
+    if (env && *env) {
+        return env;
+    }
+    gethostname(host, sizeof(host) - 1);
+    snprintf(path, sizeof(path), "%s/.mm-peak-%s", home ? home : ".", host);
+    return path;
+}
+
+/* Measure the peaks on this machine, reporting progress on log (if not NULL). */
+void peak_measure(struct peak *peak, FILE *log)
+{
+    const char *isa;
+    fma_loop_t loop = best_loop(&isa);
+
+    memset(peak, 0, sizeof(*peak));
+    gethostname(peak->host, sizeof(peak->host) - 1);
+    snprintf(peak->isa, sizeof(peak->isa), "%s", isa);
+    peak->threads = gemm_get_num_threads();
+    if (log) {
+        fprintf(log, "measuring peaks of %s (%s FMA, %d threads)\n", peak->host, isa, peak->threads);
+    }
+    peak->core_gflops = fma_rate(loop, 1);
+    peak->node_gflops = peak->threads > 1 ? fma_rate(loop, peak->threads) : peak->core_gflops;
+    peak->triad_gbs = triad_rate(peak->threads);
+    if (log) {
+        fprintf(log, "core %.4g GFLOP/s, node %.4g GFLOP/s, triad %.4g GB/s\n",
+                peak->core_gflops, peak->node_gflops, peak->triad_gbs);
+    }
+}
+
+/* Read cached peaks. Returns 1 if the file is missing or incomplete, 0 on success. */
+int peak_read(const char *file, struct peak *peak)
+{
+    char line[256], key[64], value[64];
+    FILE *f = fopen(file, "r");
+    if (!f) {
+        return 1;
+    }
+    memset(peak, 0, sizeof(*peak));
+    while (fgets(line, sizeof(line), f)) {
+        char *comment = strchr(line, '#');
+        if (comment) {
+            *comment = '\0';
+        }
+        if (sscanf(line, "%63s %63s", key, value) != 2) {
+            continue;
+        }
+        if (!strcmp(key, "host")) {
+            snprintf(peak->host, sizeof(peak->host), "%s", value);
+        } else if (!strcmp(key, "isa")) {
+            snprintf(peak->isa, sizeof(peak->isa), "%.15s", value);
+        } else if (!strcmp(key, "threads")) {
+            peak->threads = atoi(value);
+        } else if (!strcmp(key, "core_gflops")) {
+            peak->core_gflops = atof(value);
+        } else if (!strcmp(key, "node_gflops")) {
+            peak->node_gflops = atof(value);
+        } else if (!strcmp(key, "triad_gbs")) {
+            peak->triad_gbs = atof(value);
+        }
+    }
+    fclose(f);
+    return !(peak->threads > 0 && peak->core_gflops > 0 && peak->node_gflops > 0 && peak->triad_gbs > 0);
+}
+
+/* Write peaks to file. Returns 1 on failure, 0 on success. */
+int peak_write(const char *file, const struct peak *peak)
+{
+    time_t now = time(NULL);
+    FILE *f = fopen(file, "w");
+    if (!f) {
+        fprintf(stderr, "Unable to open %s for writing the peaks.\n", file);
+        return 1;
+    }
+    fprintf(f, "# Peaks of %s, measured on %s", peak->host, ctime(&now));
+    fprintf(f, "host %s\n", peak->host);
+    fprintf(f, "isa %s\n", peak->isa);
+    fprintf(f, "threads %d\n", peak->threads);
+    fprintf(f, "core_gflops %.6g\n", peak->core_gflops);
+    fprintf(f, "node_gflops %.6g\n", peak->node_gflops);
+    fprintf(f, "triad_gbs %.6g\n", peak->triad_gbs);
+    fclose(f);
+    return 0;
+}
+
+/*
+ * The peaks of this host: cached ones if they were measured here with the
+ * current number of threads, otherwise freshly measured (and cached).
+ * Returns 1 if they could not be cached, 0 otherwise.
+ */
+int peak_load(struct peak *peak)
+{
+    char host[64] = "unknown";
+    gethostname(host, sizeof(host) - 1);
+    if (!peak_read(peak_path(), peak) && !strcmp(peak->host, host)
+        && peak->threads == gemm_get_num_threads()) {
+        return 0;
+    }
+    peak_measure(peak, stderr);
+    return peak_write(peak_path(), peak);
+}
+
+/* One thread's share of the triad bandwidth, measured with all of them running. */
+double peak_thread_gbs(const struct peak *peak)
+{
+    return peak->triad_gbs / (peak->threads > 0 ? peak->threads : 1);
+}
+
+/* The FMA roof for threads threads: one core's rate for each, up to the node's. */
+double peak_gflops(const struct peak *peak, int threads)
+{
+    const double scaled = peak->core_gflops*(threads > 0 ? threads : 1);
+    return scaled < peak->node_gflops || threads <= 1 ? scaled : peak->node_gflops;
+}
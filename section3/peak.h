@@ -0,0 +1,43 @@
+#ifndef _PEAK_H
+#define _PEAK_H
+
+#include <stdio.h>
+
+/*
+ * The machine's roofs, measured natively: the sustained double precision
+ * FMA rate of one core and of all the threads together (in registers, the
+ * widest vector instructions the CPU has), and the STREAM triad bandwidth
+ * of all the threads.  Benchmarks report their rates as a percentage of
+ * these (see instrument_set_peak).
+ *
+ * Both drivers report each phase against per-thread roofs: core_gflops
+ * and one thread's share of the triad bandwidth (peak_thread_gbs).  A
+ * phase timed in every thread adds up the threads' seconds, so its rates
+ * are per thread; most of sparsemm's phases run on one thread.  A phase
+ * timed on one thread around a parallel region (the multiply phase of
+ * sparsemm with dense blocks on several GEMM threads) can pass 100%.
+ * Whole-run rates against the node use peak_gflops.
+ *
+ * Results are cached per host, in MM_PEAK_FILE if set, otherwise in
+ * ~/.mm-peak-HOSTNAME (home directories are often shared by a cluster's
+ * nodes), and measured again if the host or the thread count differs.
+ */
+
+struct peak {
+    char host[64];
+    char isa[16];           // Instruction set of the FMA loop
+    int threads;            // Threads of the node_gflops and triad_gbs measurements
+    double core_gflops;
+    double node_gflops;
+    double triad_gbs;
+};
+
+const char *peak_path(void);
+int peak_load(struct peak *);
+void peak_measure(struct peak *, FILE *log);
+int peak_read(const char *, struct peak *);
+int peak_write(const char *, const struct peak *);
+double peak_gflops(const struct peak *, int threads);
+double peak_thread_gbs(const struct peak *);
+
+#endif
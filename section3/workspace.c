@@ -0,0 +1,278 @@
+/* This file implements the workspace allocation declared in workspace.h.
+ *
+ * Every allocation is recorded (address, size and how it was made) so that
+ * workspace_free needs only the address, and so that the huge page usage
+ * of the mapped ones can be read back from /proc/self/smaps.  The kernel
+ * may merge neighbouring mappings into one region, so a region's huge
+ * pages are credited to the allocations in it up to the size they cover.
+ * Reading smaps is slow, so it is sampled only by workspace_usage and by
+ * the first free after the mapped total reaches a new peak.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "workspace.h"
+#include "instrument.h"
+
+// Size (and alignment) of a transparent huge page
+#define HUGE_PAGE ((size_t)2 << 20)
+
+struct allocation {
+    char *address;
+    size_t size;        // Bytes reserved: whole huge pages if mapped
+    int mapped;         // 1 if mmap'ed (huge page eligible), 0 if from posix_memalign
+};
+
+static struct {
+    struct allocation *list;
+    int count, capacity;
+    size_t mapped, mapped_peak;     // Bytes mapped now, and the most at once
+    size_t huge_peak;               // The most seen backed by huge pages
+    int peak_measured;              // Whether huge pages were sampled since the last peak
+} state;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t report_once = PTHREAD_ONCE_INIT;
+
+/* Whether large requests are mapped for huge pages: unless MM_HUGE_PAGES=0. */
+static int huge_pages_wanted(void)
+{
+    static int wanted = -1;
+    if (wanted < 0) {
+        const char *env = getenv("MM_HUGE_PAGES");
+        wanted = !(env && *env && !strcmp(env, "0"));
+    }
+    return wanted;
+}
+
+static int by_address(const void *x, const void *y)
+{
+    uintptr_t a = (uintptr_t)((const struct allocation *)x)->address;
+    uintptr_t b = (uintptr_t)((const struct allocation *)y)->address;
+    return (a > b) - (a < b);
+}
+
+/* Bytes of the mapped allocations backed by huge pages; called with lock held. */
+static size_t huge_bytes(void)
+{
+    FILE *f;
+    char line[512];
+    unsigned long start = 0, end = 0;
+    size_t huge = 0;
+    struct allocation *spans = malloc((state.count + 1)*sizeof(*spans));
+    int nspans = 0, first = 0;
+
+    // The mapped allocations in address order, the order smaps lists regions in,
+    // so one sweep over both finds the allocations in each region
+    for (int i = 0; i < state.count; i++) {
+        if (state.list[i].mapped) {
+            spans[nspans++] = state.list[i];
+        }
+    }
+    qsort(spans, nspans, sizeof(*spans), &by_address);
+    f = fopen("/proc/self/smaps", "r");
+    if (!f) {
+        free(spans);
+        return 0;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        unsigned long low, high, kb;
+        if (!strncmp(line, "AnonHugePages:", 14)) {
+            size_t covered = 0;
+            if (sscanf(line + 14, "%lu", &kb) != 1 || kb == 0) {
+                continue;
+            }
+            // How much of the region our allocations cover
+            while (first < nspans && (uintptr_t)spans[first].address + spans[first].size <= start) {
+                first++;
+            }
+            for (int i = first; i < nspans && (uintptr_t)spans[i].address < end; i++) {
+                uintptr_t a = (uintptr_t)spans[i].address;
+                uintptr_t b = a + spans[i].size;
+                covered += (b < end ? b : end) - (a > start ? a : start);
+            }
+            huge += kb*1024 < covered ? kb*1024 : covered;
+        } else if (sscanf(line, "%lx-%lx ", &low, &high) == 2) {
+            start = low;
+            end = high;
+        }
+    }
+    fclose(f);
+    free(spans);
+    return huge;
+}
+
+/* Update the huge page peak from what is mapped now; called with lock held. */
+static void measure(void)
+{
+    if (state.mapped > 0) {
+        size_t huge = huge_bytes();
+        state.huge_peak = huge > state.huge_peak ? huge : state.huge_peak;
+    }
+    state.peak_measured = 1;
+}
+
+/* Record the usage in the run's instrumentation record, just before it is written. */
+static void report(void)
+{
+    size_t mapped, huge;
+    workspace_usage(&mapped, &huge);
+    instrument_field("workspace_bytes", mapped);
+    instrument_field("huge_page_bytes", huge);
+}
+
+static void register_report(void)
+{
+    instrument_on_report(&report);
+}
+
+/* Map size bytes (a multiple of HUGE_PAGE) at a huge page boundary, or return NULL. */
+static void *map_aligned(size_t size)
+{
+    char *p = mmap(NULL, size + HUGE_PAGE, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    char *aligned;
+    if (p == MAP_FAILED) {
+        return NULL;
+    }
+    // Trim the unaligned head and the tail beyond size
+    aligned = (char *)(((uintptr_t)p + HUGE_PAGE - 1) & ~(uintptr_t)(HUGE_PAGE - 1));
+    if (aligned > p) {
+        munmap(p, aligned - p);
+    }
+    if (aligned + size < p + size + HUGE_PAGE) {
+        munmap(aligned + size, p + size + HUGE_PAGE - (aligned + size));
+    }
+#ifdef MADV_HUGEPAGE
+    madvise(aligned, size, MADV_HUGEPAGE);
+#endif
+    return aligned;
+}
+
+static void *allocate(size_t bytes, int *mapped)
+{
+    static size_t page = 0;
+    void *p = NULL;
+    size_t size = bytes > 0 ? bytes : 1;
+
+    pthread_once(&report_once, &register_report);
+    *mapped = 0;
+    if (huge_pages_wanted() && size >= HUGE_PAGE / 2) {
+        size = (1 + (size - 1) / HUGE_PAGE)*HUGE_PAGE;
+        p = map_aligned(size);
+        *mapped = p != NULL;
+    }
+    if (!p) {
+        if (!page) {
+            page = sysconf(_SC_PAGESIZE);
+        }
+        size = bytes > 0 ? bytes : 1;
+        if (posix_memalign(&p, page, size)) {
+            fprintf(stderr, "Unable to allocate %zu bytes of workspace\n", size);
+            exit(1);
+        }
+    }
+
+    pthread_mutex_lock(&lock);
+    if (state.count == state.capacity) {
+        state.capacity = state.capacity ? 2*state.capacity : 16;
+        state.list = realloc(state.list, state.capacity*sizeof(*state.list));
+        if (!state.list) {
+            fprintf(stderr, "Unable to allocate the workspace table\n");
+            exit(1);
+        }
+    }
+    state.list[state.count++] = (struct allocation){p, size, *mapped};
+    if (*mapped) {
+        state.mapped += size;
+        if (state.mapped > state.mapped_peak) {
+            state.mapped_peak = state.mapped;
+            state.peak_measured = 0;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return p;
+}
+
+/* At least bytes of uninitialised workspace, page aligned (huge page aligned if mapped). */
+void *workspace_alloc(size_t bytes)
+{
+    int mapped;
+    return allocate(bytes, &mapped);
+}
+
+/* As workspace_alloc, zero filled (mapped memory comes zeroed, and is left untouched). */
+void *workspace_calloc(size_t bytes)
+{
+    int mapped;
+    void *p = allocate(bytes, &mapped);
+    if (!mapped) {
+        memset(p, 0, bytes);
+    }
+    return p;
+}
+
+/* Release workspace from workspace_alloc or workspace_calloc (NULL is ignored). */
+void workspace_free(void *p)
+{
+    struct allocation found = {NULL, 0, 0};
+    if (!p) {
+        return;
+    }
+    pthread_mutex_lock(&lock);
+    for (int i = state.count - 1; i >= 0; i--) {
+        if (state.list[i].address == p) {
+            found = state.list[i];
+            if (found.mapped && instrument_enabled && !state.peak_measured) {
+                // Last chance to see the huge pages of the peak
+                measure();
+            }
+            state.list[i] = state.list[--state.count];
+            break;
+        }
+    }
+    if (found.mapped) {
+        state.mapped -= found.size;
+    }
+    pthread_mutex_unlock(&lock);
+    if (!found.address) {
+        fprintf(stderr, "workspace_free of %p, which is not workspace\n", p);
+        abort();
+    }
+    if (found.mapped) {
+        munmap(found.address, found.size);
+    } else {
+        free(found.address);
+    }
+}
+
+/* Fault in every page of [p, p + bytes) from the calling thread (so on its NUMA node),
+ * keeping the contents. */
+void workspace_touch(void *p, size_t bytes)
+{
+    static size_t page = 0;
+    volatile char *c = p;
+    if (!page) {
+        page = sysconf(_SC_PAGESIZE);
+    }
+    for (size_t offset = 0; offset < bytes; offset += page) {
+        c[offset] = c[offset];
+    }
+}
+
+/* The most workspace mapped at once, and the most of it seen backed by huge pages
+ * (including what is mapped now). */
+void workspace_usage(size_t *mapped, size_t *huge)
+{
+    pthread_mutex_lock(&lock);
+    measure();
+    *mapped = state.mapped_peak;
+    *huge = state.huge_peak;
+    pthread_mutex_unlock(&lock);
+}
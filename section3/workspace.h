@@ -0,0 +1,29 @@
+#ifndef _WORKSPACE_H
+#define _WORKSPACE_H
+
+#include <stddef.h>
+
+/*
+ * Workspace allocation shared by gemm and sparsemm: packing buffers,
+ * dense accumulators and the drivers' matrices.
+ *
+ * Requests of at least half a huge page (1MB) are mapped directly,
+ * 2MB aligned and rounded up to whole huge pages, with transparent huge
+ * pages requested through madvise; smaller ones (or all of them with
+ * MM_HUGE_PAGES=0, or if mapping fails) come from posix_memalign, page
+ * aligned.  Mapped memory is not touched here, so each page lands on the
+ * NUMA node of the thread that first writes it: workspace_touch lets the
+ * thread that will use a buffer do that up front.
+ *
+ * With instrumentation on, the run record gets workspace_bytes (the most
+ * mapped at once) and huge_page_bytes (the most of it seen backed by huge
+ * pages, from /proc/self/smaps, read at each new peak of the mapped bytes).
+ */
+
+void *workspace_alloc(size_t bytes);
+void *workspace_calloc(size_t bytes);
+void workspace_free(void *);
+void workspace_touch(void *, size_t bytes);
+void workspace_usage(size_t *mapped, size_t *huge);
+
+#endif